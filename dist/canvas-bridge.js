@@ -6,7 +6,9 @@
  *
  * Architecture:
  * - User code runs in MicroQuickJS WASM (isolated, no DOM access)
- * - Canvas commands are queued as JSON during execution
+ * - Canvas commands are queued as JSON during execution, or encoded
+ *   by the native `canvas` object in a binary command buffer which is
+ *   decoded in place with executeBuffer()
  * - After WASM returns, commands are executed on the real canvas
  * - Animation frames are orchestrated by the browser
  *
@@ -21,12 +23,14 @@ const CanvasBridge = (function() {
      * Generate the Canvas API mock code to inject into user code
      * This creates a `canvas` object that queues drawing commands
      *
+     * @param {boolean} [nativeCanvas] - use the native canvas object of
+     *     the engine when it has one (the mock is only a fallback)
      * @returns {string} JavaScript code defining the canvas mock
      */
-    function getCanvasMockCode() {
+    function getCanvasMockCode(nativeCanvas) {
         return `
     // Canvas API Mock - queues commands for browser execution
-    var canvas = {
+    var canvas = ${nativeCanvas ? 'typeof globalThis.canvas === "object" ? globalThis.canvas : ' : ''}{
         // Style properties
         fillStyle: "#000",
         strokeStyle: "#fff",
@@ -149,16 +153,21 @@ const CanvasBridge = (function() {
      * Wrap user code with all mocks and return JSON result
      *
      * @param {string} userCode - The user's JavaScript code
+     * @param {Object} [options] - {nativeCanvas: true} to use the native
+     *     canvas object of the engine instead of the JSON mock. Engines
+     *     built without it fall back to the mock, so the host should
+     *     run both executeCommands() and executeBuffer().
      * @returns {string} Wrapped code ready for WASM execution
      */
-    function wrapUserCode(userCode) {
+    function wrapUserCode(userCode, options) {
+        var nativeCanvas = options && options.nativeCanvas;
         return `(function() {
     // Internal state
     var __logs = [];
     var __canvasCommands = [];
 
     ${getConsoleMockCode()}
-    ${getCanvasMockCode()}
+    ${getCanvasMockCode(nativeCanvas)}
     ${getAnimationMockCode()}
     ${getKeyboardMockCode()}
 
@@ -249,20 +258,184 @@ const CanvasBridge = (function() {
         });
     }
 
+    /*
+     * Layout of the native command buffer (CanvasBuffer in
+     * wasm_wrapper.c). The values must match the C definitions.
+     */
+    var CANVAS_HEADER_WORDS = 6;
+    var CANVAS_MAX_STRINGS = 1024;
+    var CANVAS_STRING_POOL_SIZE = 32 * 1024;
+
+    var OP_WRAP = 0;
+    var OP_FILL_RECT = 1;
+    var OP_STROKE_RECT = 2;
+    var OP_CLEAR_RECT = 3;
+    var OP_RECT = 4;
+    var OP_BEGIN_PATH = 5;
+    var OP_CLOSE_PATH = 6;
+    var OP_MOVE_TO = 7;
+    var OP_LINE_TO = 8;
+    var OP_ARC = 9;
+    var OP_FILL = 10;
+    var OP_STROKE = 11;
+    var OP_FILL_TEXT = 12;
+    var OP_STROKE_TEXT = 13;
+    var OP_SET_FILL_STYLE = 14;
+    var OP_SET_STROKE_STYLE = 15;
+    var OP_SET_FONT = 16;
+    var OP_SET_LINE_WIDTH = 17;
+
+    /* decoded strings, per command buffer address */
+    var stringCaches = {};
+    var textDecoder = typeof TextDecoder !== 'undefined' ? new TextDecoder() : null;
+
+    /**
+     * Tell if the module was built with the native canvas object
+     *
+     * @param {Object} Module - The MQuickJS module instance
+     * @returns {boolean} true if executeBuffer() can be used
+     */
+    function hasNativeCanvas(Module) {
+        return typeof Module._mquickjs_canvas_buffer === 'function' &&
+            typeof Module._mquickjs_canvas_flush === 'function' &&
+            typeof Module._mquickjs_ctx_canvas_buffer === 'function' &&
+            typeof Module._mquickjs_ctx_canvas_flush === 'function';
+    }
+
+    /**
+     * Execute the commands of the native canvas object on a real canvas
+     * context. The buffer is read in place in the WASM memory.
+     *
+     * @param {CanvasRenderingContext2D} ctx - The canvas 2D context
+     * @param {Object} Module - The MQuickJS module instance
+     * @param {number} [handle] - Context handle from mquickjs_ctx_new(),
+     *     the default context if omitted
+     * @returns {number} Number of executed commands (0 if the module has
+     *     no native canvas: the commands are then in the JSON result)
+     */
+    function executeBuffer(ctx, Module, handle) {
+        if (!hasNativeCanvas(Module)) return 0;
+        var ptr = handle === undefined ?
+            Module._mquickjs_canvas_buffer() :
+            Module._mquickjs_ctx_canvas_buffer(handle);
+        if (!ptr) return 0;
+
+        // the views must be created again if the memory has grown
+        var heap = Module.HEAPU8;
+        var hdr = new Uint32Array(heap.buffer, ptr, CANVAS_HEADER_WORDS);
+        var size = hdr[0], pos = hdr[1], end = hdr[2], gen = hdr[4];
+        var offsetsPtr = ptr + CANVAS_HEADER_WORDS * 4;
+        var offsets = new Uint32Array(heap.buffer, offsetsPtr, CANVAS_MAX_STRINGS + 1);
+        var poolPtr = offsetsPtr + (CANVAS_MAX_STRINGS + 1) * 4;
+        var bufPtr = poolPtr + CANVAS_STRING_POOL_SIZE;
+        var u32 = new Uint32Array(heap.buffer, bufPtr, size);
+        var f32 = new Float32Array(heap.buffer, bufPtr, size);
+
+        var cache = stringCaches[ptr];
+        if (!cache || cache.gen !== gen) {
+            cache = stringCaches[ptr] = {gen: gen, strings: []};
+        }
+        var strings = cache.strings;
+        function str(idx) {
+            var s = strings[idx];
+            if (s === undefined) {
+                var bytes = heap.subarray(poolPtr + offsets[idx], poolPtr + offsets[idx + 1]);
+                s = textDecoder ? textDecoder.decode(bytes) : String.fromCharCode.apply(null, bytes);
+                strings[idx] = s;
+            }
+            return s;
+        }
+
+        var count = 0;
+        while (pos !== end) {
+            var op = u32[pos] & 0xff;
+            var a = pos + 1;
+            if (op === OP_WRAP) {
+                pos = 0;
+                continue;
+            }
+            switch (op) {
+                case OP_FILL_RECT:
+                    ctx.fillRect(f32[a], f32[a + 1], f32[a + 2], f32[a + 3]);
+                    break;
+                case OP_STROKE_RECT:
+                    ctx.strokeRect(f32[a], f32[a + 1], f32[a + 2], f32[a + 3]);
+                    break;
+                case OP_CLEAR_RECT:
+                    ctx.clearRect(f32[a], f32[a + 1], f32[a + 2], f32[a + 3]);
+                    break;
+                case OP_RECT:
+                    ctx.rect(f32[a], f32[a + 1], f32[a + 2], f32[a + 3]);
+                    break;
+                case OP_BEGIN_PATH:
+                    ctx.beginPath();
+                    break;
+                case OP_CLOSE_PATH:
+                    ctx.closePath();
+                    break;
+                case OP_MOVE_TO:
+                    ctx.moveTo(f32[a], f32[a + 1]);
+                    break;
+                case OP_LINE_TO:
+                    ctx.lineTo(f32[a], f32[a + 1]);
+                    break;
+                case OP_ARC:
+                    ctx.arc(f32[a], f32[a + 1], f32[a + 2], f32[a + 3], f32[a + 4], f32[a + 5] !== 0);
+                    break;
+                case OP_FILL:
+                    ctx.fill();
+                    break;
+                case OP_STROKE:
+                    ctx.stroke();
+                    break;
+                case OP_FILL_TEXT:
+                    ctx.fillText(str(u32[a]), f32[a + 1], f32[a + 2]);
+                    break;
+                case OP_STROKE_TEXT:
+                    ctx.strokeText(str(u32[a]), f32[a + 1], f32[a + 2]);
+                    break;
+                case OP_SET_FILL_STYLE:
+                    ctx.fillStyle = str(u32[a]);
+                    break;
+                case OP_SET_STROKE_STYLE:
+                    ctx.strokeStyle = str(u32[a]);
+                    break;
+                case OP_SET_FONT:
+                    ctx.font = str(u32[a]);
+                    break;
+                case OP_SET_LINE_WIDTH:
+                    ctx.lineWidth = f32[a];
+                    break;
+            }
+            count++;
+            pos = a + (u32[pos] >>> 8);
+            if (pos === size) pos = 0;
+        }
+
+        if (handle === undefined) {
+            Module._mquickjs_canvas_flush();
+        } else {
+            Module._mquickjs_ctx_canvas_flush(handle);
+        }
+        return count;
+    }
+
     /**
      * Generate animation frame code for continuing animations
      * This is a minimal version that only includes what's needed for the frame
      *
+     * @param {Object} [options] - same as wrapUserCode()
      * @returns {string} JavaScript code for animation frame execution
      */
-    function getAnimationFrameCode() {
+    function getAnimationFrameCode(options) {
+        var nativeCanvas = options && options.nativeCanvas;
         return `(function() {
     if (typeof __animCallback === 'function') {
         var __canvasCommands = [];
         var __logs = [];
 
         ${getConsoleMockCode()}
-        ${getCanvasMockCode()}
+        ${getCanvasMockCode(nativeCanvas)}
 
         var __nextAnim = null;
         function requestAnimationFrame(cb) { __nextAnim = cb; return 1; }
@@ -305,6 +478,8 @@ const CanvasBridge = (function() {
     return {
         wrapUserCode: wrapUserCode,
         executeCommands: executeCommands,
+        executeBuffer: executeBuffer,
+        hasNativeCanvas: hasNativeCanvas,
         getAnimationFrameCode: getAnimationFrameCode,
         getKeyHandlerCode: getKeyHandlerCode,
 
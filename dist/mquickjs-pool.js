@@ -0,0 +1,459 @@
+/**
+ * MicroQuickJS Worker Pool
+ *
+ * Evaluates independent scripts in parallel in a pool of Web Workers.
+ *
+ * Architecture:
+ * - mquickjs.wasm is compiled once on the main thread and the
+ *   WebAssembly.Module is posted to each worker, which instantiates it
+ *   with its own memory (the ROM stdlib tables stay in the read-only
+ *   data of each instance, nothing is rebuilt per worker)
+ * - Each worker takes a snapshot of its fresh engine and restores it
+ *   before each job, so the jobs never see each other's globals
+ * - The jobs are queued per worker on the main thread. A worker takes
+ *   its own jobs first (oldest first) and steals the newest job of the
+ *   most loaded worker when its queue is empty
+ * - Bytecode jobs and results are sent as transferable ArrayBuffers
+ *
+ * The same file is the worker script. mquickjs.js must be built with
+ * ENVIRONMENT='web,worker' and the instantiateWasm hook (Makefile.wasm).
+ *
+ * Usage:
+ *   MQuickJSPool.create({size: 4}).then(function(pool) {
+ *       return Promise.all(rules.map(function(src) { return pool.run(src); }));
+ *   });
+ *
+ * https://github.com/franzenzenhofer/mquickjs-wasm
+ */
+
+(function(global) {
+    'use strict';
+
+    // Result types of mquickjs_run_binary() (wasm_wrapper.c)
+    var RESULT_ERROR = -1;
+    var RESULT_STRING = 0;
+    var RESULT_BYTES = 1;
+
+    var isWorker = typeof document === 'undefined' &&
+        typeof global.importScripts === 'function';
+
+    // features of mquickjs.js used by the pool. A module built without
+    // them (e.g. an older dist/ build) cannot run in the workers.
+    var REQUIRED_FEATURES = ['instantiateWasm', '_mquickjs_snapshot', '_mquickjs_restore',
+                             '_mquickjs_run_binary', '_mquickjs_result_ptr',
+                             '_mquickjs_result_len', '_mquickjs_load_bytecode'];
+
+    function unsupportedModuleError(missing) {
+        return new Error('mquickjs.js cannot be used by the pool (missing ' +
+                         missing.join(', ') + '): rebuild it with "make -f Makefile.wasm"');
+    }
+
+    /* ---------------------------------------------------------------- */
+    /* worker side */
+
+    function workerMain() {
+        var Module = null;
+        var textEncoder = new TextEncoder();
+
+        function init(msg) {
+            var hooked = false;
+            global.importScripts(msg.scriptUrl);
+            if (typeof global.MQuickJS !== 'function')
+                return Promise.reject(new Error(msg.scriptUrl + ' does not define MQuickJS'));
+            return global.MQuickJS({
+                // use the module compiled by the main thread
+                instantiateWasm: function(imports, receiveInstance) {
+                    hooked = true;
+                    WebAssembly.instantiate(msg.module, imports).then(function(instance) {
+                        receiveInstance(instance, msg.module);
+                    });
+                    return {};
+                }
+            }).then(function(m) {
+                var missing = REQUIRED_FEATURES.filter(function(name) {
+                    return name === 'instantiateWasm' ? !hooked : typeof m[name] !== 'function';
+                });
+                if (missing.length > 0)
+                    throw unsupportedModuleError(missing);
+                Module = m;
+                if (Module._mquickjs_init() !== 0)
+                    throw new Error('could not initialize the engine');
+                if (msg.prelude)
+                    Module.ccall('mquickjs_run', 'string', ['string'], [msg.prelude]);
+                if (Module._mquickjs_snapshot() < 0)
+                    throw new Error('could not snapshot the engine');
+            });
+        }
+
+        // copy 'len' bytes of the WASM memory to a new ArrayBuffer
+        function copyOut(ptr, len) {
+            return Module.HEAPU8.slice(ptr, ptr + len).buffer;
+        }
+
+        function runSource(source) {
+            var type = Module.ccall('mquickjs_run_binary', 'number', ['string'], [source]);
+            return {
+                type: type,
+                buffer: copyOut(Module._mquickjs_result_ptr(), Module._mquickjs_result_len())
+            };
+        }
+
+        function runBytecode(bytes) {
+            var u8 = new Uint8Array(bytes);
+            var ptr = Module._malloc(u8.length);
+            var ret, str;
+            Module.HEAPU8.set(u8, ptr);
+            // the buffer is copied by mquickjs_load_bytecode()
+            ret = Module._mquickjs_load_bytecode(ptr, u8.length);
+            Module._free(ptr);
+            if (ret !== 0) {
+                str = Module.UTF8ToString(Module._mquickjs_get_output());
+                return {type: RESULT_ERROR, buffer: textEncoder.encode(str).buffer};
+            }
+            str = Module.ccall('mquickjs_run_bytecode', 'string', [], []);
+            return {
+                type: str.lastIndexOf('Error: ', 0) === 0 ? RESULT_ERROR : RESULT_STRING,
+                buffer: textEncoder.encode(str).buffer
+            };
+        }
+
+        function runJob(msg) {
+            var res, output;
+            Module._mquickjs_restore();
+            if (msg.bytecode)
+                res = runBytecode(msg.bytecode);
+            else
+                res = runSource(msg.source);
+            output = Module.UTF8ToString(Module._mquickjs_get_output());
+            global.postMessage({
+                type: 'result',
+                id: msg.id,
+                resultType: res.type,
+                buffer: res.buffer,
+                output: output
+            }, [res.buffer]);
+        }
+
+        global.onmessage = function(e) {
+            var msg = e.data;
+            if (msg.type === 'init') {
+                init(msg).then(function() {
+                    global.postMessage({type: 'ready'});
+                }, function(err) {
+                    global.postMessage({type: 'error', message: String(err)});
+                });
+            } else if (msg.type === 'job') {
+                try {
+                    runJob(msg);
+                } catch (err) {
+                    // e.g. WASM trap: the instance cannot be reused
+                    global.postMessage({type: 'error', id: msg.id, message: String(err)});
+                }
+            }
+        };
+    }
+
+    if (isWorker) {
+        workerMain();
+        return;
+    }
+
+    /* ---------------------------------------------------------------- */
+    /* main thread side */
+
+    var textDecoder = typeof TextDecoder !== 'undefined' ? new TextDecoder() : null;
+
+    function currentScriptUrl() {
+        var s = global.document && global.document.currentScript;
+        return s ? s.src : null;
+    }
+
+    // must be read while the script is being executed
+    var poolScriptUrl = currentScriptUrl();
+
+    function resolveUrl(url) {
+        return new URL(url, poolScriptUrl || global.location.href).href;
+    }
+
+    function decodeResult(msg) {
+        if (msg.resultType === RESULT_BYTES)
+            return msg.buffer;
+        var str = textDecoder ? textDecoder.decode(msg.buffer) :
+            String.fromCharCode.apply(null, new Uint8Array(msg.buffer));
+        if (msg.resultType === RESULT_ERROR) {
+            var err = new Error(str);
+            err.output = msg.output;
+            throw err;
+        }
+        return str;
+    }
+
+    /**
+     * @param {WebAssembly.Module} module compiled mquickjs.wasm
+     * @param {Object} opts see MQuickJSPool.create()
+     */
+    function Pool(module, opts) {
+        this.module = module;
+        this.size = opts.size;
+        // jobs posted to a worker before it is done with the previous one
+        this.prefetch = opts.prefetch || 1;
+        this.workers = [];
+        this.nextId = 1;
+        this.nextWorker = 0;
+        this.pending = {}; // id -> job
+        this.terminated = false;
+        this.stats = {jobs: 0, steals: 0};
+    }
+
+    Pool.prototype.start = function(opts) {
+        var self = this;
+        var ready = [];
+        var i;
+        for (i = 0; i < this.size; i++) {
+            ready.push(this.startWorker(opts));
+        }
+        return Promise.all(ready).then(function() { return self; });
+    };
+
+    Pool.prototype.startWorker = function(opts) {
+        var self = this;
+        var w = {
+            worker: new Worker(opts.workerUrl),
+            queue: [],     // jobs waiting, in submission order
+            inFlight: 0,
+            ready: false
+        };
+        this.workers.push(w);
+        return new Promise(function(resolve, reject) {
+            w.worker.onmessage = function(e) {
+                var msg = e.data;
+                if (msg.type === 'ready') {
+                    w.ready = true;
+                    resolve();
+                    self.dispatch(w);
+                } else if (msg.type === 'result') {
+                    self.complete(w, msg.id, function(job) {
+                        try {
+                            job.resolve(decodeResult(msg));
+                        } catch (err) {
+                            job.reject(err);
+                        }
+                    });
+                } else if (msg.type === 'error') {
+                    if (msg.id === undefined) {
+                        reject(new Error(msg.message));
+                        return;
+                    }
+                    self.complete(w, msg.id, function(job) {
+                        job.reject(new Error(msg.message));
+                    });
+                }
+            };
+            w.worker.onerror = function(e) {
+                reject(new Error(e.message));
+            };
+            w.worker.postMessage({
+                type: 'init',
+                module: self.module,
+                scriptUrl: opts.scriptUrl,
+                prelude: opts.prelude || ''
+            });
+        });
+    };
+
+    Pool.prototype.complete = function(w, id, settle) {
+        var job = this.pending[id];
+        delete this.pending[id];
+        w.inFlight--;
+        if (job)
+            settle(job);
+        this.dispatch(w);
+    };
+
+    // steal the newest job of the worker with the longest queue
+    Pool.prototype.steal = function(thief) {
+        var victim = null;
+        var i, w;
+        for (i = 0; i < this.workers.length; i++) {
+            w = this.workers[i];
+            if (w !== thief && w.queue.length > 0 &&
+                (!victim || w.queue.length > victim.queue.length))
+                victim = w;
+        }
+        if (!victim)
+            return null;
+        this.stats.steals++;
+        return victim.queue.pop();
+    };
+
+    Pool.prototype.dispatch = function(w) {
+        var job, transfer;
+        if (!w.ready || this.terminated)
+            return;
+        while (w.inFlight < this.prefetch) {
+            job = w.queue.shift() || this.steal(w);
+            if (!job)
+                break;
+            w.inFlight++;
+            this.pending[job.id] = job;
+            transfer = job.bytecode ? [job.bytecode] : [];
+            w.worker.postMessage({
+                type: 'job',
+                id: job.id,
+                source: job.source,
+                bytecode: job.bytecode
+            }, transfer);
+        }
+    };
+
+    Pool.prototype.submit = function(job) {
+        var self = this;
+        var w;
+        if (this.terminated)
+            return Promise.reject(new Error('pool terminated'));
+        job.id = this.nextId++;
+        this.stats.jobs++;
+        w = this.workers[this.nextWorker];
+        this.nextWorker = (this.nextWorker + 1) % this.workers.length;
+        return new Promise(function(resolve, reject) {
+            job.resolve = resolve;
+            job.reject = reject;
+            w.queue.push(job);
+            self.dispatch(w);
+        });
+    };
+
+    /**
+     * Evaluate a script in a fresh context.
+     * @param {string} source
+     * @returns {Promise<string|ArrayBuffer>} the value of the last
+     *   expression as a string, or the bytes of an ArrayBuffer or typed
+     *   array. Rejected with the error message if an exception occurs.
+     */
+    Pool.prototype.run = function(source) {
+        return this.submit({source: String(source)});
+    };
+
+    /**
+     * Run 32-bit bytecode generated by "mqjs -m32 -o file.bin file.js".
+     * @param {ArrayBuffer} bytecode transferred to the worker (it is
+     *   detached on the calling side)
+     * @returns {Promise<string>}
+     */
+    Pool.prototype.runBytecode = function(bytecode) {
+        if (ArrayBuffer.isView(bytecode)) {
+            bytecode = bytecode.buffer.slice(bytecode.byteOffset,
+                                             bytecode.byteOffset + bytecode.byteLength);
+        }
+        return this.submit({bytecode: bytecode});
+    };
+
+    /**
+     * Run a batch of jobs: strings are sources, ArrayBuffers are bytecode.
+     * @returns {Promise<Array>} the results in the order of the jobs
+     */
+    Pool.prototype.runAll = function(jobs) {
+        var self = this;
+        return Promise.all(jobs.map(function(job) {
+            return typeof job === 'string' ? self.run(job) : self.runBytecode(job);
+        }));
+    };
+
+    Pool.prototype.terminate = function() {
+        var id;
+        this.terminated = true;
+        this.workers.forEach(function(w) { w.worker.terminate(); });
+        for (id in this.pending) {
+            this.pending[id].reject(new Error('pool terminated'));
+        }
+        this.workers.forEach(function(w) {
+            w.queue.forEach(function(job) { job.reject(new Error('pool terminated')); });
+            w.queue = [];
+        });
+        this.pending = {};
+    };
+
+    // Check mquickjs.js before starting the workers: a module without
+    // the instantiateWasm hook or the worker environment would not
+    // start in a worker, or would ignore the compiled module.
+    function checkModuleScript(scriptUrl) {
+        return fetch(scriptUrl).then(function(r) {
+            if (!r.ok)
+                throw new Error('could not load ' + scriptUrl + ' (' + r.status + ')');
+            return r.text();
+        }).then(function(text) {
+            var missing = REQUIRED_FEATURES.filter(function(name) {
+                return text.indexOf(name) < 0;
+            });
+            if (missing.length > 0)
+                throw unsupportedModuleError(missing);
+        });
+    }
+
+    function compileModule(wasmUrl) {
+        if (WebAssembly.compileStreaming) {
+            return WebAssembly.compileStreaming(fetch(wasmUrl)).catch(function() {
+                // e.g. wrong MIME type
+                return fetch(wasmUrl).then(function(r) { return r.arrayBuffer(); })
+                    .then(function(buf) { return WebAssembly.compile(buf); });
+            });
+        }
+        return fetch(wasmUrl).then(function(r) { return r.arrayBuffer(); })
+            .then(function(buf) { return WebAssembly.compile(buf); });
+    }
+
+    /**
+     * Create a pool.
+     * @param {Object} [opts]
+     * @param {number} [opts.size] number of workers (default:
+     *   navigator.hardwareConcurrency)
+     * @param {number} [opts.prefetch] jobs sent in advance to each
+     *   worker (default 1, higher values hide the message latency of
+     *   very short jobs but make stealing less effective)
+     * @param {string} [opts.prelude] code run once in each worker before
+     *   the snapshot (e.g. shared helper functions). Bytecode jobs need a
+     *   pool without prelude because the bytecode must be loaded in a
+     *   context where no script was run.
+     * @param {string} [opts.scriptUrl] URL of mquickjs.js
+     * @param {string} [opts.wasmUrl] URL of mquickjs.wasm
+     * @param {string} [opts.workerUrl] URL of this file
+     * @param {WebAssembly.Module} [opts.module] already compiled module
+     * @returns {Promise<Pool>} rejected if mquickjs.js was not built with
+     *   the instantiateWasm hook and the exports used by the pool
+     */
+    function create(opts) {
+        var workerUrl, scriptUrl, wasmUrl;
+        opts = opts || {};
+        workerUrl = opts.workerUrl || poolScriptUrl;
+        if (!workerUrl)
+            return Promise.reject(new Error('workerUrl is required'));
+        scriptUrl = resolveUrl(opts.scriptUrl || 'mquickjs.js');
+        wasmUrl = resolveUrl(opts.wasmUrl || 'mquickjs.wasm');
+        var size = opts.size ||
+            (global.navigator && global.navigator.hardwareConcurrency) || 4;
+        return checkModuleScript(scriptUrl).then(function() {
+            return opts.module || compileModule(wasmUrl);
+        }).then(function(module) {
+            var pool = new Pool(module, {size: size, prefetch: opts.prefetch});
+            return pool.start({
+                workerUrl: workerUrl,
+                scriptUrl: scriptUrl,
+                prelude: opts.prelude
+            }).catch(function(err) {
+                pool.terminate();
+                throw err;
+            });
+        });
+    }
+
+    global.MQuickJSPool = {
+        create: create,
+        Pool: Pool,
+        VERSION: '1.0.0'
+    };
+
+    // Export for module systems
+    if (typeof module !== 'undefined' && module.exports) {
+        module.exports = global.MQuickJSPool;
+    }
+})(typeof self !== 'undefined' ? self : this);
@@ -30,6 +30,7 @@
 #include <ctype.h>
 #include <sys/time.h>
 #include <math.h>
+#include <float.h>
 #include <setjmp.h>
 
 #include "cutils.h"
@@ -42,12 +43,18 @@
    - reduce max memory usage
    - free format: could add shortcut if exact result
    - use 64 bit limb_t when possible
-   - use another algorithm for free format dtoa in base 10 (ryu ?)
 */
 
 #define USE_POW5_TABLE
 /* use fast path to print small integers in free format */
 #define USE_FAST_INT
+/* use Grisu3 for free format dtoa in base 10 */
+#define USE_FAST_DTOA
+/* use float64 operations to parse short base 10 numbers (the
+   operations must be correctly rounded) */
+#if !defined(FLT_EVAL_METHOD) || FLT_EVAL_METHOD == 0
+#define USE_FAST_ATOD
+#endif
 
 #define LIMB_LOG2_BITS 5
 
@@ -1012,6 +1019,238 @@ static uint64_t mul_pow_round_to_d(int *pe, mpb_t *a,
     return round_to_d(pe, a, e_offset, rnd_mode);
 }
 
+#ifdef USE_FAST_DTOA
+/* Grisu3 shortest float64 to decimal conversion (F. Loitsch,
+   "Printing Floating-Point Numbers Quickly and Accurately with
+   Integers", 2010). It fails in about 0.5% of the cases, in which case
+   the generic algorithm is used. */
+
+typedef struct {
+    uint64_t f;
+    int e;
+} diyfp_t; /* f*2^e */
+
+#define CACHED_POW10_MIN  (-348)
+#define CACHED_POW10_STEP 8
+#define CACHED_POW10_LEN  87
+
+/* mantissa and binary exponent of round(10^k) for k = -348 + 8 * i */
+static const uint64_t cached_pow10_mant[CACHED_POW10_LEN] = {
+    0xfa8fd5a0081c0288, 0xbaaee17fa23ebf76, 0x8b16fb203055ac76,
+    0xcf42894a5dce35ea, 0x9a6bb0aa55653b2d, 0xe61acf033d1a45df,
+    0xab70fe17c79ac6ca, 0xff77b1fcbebcdc4f, 0xbe5691ef416bd60c,
+    0x8dd01fad907ffc3c, 0xd3515c2831559a83, 0x9d71ac8fada6c9b5,
+    0xea9c227723ee8bcb, 0xaecc49914078536d, 0x823c12795db6ce57,
+    0xc21094364dfb5637, 0x9096ea6f3848984f, 0xd77485cb25823ac7,
+    0xa086cfcd97bf97f4, 0xef340a98172aace5, 0xb23867fb2a35b28e,
+    0x84c8d4dfd2c63f3b, 0xc5dd44271ad3cdba, 0x936b9fcebb25c996,
+    0xdbac6c247d62a584, 0xa3ab66580d5fdaf6, 0xf3e2f893dec3f126,
+    0xb5b5ada8aaff80b8, 0x87625f056c7c4a8b, 0xc9bcff6034c13053,
+    0x964e858c91ba2655, 0xdff9772470297ebd, 0xa6dfbd9fb8e5b88f,
+    0xf8a95fcf88747d94, 0xb94470938fa89bcf, 0x8a08f0f8bf0f156b,
+    0xcdb02555653131b6, 0x993fe2c6d07b7fac, 0xe45c10c42a2b3b06,
+    0xaa242499697392d3, 0xfd87b5f28300ca0e, 0xbce5086492111aeb,
+    0x8cbccc096f5088cc, 0xd1b71758e219652c, 0x9c40000000000000,
+    0xe8d4a51000000000, 0xad78ebc5ac620000, 0x813f3978f8940984,
+    0xc097ce7bc90715b3, 0x8f7e32ce7bea5c70, 0xd5d238a4abe98068,
+    0x9f4f2726179a2245, 0xed63a231d4c4fb27, 0xb0de65388cc8ada8,
+    0x83c7088e1aab65db, 0xc45d1df942711d9a, 0x924d692ca61be758,
+    0xda01ee641a708dea, 0xa26da3999aef774a, 0xf209787bb47d6b85,
+    0xb454e4a179dd1877, 0x865b86925b9bc5c2, 0xc83553c5c8965d3d,
+    0x952ab45cfa97a0b3, 0xde469fbd99a05fe3, 0xa59bc234db398c25,
+    0xf6c69a72a3989f5c, 0xb7dcbf5354e9bece, 0x88fcf317f22241e2,
+    0xcc20ce9bd35c78a5, 0x98165af37b2153df, 0xe2a0b5dc971f303a,
+    0xa8d9d1535ce3b396, 0xfb9b7cd9a4a7443c, 0xbb764c4ca7a44410,
+    0x8bab8eefb6409c1a, 0xd01fef10a657842c, 0x9b10a4e5e9913129,
+    0xe7109bfba19c0c9d, 0xac2820d9623bf429, 0x80444b5e7aa7cf85,
+    0xbf21e44003acdd2d, 0x8e679c2f5e44ff8f, 0xd433179d9c8cb841,
+    0x9e19db92b4e31ba9, 0xeb96bf6ebadf77d9, 0xaf87023b9bf0ee6b,
+};
+
+static const int16_t cached_pow10_exp[CACHED_POW10_LEN] = {
+    -1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034,
+    -1007, -980, -954, -927, -901, -874, -847, -821,
+    -794, -768, -741, -715, -688, -661, -635, -608,
+    -582, -555, -529, -502, -475, -449, -422, -396,
+    -369, -343, -316, -289, -263, -236, -210, -183,
+    -157, -130, -103, -77, -50, -24, 3, 30,
+    56, 83, 109, 136, 162, 189, 216, 242,
+    269, 295, 322, 348, 375, 402, 428, 455,
+    481, 508, 534, 561, 588, 614, 641, 667,
+    694, 720, 747, 774, 800, 827, 853, 880,
+    907, 933, 960, 986, 1013, 1039, 1066,
+};
+
+static diyfp_t diyfp_mul(diyfp_t x, diyfp_t y)
+{
+    uint64_t a, b, c, d, ac, bc, ad, bd, t;
+    diyfp_t r;
+
+    a = x.f >> 32;
+    b = x.f & 0xffffffff;
+    c = y.f >> 32;
+    d = y.f & 0xffffffff;
+    ac = a * c;
+    bc = b * c;
+    ad = a * d;
+    bd = b * d;
+    /* the result is rounded */
+    t = (bd >> 32) + (ad & 0xffffffff) + (bc & 0xffffffff) + ((uint64_t)1 << 31);
+    r.f = ac + (ad >> 32) + (bc >> 32) + (t >> 32);
+    r.e = x.e + y.e + 64;
+    return r;
+}
+
+static diyfp_t diyfp_normalize(diyfp_t x)
+{
+    int shift = clz64(x.f);
+    x.f <<= shift;
+    x.e -= shift;
+    return x;
+}
+
+/* Move the last digit of 'mant' towards 'w' while it stays in the
+   unsafe interval. Return FALSE if the result is not guaranteed to be
+   the closest shortest representation. */
+static BOOL grisu3_round_weed(uint64_t *pmant, uint64_t dist_too_high_w,
+                              uint64_t unsafe_interval, uint64_t rest,
+                              uint64_t ten_kappa, uint64_t unit)
+{
+    uint64_t small_dist, big_dist;
+
+    small_dist = dist_too_high_w - unit;
+    big_dist = dist_too_high_w + unit;
+    while (rest < small_dist &&
+           unsafe_interval - rest >= ten_kappa &&
+           (rest + ten_kappa < small_dist ||
+            small_dist - rest >= rest + ten_kappa - small_dist)) {
+        (*pmant)--;
+        rest += ten_kappa;
+    }
+    if (rest < big_dist &&
+        unsafe_interval - rest >= ten_kappa &&
+        (rest + ten_kappa < big_dist ||
+         big_dist - rest > rest + ten_kappa - big_dist))
+        return FALSE;
+    return (2 * unit <= rest) && (rest <= unsafe_interval - 4 * unit);
+}
+
+/* 'a' is a finite non zero float64 (the sign is ignored). Return the
+   number of digits P and set (*pmant, *pE) such that abs(d) =
+   0.mant*10^E with the minimum number of digits, or return 0 if the
+   fast algorithm failed. */
+static int js_dtoa_fast10(uint64_t *pmant, int *pE, uint64_t a)
+{
+    diyfp_t w, m_plus, m_minus, c, too_low, too_high;
+    uint64_t f, mant, fractionals, one_f, rest, unit, unsafe_interval;
+    uint32_t integrals, divisor;
+    int e, k, idx, mk, kappa, len, one_e;
+    BOOL lower_closer;
+
+    f = a & (((uint64_t)1 << 52) - 1);
+    e = (a >> 52) & 0x7ff;
+    if (e == 0) {
+        e = 1; /* denormal */
+        lower_closer = FALSE;
+    } else {
+        lower_closer = (f == 0 && e > 1);
+        f |= (uint64_t)1 << 52;
+    }
+    e -= 1075;
+
+    /* boundaries of the rounding interval */
+    m_plus.f = (f << 1) + 1;
+    m_plus.e = e - 1;
+    m_plus = diyfp_normalize(m_plus);
+    if (lower_closer) {
+        m_minus.f = (f << 2) - 1;
+        m_minus.e = e - 2;
+    } else {
+        m_minus.f = (f << 1) - 1;
+        m_minus.e = e - 1;
+    }
+    m_minus.f <<= m_minus.e - m_plus.e;
+    m_minus.e = m_plus.e;
+    w.f = f;
+    w.e = e;
+    w = diyfp_normalize(w);
+
+    /* c = 10^mk such that the exponent of w*c is in [-60, -32] */
+    k = -mul_log2_radix(w.e + 61, 10);
+    idx = (-CACHED_POW10_MIN + k - 1) / CACHED_POW10_STEP + 1;
+    c.f = cached_pow10_mant[idx];
+    c.e = cached_pow10_exp[idx];
+    mk = CACHED_POW10_MIN + idx * CACHED_POW10_STEP;
+    w = diyfp_mul(w, c);
+    m_minus = diyfp_mul(m_minus, c);
+    m_plus = diyfp_mul(m_plus, c);
+
+    /* digit generation. The multiplications are exact to 1 ulp so
+       the unsafe interval is one unit larger on each side. */
+    unit = 1;
+    too_low.f = m_minus.f - unit;
+    too_high.f = m_plus.f + unit;
+    unsafe_interval = too_high.f - too_low.f;
+    one_e = -w.e;
+    one_f = (uint64_t)1 << one_e;
+    integrals = too_high.f >> one_e;
+    fractionals = too_high.f & (one_f - 1);
+    divisor = 1;
+    kappa = 1;
+    while (divisor <= integrals / 10) {
+        divisor *= 10;
+        kappa++;
+    }
+    if (integrals == 0)
+        kappa = 0;
+    mant = 0;
+    len = 0;
+    while (kappa > 0) {
+        mant = mant * 10 + integrals / divisor;
+        len++;
+        integrals %= divisor;
+        kappa--;
+        rest = ((uint64_t)integrals << one_e) + fractionals;
+        if (rest < unsafe_interval) {
+            if (!grisu3_round_weed(&mant, too_high.f - w.f, unsafe_interval, rest,
+                                   (uint64_t)divisor << one_e, unit))
+                return 0;
+            goto found;
+        }
+        divisor /= 10;
+    }
+    for(;;) {
+        fractionals *= 10;
+        unit *= 10;
+        unsafe_interval *= 10;
+        mant = mant * 10 + (fractionals >> one_e);
+        len++;
+        fractionals &= one_f - 1;
+        kappa--;
+        if (fractionals < unsafe_interval) {
+            if (!grisu3_round_weed(&mant, (too_high.f - w.f) * unit, unsafe_interval,
+                                   fractionals, one_f, unit))
+                return 0;
+            break;
+        }
+        if (len >= 17)
+            return 0;
+    }
+ found:
+    if (len > 17 || mant == 0)
+        return 0;
+    while ((mant % 10) == 0) {
+        mant /= 10;
+        len--;
+        kappa++;
+    }
+    /* abs(d) = mant*10^(kappa-mk) */
+    *pmant = mant;
+    *pE = kappa - mk + len;
+    return len;
+}
+#endif /* USE_FAST_DTOA */
+
 #ifdef JS_DTOA_DUMP_STATS
 static int out_len_count[17];
 
@@ -1176,6 +1415,16 @@ int js_dtoa(char *buf, double d, int radix, int n_digits, int flags,
         goto done;
     }
 #endif
+#ifdef USE_FAST_DTOA
+    if (fmt == JS_DTOA_FORMAT_FREE && radix == 10) {
+        uint64_t mant;
+        P = js_dtoa_fast10(&mant, &E, a);
+        if (P != 0) {
+            mpb_set_u64(tmp1, mant);
+            goto output;
+        }
+    }
+#endif
     
     /* this choice of E implies F=round(x*B^(P-E) is such as: 
        B^(P-1) <= F < 2.B^P. */
@@ -1350,7 +1599,14 @@ static void mpb_mul1_base(mpb_t *r, limb_t radix_base, limb_t a)
     }
 }
 
-/* XXX: add fast path for small integers */
+#ifdef USE_FAST_ATOD
+/* exactly representable powers of ten */
+static const double pow10_table[23] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+#endif
+
 double js_atod(const char *str, const char **pnext, int radix, int flags,
                JSATODTempMem *tmp_mem)
 {
@@ -1569,6 +1825,27 @@ double js_atod(const char *str, const char **pnext, int radix, int flags,
         a = 0;
     } else {
         int expn1;
+#ifdef USE_FAST_ATOD
+        /* mant < 10^15 < 2^53 and 10^abs(expn) are exact, so a single
+           multiplication or division gives the correctly rounded result */
+        if (radix == 10 && digit_count <= 15) {
+            expn1 = expn - expn_offset;
+            if (expn1 >= -22 && expn1 <= 22 + 15 - digit_count) {
+                dval = (double)mpb_get_u64(tmp0);
+                if (expn1 > 22) {
+                    dval *= pow10_table[expn1 - 22];
+                    expn1 = 22;
+                }
+                if (expn1 >= 0)
+                    dval *= pow10_table[expn1];
+                else
+                    dval /= pow10_table[-expn1];
+                if (is_neg)
+                    dval = -dval;
+                goto done1;
+            }
+        }
+#endif
         if (radix_bits != 0) {
             if (!is_bin_exp)
                 expn *= radix_bits;
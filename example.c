@@ -221,6 +221,43 @@ static JSValue js_performance_now(JSContext *ctx, JSValue *this_val, int argc, J
 
 #include "example_stdlib.h"
 
+/* functions added at runtime with JS_NewCFunction() */
+
+static double js_lerp(double a, double b, double t)
+{
+    return a + (b - a) * t;
+}
+
+static int32_t js_imax(int32_t a, int32_t b)
+{
+    return a > b ? a : b;
+}
+
+static void js_invert_bytes(uint8_t *ptr, size_t len)
+{
+    size_t i;
+    for(i = 0; i < len; i++)
+        ptr[i] = ~ptr[i];
+}
+
+static void set_global_cfunction(JSContext *ctx, const char *name, int def_type,
+                                 JSCFunctionType func, int arg_count)
+{
+    JSValue val;
+    val = JS_NewCFunction(ctx, name, def_type, func, arg_count, 0);
+    JS_SetPropertyStr(ctx, JS_GetGlobalObject(ctx), name, val);
+}
+
+static void add_host_functions(JSContext *ctx)
+{
+    set_global_cfunction(ctx, "lerp", JS_CFUNC_f_fff,
+                         (JSCFunctionType){ .f_fff = js_lerp }, 3);
+    set_global_cfunction(ctx, "imax", JS_CFUNC_i_ii,
+                         (JSCFunctionType){ .i_ii = js_imax }, 2);
+    set_global_cfunction(ctx, "invertBytes", JS_CFUNC_v_ptr_len,
+                         (JSCFunctionType){ .v_ptr_len = js_invert_bytes }, 1);
+}
+
 static void js_log_func(void *opaque, const void *buf, size_t buf_len)
 {
     fwrite(buf, 1, buf_len, stdout);
@@ -269,6 +306,7 @@ int main(int argc, const char **argv)
     mem_buf = malloc(mem_size);
     ctx = JS_NewContext(mem_buf, mem_size, &js_stdlib);
     JS_SetLogFunc(ctx, js_log_func);
+    add_host_functions(ctx);
     
     buf = load_file(filename, &buf_len);
     val = JS_Eval(ctx, (const char *)buf, buf_len, filename, 0);
@@ -87,6 +87,14 @@ static int64_t get_time_ms(void)
 }
 #endif
 
+/* GC pause measurement in microseconds */
+static int64_t gc_clock(void *opaque)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
 static JSValue js_date_now(JSContext *ctx, JSValue *this_val, int argc, JSValue *argv)
 {
     struct timeval tv;
@@ -118,6 +126,23 @@ static JSValue js_load(JSContext *ctx, JSValue *this_val, int argc, JSValue *arg
     return ret;
 }
 
+/* if TRUE, suspend and resume the execution at each interrupt poll
+   (used to test JS_Resume()) */
+static BOOL js_suspend_mode;
+
+static int js_suspend_interrupt_handler(JSContext *ctx, void *opaque)
+{
+    return JS_INTERRUPT_SUSPEND;
+}
+
+/* 'val' is the result of JS_Run() or JS_Call() */
+static JSValue js_resume_all(JSContext *ctx, JSValue val)
+{
+    while (JS_IsException(val) && JS_IsSuspended(ctx))
+        val = JS_Resume(ctx);
+    return val;
+}
+
 /* timers */
 typedef struct {
     BOOL allocated;
@@ -197,7 +222,7 @@ static void run_timers(JSContext *ctx)
                     JS_DeleteGCRef(ctx, &th->func);
                     th->allocated = FALSE;
                     
-                    ret = JS_Call(ctx, 0);
+                    ret = js_resume_all(ctx, JS_Call(ctx, 0));
                     if (JS_IsException(ret)) {
                     fail:
                         dump_error(ctx);
@@ -288,7 +313,7 @@ static int eval_buf(JSContext *ctx, const char *eval_str, const char *filename,
     if (JS_IsException(val))
         goto exception;
 
-    val = JS_Run(ctx, val);
+    val = js_resume_all(ctx, JS_Run(ctx, val));
     if (JS_IsException(val)) {
     exception:
         dump_error(ctx);
@@ -303,19 +328,46 @@ static int eval_buf(JSContext *ctx, const char *eval_str, const char *filename,
     }
 }
 
+/* the bytecode is used in place by the context, so the loaded
+   bytecode files are kept until the context is freed */
+typedef struct BytecodeBuf {
+    struct BytecodeBuf *next;
+    uint8_t *buf;
+} BytecodeBuf;
+
+static BytecodeBuf *bytecode_list;
+
+static void free_bytecode_bufs(void)
+{
+    BytecodeBuf *b, *b_next;
+
+    for(b = bytecode_list; b != NULL; b = b_next) {
+        b_next = b->next;
+        free(b->buf);
+        free(b);
+    }
+    bytecode_list = NULL;
+}
+
 static int eval_file(JSContext *ctx, const char *filename,
                      int argc, const char **argv, int parse_flags)
 {
     uint8_t *buf;
-    int ret, buf_len;
+    int ret, buf_len, is_bytecode;
     JSValue val;
     
     buf = load_file(filename, &buf_len);
-    if (JS_IsBytecode(buf, buf_len)) {
+    is_bytecode = JS_IsBytecode(buf, buf_len);
+    if (is_bytecode) {
+        BytecodeBuf *b;
         if (JS_RelocateBytecode(ctx, buf, buf_len)) {
             fprintf(stderr, "Could not relocate bytecode\n");
             exit(1);
         }
+        b = malloc(sizeof(*b));
+        b->buf = buf;
+        b->next = bytecode_list;
+        bytecode_list = b;
         val = JS_LoadBytecode(ctx, buf);
     } else {
         val = JS_Parse(ctx, (char *)buf, buf_len, filename, parse_flags);
@@ -343,7 +395,7 @@ static int eval_file(JSContext *ctx, const char *filename,
     }
     
     
-    val = JS_Run(ctx, val);
+    val = js_resume_all(ctx, JS_Run(ctx, val));
     if (JS_IsException(val)) {
     exception:
         dump_error(ctx);
@@ -351,7 +403,8 @@ static int eval_file(JSContext *ctx, const char *filename,
     } else {
         ret = 0;
     }
-    free(buf);
+    if (!is_bytecode)
+        free(buf);
     return ret;
 }
 
@@ -384,6 +437,8 @@ static void compile_file(const char *filename, const char *outfilename,
 
     eval_str = (char *)load_file(filename, NULL);
 
+    /* the bytecode cannot contain functions which are not compiled */
+    parse_flags &= ~JS_EVAL_LAZY;
     val = JS_Parse(ctx, eval_str, strlen(eval_str), filename, parse_flags);
     free(eval_str);
     if (JS_IsException(val)) {
@@ -563,6 +618,200 @@ static void repl_run(JSContext *ctx)
     }
 }
 
+/* sampling profiler */
+
+#define PROFILE_SAMPLE_COUNT 16384
+#define PROFILE_INTERVAL     1000
+
+typedef struct {
+    char *key;
+    int count;
+} ProfileEntry;
+
+static int profile_cmp_key(const void *a, const void *b)
+{
+    return strcmp(*(char **)a, *(char **)b);
+}
+
+static int profile_cmp_count(const void *a, const void *b)
+{
+    const ProfileEntry *e1 = a, *e2 = b;
+    if (e1->count != e2->count)
+        return e2->count - e1->count;
+    return strcmp(e1->key, e2->key);
+}
+
+static void profile_put_frame(char **pp, char *buf_end, JSContext *ctx,
+                              const JSProfileSample *s, int level)
+{
+    JSProfileFrame f;
+    int len;
+    
+    JS_GetProfileFrame(ctx, &f, s, level);
+    if (!f.filename)
+        len = snprintf(*pp, buf_end - *pp, "%s (native)", f.func_name);
+    else if (f.line_num == 0)
+        len = snprintf(*pp, buf_end - *pp, "%s (%s)", f.func_name, f.filename);
+    else
+        len = snprintf(*pp, buf_end - *pp, "%s (%s:%d)", f.func_name,
+                       f.filename, f.line_num);
+    *pp += min_int(len, buf_end - *pp - 1);
+}
+
+/* flat report of the innermost frames to stderr or folded stacks
+   (one 'outer;...;inner count' line per stack) to 'fo' */
+static void profile_report(JSContext *ctx, JSProfileSample *samples,
+                           FILE *fo, BOOL folded)
+{
+    uint32_t total;
+    int n, i, j, n_entries;
+    char **keys, buf[2048], *p;
+    ProfileEntry *tab;
+    const JSProfileSample *s;
+    
+    total = JS_GetProfileSampleCount(ctx);
+    n = min_uint32(total, PROFILE_SAMPLE_COUNT);
+    keys = malloc(sizeof(keys[0]) * (n + 1));
+    tab = malloc(sizeof(tab[0]) * (n + 1));
+    for(i = 0; i < n; i++) {
+        s = &samples[i];
+        p = buf;
+        buf[0] = '\0';
+        if (folded) {
+            for(j = s->depth - 1; j >= 0; j--) {
+                profile_put_frame(&p, buf + sizeof(buf), ctx, s, j);
+                if (j != 0 && p < buf + sizeof(buf) - 1) {
+                    *p++ = ';';
+                    *p = '\0';
+                }
+            }
+        } else {
+            profile_put_frame(&p, buf + sizeof(buf), ctx, s, 0);
+        }
+        keys[i] = strdup(buf);
+    }
+    qsort(keys, n, sizeof(keys[0]), profile_cmp_key);
+    n_entries = 0;
+    for(i = 0; i < n; i++) {
+        if (n_entries != 0 && !strcmp(tab[n_entries - 1].key, keys[i])) {
+            tab[n_entries - 1].count++;
+            free(keys[i]);
+        } else {
+            tab[n_entries].key = keys[i];
+            tab[n_entries].count = 1;
+            n_entries++;
+        }
+    }
+    if (folded) {
+        for(i = 0; i < n_entries; i++)
+            fprintf(fo, "%s %d\n", tab[i].key, tab[i].count);
+    } else {
+        qsort(tab, n_entries, sizeof(tab[0]), profile_cmp_count);
+        fprintf(fo, "%u samples", total);
+        if (total > n)
+            fprintf(fo, " (last %d reported)", n);
+        fprintf(fo, "\n%8s %6s  %s\n", "SAMPLES", "%", "FUNCTION");
+        for(i = 0; i < n_entries; i++) {
+            fprintf(fo, "%8d %5.1f%%  %s\n", tab[i].count,
+                    tab[i].count * 100.0 / n, tab[i].key);
+        }
+    }
+    for(i = 0; i < n_entries; i++)
+        free(tab[i].key);
+    free(tab);
+    free(keys);
+}
+
+static void profile_end(JSContext *ctx, JSProfileSample *samples,
+                        BOOL profile, const char *filename)
+{
+    FILE *fo;
+    
+    if (!samples)
+        return;
+    if (profile)
+        profile_report(ctx, samples, stderr, FALSE);
+    if (filename) {
+        fo = fopen(filename, "w");
+        if (!fo) {
+            perror(filename);
+        } else {
+            profile_report(ctx, samples, fo, TRUE);
+            fclose(fo);
+        }
+    }
+    JS_SetProfileBuffer(ctx, NULL, 0, 0);
+    free(samples);
+}
+
+/* --memory-grow: the whole memory limit is allocated (the pages are
+   only committed when touched) but the context starts with a small
+   usable part of it */
+#define HEAP_GROW_INIT_SIZE (64 * 1024)
+
+static size_t js_heap_grow(void *opaque, void *mem_start, size_t mem_size,
+                           size_t min_size)
+{
+    return min_size;
+}
+
+/* save the context and restore it in a new memory block (at another
+   address). Return NULL if error. */
+static JSContext *js_snapshot_restore(JSContext *ctx, uint8_t **pmem_buf,
+                                      size_t mem_size)
+{
+    uint8_t *buf, *mem_buf;
+    size_t len;
+    JSContext *ctx1;
+
+    len = JS_SnapshotContext(ctx, NULL, 0);
+    if (len == 0)
+        return NULL;
+    buf = malloc(len);
+    JS_SnapshotContext(ctx, buf, len);
+    mem_buf = malloc(mem_size);
+    ctx1 = JS_RestoreContext(mem_buf, mem_size, buf, len);
+    free(buf);
+    if (!ctx1) {
+        free(mem_buf);
+        return NULL;
+    }
+    JS_FreeContext(ctx);
+    /* no pointer to the old memory block must remain */
+    memset(*pmem_buf, 0xaa, mem_size);
+    free(*pmem_buf);
+    *pmem_buf = mem_buf;
+    return ctx1;
+}
+
+/* memory and GC statistics in JSON (used by "make bench") */
+static void write_stats(JSContext *ctx, const char *filename)
+{
+    JSMemoryUsage mu;
+    JSMeterStats ms;
+    FILE *fo;
+
+    fo = fopen(filename, "w");
+    if (!fo) {
+        perror(filename);
+        return;
+    }
+    JS_GetMemoryUsage(ctx, &mu);
+    JS_GetMeterStats(ctx, &ms);
+    fprintf(fo, "{\"mem_size\": %u, \"heap_size\": %u, \"max_heap_size\": %llu, "
+            "\"gc_count\": %u, \"minor_gc_count\": %u, \"reclaimed_bytes\": %llu, "
+            "\"gc_total_pause_ms\": %.3f, \"heap_grow_count\": %u, "
+            "\"ticks\": %llu, \"alloc_bytes\": %llu, \"native_time_ms\": %.3f}\n",
+            (unsigned int)mu.mem_size, (unsigned int)mu.heap_size,
+            (unsigned long long)mu.gc.max_heap_size,
+            mu.gc.gc_count, mu.gc.minor_gc_count,
+            (unsigned long long)mu.gc.reclaimed_bytes,
+            mu.gc.total_pause / 1000.0, mu.gc.heap_grow_count,
+            (unsigned long long)ms.ticks, (unsigned long long)ms.alloc_bytes,
+            ms.native_time / 1000.0);
+    fclose(fo);
+}
+
 static void help(void)
 {
     printf("MicroQuickJS" "\n"
@@ -573,6 +822,16 @@ static void help(void)
            "-I  --include file include an additional file\n"
            "-d  --dump         dump the memory usage stats\n"
            "    --memory-limit n       limit the memory usage to 'n' bytes\n"
+           "    --memory-grow          start with a small memory and extend it up to the limit\n"
+           "    --gc-generational      collect the young blocks first (shorter GC pauses)\n"
+           "    --shapes               share the property layout of similar objects\n"
+           "    --lazy                 compile the functions at their first call\n"
+           "    --profile              print a flat profile of the sampled functions\n"
+           "    --profile-folded FILE  save the sampled stacks to FILE in folded format\n"
+           "    --suspend              suspend and resume the execution at each interrupt poll\n"
+           "    --max-ticks n          stop the execution after 'n' calls and jumps\n"
+           "    --stats FILE           save the memory, GC and metering statistics to FILE in JSON\n"
+           "    --snapshot             save and restore the context at another address after the included files\n"
            "--no-column        no column number in debug information\n"
            "-o FILE            save the bytecode to FILE\n"
            "-m32               force 32 bit bytecode output (use with -o)\n");
@@ -593,11 +852,29 @@ int main(int argc, const char **argv)
     JSContext *ctx;
     int i, parse_flags;
     BOOL force_32bit;
+    int gc_mode;
+    BOOL shape_mode;
+    BOOL memory_grow;
+    BOOL snapshot;
+    BOOL profile;
+    const char *profile_filename;
+    JSProfileSample *profile_samples;
+    const char *stats_filename;
+    JSMeterStats budget;
     
     mem_size = 16 << 20;
+    gc_mode = JS_GC_MODE_FULL;
+    shape_mode = FALSE;
+    memory_grow = FALSE;
+    snapshot = FALSE;
     dump_memory = 0;
     parse_flags = 0;
     force_32bit = FALSE;
+    profile = FALSE;
+    profile_filename = NULL;
+    profile_samples = NULL;
+    stats_filename = NULL;
+    memset(&budget, 0, sizeof(budget));
     
     /* cannot use getopt because we want to pass the command line to
        the script */
@@ -660,6 +937,58 @@ int main(int argc, const char **argv)
                 }
                 continue;
             }
+            if (!strcmp(longopt, "memory-grow")) {
+                memory_grow = TRUE;
+                continue;
+            }
+            if (!strcmp(longopt, "gc-generational")) {
+                gc_mode = JS_GC_MODE_GENERATIONAL;
+                continue;
+            }
+            if (!strcmp(longopt, "shapes")) {
+                shape_mode = TRUE;
+                continue;
+            }
+            if (!strcmp(longopt, "lazy")) {
+                parse_flags |= JS_EVAL_LAZY;
+                continue;
+            }
+            if (!strcmp(longopt, "max-ticks")) {
+                if (optind >= argc) {
+                    fprintf(stderr, "expecting tick count");
+                    exit(1);
+                }
+                budget.ticks = strtoull(argv[optind++], NULL, 0);
+                continue;
+            }
+            if (!strcmp(longopt, "stats")) {
+                if (optind >= argc) {
+                    fprintf(stderr, "expecting filename");
+                    exit(1);
+                }
+                stats_filename = argv[optind++];
+                continue;
+            }
+            if (!strcmp(longopt, "snapshot")) {
+                snapshot = TRUE;
+                continue;
+            }
+            if (!strcmp(longopt, "suspend")) {
+                js_suspend_mode = TRUE;
+                continue;
+            }
+            if (!strcmp(longopt, "profile")) {
+                profile = TRUE;
+                continue;
+            }
+            if (!strcmp(longopt, "profile-folded")) {
+                if (optind >= argc) {
+                    fprintf(stderr, "expecting filename");
+                    exit(1);
+                }
+                profile_filename = argv[optind++];
+                continue;
+            }
             if (opt == 'd' || !strcmp(longopt, "dump")) {
                 dump_memory++;
                 continue;
@@ -721,17 +1050,45 @@ int main(int argc, const char **argv)
     } else {
         mem_buf = malloc(mem_size);
         ctx = JS_NewContext(mem_buf, mem_size, &js_stdlib);
+        if (memory_grow)
+            JS_SetHeapGrowCallback(ctx, js_heap_grow, NULL, HEAP_GROW_INIT_SIZE);
         JS_SetLogFunc(ctx, js_log_func);
+        /* nursery of 1/16 of the memory */
+        JS_SetGCMode(ctx, gc_mode, mem_size / 16);
+        JS_SetShapeMode(ctx, shape_mode);
+        JS_SetGCClock(ctx, gc_clock);
+        if (js_suspend_mode)
+            JS_SetInterruptHandler(ctx, js_suspend_interrupt_handler);
         {
             struct timeval tv;
             gettimeofday(&tv, NULL);
             JS_SetRandomSeed(ctx, ((uint64_t)tv.tv_sec << 32) ^ tv.tv_usec);
         }
+        if (profile || profile_filename) {
+            profile_samples = malloc(sizeof(profile_samples[0]) * PROFILE_SAMPLE_COUNT);
+            JS_SetProfileBuffer(ctx, profile_samples, PROFILE_SAMPLE_COUNT,
+                                PROFILE_INTERVAL);
+        }
+        /* the native time measurement has a cost */
+        if (budget.ticks != 0 || stats_filename)
+            JS_ResetMeter(ctx, &budget);
 
         for(i = 0; i < include_count; i++) {
             if (eval_file(ctx, include_list[i], 0, NULL, parse_flags))
                 goto fail;
         }
+        if (snapshot) {
+            JSContext *ctx1 = js_snapshot_restore(ctx, &mem_buf, mem_size);
+            if (!ctx1) {
+                fprintf(stderr, "Could not snapshot the context\n");
+                goto fail;
+            }
+            ctx = ctx1;
+            /* the profile buffer is not saved */
+            if (profile_samples)
+                JS_SetProfileBuffer(ctx, profile_samples, PROFILE_SAMPLE_COUNT,
+                                    PROFILE_INTERVAL);
+        }
         
         if (expr) {
             if (eval_buf(ctx, expr, "<cmdline>", FALSE, parse_flags | JS_EVAL_REPL))
@@ -752,13 +1109,22 @@ int main(int argc, const char **argv)
         
         if (dump_memory)
             JS_DumpMemory(ctx, (dump_memory >= 2));
+        if (stats_filename)
+            write_stats(ctx, stats_filename);
         
+        profile_end(ctx, profile_samples, profile, profile_filename);
         JS_FreeContext(ctx);
+        free_bytecode_bufs();
         free(mem_buf);
     }
     return 0;
  fail:
+    /* the statistics also tell why a run was stopped */
+    if (stats_filename)
+        write_stats(ctx, stats_filename);
+    profile_end(ctx, profile_samples, profile, profile_filename);
     JS_FreeContext(ctx);
+    free_bytecode_bufs();
     free(mem_buf);
     return 1;
 }
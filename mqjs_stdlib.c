@@ -30,6 +30,8 @@
 
 /* defined in mqjs_example.c */
 //#define CONFIG_CLASS_EXAMPLE
+/* defined in wasm_stdlib.c */
+//#define CONFIG_WASM_CANVAS
 
 static const JSPropDef js_object_proto[] = {
     JS_CFUNC_DEF("hasOwnProperty", 1, js_object_hasOwnProperty),
@@ -210,14 +212,14 @@ static const JSPropDef js_math[] = {
     JS_CFUNC_SPECIAL_DEF("asin", 1, f_f, js_asin ),
     JS_CFUNC_SPECIAL_DEF("acos", 1, f_f, js_acos ),
     JS_CFUNC_SPECIAL_DEF("atan", 1, f_f, js_atan ),
-    JS_CFUNC_DEF("atan2", 2, js_math_atan2 ),
+    JS_CFUNC_SPECIAL_DEF("atan2", 2, f_ff, js_atan2 ),
     JS_CFUNC_SPECIAL_DEF("exp", 1, f_f, js_exp ),
     JS_CFUNC_SPECIAL_DEF("log", 1, f_f, js_log ),
-    JS_CFUNC_DEF("pow", 2, js_math_pow ),
+    JS_CFUNC_SPECIAL_DEF("pow", 2, f_ff, js_pow ),
     JS_CFUNC_DEF("random", 0, js_math_random ),
 
     /* some ES6 functions */
-    JS_CFUNC_DEF("imul", 2, js_math_imul ),
+    JS_CFUNC_SPECIAL_DEF("imul", 2, i_ii, js_math_imul ),
     JS_CFUNC_DEF("clz32", 1, js_math_clz32 ),
     JS_CFUNC_SPECIAL_DEF("fround", 1, f_f, js_math_fround ),
     JS_CFUNC_SPECIAL_DEF("trunc", 1, f_f, js_trunc ),
@@ -256,6 +258,15 @@ static const JSPropDef js_typed_array_base_proto[] = {
     JS_CFUNC_DEF("join", 1, js_array_join ),
     JS_CFUNC_DEF("toString", 0, js_array_toString ),
     JS_CFUNC_DEF("subarray", 2, js_typed_array_subarray ),
+    JS_CFUNC_DEF("set", 1, js_typed_array_set ),
+    JS_CFUNC_DEF("fill", 1, js_typed_array_fill ),
+    JS_CFUNC_DEF("copyWithin", 2, js_typed_array_copyWithin ),
+    JS_CFUNC_DEF("slice", 2, js_typed_array_slice ),
+    JS_CFUNC_MAGIC_DEF("indexOf", 1, js_typed_array_indexOf, 0 ),
+    JS_CFUNC_MAGIC_DEF("lastIndexOf", 1, js_typed_array_indexOf, 1 ),
+    JS_CFUNC_MAGIC_DEF("includes", 1, js_typed_array_indexOf, 2 ),
+    JS_CFUNC_MAGIC_DEF("reduce", 1, js_typed_array_reduce, js_special_reduce ),
+    JS_CFUNC_MAGIC_DEF("reduceRight", 1, js_typed_array_reduce, js_special_reduceRight ),
     JS_PROP_END,
 };
 
@@ -378,6 +389,11 @@ static const JSPropDef js_global_object[] = {
     JS_CFUNC_DEF("load", 1, js_load),
     JS_CFUNC_DEF("setTimeout", 2, js_setTimeout),
     JS_CFUNC_DEF("clearTimeout", 1, js_clearTimeout),
+#endif
+#ifdef CONFIG_WASM_CANVAS
+    JS_PROP_CLASS_DEF("canvas", &js_canvas_obj),
+    JS_CFUNC_DEF("setInterval", 2, js_setInterval),
+    JS_CFUNC_DEF("clearInterval", 1, js_clearTimeout),
 #endif
     JS_PROP_END,
 };
@@ -71,7 +71,7 @@
 #define JS_VALUE_IS_BOTH_INT(a, b) ((((a) | (b)) & 1) == 0)
 #define JS_VALUE_IS_BOTH_SHORT_FLOAT(a, b) (((((a) - JS_TAG_SHORT_FLOAT) | ((b) - JS_TAG_SHORT_FLOAT)) & 7) == 0)
 
-static __maybe_unused const char *js_mtag_name[JS_MTAG_COUNT] = {
+static const char *js_mtag_name[JS_MTAG_COUNT] = {
     "free",
     "object",
     "float64",
@@ -87,6 +87,7 @@ static __maybe_unused const char *js_mtag_name[JS_MTAG_COUNT] = {
 /* FRAME_CF_CTOR */
 #define FRAME_CF_POP_RET        (1 << 17) /* pop the return value */
 #define FRAME_CF_PC_ADD1        (1 << 18) /* increment the PC by 1 instead of 3 */
+#define FRAME_CF_RESUME         (1 << 19) /* JS_Resume(): continue a suspended execution */
 
 #define JS_MB_PAD(n)  (JSW * 8 - (n))
 
@@ -179,15 +180,34 @@ typedef struct JSROMClass {
     JSValue parent_class; /* JSROMClass or JS_NULL */
 } JSROMClass;
 
-#define N_ROM_ATOM_TABLES_MAX 2
+/* maximum number of bytecode files loaded with JS_LoadBytecode() */
+#define JS_BYTECODE_FILES_MAX 4
+/* the stdlib atoms + one table per bytecode file */
+#define N_ROM_ATOM_TABLES_MAX (1 + JS_BYTECODE_FILES_MAX)
 
 /* must be large enough to have a negligible runtime cost and small
    enough to call the interrupt callback often. */
 #define JS_INTERRUPT_COUNTER_INIT 10000
 
+#ifndef JS_STRING_POS_CACHE_SIZE
 #define JS_STRING_POS_CACHE_SIZE 2
+#endif
 #define JS_STRING_POS_CACHE_MIN_LEN 16 
 
+/* number of strings having a UTF-16 position index */
+#ifndef JS_STRING_INDEX_SIZE
+#define JS_STRING_INDEX_SIZE 4
+#endif
+/* minimum length in bytes of a string to have an index */
+#define JS_STRING_INDEX_MIN_LEN 1024
+/* distance between two index positions in UTF-16 characters */
+#define JS_STRING_INDEX_STEP 64
+
+/* number of compiled regexps kept by the RegExp constructor */
+#ifndef JS_REGEXP_CACHE_SIZE
+#define JS_REGEXP_CACHE_SIZE 4
+#endif
+
 typedef enum {
     POS_TYPE_UTF8,
     POS_TYPE_UTF16,
@@ -200,6 +220,73 @@ typedef struct {
     uint32_t str_pos[2]; /* 0 = UTF-8 pos (in bytes), 1 = UTF-16 pos */
 } JSStringPosCacheEntry;
 
+/* Sparse index of a long non ASCII string. Position k contains the
+   last character boundary at or before the UTF-16 position k *
+   JS_STRING_INDEX_STEP. */
+typedef struct {
+    uint32_t str_pos[2]; /* 0 = UTF-8 pos (in bytes), 1 = UTF-16 pos */
+} JSStringIndexPos;
+
+typedef struct {
+    JSValue str; /* JS_NULL or weak reference to a JSString */
+    JSValue index; /* JSByteArray of JSStringIndexPos. Only kept
+                      while 'str' is alive */
+} JSStringIndexEntry;
+
+/* property cache of the OP_get_field, OP_get_field2 and OP_put_field
+   sites, indexed by their bytecode address. The sites which share an
+   entry just replace each other's cached property. Must be a power of
+   two. */
+#ifndef JS_PROP_CACHE_SIZE
+#define JS_PROP_CACHE_SIZE 64
+#endif
+
+typedef struct {
+    const uint8_t *pc; /* bytecode site or NULL if the entry is free */
+    JSValue hash_mask; /* hash_mask of the property array holding the
+                          property. It defines the start of the
+                          properties, so 'offset' is a property boundary */
+    JSValue recv_shape; /* depth = 1: shape of a receiver which does not
+                           have the property, or JS_NULL */
+    uint32_t depth : 1; /* 0 = own property, 1 = found in the prototype */
+    uint32_t offset : 31; /* JSValue offset of the JSProperty or
+                             index in the value array if 'hash_mask'
+                             is a shape */
+} JSPropCacheEntry;
+
+/* Shared shapes (see JS_SetShapeMode()). Plain objects with at most
+   JS_SHAPE_MAX_PROPS normal properties store only their values. The
+   keys are in an immutable property array (the shape) shared by all
+   the objects built with the same key sequence. */
+#ifndef JS_SHAPE_MAX_PROPS
+#define JS_SHAPE_MAX_PROPS 16
+#endif
+/* initial value capacity of a shaped object */
+#define JS_SHAPE_INIT_SIZE 3
+/* shape transition cache. Must be a power of two. */
+#ifndef JS_SHAPE_CACHE_SIZE
+#define JS_SHAPE_CACHE_SIZE 64
+#endif
+/* card table of the generational GC. Each card covers
+   (1 << gc_card_shift) bytes of the memory block. A card is dirty
+   when a value may have been stored in its old blocks since the last
+   GC, so that a minor GC only scans the old blocks of the dirty
+   cards. */
+#ifdef DEBUG_GC
+/* small cards so that gc_check_cards() finds the missing barriers */
+#define JS_GC_CARD_SHIFT_MIN 4
+#define JS_GC_CARD_COUNT_MAX 65536
+#else
+#define JS_GC_CARD_SHIFT_MIN 9
+#define JS_GC_CARD_COUNT_MAX 4096
+#endif
+
+typedef struct {
+    JSValue shape; /* JS_NULL if the entry is free (weak reference) */
+    JSValue key;
+    JSValue next_shape; /* 'shape' with the property 'key' added */
+} JSShapeCacheEntry;
+
 struct JSContext {
     /* memory map:
        Stack
@@ -214,16 +301,25 @@ struct JSContext {
     JSValue *sp; /* current stack pointer */
     JSValue *fp; /* current frame pointer, stack_top if none */
     uint32_t min_free_size; /* min free size between heap_free and the
-                               bottom of the stack */
+                               bottom of the stack. Includes 'mem_reserve' */
+    uint32_t mem_reserve; /* part of the memory block which cannot be
+                             used yet (heap growth) */
     BOOL in_out_of_memory : 8; /* != 0 if generating the out of memory object */
     uint8_t n_rom_atom_tables;
     uint8_t string_pos_cache_counter; /* used for string_pos_cache[] update */
+    uint8_t string_index_counter; /* used for string_index[] update */
+    uint8_t regexp_cache_counter; /* used for regexp_cache[] update */
     uint16_t class_count; /* number of classes including user classes */
     int16_t interrupt_counter;
+    int16_t interrupt_counter_init; /* value of interrupt_counter at
+                                       its last reload */
     BOOL current_exception_is_uncatchable : 8;
+    BOOL is_suspended : 8; /* TRUE if a JS_Call() was suspended */
     struct JSParseState *parse_state; /* != NULL during JS_Eval() */
-    int unique_strings_len;
+    int unique_strings_len; /* number of strings in unique_strings */
+    int unique_strings_deleted; /* number of deleted hash table entries */
     int js_call_rec_count; /* number of recursing JS_Call() */
+    JSValue *suspended_fp; /* initial frame of the suspended JS_Call() */
     JSGCRef *top_gc_ref; /* used to reference temporary GC roots (stack top) */
     JSGCRef *last_gc_ref; /* used to reference temporary GC roots (list) */
     const JSWord *atom_table; /* constant atom table */
@@ -231,15 +327,56 @@ struct JSContext {
     const JSValueArray *rom_atom_tables[N_ROM_ATOM_TABLES_MAX];
     const JSCFunctionDef *c_function_table;
     const JSCFinalizer *c_finalizer_table;
+    /* functions created with JS_NewCFunction(). Their index is
+       JS_HOST_FUNC_IDX_BASE + i and their name is in host_func_names[i] */
+    int host_func_count;
+    JSCFunctionDef host_funcs[JS_HOST_FUNCTION_MAX];
     uint64_t random_state;
     JSInterruptHandler *interrupt_handler;
     JSWriteFunc *write_func; /* for the various dump functions */
     void *opaque;
+    uint8_t gc_mode; /* JS_GC_MODE_x */
+    BOOL shape_mode : 8; /* TRUE if new plain objects use shared shapes */
+    /* the blocks below are not collected by the minor GC. Equal to
+       heap_base during a full GC. */
+    uint8_t *gc_young_start;
+    uint32_t gc_nursery_size; /* 0 if no limit */
+    uint8_t gc_card_shift; /* log2 of the card size */
+    uint32_t gc_card_count; /* number of cards in gc_card_table */
+#ifdef DEBUG_GC
+    BOOL gc_check_cards : 8; /* see gc_check_cards() */
+#endif
+    JSClockFunc *gc_clock;
+    JSGCStats gc_stats;
+    JSHeapGrowFunc *heap_grow_func;
+    void *heap_grow_opaque;
+    JSProfileSample *profile_samples; /* NULL if no profiling */
+    int profile_sample_count;
+    uint32_t profile_count; /* number of samples taken */
+    int16_t profile_interval;
+    /* metering (see JS_ResetMeter()) */
+    BOOL meter_enabled : 8; /* TRUE if there is a budget */
+    /* clock of the native time measurement. NULL if disabled or
+       inside a measured native call */
+    JSClockFunc *meter_clock;
+    uint64_t meter_ticks; /* ticks before the last counter reload */
+    uint64_t meter_freed_bytes; /* bytes freed since the context creation */
+    uint64_t meter_alloc_start; /* allocated bytes at the last reset */
+    int64_t meter_native_time;
+    JSMeterStats meter_budget;
     JSValue *class_obj; /* same as class_proto + class_count */
     JSStringPosCacheEntry string_pos_cache[JS_STRING_POS_CACHE_SIZE];
+    JSStringIndexEntry string_index[JS_STRING_INDEX_SIZE];
+    JSPropCacheEntry prop_cache[JS_PROP_CACHE_SIZE];
+    JSShapeCacheEntry shape_cache[JS_SHAPE_CACHE_SIZE];
+    /* for-in iterator of a shaped object which completed, reused by
+       the next for-in loop. Not a GC root: JS_NULL after a GC. */
+    JSValue free_for_in_iter;
                                            
     /* must only contain JSValue from this point (see JS_GC()) */
-    JSValue unique_strings; /* JSValueArray of sorted strings or JS_NULL */
+    JSValue unique_strings; /* JSValueArray hash table of strings or
+                               JS_NULL. Sorted array when saving
+                               bytecode */
     
     JSValue current_exception; /* currently pending exception, must
                                   come after unique_strings */
@@ -249,6 +386,12 @@ struct JSContext {
     JSValue empty_props; /* empty prop list, for objects with no properties */
     JSValue global_obj;
     JSValue minus_zero; /* minus zero float64 value */
+    /* JSByteArray of the generational GC card table (see
+       js_write_barrier()) or JS_NULL */
+    JSValue gc_card_table;
+    /* (source, byte_code) pairs of the last compiled regexps */
+    JSValue regexp_cache[JS_REGEXP_CACHE_SIZE * 2];
+    JSValue host_func_names[JS_HOST_FUNCTION_MAX];
     JSValue class_proto[]; /* prototype for each class (class_count
                               element, then class_count elements for
                               class_obj */
@@ -364,7 +507,16 @@ typedef struct JSFunctionBytecode {
 } JSFunctionBytecode;
 
 static JSValue js_resize_value_array(JSContext *ctx, JSValue val, int new_size);
+static JSValueArray *js_alloc_value_array(JSContext *ctx, int init_base, int new_size);
 static int get_mblock_size(const void *ptr);
+static void JS_GC2(JSContext *ctx, BOOL keep_atoms, BOOL minor);
+static void gc_promote_blocks(JSContext *ctx);
+static int js_check_free_mem_grow(JSContext *ctx, JSValue *stack_bottom,
+                                  uint32_t size);
+static void rqsort_idx(size_t nmemb,
+                       int (*cmp)(size_t, size_t, void *),
+                       void (*swap)(size_t, size_t, void *),
+                       void *opaque);
 static JSValue JS_NewObjectProtoClass(JSContext *ctx, JSValue proto, int class_id, int extra_size);
 static void js_shrink_byte_array(JSContext *ctx, JSValue *pval, int new_size);
 static void build_backtrace(JSContext *ctx, JSValue error_obj,
@@ -377,6 +529,7 @@ static int JS_ToUint8Clamp(JSContext *ctx, int *pres, JSValue val);
 static JSValue js_set_prototype_internal(JSContext *ctx, JSValue obj, JSValue proto);
 static JSValue js_resize_byte_array(JSContext *ctx, JSValue val, int new_size);
 static JSValueArray *js_alloc_props(JSContext *ctx, int n);
+static int js_compile_lazy_function(JSContext *ctx, JSValue func);
 
 typedef enum OPCodeFormat {
 #define FMT(f) OP_FMT_ ## f,
@@ -495,16 +648,86 @@ static int js_get_mtag(void *ptr)
     return ((JSMemBlockHeader *)ptr)->mtag;
 }
 
+/* the card table contains gc_card_count offsets from heap_base, the
+   start of the block containing the first byte of each old card,
+   followed by gc_card_count dirty flags */
+static inline uint32_t *js_gc_card_start(JSContext *ctx)
+{
+    JSByteArray *arr = JS_VALUE_TO_PTR(ctx->gc_card_table);
+    return (uint32_t *)arr->buf;
+}
+
+static inline uint8_t *js_gc_card_dirty(JSContext *ctx)
+{
+    JSByteArray *arr = JS_VALUE_TO_PTR(ctx->gc_card_table);
+    return arr->buf + ctx->gc_card_count * sizeof(uint32_t);
+}
+
+/* must be called after a value is stored at 'pval' in a memory block:
+   if the block is old, the minor GC must scan it. Also called with
+   &p->props when the property keys of the object 'p' are modified. */
+static force_inline void js_write_barrier(JSContext *ctx, const void *pval)
+{
+    uintptr_t pos = (const uint8_t *)pval - ctx->heap_base;
+    if (pos < (uintptr_t)(ctx->gc_young_start - ctx->heap_base))
+        js_gc_card_dirty(ctx)[pos >> ctx->gc_card_shift] = 1;
+}
+
+/* same as js_write_barrier() for the 'len' values at 'pval' */
+static void js_write_barrier_range(JSContext *ctx, const JSValue *pval, size_t len)
+{
+    uintptr_t pos, end;
+    int shift;
+    
+    pos = (const uint8_t *)pval - ctx->heap_base;
+    if (len == 0 || pos >= (uintptr_t)(ctx->gc_young_start - ctx->heap_base))
+        return;
+    shift = ctx->gc_card_shift;
+    end = pos + (len - 1) * sizeof(JSValue);
+    memset(js_gc_card_dirty(ctx) + (pos >> shift), 1,
+           (end >> shift) - (pos >> shift) + 1);
+}
+
+/* the old block [ptr, end) contains the first byte of the cards
+   starting inside it */
+static void js_gc_set_card_start(JSContext *ctx, uint8_t *ptr, uint8_t *end)
+{
+    uint32_t *card_start = js_gc_card_start(ctx);
+    uint32_t pos, c, c_end, card_size;
+
+    card_size = 1 << ctx->gc_card_shift;
+    pos = ptr - ctx->heap_base;
+    c = (pos + card_size - 1) >> ctx->gc_card_shift;
+    c_end = (end - ctx->heap_base + card_size - 1) >> ctx->gc_card_shift;
+    for(; c < c_end; c++)
+        card_start[c] = pos;
+}
+
 static int check_free_mem(JSContext *ctx, JSValue *stack_bottom, uint32_t size)
 {
 #ifdef DEBUG_GC
     assert(ctx->sp >= stack_bottom);
     /* don't start the GC before dummy_block is allocated */
     if (JS_IsPtr(ctx->dummy_block)) {
-        JS_GC(ctx);
+        JS_GC2(ctx, TRUE, ctx->gc_mode == JS_GC_MODE_GENERATIONAL);
     }
 #endif
+    if (unlikely(ctx->gc_nursery_size != 0) &&
+        (ctx->heap_free - ctx->gc_young_start) >= ctx->gc_nursery_size) {
+        JS_GC2(ctx, TRUE, TRUE);
+    }
     if (((uint8_t *)stack_bottom - ctx->heap_free) < size + ctx->min_free_size) {
+        if (unlikely(ctx->heap_grow_func != NULL))
+            return js_check_free_mem_grow(ctx, stack_bottom, size);
+        if (ctx->gc_mode == JS_GC_MODE_GENERATIONAL) {
+            /* keep at least 1/8 of the memory free after a minor GC
+               so that they are not too frequent */
+            JS_GC2(ctx, TRUE, TRUE);
+            if (((uint8_t *)stack_bottom - ctx->heap_free) >=
+                size + ctx->min_free_size +
+                ((ctx->stack_top - ctx->heap_base - ctx->mem_reserve) / 8))
+                return 0;
+        }
         JS_GC(ctx);
         if (((uint8_t *)stack_bottom - ctx->heap_free) < size + ctx->min_free_size) {
             JS_ThrowOutOfMemory(ctx);
@@ -548,6 +771,25 @@ static void *js_malloc(JSContext *ctx, uint32_t size, int mtag)
     return p;
 }
 
+/* same as js_malloc() but never triggers a GC so that the pointers
+   held by the caller stay valid. Return NULL without raising an
+   exception if there is not enough free memory. */
+static void *js_malloc_nogc(JSContext *ctx, uint32_t size, int mtag)
+{
+    JSMemBlockHeader *p;
+
+    size = (size + JSW - 1) & ~(JSW - 1);
+    if (((uint8_t *)ctx->stack_bottom - ctx->heap_free) < size + ctx->min_free_size)
+        return NULL;
+    p = (JSMemBlockHeader *)ctx->heap_free;
+    ctx->heap_free += size;
+
+    p->mtag = mtag;
+    p->gc_mark = 0;
+    p->dummy = 0;
+    return p;
+}
+
 static void *js_mallocz(JSContext *ctx, uint32_t size, int mtag)
 {
     uint8_t *ptr;
@@ -568,8 +810,13 @@ static void js_free(JSContext *ctx, void *ptr)
         return;
     ptr1 = ptr;
     ptr1 += get_mblock_size(ptr1);
-    if (ptr1 == ctx->heap_free)
+    if (ptr1 == ctx->heap_free) {
+        ctx->meter_freed_bytes += ptr1 - (uint8_t *)ptr;
         ctx->heap_free = ptr;
+        /* the next blocks must not overlap the old ones */
+        if (ctx->gc_young_start > ctx->heap_free)
+            ctx->gc_young_start = ctx->heap_free;
+    }
 }
 
 /* 'size' is in bytes and must be multiple of JSW and > 0 */
@@ -940,13 +1187,15 @@ JSValue __js_printf_like(3, 4) JS_ThrowError(JSContext *ctx, JSObjectClassEnum e
 JSValue JS_ThrowOutOfMemory(JSContext *ctx)
 {
     JSValue val;
+    uint32_t min_free_size;
     if (ctx->in_out_of_memory)
         return JS_Throw(ctx, JS_NULL);
     ctx->in_out_of_memory = TRUE;
-    ctx->min_free_size = JS_MIN_CRITICAL_FREE_SIZE;
+    min_free_size = ctx->min_free_size;
+    ctx->min_free_size = JS_MIN_CRITICAL_FREE_SIZE + ctx->mem_reserve;
     val = JS_ThrowInternalError(ctx, "out of memory");
     ctx->in_out_of_memory = FALSE;
-    ctx->min_free_size = JS_MIN_FREE_SIZE;
+    ctx->min_free_size = min_free_size;
     return val;
 }
 
@@ -1434,6 +1683,104 @@ static __maybe_unused void dump_string_pos_cache(JSContext *ctx)
     }
 }
 
+static JSByteArray *js_string_build_index(JSContext *ctx, JSString *p)
+{
+    JSByteArray *arr;
+    JSStringIndexPos *tab;
+    size_t i, clen, len;
+    uint32_t j, k, w, n;
+
+    len = p->len;
+    j = 0;
+    for(i = 0; i < len; i += clen) {
+        clen = utf8_char_len(p->buf[i]);
+        if (clen == 4 && is_valid_len4_utf8(p->buf + i))
+            j += 2;
+        else
+            j++;
+    }
+    n = j / JS_STRING_INDEX_STEP + 1;
+    arr = js_malloc_nogc(ctx, sizeof(JSByteArray) + n * sizeof(JSStringIndexPos),
+                         JS_MTAG_BYTE_ARRAY);
+    if (!arr)
+        return NULL;
+    arr->size = n * sizeof(JSStringIndexPos);
+    tab = (JSStringIndexPos *)arr->buf;
+    j = 0;
+    k = 0;
+    for(i = 0; i < len; i += clen) {
+        clen = utf8_char_len(p->buf[i]);
+        if (clen == 4 && is_valid_len4_utf8(p->buf + i))
+            w = 2;
+        else
+            w = 1;
+        if (k * JS_STRING_INDEX_STEP < j + w) {
+            tab[k].str_pos[POS_TYPE_UTF8] = i;
+            tab[k].str_pos[POS_TYPE_UTF16] = j;
+            k++;
+        }
+        j += w;
+    }
+    if (k < n) {
+        tab[k].str_pos[POS_TYPE_UTF8] = len;
+        tab[k].str_pos[POS_TYPE_UTF16] = j;
+    }
+    return arr;
+}
+
+/* Find the closest index position before 'pos'. The index is built
+   if 'build' is TRUE. Return FALSE if no index is available. */
+static BOOL js_string_index_find(JSContext *ctx, JSValue val, JSString *p,
+                                 uint32_t pos, StringPosTypeEnum pos_type,
+                                 BOOL build, size_t *pi, uint32_t *pj)
+{
+    JSStringIndexEntry *e;
+    JSByteArray *arr;
+    JSStringIndexPos *tab;
+    int i, n, k, k_min, k_max;
+
+    e = NULL;
+    for(i = 0; i < JS_STRING_INDEX_SIZE; i++) {
+        if (ctx->string_index[i].str == val) {
+            e = &ctx->string_index[i];
+            break;
+        }
+    }
+    if (!e) {
+        if (!build || JS_IS_ROM_PTR(ctx, p))
+            return FALSE;
+        arr = js_string_build_index(ctx, p);
+        if (!arr)
+            return FALSE;
+        e = &ctx->string_index[ctx->string_index_counter];
+        if (++ctx->string_index_counter == JS_STRING_INDEX_SIZE)
+            ctx->string_index_counter = 0;
+        e->str = val;
+        e->index = JS_VALUE_FROM_PTR(arr);
+    }
+    arr = JS_VALUE_TO_PTR(e->index);
+    tab = (JSStringIndexPos *)arr->buf;
+    n = arr->size / sizeof(JSStringIndexPos);
+    if (pos_type == POS_TYPE_UTF16) {
+        k = min_uint32(pos / JS_STRING_INDEX_STEP, n - 1);
+    } else {
+        /* binary search of the last position <= pos */
+        k_min = 0;
+        k_max = n - 1;
+        while (k_min < k_max) {
+            k = (k_min + k_max + 1) / 2;
+            if (tab[k].str_pos[POS_TYPE_UTF8] <= pos)
+                k_min = k;
+            else
+                k_max = k - 1;
+        }
+        k = k_min;
+    }
+    *pi = tab[k].str_pos[POS_TYPE_UTF8];
+    *pj = tab[k].str_pos[POS_TYPE_UTF16];
+    return TRUE;
+}
+
 /* an UTF-8 position is the byte position multiplied by 2. One is
    added when the corresponding UTF-16 character represents the left
    surrogate if the code is >= 0x10000.
@@ -1496,6 +1843,13 @@ static uint32_t js_string_convert_pos(JSContext *ctx, JSValue val, uint32_t pos,
     
     i = ce->str_pos[POS_TYPE_UTF8];
     j = ce->str_pos[POS_TYPE_UTF16];
+    /* far from the cached position: use the index of the string
+       (built only if the scan would be long) */
+    if (d_min > JS_STRING_INDEX_STEP && len >= JS_STRING_INDEX_MIN_LEN &&
+        js_string_index_find(ctx, val, p, pos, pos_type,
+                             d_min > 4 * JS_STRING_INDEX_STEP, &i, &j)) {
+        goto uncached;
+    }
     if (ce->str_pos[pos_type] <= pos) {
     uncached:
         surrogate_flag = 0;
@@ -1740,10 +2094,69 @@ static int string_buffer_concat(JSContext *ctx, StringBuffer *s, JSValue val2)
     return string_buffer_concat_str(ctx, s, val2);
 }
 
-/* XXX: could optimize */
+/* Return a pointer to 'n' free bytes at the end of the buffer or NULL
+   in case of exception. The pointer is valid until the next memory
+   allocation. The caller updates 's->len' and 's->is_ascii' after
+   writing. The written bytes must not start with a right surrogate. */
+static uint8_t *string_buffer_reserve(JSContext *ctx, StringBuffer *s, int n)
+{
+    JSStringCharBuf buf1;
+    JSByteArray *arr;
+    JSString *p1;
+    JSValue val1;
+    JSGCRef val1_ref;
+    int len;
+    
+    if (JS_IsException(s->buffer))
+        return NULL;
+    if (JS_IsString(ctx, s->buffer)) {
+        val1 = s->buffer;
+        p1 = get_string_ptr(ctx, &buf1, val1);
+        s->len = p1->len;
+        arr = NULL;
+    } else {
+        val1 = JS_NULL;
+        arr = JS_VALUE_TO_PTR(s->buffer);
+    }
+    len = s->len + n;
+    if (len > JS_STRING_LEN_MAX) {
+        s->buffer = JS_ThrowInternalError(ctx, "string too long");
+        return NULL;
+    }
+    if (!arr || (len + 1) > arr->size) {
+        JS_PUSH_VALUE(ctx, val1);
+        s->buffer = js_resize_byte_array(ctx, arr ? s->buffer : JS_NULL, len + 1);
+        JS_POP_VALUE(ctx, val1);
+        if (JS_IsException(s->buffer))
+            return NULL;
+        arr = JS_VALUE_TO_PTR(s->buffer);
+        if (val1 != JS_NULL) {
+            p1 = get_string_ptr(ctx, &buf1, val1);
+            s->is_ascii = p1->is_ascii;
+            memcpy(arr->buf, p1->buf, s->len);
+        }
+    }
+    return arr->buf + s->len;
+}
+
 static int string_buffer_putc(JSContext *ctx, StringBuffer *s, int c)
 {
-    return string_buffer_concat_str(ctx, s, JS_NewStringChar(c));
+    uint8_t *q;
+    
+    /* surrogates may have to be combined */
+    if (unlikely(c >= 0xd800 && c < 0xe000))
+        return string_buffer_concat_str(ctx, s, JS_NewStringChar(c));
+    q = string_buffer_reserve(ctx, s, UTF8_CHAR_LEN_MAX);
+    if (!q)
+        return -1;
+    if (c < 0x80) {
+        *q = c;
+        s->len++;
+    } else {
+        s->len += unicode_to_utf8(q, c);
+        s->is_ascii = FALSE;
+    }
+    return 0;
 }
 
 static int string_buffer_puts(JSContext *ctx, StringBuffer *s, const char *str)
@@ -1788,6 +2201,135 @@ static JSValue JS_ConcatString(JSContext *ctx, JSValue val1, JSValue val2)
     return string_buffer_end(ctx, b);
 }
 
+/* String builders: 'local += expr' on a local variable is compiled to
+   OP_get_loc_append/OP_append_loc. When the result is a string, it is
+   stored in the variable as a "builder": a non unique string with
+   is_numeric = TRUE, meaning that the variable slot holds its only
+   reference. Any other read of the variable clears the flag
+   (js_string_builder_release()). The builder is followed by a free
+   block so that the next appends can be done in place instead of
+   copying the whole string. The free block disappears at the next
+   GC. */
+#define JS_STRING_BUILDER_MIN_LEN 32
+
+static inline BOOL js_is_string_builder(JSValue val)
+{
+    JSString *p;
+    if (!JS_IsPtr(val))
+        return FALSE;
+    p = JS_VALUE_TO_PTR(val);
+    return (p->mtag == JS_MTAG_STRING && p->is_numeric && !p->is_unique);
+}
+
+static force_inline JSValue js_string_builder_release(JSValue val)
+{
+    if (unlikely(js_is_string_builder(val))) {
+        JSString *p = JS_VALUE_TO_PTR(val);
+        p->is_numeric = FALSE;
+    }
+    return val;
+}
+
+/* try to extend the memory block of 'p' so that it can contain
+   'new_len' bytes. No allocation is done. */
+static BOOL js_string_builder_grow(JSContext *ctx, JSString *p, uint32_t new_len)
+{
+    uint8_t *end, *new_end, *free_end;
+
+    end = (uint8_t *)p + get_mblock_size(p);
+    new_end = (uint8_t *)p + sizeof(JSString) + ((new_len + JSW) & ~(JSW - 1));
+    if (new_end <= end)
+        return TRUE;
+    if (end == ctx->heap_free) {
+        if (((uint8_t *)ctx->stack_bottom - new_end) < ctx->min_free_size)
+            return FALSE;
+        /* the block stays old if it was */
+        if (ctx->gc_young_start == end) {
+            ctx->gc_young_start = new_end;
+            js_gc_set_card_start(ctx, (uint8_t *)p, new_end);
+        }
+        ctx->heap_free = new_end;
+        return TRUE;
+    }
+    if (js_get_mtag(end) != JS_MTAG_FREE)
+        return FALSE;
+    free_end = end + get_mblock_size(end);
+    if (new_end > free_end)
+        return FALSE;
+    if (new_end < free_end)
+        set_free_block(new_end, free_end - new_end);
+    if ((uint8_t *)p < ctx->gc_young_start) {
+        js_gc_set_card_start(ctx, (uint8_t *)p, new_end);
+        js_gc_set_card_start(ctx, new_end, free_end);
+    }
+    return TRUE;
+}
+
+/* ctx->sp[1] and ctx->sp[0] must be strings. Return the concatenation
+   as a string builder, reusing ctx->sp[1] if it is already one. */
+static JSValue js_string_builder_append(JSContext *ctx)
+{
+    JSStringCharBuf buf1, buf2;
+    JSString *p, *p1, *p2;
+    uint32_t len, len1, len2, cap;
+    BOOL merge;
+    uint8_t *q;
+
+    p1 = get_string_ptr(ctx, &buf1, ctx->sp[1]);
+    p2 = get_string_ptr(ctx, &buf2, ctx->sp[0]);
+    len1 = p1->len;
+    len2 = p2->len;
+    len = len1 + len2;
+    /* contract the surrogate pairs as in string_buffer_concat_str() */
+    merge = (len2 >= 3 && unlikely(is_utf8_right_surrogate(p2->buf)) &&
+             len1 >= 3 && is_utf8_left_surrogate(p1->buf + len1 - 3));
+    if (merge)
+        len -= 2;
+    if (len < JS_STRING_BUILDER_MIN_LEN || len > JS_STRING_LEN_MAX)
+        return JS_ConcatString(ctx, ctx->sp[1], ctx->sp[0]);
+
+    if (js_is_string_builder(ctx->sp[1]) &&
+        js_string_builder_grow(ctx, p1, len)) {
+        p = p1;
+    } else {
+        cap = min_uint32(len + len / 2, JS_STRING_LEN_MAX);
+        /* no slack if it would trigger a GC */
+        if (((uint8_t *)ctx->stack_bottom - ctx->heap_free) <
+            sizeof(JSString) + cap + 1 + ctx->min_free_size)
+            cap = len;
+        p = js_alloc_string(ctx, cap);
+        if (!p)
+            return JS_EXCEPTION;
+        /* the GC may have moved the strings */
+        p1 = get_string_ptr(ctx, &buf1, ctx->sp[1]);
+        p2 = get_string_ptr(ctx, &buf2, ctx->sp[0]);
+        memcpy(p->buf, p1->buf, len1);
+        p->is_ascii = p1->is_ascii;
+        /* keep the remaining space as a free block */
+        js_shrink(ctx, p, sizeof(JSString) + len + 1);
+        p->is_numeric = TRUE;
+    }
+
+    q = p->buf + len1;
+    if (merge) {
+        size_t clen;
+        int c;
+        c = (utf8_get(q - 3, &clen) & 0x3ff) << 10;
+        c |= (utf8_get(p2->buf, &clen) & 0x3ff);
+        c += 0x10000;
+        q -= 3;
+        q += unicode_to_utf8(q, c);
+        memcpy(q, p2->buf + 3, len2 - 3);
+        p->is_ascii = FALSE;
+    } else {
+        memcpy(q, p2->buf, len2);
+        p->is_ascii &= p2->is_ascii;
+    }
+    p->len = len;
+    p->buf[len] = '\0';
+    return JS_VALUE_FROM_PTR(p);
+}
+
 static BOOL js_string_eq(JSContext *ctx, JSValue val1, JSValue val2)
 {
     JSStringCharBuf buf1, buf2;
@@ -1997,15 +2539,93 @@ static JSValue find_atom(JSContext *ctx, int *pidx, const JSValueArray *arr, int
     return JS_NULL;
 }
 
+/* The unique strings created at runtime are stored in an open
+   addressing hash table (ctx->unique_strings) whose size is a power of
+   two. A free entry is JS_UNDEFINED and an entry deleted by the GC is
+   JS_NULL. The hash only depends on the string content, so the table
+   remains valid when the GC moves the strings. */
+
+#define JS_UNIQUE_STRINGS_MIN_SIZE 16
+
+static uint32_t js_string_hash(const JSString *p)
+{
+    uint32_t h, i;
+    h = 0;
+    for(i = 0; i < p->len; i++)
+        h = h * 263 + p->buf[i];
+    return h ^ (h >> 15);
+}
+
+/* Return the unique string equal to 'val' or JS_NULL. In the latter
+   case, '*pidx' is the index where it can be inserted. */
+static JSValue find_unique_string(JSValueArray *arr, int *pidx, JSValue val)
+{
+    JSString *p, *p1;
+    uint32_t h, mask;
+    int free_idx;
+    JSValue val1;
+
+    p = JS_VALUE_TO_PTR(val);
+    mask = arr->size - 1;
+    h = js_string_hash(p) & mask;
+    free_idx = -1;
+    for(;;) {
+        val1 = arr->arr[h];
+        if (val1 == JS_UNDEFINED) {
+            break;
+        } else if (val1 == JS_NULL) {
+            if (free_idx < 0)
+                free_idx = h;
+        } else {
+            p1 = JS_VALUE_TO_PTR(val1);
+            if (p1->len == p->len && !memcmp(p1->buf, p->buf, p->len))
+                return val1;
+        }
+        h = (h + 1) & mask;
+    }
+    if (free_idx < 0)
+        free_idx = h;
+    *pidx = free_idx;
+    return JS_NULL;
+}
+
+/* resize the unique string table so that it can contain 'count'
+   strings. Return -1 if memory error. */
+static int js_resize_unique_strings(JSContext *ctx, int count)
+{
+    JSValueArray *arr, *new_arr;
+    int new_size, i, idx;
+    JSValue val;
+
+    new_size = JS_UNIQUE_STRINGS_MIN_SIZE;
+    while (new_size * 3 < count * 4)
+        new_size *= 2;
+    new_arr = js_alloc_value_array(ctx, 0, new_size);
+    if (!new_arr)
+        return -1;
+    if (!JS_IsNull(ctx->unique_strings)) {
+        arr = JS_VALUE_TO_PTR(ctx->unique_strings);
+        for(i = 0; i < arr->size; i++) {
+            val = arr->arr[i];
+            if (JS_IsPtr(val)) {
+                find_unique_string(new_arr, &idx, val);
+                new_arr->arr[idx] = val;
+            }
+        }
+    }
+    ctx->unique_strings = JS_VALUE_FROM_PTR(new_arr);
+    ctx->unique_strings_deleted = 0;
+    return 0;
+}
+
 /* if 'val' is not a string, it is returned */
-/* XXX: use hash table */
 static JSValue JS_MakeUniqueString(JSContext *ctx, JSValue val)
 {
     JSString *p;
     int a, is_numeric, i;
     JSValueArray *arr;
     const JSValueArray *arr1;
-    JSValue val1, new_tab;
+    JSValue val1;
     JSGCRef val_ref;
     
     if (!JS_IsPtr(val))
@@ -2024,10 +2644,12 @@ static JSValue JS_MakeUniqueString(JSContext *ctx, JSValue val)
         }
     }
     
-    arr = JS_VALUE_TO_PTR( ctx->unique_strings);
-    val1 = find_atom(ctx, &a, arr, ctx->unique_strings_len, val); 
-    if (!JS_IsNull(val1))
-        return val1;
+    if (!JS_IsNull(ctx->unique_strings)) {
+        arr = JS_VALUE_TO_PTR(ctx->unique_strings);
+        val1 = find_unique_string(arr, &a, val);
+        if (!JS_IsNull(val1))
+            return val1;
+    }
     
     JS_PUSH_VALUE(ctx, val);
     is_numeric = js_is_numeric_string(ctx, val);
@@ -2035,18 +2657,23 @@ static JSValue JS_MakeUniqueString(JSContext *ctx, JSValue val)
     if (is_numeric < 0)
         return JS_EXCEPTION;
     
-    /* not found: add it in the table */
-    JS_PUSH_VALUE(ctx, val);
-    new_tab = js_resize_value_array(ctx, ctx->unique_strings,
-                                 ctx->unique_strings_len + 1);
-    JS_POP_VALUE(ctx, val);
-    if (JS_IsException(new_tab))
-        return JS_EXCEPTION;
-    ctx->unique_strings = new_tab;
-    arr = JS_VALUE_TO_PTR( ctx->unique_strings);
-    memmove(&arr->arr[a + 1], &arr->arr[a],
-            sizeof(arr->arr[0]) * (ctx->unique_strings_len - a));
+    /* not found: add it in the table (the GC may have modified it) */
+    if (JS_IsNull(ctx->unique_strings) ||
+        (ctx->unique_strings_len + ctx->unique_strings_deleted + 1) * 4 >
+        ((JSValueArray *)JS_VALUE_TO_PTR(ctx->unique_strings))->size * 3) {
+        int ret;
+        JS_PUSH_VALUE(ctx, val);
+        ret = js_resize_unique_strings(ctx, ctx->unique_strings_len + 1);
+        JS_POP_VALUE(ctx, val);
+        if (ret)
+            return JS_EXCEPTION;
+    }
+    arr = JS_VALUE_TO_PTR(ctx->unique_strings);
+    find_unique_string(arr, &a, val);
+    if (arr->arr[a] == JS_NULL)
+        ctx->unique_strings_deleted--;
     arr->arr[a] = val;
+    js_write_barrier(ctx, &arr->arr[a]);
     p = JS_VALUE_TO_PTR(val);
     p->is_unique = TRUE;
     p->is_numeric = is_numeric;
@@ -2221,6 +2848,48 @@ static JSValueArray *js_alloc_value_array(JSContext *ctx, int init_base, int new
     return arr;
 }
 
+/* Try to extend 'arr' to 'new_size' elements without moving it: it
+   must be the last block of the heap or be followed by a large enough
+   free block. The new elements are set to undefined. No allocation is
+   done. */
+static BOOL js_value_array_grow(JSContext *ctx, JSValueArray *arr, int new_size)
+{
+    uint8_t *end, *new_end, *free_end;
+    int i;
+
+    if (JS_IS_ROM_PTR(ctx, arr) || new_size > JS_VALUE_ARRAY_SIZE_MAX)
+        return FALSE;
+    end = (uint8_t *)arr + get_mblock_size(arr);
+    new_end = (uint8_t *)arr + sizeof(JSValueArray) + new_size * sizeof(JSValue);
+    if (end == ctx->heap_free) {
+        if (((uint8_t *)ctx->stack_bottom - new_end) < ctx->min_free_size)
+            return FALSE;
+        /* the block stays old if it was */
+        if (ctx->gc_young_start == end) {
+            ctx->gc_young_start = new_end;
+            js_gc_set_card_start(ctx, (uint8_t *)arr, new_end);
+        }
+        ctx->heap_free = new_end;
+    } else {
+        /* an old block cannot extend over the young blocks */
+        if (end == ctx->gc_young_start || js_get_mtag(end) != JS_MTAG_FREE)
+            return FALSE;
+        free_end = end + get_mblock_size(end);
+        if (new_end > free_end)
+            return FALSE;
+        if (new_end < free_end)
+            set_free_block(new_end, free_end - new_end);
+        if ((uint8_t *)arr < ctx->gc_young_start) {
+            js_gc_set_card_start(ctx, (uint8_t *)arr, new_end);
+            js_gc_set_card_start(ctx, new_end, free_end);
+        }
+    }
+    for(i = arr->size; i < new_size; i++)
+        arr->arr[i] = JS_UNDEFINED;
+    arr->size = new_size;
+    return TRUE;
+}
+
 /* val can be JS_NULL (zero size). 'prop_base' is non zero only when
  * resizing the property arrays so that the property array has a size
  * which is a multiple of 3 */
@@ -2250,6 +2919,8 @@ static JSValue js_resize_value_array2(JSContext *ctx, JSValue val, int new_size,
             }
         }
         new_size = max_int(new_size, old_size + old_size / 2);
+        if (slots && js_value_array_grow(ctx, slots, new_size))
+            return val;
         JS_PUSH_VALUE(ctx, val);
         new_slots = js_alloc_value_array(ctx, old_size, new_size);
         JS_POP_VALUE(ctx, val);
@@ -2409,12 +3080,20 @@ JSValue JS_NewObjectPrealloc(JSContext *ctx, int n)
     if (JS_IsException(obj) || n <= 0)
         return obj;
     JS_PUSH_VALUE(ctx, obj);
-    arr = js_alloc_props(ctx, n);
+    if (ctx->shape_mode && n <= JS_SHAPE_MAX_PROPS) {
+        /* value array with the empty shape */
+        arr = js_alloc_value_array(ctx, 1, 1 + n);
+        if (arr)
+            arr->arr[0] = ctx->empty_props;
+    } else {
+        arr = js_alloc_props(ctx, n);
+    }
     JS_POP_VALUE(ctx, obj);
     if (!arr)
         return JS_EXCEPTION;
     p = JS_VALUE_TO_PTR(obj);
     p->props = JS_VALUE_FROM_PTR(arr);
+    js_write_barrier(ctx, &p->props);
     return obj;
 }
 
@@ -2439,6 +3118,7 @@ JSValue JS_NewArray(JSContext *ctx, int initial_len)
             return JS_EXCEPTION;
         p = JS_VALUE_TO_PTR(val);
         p->u.array.tab = JS_VALUE_FROM_PTR(arr);
+        js_write_barrier(ctx, &p->u.array.tab);
         p->u.array.len = initial_len;
     }
     return val;
@@ -2449,7 +3129,34 @@ static inline uint32_t hash_prop(JSValue prop)
     return (prop / JSW) ^ (prop % JSW); /* XXX: improve */
 }
 
-/* return NULL if not found */
+/* A shaped object has 'props' = [shape, value_0, ... value_n-1,
+   undefined...]. The shape is a property array whose normal
+   properties contain the index of their value in 'props'. */
+static inline BOOL js_is_shaped_props(JSValueArray *arr)
+{
+    return JS_IsPtr(arr->arr[0]);
+}
+
+/* return the property array containing the keys of 'p' */
+static force_inline JSValueArray *js_get_prop_keys(JSObject *p)
+{
+    JSValueArray *arr = JS_VALUE_TO_PTR(p->props);
+    if (js_is_shaped_props(arr))
+        arr = JS_VALUE_TO_PTR(arr->arr[0]);
+    return arr;
+}
+
+/* 'pr' is a property of 'p'. Return the location of its value. */
+static force_inline JSValue *js_get_prop_value_ptr(JSObject *p, JSProperty *pr)
+{
+    JSValueArray *arr = JS_VALUE_TO_PTR(p->props);
+    if (js_is_shaped_props(arr))
+        return &arr->arr[JS_VALUE_GET_INT(pr->value)];
+    else
+        return &pr->value;
+}
+
+/* return NULL if not found */
 static force_inline JSProperty *find_own_property_inlined(JSContext *ctx,
                                                           JSObject *p, JSValue prop)
 {
@@ -2457,7 +3164,7 @@ static force_inline JSProperty *find_own_property_inlined(JSContext *ctx,
     JSProperty *pr;
     uint32_t hash_mask, h, idx;
     
-    arr = JS_VALUE_TO_PTR(p->props);
+    arr = js_get_prop_keys(p);
     hash_mask = JS_VALUE_GET_INT(arr->arr[1]);
     h = hash_prop(prop) & hash_mask;
     idx = arr->arr[2 + h]; /* JSValue, hence idx * 2 */
@@ -2476,6 +3183,81 @@ static inline JSProperty *find_own_property(JSContext *ctx,
     return find_own_property_inlined(ctx, p, prop);
 }
 
+static inline JSPropCacheEntry *js_prop_cache_entry(JSContext *ctx,
+                                                    const uint8_t *pc)
+{
+    uintptr_t h = (uintptr_t)pc;
+    h ^= h >> 7;
+    return &ctx->prop_cache[h & (JS_PROP_CACHE_SIZE - 1)];
+}
+
+/* 'p1' is the receiver 'p' or its prototype if depth = 1. 'pr' is a
+   normal property of 'p1'. */
+static void js_prop_cache_update(JSContext *ctx, const uint8_t *pc,
+                                 JSObject *p, JSObject *p1, JSProperty *pr,
+                                 int depth)
+{
+    JSPropCacheEntry *ce = js_prop_cache_entry(ctx, pc);
+    JSValueArray *arr1;
+
+    arr1 = JS_VALUE_TO_PTR(p->props);
+    ce->recv_shape = JS_NULL;
+    if (depth && js_is_shaped_props(arr1))
+        ce->recv_shape = arr1->arr[0];
+    arr1 = JS_VALUE_TO_PTR(p1->props);
+    ce->pc = pc;
+    ce->depth = depth;
+    if (js_is_shaped_props(arr1)) {
+        ce->hash_mask = arr1->arr[0];
+        ce->offset = JS_VALUE_GET_INT(pr->value);
+    } else {
+        ce->hash_mask = arr1->arr[1];
+        ce->offset = (JSValue *)pr - arr1->arr;
+    }
+}
+
+/* Return the location of the value of the property 'prop' of the
+   property array 'arr' cached in 'ce' or NULL. For property arrays,
+   only offsets are cached and the key is checked, so a stale entry
+   (deleted property, moved bytecode or objects after
+   gc_compact_heap()) is never used. Objects with the same property
+   layout share the entry. For shaped objects, the shape identity is
+   cached: such entries are removed by the GC because a shape can be
+   moved to the address of another one. */
+static force_inline JSValue *js_prop_cache_get(JSPropCacheEntry *ce,
+                                               JSValueArray *arr, JSValue prop)
+{
+    JSProperty *pr;
+    if (JS_IsPtr(ce->hash_mask)) {
+        if (arr->arr[0] != ce->hash_mask)
+            return NULL;
+        return &arr->arr[ce->offset];
+    }
+    if (arr->arr[1] != ce->hash_mask || ce->offset >= arr->size ||
+        js_is_shaped_props(arr))
+        return NULL;
+    pr = (JSProperty *)&arr->arr[ce->offset];
+    if (pr->key != prop || pr->prop_type != JS_PROP_NORMAL)
+        return NULL;
+    return &pr->value;
+}
+
+/* Return TRUE if the receiver 'p' of the depth 1 entry 'ce' does not
+   have the own property 'prop'. The probe is skipped if it has no
+   property or if it has the cached shape, since a shape is immutable. */
+static force_inline BOOL js_prop_cache_no_own_prop(JSContext *ctx,
+                                                   JSPropCacheEntry *ce,
+                                                   JSObject *p, JSValue prop)
+{
+    JSValueArray *arr;
+    if (p->props == ctx->empty_props)
+        return TRUE;
+    arr = JS_VALUE_TO_PTR(p->props);
+    if (arr->arr[0] == ce->recv_shape)
+        return TRUE;
+    return !find_own_property_inlined(ctx, p, prop);
+}
+
 static JSValue get_special_prop(JSContext *ctx, JSValue val)
 {
     int idx;
@@ -2596,7 +3378,7 @@ static JSValue JS_GetPropertyInternal(JSContext *ctx, JSValue obj, JSValue prop,
         pr = find_own_property(ctx, p, prop);
         if (pr) {
             if (likely(pr->prop_type == JS_PROP_NORMAL)) {
-                return pr->value;
+                return *js_get_prop_value_ptr(p, pr);
             } else if (pr->prop_type == JS_PROP_VARREF) {
                 JSVarRef *pv = JS_VALUE_TO_PTR(pr->value);
                 /* always detached */
@@ -2727,18 +3509,12 @@ static JSValueArray *js_alloc_props(JSContext *ctx, int n)
     return arr;
 }
                           
-static void js_rehash_props(JSContext *ctx, JSObject *p, BOOL gc_rehash)
+static void js_rehash_props_array(JSValueArray *arr)
 {
-    JSValueArray *arr;
     int prop_count, hash_mask, h, idx, i, j;
     JSProperty *pr;
 
-    arr = JS_VALUE_TO_PTR(p->props);
-    if (JS_IS_ROM_PTR(ctx, arr))
-        return;
     hash_mask = JS_VALUE_GET_INT(arr->arr[1]);
-    if (hash_mask == 0 && gc_rehash)
-        return; /* no need to rehash if single hash entry */
     prop_count = JS_VALUE_GET_INT(arr->arr[0]);
     for(i = 0; i <= hash_mask; i++) {
         arr->arr[2 + i] = JS_NewShortInt(0);
@@ -2755,6 +3531,18 @@ static void js_rehash_props(JSContext *ctx, JSObject *p, BOOL gc_rehash)
     }
 }
 
+static void js_rehash_props(JSContext *ctx, JSObject *p, BOOL gc_rehash)
+{
+    JSValueArray *arr;
+
+    arr = js_get_prop_keys(p);
+    if (JS_IS_ROM_PTR(ctx, arr))
+        return;
+    if (JS_VALUE_GET_INT(arr->arr[1]) == 0 && gc_rehash)
+        return; /* no need to rehash if single hash entry */
+    js_rehash_props_array(arr);
+}
+
 /* Compact the properties. No memory allocation is done */
 static void js_compact_props(JSContext *ctx, JSObject *p)
 {
@@ -2771,6 +3559,7 @@ static void js_compact_props(JSContext *ctx, JSObject *p)
        if (p->props != ctx->empty_props) {
            //js_free(ctx, p->props);
            p->props = ctx->empty_props;
+           js_write_barrier(ctx, &p->props);
        }
        return;
    }
@@ -2794,6 +3583,8 @@ static void js_compact_props(JSContext *ctx, JSObject *p)
             j++;
         }
    }
+   js_write_barrier_range(ctx, &arr->arr[2 + (new_hash_mask + 1)], 3 * prop_count);
+   js_write_barrier(ctx, &p->props);
    
    js_shrink_value_array(ctx, &p->props, new_size);
 
@@ -2830,12 +3621,14 @@ static int js_update_props(JSContext *ctx, JSValue obj)
         pr = (JSProperty *)&arr1->arr[idx];
         if (pr->prop_type == JS_PROP_SPECIAL) {
             pr->value = get_special_prop(ctx, pr->value);
+            js_write_barrier(ctx, &pr->value);
             pr->prop_type = JS_PROP_NORMAL;
         }
     }
     
     p = JS_VALUE_TO_PTR(obj);
     p->props = JS_VALUE_FROM_PTR(arr1);
+    js_write_barrier(ctx, &p->props);
     return 0;
 }
 
@@ -2885,6 +3678,7 @@ static JSProperty *js_create_property(JSContext *ctx, JSValue obj,
                 return NULL;
             p = JS_VALUE_TO_PTR(obj);
             p->props = JS_VALUE_FROM_PTR(arr);
+            js_write_barrier(ctx, &p->props);
             first_free = 3;
         } else {
             first_free = arr->size;
@@ -2905,12 +3699,15 @@ static JSProperty *js_create_property(JSContext *ctx, JSValue obj,
                 return NULL;
             p = JS_VALUE_TO_PTR(obj);
             p->props = new_props;
+            js_write_barrier(ctx, &p->props);
             arr = JS_VALUE_TO_PTR(p->props);
             if (new_hash_mask != hash_mask) {
                 /* rebuild the hash table */
                 memmove(&arr->arr[2 + (new_hash_mask + 1)],
                         &arr->arr[2 + (hash_mask + 1)],
                         (first_free - (2 + hash_mask + 1)) * sizeof(JSValue));
+                js_write_barrier_range(ctx, &arr->arr[2 + (new_hash_mask + 1)],
+                                       first_free - (2 + hash_mask + 1));
                 first_free += new_hash_mask - hash_mask;
                 hash_mask = new_hash_mask;
                 arr->arr[1] = JS_NewShortInt(hash_mask);
@@ -2926,6 +3723,8 @@ static JSProperty *js_create_property(JSContext *ctx, JSValue obj,
 
     pr = (JSProperty *)&arr->arr[first_free];
     pr->key = prop;
+    js_write_barrier(ctx, &pr->key);
+    js_write_barrier(ctx, &p->props);
     pr->value = JS_UNDEFINED;
     pr->prop_type = JS_PROP_NORMAL;
     h = hash_prop(prop) & hash_mask;
@@ -2942,6 +3741,227 @@ static JSProperty *js_create_property(JSContext *ctx, JSValue obj,
     return pr;
 }
 
+static void js_shape_cache_reset(JSContext *ctx)
+{
+    int i;
+    for(i = 0; i < JS_SHAPE_CACHE_SIZE; i++)
+        ctx->shape_cache[i].shape = JS_NULL;
+}
+
+static inline JSShapeCacheEntry *js_shape_cache_entry(JSContext *ctx,
+                                                      JSValue shape, JSValue key)
+{
+    uint32_t h = hash_prop(shape) * 31 + hash_prop(key);
+    h ^= h >> 7;
+    return &ctx->shape_cache[h & (JS_SHAPE_CACHE_SIZE - 1)];
+}
+
+/* Return the shape 'shape' with the property 'key' appended. Return
+   JS_EXCEPTION if memory error. */
+static JSValue js_shape_add(JSContext *ctx, JSValue shape, JSValue key)
+{
+    JSShapeCacheEntry *ce;
+    JSValueArray *arr, *arr1;
+    JSProperty *pr;
+    JSGCRef shape_ref, key_ref;
+    int i, n, hash_mask, hash_mask1;
+
+    ce = js_shape_cache_entry(ctx, shape, key);
+    if (ce->shape == shape && ce->key == key)
+        return ce->next_shape;
+
+    arr = JS_VALUE_TO_PTR(shape);
+    n = JS_VALUE_GET_INT(arr->arr[0]);
+    JS_PUSH_VALUE(ctx, shape);
+    JS_PUSH_VALUE(ctx, key);
+    arr1 = js_alloc_props(ctx, n + 1);
+    JS_POP_VALUE(ctx, key);
+    JS_POP_VALUE(ctx, shape);
+    if (!arr1)
+        return JS_EXCEPTION;
+    arr = JS_VALUE_TO_PTR(shape);
+    hash_mask = JS_VALUE_GET_INT(arr->arr[1]);
+    hash_mask1 = JS_VALUE_GET_INT(arr1->arr[1]);
+    for(i = 0; i <= n; i++) {
+        pr = (JSProperty *)&arr1->arr[2 + (hash_mask1 + 1) + 3 * i];
+        if (i < n)
+            pr->key = arr->arr[2 + (hash_mask + 1) + 3 * i];
+        else
+            pr->key = key;
+        pr->value = JS_NewShortInt(1 + i); /* index in the value array */
+        pr->prop_type = JS_PROP_NORMAL;
+    }
+    arr1->arr[0] = JS_NewShortInt(n + 1);
+    js_rehash_props_array(arr1);
+
+    /* the shape may have been moved by the GC */
+    ce = js_shape_cache_entry(ctx, shape, key);
+    ce->shape = shape;
+    ce->key = key;
+    ce->next_shape = JS_VALUE_FROM_PTR(arr1);
+    return ce->next_shape;
+}
+
+/* Convert the shaped object 'obj' to a property array. Return non
+   zero if error. */
+static int js_unshape_props(JSContext *ctx, JSValue obj)
+{
+    JSObject *p;
+    JSValueArray *arr, *arr1, *shape;
+    JSProperty *pr, *pr1;
+    JSGCRef obj_ref;
+    int i, n, hash_mask;
+
+    p = JS_VALUE_TO_PTR(obj);
+    arr = JS_VALUE_TO_PTR(p->props);
+    shape = JS_VALUE_TO_PTR(arr->arr[0]);
+    n = JS_VALUE_GET_INT(shape->arr[0]);
+    if (n == 0) {
+        p->props = ctx->empty_props;
+        js_write_barrier(ctx, &p->props);
+        return 0;
+    }
+    JS_PUSH_VALUE(ctx, obj);
+    arr1 = js_alloc_props(ctx, n);
+    JS_POP_VALUE(ctx, obj);
+    if (!arr1)
+        return -1;
+    p = JS_VALUE_TO_PTR(obj);
+    arr = JS_VALUE_TO_PTR(p->props);
+    shape = JS_VALUE_TO_PTR(arr->arr[0]);
+    hash_mask = JS_VALUE_GET_INT(shape->arr[1]);
+    /* same hash table size: the properties can be copied */
+    memcpy(arr1->arr, shape->arr, (2 + (hash_mask + 1)) * sizeof(JSValue));
+    for(i = 0; i < n; i++) {
+        pr = (JSProperty *)&shape->arr[2 + (hash_mask + 1) + 3 * i];
+        pr1 = (JSProperty *)&arr1->arr[2 + (hash_mask + 1) + 3 * i];
+        *pr1 = *pr;
+        pr1->value = arr->arr[1 + i];
+    }
+    p->props = JS_VALUE_FROM_PTR(arr1);
+    js_write_barrier(ctx, &p->props);
+    return 0;
+}
+
+/* Add the property 'prop' to 'obj' and return the location of its
+   value or NULL if exception. It is assumed that the property does
+   not already exists. */
+static JSValue *js_add_property(JSContext *ctx, JSValue obj,
+                                JSValue prop, JSPropTypeEnum prop_type)
+{
+    JSObject *p;
+    JSValueArray *arr;
+    JSProperty *pr;
+    JSValue shape, new_props;
+    JSGCRef obj_ref, prop_ref, shape_ref;
+    int n;
+
+    p = JS_VALUE_TO_PTR(obj);
+    arr = JS_VALUE_TO_PTR(p->props);
+    if (ctx->shape_mode && p->class_id == JS_CLASS_OBJECT &&
+        prop_type == JS_PROP_NORMAL &&
+        (p->props == ctx->empty_props || js_is_shaped_props(arr))) {
+        if (p->props == ctx->empty_props) {
+            shape = ctx->empty_props;
+            n = 0;
+        } else {
+            shape = arr->arr[0];
+            n = JS_VALUE_GET_INT(((JSValueArray *)JS_VALUE_TO_PTR(shape))->arr[0]);
+        }
+        if (n < JS_SHAPE_MAX_PROPS) {
+            JS_PUSH_VALUE(ctx, obj);
+            shape = js_shape_add(ctx, shape, prop);
+            JS_POP_VALUE(ctx, obj);
+            if (JS_IsException(shape))
+                return NULL;
+            JS_PUSH_VALUE(ctx, obj);
+            JS_PUSH_VALUE(ctx, shape);
+            p = JS_VALUE_TO_PTR(obj);
+            if (p->props == ctx->empty_props) {
+                arr = js_alloc_value_array(ctx, 0, 1 + JS_SHAPE_INIT_SIZE);
+                new_props = arr ? JS_VALUE_FROM_PTR(arr) : JS_EXCEPTION;
+            } else {
+                new_props = js_resize_value_array(ctx, p->props, n + 2);
+            }
+            JS_POP_VALUE(ctx, shape);
+            JS_POP_VALUE(ctx, obj);
+            if (JS_IsException(new_props))
+                return NULL;
+            p = JS_VALUE_TO_PTR(obj);
+            p->props = new_props;
+            js_write_barrier(ctx, &p->props);
+            arr = JS_VALUE_TO_PTR(new_props);
+            arr->arr[0] = shape;
+            js_write_barrier(ctx, &arr->arr[0]);
+            return &arr->arr[1 + n];
+        }
+    }
+    if (js_is_shaped_props(arr)) {
+        int ret;
+        JS_PUSH_VALUE(ctx, obj);
+        JS_PUSH_VALUE(ctx, prop);
+        ret = js_unshape_props(ctx, obj);
+        JS_POP_VALUE(ctx, prop);
+        JS_POP_VALUE(ctx, obj);
+        if (ret)
+            return NULL;
+    }
+    pr = js_create_property(ctx, obj, prop);
+    if (!pr)
+        return NULL;
+    pr->prop_type = prop_type;
+    return &pr->value;
+}
+
+/* Delete the property 'prop' of the shaped object 'obj': its shape
+   is rebuilt without the property. */
+static JSValue js_shape_delete_property(JSContext *ctx, JSValue obj, JSValue prop)
+{
+    JSObject *p;
+    JSValueArray *arr, *shape;
+    JSProperty *pr;
+    JSValue new_shape;
+    JSGCRef obj_ref, new_shape_ref;
+    int i, k, n, hash_mask;
+
+    p = JS_VALUE_TO_PTR(obj);
+    pr = find_own_property(ctx, p, prop);
+    if (!pr)
+        return JS_TRUE;
+    k = JS_VALUE_GET_INT(pr->value);
+    shape = js_get_prop_keys(p);
+    n = JS_VALUE_GET_INT(shape->arr[0]);
+
+    new_shape = ctx->empty_props;
+    JS_PUSH_VALUE(ctx, obj);
+    JS_PUSH_VALUE(ctx, new_shape);
+    for(i = 1; i <= n; i++) {
+        if (i == k)
+            continue;
+        /* the keys are in the same order as the values */
+        shape = js_get_prop_keys(JS_VALUE_TO_PTR(obj_ref.val));
+        hash_mask = JS_VALUE_GET_INT(shape->arr[1]);
+        new_shape = js_shape_add(ctx, new_shape_ref.val,
+                                 shape->arr[2 + (hash_mask + 1) + 3 * (i - 1)]);
+        new_shape_ref.val = new_shape;
+        if (JS_IsException(new_shape))
+            break;
+    }
+    JS_POP_VALUE(ctx, new_shape);
+    JS_POP_VALUE(ctx, obj);
+    if (JS_IsException(new_shape))
+        return JS_EXCEPTION;
+    p = JS_VALUE_TO_PTR(obj);
+    arr = JS_VALUE_TO_PTR(p->props);
+    memmove(&arr->arr[k], &arr->arr[k + 1], (n - k) * sizeof(JSValue));
+    js_write_barrier_range(ctx, &arr->arr[k], n - k);
+    arr->arr[n] = JS_UNDEFINED;
+    arr->arr[0] = new_shape;
+    js_write_barrier(ctx, &arr->arr[0]);
+    js_write_barrier(ctx, &p->props);
+    return JS_TRUE;
+}
+
 #define JS_DEF_PROP_FLAGS_LOOKUP  (1 << 0)
 #define JS_DEF_PROP_FLAGS_RET_VAL (1 << 1)
 
@@ -2953,6 +3973,7 @@ static JSValue JS_DefinePropertyInternal(JSContext *ctx, JSValue obj,
 {
     JSProperty *pr;
     JSValueArray *arr;
+    JSValue *pval;
     JSGCRef obj_ref, prop_ref, val_ref, setter_ref;
     int ret;
     
@@ -2976,8 +3997,10 @@ static JSValue JS_DefinePropertyInternal(JSContext *ctx, JSValue obj,
                 return JS_ThrowTypeError(ctx, "cannot modify getter/setter/value kind");
             switch(prop_type) {
             case JS_PROP_NORMAL:
-                pr->value = val;
-                break;
+                pval = js_get_prop_value_ptr(JS_VALUE_TO_PTR(obj), pr);
+                *pval = val;
+                js_write_barrier(ctx, pval);
+                return val;
             case JS_PROP_GETSET:
                 arr = JS_VALUE_TO_PTR(pr->value);
                 /* XXX: should add flags to set only getter or setter */
@@ -2985,6 +4008,7 @@ static JSValue JS_DefinePropertyInternal(JSContext *ctx, JSValue obj,
                     arr->arr[0] = val;
                 if (setter != JS_UNDEFINED)
                     arr->arr[1] = setter;
+                js_write_barrier_range(ctx, arr->arr, 2);
                 break;
             default:
                 assert(0);
@@ -3025,12 +4049,12 @@ static JSValue JS_DefinePropertyInternal(JSContext *ctx, JSValue obj,
         val = JS_VALUE_FROM_PTR(pv);
     }
     JS_PUSH_VALUE(ctx, val);
-    pr = js_create_property(ctx, obj, prop);
+    pval = js_add_property(ctx, obj, prop, prop_type);
     JS_POP_VALUE(ctx, val);
-    if (!pr)
+    if (!pval)
         return JS_EXCEPTION;
-    pr->prop_type = prop_type;
-    pr->value = val;
+    *pval = val;
+    js_write_barrier(ctx, pval);
     if (flags & JS_DEF_PROP_FLAGS_RET_VAL) {
         return val;
     } else {
@@ -3086,7 +4110,7 @@ static JSValue JS_SetPropertyInternal(JSContext *ctx, JSValue this_obj,
                                       JSValue prop, JSValue val,
                                       BOOL allow_tail_call)
 {
-    JSValue proto;
+    JSValue proto, *pval;
     JSObject *p;
     JSProperty *pr;
     BOOL is_obj;
@@ -3144,6 +4168,7 @@ static JSValue JS_SetPropertyInternal(JSContext *ctx, JSValue this_obj,
             if (idx < p->u.array.len) {
                 arr = JS_VALUE_TO_PTR(p->u.array.tab);
                 arr->arr[idx] = val;
+                js_write_barrier(ctx, &arr->arr[idx]);
                 return JS_UNDEFINED;
             } else if (idx == p->u.array.len) {
                 JSValue new_tab;
@@ -3158,8 +4183,10 @@ static JSValue JS_SetPropertyInternal(JSContext *ctx, JSValue this_obj,
                     return JS_EXCEPTION;
                 p = JS_VALUE_TO_PTR(this_obj);
                 p->u.array.tab = new_tab;
+                js_write_barrier(ctx, &p->u.array.tab);
                 arr = JS_VALUE_TO_PTR(p->u.array.tab);
                 arr->arr[idx] = val;
+                js_write_barrier(ctx, &arr->arr[idx]);
                 p->u.array.len++;
                 return JS_UNDEFINED;
             } else {
@@ -3239,12 +4266,15 @@ static JSValue JS_SetPropertyInternal(JSContext *ctx, JSValue this_obj,
         if (likely(pr->prop_type == JS_PROP_NORMAL)) {
             if (unlikely(JS_IS_ROM_PTR(ctx, pr)))
                 goto convert_to_ram;
-            pr->value = val;
+            pval = js_get_prop_value_ptr(p, pr);
+            *pval = val;
+            js_write_barrier(ctx, pval);
             return JS_UNDEFINED;
         } else if (pr->prop_type == JS_PROP_VARREF) {
             JSVarRef *pv = JS_VALUE_TO_PTR(pr->value);
             /* always detached */
             pv->u.value = val;
+            js_write_barrier(ctx, &pv->u.value);
             return JS_UNDEFINED;
         } else if (pr->prop_type == JS_PROP_SPECIAL) {
             JSGCRef val_ref, prop_ref, this_obj_ref;
@@ -3373,6 +4403,8 @@ static JSValue JS_DeleteProperty(JSContext *ctx, JSValue this_obj,
         return JS_TRUE;
 
     arr = JS_VALUE_TO_PTR(p->props);
+    if (js_is_shaped_props(arr))
+        return js_shape_delete_property(ctx, this_obj, prop);
     hash_mask = JS_VALUE_GET_INT(arr->arr[1]);
     h = hash_prop(prop) & hash_mask;
     idx = JS_VALUE_GET_INT(arr->arr[2 + h]);
@@ -3534,6 +4566,7 @@ JSContext *JS_NewContext2(void *mem_start, size_t mem_size, const JSSTDLibraryDe
     ctx->class_obj = ctx->class_proto + ctx->class_count;
     ctx->heap_base = (void *)(ctx->class_proto + 2 * ctx->class_count);
     ctx->heap_free = ctx->heap_base;
+    ctx->gc_young_start = ctx->heap_base;
     ctx->stack_top = mem_start + mem_size;
     ctx->sp = (JSValue *)ctx->stack_top;
     ctx->stack_bottom = ctx->sp;
@@ -3547,6 +4580,17 @@ JSContext *JS_NewContext2(void *mem_start, size_t mem_size, const JSSTDLibraryDe
     ctx->write_func = dummy_write_func;
     for(i = 0; i < JS_STRING_POS_CACHE_SIZE; i++)
         ctx->string_pos_cache[i].str = JS_NULL;
+    for(i = 0; i < JS_STRING_INDEX_SIZE; i++) {
+        ctx->string_index[i].str = JS_NULL;
+        ctx->string_index[i].index = JS_NULL;
+    }
+    for(i = 0; i < JS_REGEXP_CACHE_SIZE * 2; i++)
+        ctx->regexp_cache[i] = JS_NULL;
+    for(i = 0; i < JS_HOST_FUNCTION_MAX; i++)
+        ctx->host_func_names[i] = JS_NULL;
+    js_shape_cache_reset(ctx);
+    ctx->free_for_in_iter = JS_NULL;
+    ctx->gc_card_table = JS_NULL;
 
     if (prepare_compilation) {
         int atom_table_len;
@@ -3564,15 +4608,18 @@ JSContext *JS_NewContext2(void *mem_start, size_t mem_size, const JSSTDLibraryDe
                atom_table_len * sizeof(JSWord));
         ctx->heap_free += atom_table_len * sizeof(JSWord);
 
-        /* allocate the sorted atom table and populate it */
+        /* allocate the unique string table and populate it */
         arr1 = (JSValueArray *)(stdlib_def->stdlib_table + atom_table_len);
-        arr = js_alloc_value_array(ctx, 0, arr1->size);
-        ctx->unique_strings = JS_VALUE_FROM_PTR(arr);
+        ctx->unique_strings = JS_NULL;
+        js_resize_unique_strings(ctx, arr1->size);
+        arr = JS_VALUE_TO_PTR(ctx->unique_strings);
         for(i = 0; i < arr1->size; i++) {
+            int idx;
             ptr = JS_VALUE_TO_PTR(arr1->arr[i]);
             ptr = ptr - (uint8_t *)stdlib_def->stdlib_table +
                 (uint8_t *)ctx->atom_table;
-            arr->arr[i] = JS_VALUE_FROM_PTR(ptr);
+            find_unique_string(arr, &idx, JS_VALUE_FROM_PTR(ptr));
+            arr->arr[idx] = JS_VALUE_FROM_PTR(ptr);
         }
         ctx->unique_strings_len = arr1->size;
     } else {
@@ -3651,6 +4698,11 @@ void JS_SetContextOpaque(JSContext *ctx, void *opaque)
     ctx->opaque = opaque;
 }
 
+void *JS_GetContextOpaque(JSContext *ctx)
+{
+    return ctx->opaque;
+}
+
 void JS_SetInterruptHandler(JSContext *ctx, JSInterruptHandler *interrupt_handler)
 {
     ctx->interrupt_handler = interrupt_handler;
@@ -3666,6 +4718,210 @@ void JS_SetRandomSeed(JSContext *ctx, uint64_t seed)
     ctx->random_state = seed;
 }
 
+/* Allocate the card table for the whole memory block and make all the
+   blocks old. Return -1 if not enough memory (the full GC mode is then
+   used). */
+static int js_gc_init_cards(JSContext *ctx)
+{
+    JSByteArray *arr;
+    uint32_t mem_size, count, size;
+    int shift;
+
+    ctx->gc_mode = JS_GC_MODE_FULL;
+    ctx->gc_young_start = ctx->heap_base;
+    ctx->gc_card_table = JS_NULL;
+    mem_size = ctx->stack_top - ctx->heap_base;
+    shift = JS_GC_CARD_SHIFT_MIN;
+    while ((mem_size >> shift) >= JS_GC_CARD_COUNT_MAX)
+        shift++;
+    count = (mem_size + (1 << shift) - 1) >> shift;
+    size = count * (sizeof(uint32_t) + 1);
+    arr = js_malloc_nogc(ctx, sizeof(JSByteArray) + size, JS_MTAG_BYTE_ARRAY);
+    if (!arr) {
+        JS_GC(ctx);
+        arr = js_malloc_nogc(ctx, sizeof(JSByteArray) + size, JS_MTAG_BYTE_ARRAY);
+        if (!arr)
+            return -1;
+    }
+    arr->size = size;
+    ctx->gc_card_table = JS_VALUE_FROM_PTR(arr);
+    ctx->gc_card_shift = shift;
+    ctx->gc_card_count = count;
+    ctx->gc_mode = JS_GC_MODE_GENERATIONAL;
+    gc_promote_blocks(ctx);
+    /* the previous stores into the blocks were not tracked */
+    memset(js_gc_card_dirty(ctx), 1, count);
+    return 0;
+}
+
+void JS_SetGCMode(JSContext *ctx, int gc_mode, size_t nursery_size)
+{
+    if (gc_mode == JS_GC_MODE_GENERATIONAL && js_gc_init_cards(ctx) == 0) {
+        ctx->gc_nursery_size = min_uint32(nursery_size, UINT32_MAX);
+    } else {
+        ctx->gc_mode = JS_GC_MODE_FULL;
+        ctx->gc_young_start = ctx->heap_base;
+        ctx->gc_card_table = JS_NULL;
+        ctx->gc_nursery_size = 0;
+    }
+}
+
+void JS_SetShapeMode(JSContext *ctx, JS_BOOL enable)
+{
+    ctx->shape_mode = (enable != 0);
+}
+
+void JS_SetGCClock(JSContext *ctx, JSClockFunc *clock_func)
+{
+    ctx->gc_clock = clock_func;
+}
+
+static void js_update_max_heap_size(JSContext *ctx)
+{
+    uint64_t size = ctx->heap_free - ctx->heap_base;
+    if (size > ctx->gc_stats.max_heap_size)
+        ctx->gc_stats.max_heap_size = size;
+}
+
+void JS_GetGCStats(JSContext *ctx, JSGCStats *stats)
+{
+    js_update_max_heap_size(ctx);
+    *stats = ctx->gc_stats;
+}
+
+void JS_ResetGCStats(JSContext *ctx)
+{
+    memset(&ctx->gc_stats, 0, sizeof(ctx->gc_stats));
+}
+
+/* The ticks are the decrements of interrupt_counter: they are added to
+   meter_ticks when the counter is reloaded. */
+static uint64_t js_meter_get_ticks(JSContext *ctx)
+{
+    return ctx->meter_ticks +
+        (ctx->interrupt_counter_init - ctx->interrupt_counter);
+}
+
+static void js_set_interrupt_counter(JSContext *ctx, int n)
+{
+    ctx->meter_ticks = js_meter_get_ticks(ctx);
+    ctx->interrupt_counter = n;
+    ctx->interrupt_counter_init = n;
+}
+
+/* reload the interrupt counter so that the next poll occurs at the
+   latest when the tick budget is reached */
+static void js_reload_interrupt_counter(JSContext *ctx)
+{
+    uint64_t ticks, max_ticks;
+    int n;
+
+    if (ctx->profile_samples)
+        n = ctx->profile_interval;
+    else
+        n = JS_INTERRUPT_COUNTER_INIT;
+    max_ticks = ctx->meter_budget.ticks;
+    if (max_ticks != 0) {
+        ticks = js_meter_get_ticks(ctx);
+        if (ticks >= max_ticks)
+            n = 1;
+        else if (max_ticks - ticks < n)
+            n = max_ticks - ticks;
+    }
+    js_set_interrupt_counter(ctx, n);
+}
+
+/* bytes allocated since the context creation. The heap only shrinks
+   when blocks are freed. */
+static uint64_t js_meter_get_alloc_bytes(JSContext *ctx)
+{
+    return (ctx->heap_free - ctx->heap_base) + ctx->meter_freed_bytes;
+}
+
+void JS_ResetMeter(JSContext *ctx, const JSMeterStats *budget)
+{
+    if (budget)
+        ctx->meter_budget = *budget;
+    else
+        memset(&ctx->meter_budget, 0, sizeof(ctx->meter_budget));
+    ctx->meter_enabled = (ctx->meter_budget.ticks != 0 ||
+                          ctx->meter_budget.alloc_bytes != 0 ||
+                          ctx->meter_budget.native_time != 0);
+    ctx->meter_clock = ctx->gc_clock;
+    ctx->meter_alloc_start = js_meter_get_alloc_bytes(ctx);
+    ctx->meter_native_time = 0;
+    js_set_interrupt_counter(ctx, ctx->interrupt_counter);
+    ctx->meter_ticks = 0;
+    if (ctx->meter_budget.ticks != 0)
+        js_reload_interrupt_counter(ctx);
+}
+
+void JS_GetMeterStats(JSContext *ctx, JSMeterStats *stats)
+{
+    stats->ticks = js_meter_get_ticks(ctx);
+    stats->alloc_bytes = js_meter_get_alloc_bytes(ctx) - ctx->meter_alloc_start;
+    stats->native_time = ctx->meter_native_time;
+}
+
+/* return the name of the exceeded budget or NULL */
+static const char *js_meter_check(JSContext *ctx)
+{
+    JSMeterStats s;
+
+    JS_GetMeterStats(ctx, &s);
+    if (ctx->meter_budget.ticks != 0 && s.ticks >= ctx->meter_budget.ticks)
+        return "tick";
+    if (ctx->meter_budget.alloc_bytes != 0 &&
+        s.alloc_bytes >= ctx->meter_budget.alloc_bytes)
+        return "allocation";
+    if (ctx->meter_budget.native_time != 0 &&
+        s.native_time >= ctx->meter_budget.native_time)
+        return "native time";
+    return NULL;
+}
+
+/* measure the time of the outermost native function calls */
+static int64_t js_meter_native_start(JSContext *ctx)
+{
+    JSClockFunc *clock_func = ctx->meter_clock;
+    ctx->meter_clock = NULL;
+    return clock_func(ctx->opaque);
+}
+
+static void js_meter_native_end(JSContext *ctx, JSClockFunc *clock_func,
+                                int64_t t0)
+{
+    ctx->meter_native_time += clock_func(ctx->opaque) - t0;
+    ctx->meter_clock = clock_func;
+}
+
+void JS_GetMemoryUsage(JSContext *ctx, JSMemoryUsage *s)
+{
+    uint8_t *ptr;
+    int mtag, size;
+
+    memset(s, 0, sizeof(*s));
+    s->mem_size = ctx->stack_top - (uint8_t *)ctx - ctx->mem_reserve;
+    s->heap_size = ctx->heap_free - ctx->heap_base;
+    s->stack_size = ctx->stack_top - (uint8_t *)ctx->sp;
+    s->free_size = (uint8_t *)ctx->sp - ctx->heap_free - ctx->mem_reserve;
+    for(ptr = ctx->heap_base; ptr < ctx->heap_free; ptr += size) {
+        mtag = js_get_mtag(ptr);
+        size = get_mblock_size(ptr);
+        s->block_count[mtag]++;
+        s->block_size[mtag] += size;
+    }
+    js_update_max_heap_size(ctx);
+    s->gc = ctx->gc_stats;
+}
+
+const char *JS_GetMemoryTagName(int tag)
+{
+    if (tag < 0 || tag >= JS_MTAG_COUNT)
+        return NULL;
+    return js_mtag_name[tag];
+}
+
 JSValue JS_GetGlobalObject(JSContext *ctx)
 {
     return ctx->global_obj;
@@ -3745,6 +5001,25 @@ static JSValue reloc_c_func_name(JSContext *ctx, JSValue val)
     return val;
 }
 
+/* index of the functions created with JS_NewCFunction() */
+#define JS_HOST_FUNC_IDX_BASE 0x10000
+
+static inline const JSCFunctionDef *js_get_c_function_def(JSContext *ctx, uint32_t idx)
+{
+    if (unlikely(idx >= JS_HOST_FUNC_IDX_BASE))
+        return &ctx->host_funcs[idx - JS_HOST_FUNC_IDX_BASE];
+    else
+        return &ctx->c_function_table[idx];
+}
+
+static JSValue js_get_c_function_name(JSContext *ctx, uint32_t idx)
+{
+    if (idx >= JS_HOST_FUNC_IDX_BASE)
+        return ctx->host_func_names[idx - JS_HOST_FUNC_IDX_BASE];
+    else
+        return reloc_c_func_name(ctx, ctx->c_function_table[idx].name);
+}
+
 /* no memory allocation is done */
 /* XXX: handle bound functions */
 static JSValue js_function_get_length_name1(JSContext *ctx, JSValue *this_val,
@@ -3780,9 +5055,9 @@ static JSValue js_function_get_length_name1(JSContext *ctx, JSValue *this_val,
         } else if (p->class_id == JS_CLASS_C_FUNCTION) {
             short_func_idx = p->u.cfunc.idx;
         short_func:
-            fd = &ctx->c_function_table[short_func_idx];
+            fd = js_get_c_function_def(ctx, short_func_idx);
             if (is_name) {
-                ret = reloc_c_func_name(ctx, fd->name);
+                ret = js_get_c_function_name(ctx, short_func_idx);
             } else {
                 ret = JS_NewShortInt(fd->arg_count);
             }
@@ -3924,12 +5199,13 @@ static int find_line_col(int *pcol_num, JSFunctionBytecode *b, uint32_t pc)
     while (pos < arr->size) {
         get_pc2line(&line_num, &col_num, pc2line->buf, pc2line->size,
                     &pc2line_pos, b->has_column);
-        if (pos == pc) {
+        op = arr->buf[pos];
+        pos += opcode_info[op].size;
+        /* 'pc' may point inside the instruction */
+        if (pc < pos) {
             *pcol_num = col_num;
             return line_num;
         }
-        op = arr->buf[pos];
-        pos += opcode_info[op].size;
     }
  fail:
     *pcol_num = 0;
@@ -4009,18 +5285,91 @@ static void build_backtrace(JSContext *ctx, JSValue error_obj,
     JS_POP_VALUE(ctx, error_obj);
     p1 = JS_VALUE_TO_PTR(error_obj);
     p1->u.error.stack = stack_str;
+    js_write_barrier(ctx, &p1->u.error.stack);
 }
 
-#define HINT_STRING  0
-#define HINT_NUMBER  1
-#define HINT_NONE    HINT_NUMBER
+void JS_SetProfileBuffer(JSContext *ctx, JSProfileSample *samples,
+                         int sample_count, int interval)
+{
+    if (!samples || sample_count <= 0) {
+        ctx->profile_samples = NULL;
+        ctx->profile_sample_count = 0;
+        interval = JS_INTERRUPT_COUNTER_INIT;
+    } else {
+        ctx->profile_samples = samples;
+        ctx->profile_sample_count = sample_count;
+        interval = max_int(min_int(interval, INT16_MAX), 1);
+    }
+    ctx->profile_count = 0;
+    ctx->profile_interval = interval;
+    js_set_interrupt_counter(ctx, min_int(ctx->interrupt_counter, interval));
+}
 
-static JSValue JS_ToPrimitive(JSContext *ctx, JSValue val, int hint)
+uint32_t JS_GetProfileSampleCount(JSContext *ctx)
 {
-    int i, atom;
-    JSValue method, ret;
-    JSGCRef val_ref, method_ref;
-    
+    return ctx->profile_count;
+}
+
+/* record the current call stack. No allocation is done. */
+static void js_profile_sample(JSContext *ctx)
+{
+    JSProfileSample *s;
+    JSValue *fp;
+    int depth;
+    
+    s = &ctx->profile_samples[ctx->profile_count % ctx->profile_sample_count];
+    ctx->profile_count++;
+    depth = 0;
+    for(fp = ctx->fp; fp != (JSValue *)ctx->stack_top &&
+            depth < JS_PROFILE_MAX_DEPTH; 
+        fp = VALUE_TO_SP(ctx, fp[FRAME_OFFSET_SAVED_FP])) {
+        s->func[depth] = fp[FRAME_OFFSET_FUNC_OBJ];
+        s->pc[depth] = JS_VALUE_GET_INT(fp[FRAME_OFFSET_CUR_PC]);
+        depth++;
+    }
+    s->depth = depth;
+}
+
+int JS_GetProfileFrame(JSContext *ctx, JSProfileFrame *f,
+                       const JSProfileSample *s, int level)
+{
+    JSFunctionBytecode *b;
+    
+    if (level < 0 || level >= s->depth)
+        return -1;
+    f->func_name = get_func_name(ctx, s->func[level], &f->buf[0], &b);
+    if (!f->func_name || f->func_name[0] == '\0')
+        f->func_name = "<anonymous>";
+    if (b) {
+        f->filename = JS_ToCString(ctx, b->filename, &f->buf[1]);
+        /* the pc of the outer frames is just after the call opcode */
+        f->line_num = find_line_col(&f->col_num, b, s->pc[level]);
+    } else {
+        f->filename = NULL;
+        f->line_num = 0;
+        f->col_num = 0;
+    }
+    return 0;
+}
+
+/* the number of valid entries in the profile ring buffer */
+static int js_profile_len(JSContext *ctx)
+{
+    if (!ctx->profile_samples)
+        return 0;
+    return min_uint32(ctx->profile_count, ctx->profile_sample_count);
+}
+
+#define HINT_STRING  0
+#define HINT_NUMBER  1
+#define HINT_NONE    HINT_NUMBER
+
+static JSValue JS_ToPrimitive(JSContext *ctx, JSValue val, int hint)
+{
+    int i, atom;
+    JSValue method, ret;
+    JSGCRef val_ref, method_ref;
+    
     if (JS_IsPrimitive(ctx, val))
         return val;
     for(i = 0; i < 2; i++) {
@@ -4290,6 +5639,42 @@ int JS_ToNumber(JSContext *ctx, double *pres, JSValue val)
     }
 }
 
+/* ToInt32() of a float64 (remainder modulo 2^32) */
+static int32_t js_float64_to_int32(double d)
+{
+    uint64_t u, v;
+    int e;
+    int32_t ret;
+    
+    u = float64_as_uint64(d);
+    e = (u >> 52) & 0x7ff;
+    if (likely(e <= (1023 + 30))) {
+        /* fast case */
+        ret = (int32_t)d;
+    } else if (e <= (1023 + 30 + 53)) {
+        /* remainder modulo 2^32 */
+        v = (u & (((uint64_t)1 << 52) - 1)) | ((uint64_t)1 << 52);
+        v = v << ((e - 1023) - 52 + 32);
+        ret = v >> 32;
+        /* take the sign into account */
+        if (u >> 63)
+            ret = -ret;
+    } else {
+        ret = 0; /* also handles NaN and +inf */
+    }
+    return ret;
+}
+
+static int js_float64_to_uint8_clamp(double d)
+{
+    if (d < 0 || isnan(d))
+        return 0;
+    else if (d > 255)
+        return 255;
+    else
+        return js_lrint(d);
+}
+
 static int JS_ToInt32Internal(JSContext *ctx, int *pres, JSValue val, BOOL sat_flag)
 {
     int32_t ret;
@@ -4322,18 +5707,7 @@ static int JS_ToInt32Internal(JSContext *ctx, int *pres, JSValue val, BOOL sat_f
             /* fast case */
             ret = (int32_t)d;
         } else if (!sat_flag) {
-            if (e <= (1023 + 30 + 53)) {
-                uint64_t v;
-                /* remainder modulo 2^32 */
-                v = (u & (((uint64_t)1 << 52) - 1)) | ((uint64_t)1 << 52);
-                v = v << ((e - 1023) - 52 + 32);
-                ret = v >> 32;
-                /* take the sign into account */
-                if (u >> 63)
-                    ret = -ret;
-            } else {
-                ret = 0; /* also handles NaN and +inf */
-            }
+            ret = js_float64_to_int32(d);
         } else {
             if (e == 2047 && (u & (((uint64_t)1 << 52) - 1)) != 0) {
                 /* nan */
@@ -4420,12 +5794,7 @@ static int JS_ToUint8Clamp(JSContext *ctx, int *pres, JSValue val)
 #ifdef JS_USE_SHORT_FLOAT
     handle_float64:
 #endif        
-        if (d < 0 || isnan(d))
-            ret = 0;
-        else if (d > 255)
-            ret = 255;
-        else
-            ret = js_lrint(d);
+        ret = js_float64_to_uint8_clamp(d);
     } else {
         switch(JS_VALUE_GET_SPECIAL_TAG(val)) {
         case JS_TAG_BOOL:
@@ -4484,6 +5853,33 @@ static no_inline JSValue js_add_slow(JSContext *ctx)
     }
 }
 
+/* same as js_add_slow() but a string result is returned as a string
+   builder (OP_append_loc) */
+static no_inline JSValue js_append_slow(JSContext *ctx)
+{
+    JSValue *op1, *op2;
+
+    op1 = &ctx->sp[1];
+    op2 = &ctx->sp[0];
+    if (!JS_IsString(ctx, *op1) || !JS_IsString(ctx, *op2)) {
+        *op1 = JS_ToPrimitive(ctx, *op1, HINT_NONE);
+        if (JS_IsException(*op1))
+            return JS_EXCEPTION;
+        *op2 = JS_ToPrimitive(ctx, *op2, HINT_NONE);
+        if (JS_IsException(*op2))
+            return JS_EXCEPTION;
+        if (!JS_IsString(ctx, *op1) && !JS_IsString(ctx, *op2))
+            return js_add_slow(ctx);
+        *op1 = JS_ToString(ctx, *op1);
+        if (JS_IsException(*op1))
+            return JS_EXCEPTION;
+        *op2 = JS_ToString(ctx, *op2);
+        if (JS_IsException(*op2))
+            return JS_EXCEPTION;
+    }
+    return js_string_builder_append(ctx);
+}
+
 static no_inline JSValue js_binary_arith_slow(JSContext *ctx, OPCodeEnum op)
 {
     double d1, d2, r;
@@ -4516,6 +5912,41 @@ static no_inline JSValue js_binary_arith_slow(JSContext *ctx, OPCodeEnum op)
     return JS_NewFloat64(ctx, r);
 }
 
+/* OP_arith_tmp operand: opcode - OP_mul and the temporary operands */
+#define ARITH_TMP_OP_MASK 0x0f
+#define ARITH_TMP_OP1     (1 << 4)
+#define ARITH_TMP_OP2     (1 << 5)
+
+/* return TRUE and set '*pres' if 'val' is a number */
+static inline BOOL js_get_number(JSValue val, double *pres)
+{
+    if (JS_IsInt(val)) {
+        *pres = (double)JS_VALUE_GET_INT(val);
+        return TRUE;
+    } else
+#ifdef JS_USE_SHORT_FLOAT
+    if (JS_IsShortFloat(val)) {
+        *pres = js_get_short_float(val);
+        return TRUE;
+    } else
+#endif
+    if (JS_IsPtr(val) && js_get_mtag(JS_VALUE_TO_PTR(val)) == JS_MTAG_FLOAT64) {
+        *pres = ((JSFloat64 *)JS_VALUE_TO_PTR(val))->u.dval;
+        return TRUE;
+    } else {
+        return FALSE;
+    }
+}
+
+/* 'val' is only referenced from the stack: free it if it is the last
+   allocated float64 so that the result reuses its memory */
+static inline void js_free_float64_tmp(JSContext *ctx, JSValue val)
+{
+    if (JS_IsPtr(val) && val != ctx->minus_zero &&
+        js_get_mtag(JS_VALUE_TO_PTR(val)) == JS_MTAG_FLOAT64)
+        js_free(ctx, JS_VALUE_TO_PTR(val));
+}
+
 static no_inline JSValue js_unary_arith_slow(JSContext *ctx, OPCodeEnum op)
 {
     double d;
@@ -4928,16 +6359,55 @@ static JSValue js_closure(JSContext *ctx, JSValue bfunc, JSValue *fp)
                 return val;
             p = JS_VALUE_TO_PTR(closure);
             p->u.closure.var_refs[i] = val;
+            js_write_barrier(ctx, &p->u.closure.var_refs[i]);
         }
     }
     return closure;
 }
 
+/* Return the shape of the plain object 'obj' or JS_NULL if it has no
+   shape. Its keys can be enumerated directly because a shape is never
+   modified. */
+static JSValue js_get_enum_shape(JSContext *ctx, JSValue obj)
+{
+    JSObject *p;
+    JSValueArray *arr;
+
+    if (!JS_IsObject(ctx, obj))
+        return JS_NULL;
+    p = JS_VALUE_TO_PTR(obj);
+    if (p->class_id != JS_CLASS_OBJECT)
+        return JS_NULL;
+    if (p->props == ctx->empty_props)
+        return p->props;
+    arr = JS_VALUE_TO_PTR(p->props);
+    if (!js_is_shaped_props(arr))
+        return JS_NULL;
+    return arr->arr[0];
+}
+
+/* The iterator is [array, pos] or [shape, pos] for the for-in loops
+   on shaped objects. */
 static JSValue js_for_of_start(JSContext *ctx, BOOL is_for_in)
 {
     JSValueArray *arr;
 
     if (is_for_in) {
+        if (js_get_enum_shape(ctx, ctx->sp[0]) != JS_NULL) {
+            /* no key array is built and the iterator is reused */
+            if (ctx->free_for_in_iter != JS_NULL) {
+                arr = JS_VALUE_TO_PTR(ctx->free_for_in_iter);
+                ctx->free_for_in_iter = JS_NULL;
+            } else {
+                arr = js_alloc_value_array(ctx, 0, 2);
+                if (!arr)
+                    return JS_EXCEPTION;
+            }
+            arr->arr[0] = js_get_enum_shape(ctx, ctx->sp[0]);
+            js_write_barrier(ctx, &arr->arr[0]);
+            arr->arr[1] = JS_NewShortInt(0);
+            return JS_VALUE_FROM_PTR(arr);
+        }
         /* XXX: not spec compliant and slow. We return only the own
            object keys. */
         ctx->sp[0] = js_object_keys(ctx, NULL, 1, &ctx->sp[0]);
@@ -4960,10 +6430,34 @@ static JSValue js_for_of_next(JSContext *ctx)
 {
     JSValueArray *arr, *arr1;
     JSObject *p;
-    int pos;
+    JSValue key;
+    int pos, hash_mask;
     
     arr = JS_VALUE_TO_PTR(ctx->sp[0]);
     pos = JS_VALUE_GET_INT(arr->arr[1]);
+    if (js_get_mtag(JS_VALUE_TO_PTR(arr->arr[0])) == JS_MTAG_VALUE_ARRAY) {
+        /* for-in on a shaped object */
+        arr1 = JS_VALUE_TO_PTR(arr->arr[0]);
+        if (pos >= JS_VALUE_GET_INT(arr1->arr[0])) {
+            ctx->sp[-2] = JS_TRUE;
+            ctx->sp[-1] = JS_UNDEFINED;
+            /* the iterator is dropped after the loop */
+            ctx->free_for_in_iter = ctx->sp[0];
+        } else {
+            hash_mask = JS_VALUE_GET_INT(arr1->arr[1]);
+            key = arr1->arr[2 + (hash_mask + 1) + 3 * pos];
+            arr->arr[1] = JS_NewShortInt(pos + 1);
+            if (!JS_IsPtr(key)) {
+                /* integer key */
+                key = JS_ToString(ctx, key);
+                if (JS_IsException(key))
+                    return key;
+            }
+            ctx->sp[-2] = JS_FALSE;
+            ctx->sp[-1] = key;
+        }
+        return JS_UNDEFINED;
+    }
     p = JS_VALUE_TO_PTR(arr->arr[0]);
     if (pos >= p->u.array.len) {
         ctx->sp[-2] = JS_TRUE;
@@ -5000,6 +6494,41 @@ JSValue JS_NewCFunctionParams(JSContext *ctx, int func_idx, JSValue params)
     return js_new_c_function_proto(ctx, func_idx, ctx->class_proto[JS_CLASS_CLOSURE], TRUE, params);
 }
 
+JSValue JS_NewCFunction(JSContext *ctx, const char *name, int def_type,
+                        JSCFunctionType func, int arg_count, int magic)
+{
+    JSCFunctionDef *fd;
+    JSValue name_val;
+    int i;
+
+    if (!(def_type == JS_CFUNC_generic || def_type == JS_CFUNC_generic_magic ||
+          (def_type >= JS_CFUNC_f_f && def_type <= JS_CFUNC_v_ptr_len)))
+        return JS_ThrowTypeError(ctx, "unsupported C function type");
+    for(i = 0; i < ctx->host_func_count; i++) {
+        fd = &ctx->host_funcs[i];
+        if (fd->def_type == def_type && fd->arg_count == arg_count &&
+            fd->magic == magic &&
+            !memcmp(&fd->func, &func, sizeof(func)))
+            goto found;
+    }
+    if (ctx->host_func_count >= JS_HOST_FUNCTION_MAX)
+        return JS_ThrowInternalError(ctx, "too many C functions");
+    name_val = JS_NewString(ctx, name);
+    if (JS_IsException(name_val))
+        return name_val;
+    i = ctx->host_func_count++;
+    fd = &ctx->host_funcs[i];
+    fd->func = func;
+    fd->name = JS_NULL; /* see host_func_names[] */
+    fd->def_type = def_type;
+    fd->arg_count = arg_count;
+    fd->magic = magic;
+    ctx->host_func_names[i] = name_val;
+ found:
+    return js_new_c_function_proto(ctx, JS_HOST_FUNC_IDX_BASE + i,
+                                   ctx->class_proto[JS_CLASS_CLOSURE], FALSE, JS_UNDEFINED);
+}
+
 static JSValue js_call_constructor_start(JSContext *ctx, JSValue func)
 {
     JSValue proto;
@@ -5023,25 +6552,182 @@ static JSValue js_call_constructor_start(JSContext *ctx, JSValue func)
         pc = ((JSByteArray *)JS_VALUE_TO_PTR(b->byte_code))->buf + JS_VALUE_GET_INT(fp[FRAME_OFFSET_CUR_PC]); \
     } while (0)
 
-static JSValue __js_poll_interrupt(JSContext *ctx)
+/* Move the stack so that it ends at 'new_stack_top'. The frame links
+   and the variable references to the stack are updated. The caller
+   must reload its own stack pointers. */
+static void js_move_stack(JSContext *ctx, uint8_t *new_stack_top)
+{
+    intptr_t delta;
+    JSValue *fp, *next_fp, val;
+    JSObject *p;
+    JSVarRef *pv;
+
+    delta = new_stack_top - ctx->stack_top;
+    memmove((uint8_t *)ctx->sp + delta, ctx->sp,
+            ctx->stack_top - (uint8_t *)ctx->sp);
+    ctx->sp = (JSValue *)((uint8_t *)ctx->sp + delta);
+    ctx->fp = (JSValue *)((uint8_t *)ctx->fp + delta);
+    ctx->stack_bottom = (JSValue *)((uint8_t *)ctx->stack_bottom + delta);
+    ctx->stack_top = new_stack_top;
+
+    for(fp = ctx->fp; fp != (JSValue *)ctx->stack_top; fp = next_fp) {
+        next_fp = (JSValue *)((uint8_t *)VALUE_TO_SP(ctx, fp[FRAME_OFFSET_SAVED_FP]) + delta);
+        fp[FRAME_OFFSET_SAVED_FP] = SP_TO_VALUE(ctx, next_fp);
+        val = fp[FRAME_OFFSET_FUNC_OBJ];
+        if (!JS_IsPtr(val))
+            continue;
+        p = JS_VALUE_TO_PTR(val);
+        if (p->class_id != JS_CLASS_CLOSURE)
+            continue;
+        for(val = fp[FRAME_OFFSET_FIRST_VARREF]; val != JS_NULL; val = pv->u.next) {
+            pv = JS_VALUE_TO_PTR(val);
+            pv->u.pvalue = (JSValue *)((uint8_t *)pv->u.pvalue + delta);
+        }
+    }
+}
+
+/* 'min_free_size' includes the part of the memory block which cannot
+   be used yet */
+static void js_update_heap_reserve(JSContext *ctx)
+{
+    ctx->min_free_size = JS_MIN_FREE_SIZE + ctx->mem_reserve;
+}
+
+/* Ask the host for more usable memory. Nothing is moved: the heap and
+   the stack can just use a larger part of the memory block. */
+static void js_grow_heap(JSContext *ctx, uint32_t size)
+{
+    size_t block_size, mem_size, min_size, new_size;
+
+    if (ctx->mem_reserve == 0)
+        return;
+    block_size = ctx->stack_top - (uint8_t *)ctx;
+    mem_size = block_size - ctx->mem_reserve;
+    /* grow by at least 50% so that the GC is not run too often */
+    min_size = size + JS_MIN_FREE_SIZE;
+    if (min_size < mem_size / 2)
+        min_size = mem_size / 2;
+    min_size += mem_size;
+    if (min_size > block_size)
+        min_size = block_size;
+    new_size = ctx->heap_grow_func(ctx->heap_grow_opaque, ctx, mem_size,
+                                   min_size);
+    if (new_size <= mem_size)
+        return;
+    if (new_size > block_size)
+        new_size = block_size;
+    ctx->mem_reserve = block_size - new_size;
+    js_update_heap_reserve(ctx);
+    ctx->gc_stats.heap_grow_count++;
+}
+
+/* check_free_mem() slow path when there is a heap grow callback: the
+   memory is grown if less than half of it is free after the GC. As
+   the stack does not move, it can be done at any allocation. */
+static int js_check_free_mem_grow(JSContext *ctx, JSValue *stack_bottom,
+                                  uint32_t size)
+{
+    size_t mem_size;
+
+    JS_GC(ctx);
+    mem_size = ctx->stack_top - (uint8_t *)ctx - ctx->mem_reserve;
+    if (((uint8_t *)stack_bottom - ctx->heap_free) <
+        size + ctx->min_free_size + mem_size / 2)
+        js_grow_heap(ctx, size);
+    if (((uint8_t *)stack_bottom - ctx->heap_free) < size + ctx->min_free_size) {
+        JS_ThrowOutOfMemory(ctx);
+        return -1;
+    }
+    return 0;
+}
+
+void JS_SetHeapGrowCallback(JSContext *ctx, JSHeapGrowFunc *func, void *opaque,
+                            size_t mem_size)
+{
+    size_t block_size, min_size;
+
+    block_size = ctx->stack_top - (uint8_t *)ctx;
+    /* the memory in use stays usable */
+    min_size = block_size - ((uint8_t *)ctx->stack_bottom - ctx->heap_free) +
+        JS_MIN_FREE_SIZE;
+    if (!func || mem_size > block_size)
+        mem_size = block_size;
+    if (mem_size < min_size)
+        mem_size = min_size;
+    ctx->heap_grow_func = func;
+    ctx->heap_grow_opaque = opaque;
+    ctx->mem_reserve = block_size - mem_size;
+    js_update_heap_reserve(ctx);
+}
+
+/* return -1 if the execution is interrupted (exception), 1 if it
+   must be suspended, 0 otherwise. Suspension is only possible at an
+   instruction boundary ('can_suspend') of the outermost JS_Call(). */
+static int __js_poll_interrupt(JSContext *ctx, BOOL can_suspend)
 {
-    ctx->interrupt_counter = JS_INTERRUPT_COUNTER_INIT;
-    if (ctx->interrupt_handler && ctx->interrupt_handler(ctx, ctx->opaque)) {
+    const char *budget_name;
+    int ret;
+    
+    if (ctx->profile_samples)
+        js_profile_sample(ctx);
+    js_reload_interrupt_counter(ctx);
+    if (unlikely(ctx->meter_enabled)) {
+        budget_name = js_meter_check(ctx);
+        if (budget_name) {
+            JS_ThrowInternalError(ctx, "%s budget exceeded", budget_name);
+            ctx->current_exception_is_uncatchable = TRUE;
+            return -1;
+        }
+    }
+    if (!ctx->interrupt_handler)
+        return 0;
+    ret = ctx->interrupt_handler(ctx, ctx->opaque);
+    if (ret == JS_INTERRUPT_SUSPEND) {
+        /* otherwise continue: the handler is polled again later */
+        return (can_suspend && ctx->js_call_rec_count == 1 &&
+                !ctx->is_suspended);
+    } else if (ret) {
         JS_ThrowInternalError(ctx, "interrupted");
         ctx->current_exception_is_uncatchable = TRUE;
-        return JS_EXCEPTION;
+        return -1;
     }
-    return JS_UNDEFINED;
+    return 0;
 }
 
 /* handle user interruption */
 #define POLL_INTERRUPT() do {                           \
         if (unlikely(--ctx->interrupt_counter <= 0)) {  \
             SAVE();                                     \
-            val = __js_poll_interrupt(ctx);             \
+            poll_ret = __js_poll_interrupt(ctx, FALSE); \
+            RESTORE();                                  \
+            if (poll_ret) {                             \
+                val = JS_EXCEPTION;                     \
+                goto exception;                         \
+            }                                           \
+        }                                               \
+    } while(0)
+
+/* same as POLL_INTERRUPT() but the execution may be suspended. 'pc'
+   must point to the next instruction and the stack must be in a
+   consistent state. 'branch_pc' is the pc just after the opcode of
+   the branch so that the errors are reported at the branch and not
+   at the jump target. */
+#define POLL_INTERRUPT_SUSPEND(branch_pc) do {          \
+        if (unlikely(--ctx->interrupt_counter <= 0)) {  \
+            int pc_delta = pc - (branch_pc);            \
+            pc = branch_pc;                             \
+            SAVE();                                     \
+            poll_ret = __js_poll_interrupt(ctx, TRUE);  \
             RESTORE();                                  \
-            if (JS_IsException(val))                    \
+            pc += pc_delta;                             \
+            if (poll_ret) {                             \
+                if (poll_ret > 0) {                     \
+                    SAVE();                             \
+                    goto suspend;                       \
+                }                                       \
+                val = JS_EXCEPTION;                     \
                 goto exception;                         \
+            }                                           \
         }                                               \
     } while(0)
 
@@ -5063,12 +6749,70 @@ void JS_PushArg(JSContext *ctx, JSValue val)
    JS_PushArg(ctx, this_obj);
    res = JS_Call(ctx, n);
 */
+/* call a C function with a typed convention (JS_CFUNC_f_f and
+   following). A missing argument is undefined. */
+static JSValue js_call_c_function_typed(JSContext *ctx, const JSCFunctionDef *fd,
+                                        int argc, JSValue *argv)
+{
+    double d[3], r;
+    int32_t v[2];
+    int i, n;
+
+    switch(fd->def_type) {
+    case JS_CFUNC_f_f:
+    case JS_CFUNC_f_ff:
+    case JS_CFUNC_f_fff:
+        n = fd->def_type - JS_CFUNC_f_f + 1;
+        for(i = 0; i < n; i++) {
+            if (i >= argc) {
+                d[i] = NAN;
+            } else if (!js_get_number(argv[i], &d[i])) {
+                if (JS_ToNumber(ctx, &d[i], argv[i]))
+                    return JS_EXCEPTION;
+            }
+        }
+        if (n == 1)
+            r = fd->func.f_f(d[0]);
+        else if (n == 2)
+            r = fd->func.f_ff(d[0], d[1]);
+        else
+            r = fd->func.f_fff(d[0], d[1], d[2]);
+        return JS_NewFloat64(ctx, r);
+    case JS_CFUNC_i_ii:
+        for(i = 0; i < 2; i++) {
+            if (i >= argc) {
+                v[i] = 0;
+            } else if (JS_IsInt(argv[i])) {
+                v[i] = JS_VALUE_GET_INT(argv[i]);
+            } else {
+                if (JS_ToInt32(ctx, &v[i], argv[i]))
+                    return JS_EXCEPTION;
+            }
+        }
+        return JS_NewInt32(ctx, fd->func.i_ii(v[0], v[1]));
+    case JS_CFUNC_v_ptr_len:
+        {
+            uint8_t *ptr;
+            size_t len;
+            ptr = NULL;
+            if (argc >= 1)
+                ptr = JS_GetArrayBuffer(ctx, &len, argv[0]);
+            if (!ptr)
+                return JS_ThrowTypeError(ctx, "ArrayBuffer or typed array expected");
+            fd->func.v_ptr_len(ptr, len);
+            return JS_UNDEFINED;
+        }
+    default:
+        abort();
+    }
+}
+
 JSValue JS_Call(JSContext *ctx, int call_flags)
 {
     JSValue *fp, *sp, val = JS_UNDEFINED, *initial_fp;
     uint8_t *pc;
     /* temporary variables */
-    int opcode = OP_invalid, i;
+    int opcode = OP_invalid, i, poll_ret;
     JSFunctionBytecode *b;
 #ifdef JS_USE_SHORT_FLOAT
     double dr;
@@ -5080,10 +6824,16 @@ JSValue JS_Call(JSContext *ctx, int call_flags)
 
     sp = ctx->sp;
     fp = ctx->fp;
-    initial_fp = fp;
-    b = NULL;
-    pc = NULL;
-    goto function_call;
+    if (unlikely(call_flags & FRAME_CF_RESUME)) {
+        /* continue the execution saved by the 'suspend' exit */
+        initial_fp = ctx->suspended_fp;
+        RESTORE();
+    } else {
+        initial_fp = fp;
+        b = NULL;
+        pc = NULL;
+        goto function_call;
+    }
 
 #define CASE(op)        case op
 #define DEFAULT         default
@@ -5353,9 +7103,11 @@ JSValue JS_Call(JSContext *ctx, int call_flags)
                     if (p->class_id == JS_CLASS_C_FUNCTION) {
                         const JSCFunctionDef *fd;
                         int pushed_argc;
+                        JSClockFunc *meter_clock;
+                        int64_t meter_t0;
                         short_func_idx = p->u.cfunc.idx;
                     c_function:
-                        fd = &ctx->c_function_table[short_func_idx];
+                        fd = js_get_c_function_def(ctx, short_func_idx);
                         /* add undefined arguments if the caller did not
                            provide enough arguments */
                         call_flags = JS_VALUE_GET_INT(sp[FRAME_OFFSET_CALL_FLAGS]);
@@ -5368,6 +7120,22 @@ JSValue JS_Call(JSContext *ctx, int call_flags)
                         }
 
                         argc = call_flags & FRAME_CF_ARGC_MASK;
+                        meter_clock = ctx->meter_clock;
+                        meter_t0 = 0;
+                        if (fd->def_type >= JS_CFUNC_f_f) {
+                            /* typed C function: the arguments are
+                               converted in place, no padding is needed */
+                            fp = sp;
+                            ctx->sp = sp;
+                            ctx->fp = fp;
+                            if (unlikely(meter_clock != NULL))
+                                meter_t0 = js_meter_native_start(ctx);
+                            val = js_call_c_function_typed(ctx, fd, argc, fp + FRAME_OFFSET_ARG0);
+                            if (unlikely(meter_clock != NULL))
+                                js_meter_native_end(ctx, meter_clock, meter_t0);
+                            sp = fp + FRAME_OFFSET_ARG0 + argc;
+                            goto return_call;
+                        }
                         /* JS_StackCheck may trigger a gc */
                         ctx->sp = sp;
                         ctx->fp = fp;
@@ -5390,6 +7158,8 @@ JSValue JS_Call(JSContext *ctx, int call_flags)
                         fp = sp;
                         ctx->sp = sp;
                         ctx->fp = fp;
+                        if (unlikely(meter_clock != NULL))
+                            meter_t0 = js_meter_native_start(ctx);
                         switch(fd->def_type) {
                         case JS_CFUNC_generic:
                         case JS_CFUNC_constructor:
@@ -5409,20 +7179,11 @@ JSValue JS_Call(JSContext *ctx, int call_flags)
                                                           call_flags & (FRAME_CF_CTOR | FRAME_CF_ARGC_MASK),
                                                           fp + FRAME_OFFSET_ARG0, p->u.cfunc.params);
                             break;
-                        case JS_CFUNC_f_f:
-                            {
-                                double d;
-                                if (JS_ToNumber(ctx, &d, fp[FRAME_OFFSET_ARG0])) {
-                                    val = JS_EXCEPTION;
-                                } else {
-                                    d = fd->func.f_f(d);
-                                }
-                                val = JS_NewFloat64(ctx, d);
-                            }
-                            break;
                         default:
                             assert(0);
                         }
+                        if (unlikely(meter_clock != NULL))
+                            js_meter_native_end(ctx, meter_clock, meter_t0);
                         if (JS_IsExceptionOrTailCall(val) &&
                             JS_VALUE_GET_SPECIAL_VALUE(val) >= JS_EX_CALL) {
                             JSValue *fp1, *sp1;
@@ -5459,6 +7220,22 @@ JSValue JS_Call(JSContext *ctx, int call_flags)
                             p = JS_VALUE_TO_PTR(func_obj);
                         }
                         b = JS_VALUE_TO_PTR(p->u.closure.func_bytecode);
+                        if (unlikely(b->byte_code == JS_NULL)) {
+                            /* first call of a lazily compiled function */
+                            /* the PC of the caller is already saved */
+                            ctx->sp = sp;
+                            ctx->fp = fp;
+                            n = js_compile_lazy_function(ctx, p->u.closure.func_bytecode);
+                            if (pc)
+                                RESTORE();
+                            if (n) {
+                                val = JS_EXCEPTION;
+                                goto exception;
+                            }
+                            func_obj = sp[FRAME_OFFSET_FUNC_OBJ];
+                            p = JS_VALUE_TO_PTR(func_obj);
+                            b = JS_VALUE_TO_PTR(p->u.closure.func_bytecode);
+                        }
                         if (b->vars != JS_NULL) {
                             JSValueArray *vars = JS_VALUE_TO_PTR(b->vars);
                             n_vars = vars->size - b->arg_count;
@@ -5579,6 +7356,7 @@ JSValue JS_Call(JSContext *ctx, int call_flags)
                     val2 = pv->u.next;
                     assert(!pv->is_detached);
                     pv->u.value = *pv->u.pvalue;
+                    js_write_barrier(ctx, &pv->u.value);
                     pv->is_detached = TRUE;
                     /* shrink 'pv' */
                     set_free_block((uint8_t *)pv + sizeof(JSVarRef) - sizeof(JSValue), sizeof(JSValue));
@@ -5663,7 +7441,7 @@ JSValue JS_Call(JSContext *ctx, int call_flags)
                 int idx;
                 idx = get_u16(pc);
                 pc += 2;
-                *--sp = fp[FRAME_OFFSET_VAR0 - idx];
+                *--sp = js_string_builder_release(fp[FRAME_OFFSET_VAR0 - idx]);
             }
             BREAK;
         CASE(OP_put_loc):
@@ -5675,6 +7453,40 @@ JSValue JS_Call(JSContext *ctx, int call_flags)
                 sp++;
             }
             BREAK;
+        CASE(OP_get_loc_append):
+            {
+                /* the string builder flag is kept (see OP_append_loc) */
+                int idx;
+                idx = get_u16(pc);
+                pc += 2;
+                *--sp = fp[FRAME_OFFSET_VAR0 - idx];
+            }
+            BREAK;
+        CASE(OP_append_loc):
+            {
+                JSValue op1, op2;
+                int idx;
+                idx = get_u16(pc);
+                pc += 2;
+                op1 = sp[1];
+                op2 = sp[0];
+                if (likely(JS_VALUE_IS_BOTH_INT(op1, op2))) {
+                    int r;
+                    if (unlikely(__builtin_add_overflow((int)op1, (int)op2, &r)))
+                        goto append_slow;
+                    val = (uint32_t)r;
+                } else {
+                append_slow:
+                    SAVE();
+                    val = js_append_slow(ctx);
+                    RESTORE();
+                    if (JS_IsException(val))
+                        goto exception;
+                }
+                fp[FRAME_OFFSET_VAR0 - idx] = val;
+                sp += 2;
+            }
+            BREAK;
         CASE(OP_get_arg):
             {
                 int idx;
@@ -5693,11 +7505,11 @@ JSValue JS_Call(JSContext *ctx, int call_flags)
             }
             BREAK;
             
-        CASE(OP_get_loc0): *--sp = fp[FRAME_OFFSET_VAR0 - 0]; BREAK;
-        CASE(OP_get_loc1): *--sp = fp[FRAME_OFFSET_VAR0 - 1]; BREAK;
-        CASE(OP_get_loc2): *--sp = fp[FRAME_OFFSET_VAR0 - 2]; BREAK;
-        CASE(OP_get_loc3): *--sp = fp[FRAME_OFFSET_VAR0 - 3]; BREAK;
-        CASE(OP_get_loc8): *--sp = fp[FRAME_OFFSET_VAR0 - *pc++]; BREAK;
+        CASE(OP_get_loc0): *--sp = js_string_builder_release(fp[FRAME_OFFSET_VAR0 - 0]); BREAK;
+        CASE(OP_get_loc1): *--sp = js_string_builder_release(fp[FRAME_OFFSET_VAR0 - 1]); BREAK;
+        CASE(OP_get_loc2): *--sp = js_string_builder_release(fp[FRAME_OFFSET_VAR0 - 2]); BREAK;
+        CASE(OP_get_loc3): *--sp = js_string_builder_release(fp[FRAME_OFFSET_VAR0 - 3]); BREAK;
+        CASE(OP_get_loc8): *--sp = js_string_builder_release(fp[FRAME_OFFSET_VAR0 - *pc++]); BREAK;
             
         CASE(OP_put_loc0): fp[FRAME_OFFSET_VAR0 - 0] = *sp++; BREAK;
         CASE(OP_put_loc1): fp[FRAME_OFFSET_VAR0 - 1] = *sp++; BREAK;
@@ -5737,7 +7549,7 @@ JSValue JS_Call(JSContext *ctx, int call_flags)
                     goto exception;
                 }
                 pc += 2;
-                *--sp = val;
+                *--sp = js_string_builder_release(val);
             }
             BREAK;
         CASE(OP_put_var_ref):
@@ -5763,17 +7575,22 @@ JSValue JS_Call(JSContext *ctx, int call_flags)
                     goto exception;
                 }
                 *pval = *sp++;
+                js_write_barrier(ctx, pval);
                 pc += 2;
             }
             BREAK;
 
         CASE(OP_goto):
-            pc += (int32_t)get_u32(pc);
-            POLL_INTERRUPT();
+            {
+                uint8_t *branch_pc = pc;
+                pc += (int32_t)get_u32(pc);
+                POLL_INTERRUPT_SUSPEND(branch_pc);
+            }
             BREAK;
         CASE(OP_if_false):
         CASE(OP_if_true):
             {
+                uint8_t *branch_pc = pc;
                 int res;
 
                 pc += 4;
@@ -5782,7 +7599,7 @@ JSValue JS_Call(JSContext *ctx, int call_flags)
                 if (res ^ (OP_if_true - opcode)) {
                     pc += (int32_t)get_u32(pc - 4) - 4;
                 }
-                POLL_INTERRUPT();
+                POLL_INTERRUPT_SUSPEND(branch_pc);
             }
             BREAK;
 
@@ -5811,9 +7628,28 @@ JSValue JS_Call(JSContext *ctx, int call_flags)
                     /* fast case */
                     JSObject *p = JS_VALUE_TO_PTR(obj);
                     JSProperty *pr;
+                    JSPropCacheEntry *ce;
+                    JSValue *pv;
+                    int depth;
                     if (unlikely(p->mtag != JS_MTAG_OBJECT))
                         goto get_field_slow;
-                    for(;;) {
+                    ce = js_prop_cache_entry(ctx, pc);
+                    if (ce->pc == pc) {
+                        if (!ce->depth) {
+                            pv = js_prop_cache_get(ce, JS_VALUE_TO_PTR(p->props), prop);
+                        } else if (p->proto != JS_NULL &&
+                                   js_prop_cache_no_own_prop(ctx, ce, p, prop)) {
+                            JSObject *p1 = JS_VALUE_TO_PTR(p->proto);
+                            pv = js_prop_cache_get(ce, JS_VALUE_TO_PTR(p1->props), prop);
+                        } else {
+                            pv = NULL;
+                        }
+                        if (likely(pv)) {
+                            val = *pv;
+                            goto get_field_done;
+                        }
+                    }
+                    for(depth = 0;; depth++) {
                         /* no array check is necessary because 'prop' is
                            guaranted not to be a numeric property */
                         /* XXX: slow due to short ints */
@@ -5824,7 +7660,10 @@ JSValue JS_Call(JSContext *ctx, int call_flags)
                                    object */
                                 goto get_field_slow;
                             } else {
-                                val = pr->value;
+                                val = *js_get_prop_value_ptr(p, pr);
+                                if (depth <= 1)
+                                    js_prop_cache_update(ctx, pc, JS_VALUE_TO_PTR(sp[0]),
+                                                         p, pr, depth);
                                 break;
                             }
                         }
@@ -5845,6 +7684,7 @@ JSValue JS_Call(JSContext *ctx, int call_flags)
                         goto exception;
                     }
                 }
+            get_field_done:
                 pc += 2;
                 sp[0] = val;
             }
@@ -5910,8 +7750,21 @@ JSValue JS_Call(JSContext *ctx, int call_flags)
                     /* fast case */
                     JSObject *p = JS_VALUE_TO_PTR(obj);
                     JSProperty *pr;
+                    JSPropCacheEntry *ce;
+                    JSValue *pval;
                     if (unlikely(p->mtag != JS_MTAG_OBJECT))
                         goto put_field_slow;
+                    ce = js_prop_cache_entry(ctx, pc);
+                    if (ce->pc == pc && !ce->depth) {
+                        JSValueArray *arr = JS_VALUE_TO_PTR(p->props);
+                        JSValue *pv = js_prop_cache_get(ce, arr, prop);
+                        if (likely(pv && !JS_IS_ROM_PTR(ctx, arr))) {
+                            *pv = sp[0];
+                            js_write_barrier(ctx, pv);
+                            sp += 2;
+                            goto put_field_done;
+                        }
+                    }
                     /* no array check is necessary because 'prop' is
                        guaranted not to be a numeric property */
                     /* XXX: slow due to short ints */
@@ -5923,7 +7776,10 @@ JSValue JS_Call(JSContext *ctx, int call_flags)
                     /* XXX: slow */
                     if (unlikely(JS_IS_ROM_PTR(ctx, pr)))
                         goto put_field_slow;
-                    pr->value = sp[0];
+                    js_prop_cache_update(ctx, pc, p, p, pr, 0);
+                    pval = js_get_prop_value_ptr(p, pr);
+                    *pval = sp[0];
+                    js_write_barrier(ctx, pval);
                     sp += 2;
                 } else {
                 put_field_slow:
@@ -5937,6 +7793,7 @@ JSValue JS_Call(JSContext *ctx, int call_flags)
                     }
                     sp++;
                 }
+            put_field_done:
                 pc += 2;
             }
             BREAK;
@@ -6007,9 +7864,12 @@ JSValue JS_Call(JSContext *ctx, int call_flags)
                     idx = JS_VALUE_GET_INT(prop);
                     arr = JS_VALUE_TO_PTR(p->u.array.tab);
                     if (unlikely(idx >= p->u.array.len)) {
+                        /* append: the array is extended in place if
+                           possible */
                         if (idx == p->u.array.len &&
                             p->u.array.tab != JS_NULL &&
-                            idx < arr->size) {
+                            (idx < arr->size ||
+                             js_value_array_grow(ctx, arr, max_int(idx + 1, arr->size + arr->size / 2)))) {
                             arr->arr[idx] = sp[0];
                             p->u.array.len = idx + 1;
                         } else {
@@ -6018,6 +7878,7 @@ JSValue JS_Call(JSContext *ctx, int call_flags)
                     } else {
                         arr->arr[idx] = sp[0];
                     }
+                    js_write_barrier(ctx, &arr->arr[idx]);
                     sp += 3;
                 } else {
                 put_array_el_slow:
@@ -6515,34 +8376,229 @@ JSValue JS_Call(JSContext *ctx, int call_flags)
             OP_CMP(OP_neq, !=, js_eq_slow(ctx, 1));
             OP_CMP(OP_strict_eq, ==, js_strict_eq_slow(ctx, 0));
             OP_CMP(OP_strict_neq, !=, js_strict_eq_slow(ctx, 1));
-        CASE(OP_in):
-            SAVE();
-            val = js_operator_in(ctx);
-            RESTORE();
-            if (unlikely(JS_IsException(val)))
-                goto exception;
-            sp[1] = val;
-            sp++;
-            BREAK;
-        CASE(OP_instanceof):
-            SAVE();
-            val = js_operator_instanceof(ctx);
-            RESTORE();
-            if (unlikely(JS_IsException(val)))
-                goto exception;
-            sp[1] = val;
-            sp++;
-            BREAK;
-        CASE(OP_typeof):
-            SAVE();
-            val = js_operator_typeof(ctx, sp[0]);
-            RESTORE();
-            if (unlikely(JS_IsException(val)))
-                goto exception;
-            sp[0] = val;
-            BREAK;
-        CASE(OP_delete):
-            SAVE();
+        /* same as OP_mul, OP_div, OP_add, OP_sub, OP_lt, OP_lte,
+           OP_gt and OP_gte but the operands marked by the
+           compiler are the result of a previous arithmetic
+           operation with no other reference. Their float64 box is
+           freed so that the GC is not triggered by the
+           intermediate results of numeric expressions. */
+        CASE(OP_arith_tmp):
+            {
+                JSValue op1, op2;
+                double d1, d2, r;
+                int flags, res;
+
+                flags = *pc++;
+                opcode = OP_mul + (flags & ARITH_TMP_OP_MASK);
+                op1 = sp[1];
+                op2 = sp[0];
+                /* integer results have no box to free */
+                if (JS_VALUE_IS_BOTH_INT(op1, op2) && opcode >= OP_add) {
+                    int r;
+                    if (opcode == OP_add) {
+                        if (unlikely(__builtin_add_overflow((int)op1, (int)op2, &r)))
+                            goto arith_tmp_float;
+                        sp[1] = (uint32_t)r;
+                    } else if (opcode == OP_sub) {
+                        if (unlikely(__builtin_sub_overflow((int)op1, (int)op2, &r)))
+                            goto arith_tmp_float;
+                        sp[1] = (uint32_t)r;
+                    } else {
+                        /* the comparison of the tagged values gives
+                           the same result */
+                        switch(opcode) {
+                        case OP_lt:
+                            res = ((int)op1 < (int)op2);
+                            break;
+                        case OP_lte:
+                            res = ((int)op1 <= (int)op2);
+                            break;
+                        case OP_gt:
+                            res = ((int)op1 > (int)op2);
+                            break;
+                        default:
+                            res = ((int)op1 >= (int)op2);
+                            break;
+                        }
+                        sp[1] = JS_NewBool(res);
+                    }
+                    sp++;
+                    BREAK;
+                }
+            arith_tmp_float:
+                if (unlikely(!js_get_number(op1, &d1) ||
+                             !js_get_number(op2, &d2))) {
+                    SAVE();
+                    if (opcode == OP_add)
+                        val = js_add_slow(ctx);
+                    else if (opcode >= OP_lt)
+                        val = js_relational_slow(ctx, opcode);
+                    else
+                        val = js_binary_arith_slow(ctx, opcode);
+                    RESTORE();
+                    if (JS_IsException(val))
+                        goto exception;
+                    sp[1] = val;
+                    sp++;
+                    BREAK;
+                }
+                /* the box of op2 was allocated after the one of op1 */
+                sp[0] = JS_NULL;
+                sp[1] = JS_NULL;
+                if (flags & ARITH_TMP_OP2)
+                    js_free_float64_tmp(ctx, op2);
+                if (flags & ARITH_TMP_OP1)
+                    js_free_float64_tmp(ctx, op1);
+                sp++;
+                if (opcode >= OP_lt) {
+                    switch(opcode) {
+                    case OP_lt:
+                        res = (d1 < d2);
+                        break;
+                    case OP_lte:
+                        res = (d1 <= d2);
+                        break;
+                    case OP_gt:
+                        res = (d1 > d2);
+                        break;
+                    default:
+                        res = (d1 >= d2);
+                        break;
+                    }
+                    sp[0] = JS_NewBool(res);
+                } else {
+                    switch(opcode) {
+                    case OP_mul:
+                        r = d1 * d2;
+                        break;
+                    case OP_div:
+                        r = d1 / d2;
+                        break;
+                    case OP_add:
+                        r = d1 + d2;
+                        break;
+                    default:
+                        r = d1 - d2;
+                        break;
+                    }
+                    SAVE();
+                    val = JS_NewFloat64(ctx, r);
+                    RESTORE();
+                    if (JS_IsException(val))
+                        goto exception;
+                    sp[0] = val;
+                }
+            }
+            BREAK;
+#ifdef JS_FUSED_OPCODES
+#define OP_CMP_IF_FALSE(opcode, binary_op, slow_call)              \
+            CASE(opcode):                                       \
+                {                                               \
+                JSValue op1, op2;                               \
+                uint8_t *branch_pc;                             \
+                int res;                                        \
+                op1 = sp[1];                                    \
+                op2 = sp[0];                                    \
+                if (likely(JS_VALUE_IS_BOTH_INT(op1, op2))) {           \
+                    res = (JS_VALUE_GET_INT(op1) binary_op JS_VALUE_GET_INT(op2)); \
+                } else {                                                \
+                    SAVE();                                             \
+                    val = slow_call;                                    \
+                    RESTORE();                                          \
+                    if (JS_IsException(val))                            \
+                        goto exception;                                 \
+                    res = (val == JS_TRUE);                             \
+                }                                                       \
+                sp += 2;                                                \
+                /* pc points to the following if_false */               \
+                branch_pc = pc;                                         \
+                if (res)                                                \
+                    pc += 5;                                            \
+                else                                                    \
+                    pc += 1 + (int32_t)get_u32(pc + 1);                 \
+                POLL_INTERRUPT_SUSPEND(branch_pc);                      \
+                }                                                       \
+                BREAK;
+
+            OP_CMP_IF_FALSE(OP_lt_if_false, <, js_relational_slow(ctx, OP_lt));
+            OP_CMP_IF_FALSE(OP_lte_if_false, <=, js_relational_slow(ctx, OP_lte));
+            OP_CMP_IF_FALSE(OP_gt_if_false, >, js_relational_slow(ctx, OP_gt));
+            OP_CMP_IF_FALSE(OP_gte_if_false, >=, js_relational_slow(ctx, OP_gte));
+            OP_CMP_IF_FALSE(OP_eq_if_false, ==, js_eq_slow(ctx, 0));
+            OP_CMP_IF_FALSE(OP_neq_if_false, !=, js_eq_slow(ctx, 1));
+            OP_CMP_IF_FALSE(OP_strict_eq_if_false, ==, js_strict_eq_slow(ctx, 0));
+            OP_CMP_IF_FALSE(OP_strict_neq_if_false, !=, js_strict_eq_slow(ctx, 1));
+
+        CASE(OP_dec_loc):
+        CASE(OP_inc_loc):
+            {
+                JSValue op1;
+                int idx, v1;
+                idx = get_u16(pc);
+                pc += 2;
+                op1 = fp[FRAME_OFFSET_VAR0 - idx];
+                if (likely(JS_IsInt(op1))) {
+                    v1 = JS_VALUE_GET_INT(op1) + 2 * (opcode - OP_dec_loc) - 1;
+                    if (likely(v1 >= JS_SHORTINT_MIN && v1 <= JS_SHORTINT_MAX)) {
+                        fp[FRAME_OFFSET_VAR0 - idx] = JS_NewShortInt(v1);
+                        BREAK;
+                    }
+                }
+                *--sp = js_string_builder_release(op1);
+                SAVE();
+                val = js_unary_arith_slow(ctx, OP_dec + opcode - OP_dec_loc);
+                RESTORE();
+                if (JS_IsException(val))
+                    goto exception;
+                sp++;
+                fp[FRAME_OFFSET_VAR0 - idx] = val;
+            }
+            BREAK;
+        CASE(OP_get_loc_field):
+            {
+                int idx;
+                idx = get_u16(pc);
+                pc += 2;
+                *--sp = js_string_builder_release(fp[FRAME_OFFSET_VAR0 - idx]);
+            }
+            goto get_field_common;
+        CASE(OP_get_arg_field):
+            {
+                int idx;
+                idx = get_u16(pc);
+                pc += 2;
+                *--sp = fp[FRAME_OFFSET_ARG0 + idx];
+            }
+            goto get_field_common;
+#endif
+        CASE(OP_in):
+            SAVE();
+            val = js_operator_in(ctx);
+            RESTORE();
+            if (unlikely(JS_IsException(val)))
+                goto exception;
+            sp[1] = val;
+            sp++;
+            BREAK;
+        CASE(OP_instanceof):
+            SAVE();
+            val = js_operator_instanceof(ctx);
+            RESTORE();
+            if (unlikely(JS_IsException(val)))
+                goto exception;
+            sp[1] = val;
+            sp++;
+            BREAK;
+        CASE(OP_typeof):
+            SAVE();
+            val = js_operator_typeof(ctx, sp[0]);
+            RESTORE();
+            if (unlikely(JS_IsException(val)))
+                goto exception;
+            sp[0] = val;
+            BREAK;
+        CASE(OP_delete):
+            SAVE();
             val = JS_DeleteProperty(ctx, sp[1], sp[0]);
             RESTORE();
             if (unlikely(JS_IsException(val)))
@@ -6584,6 +8640,25 @@ JSValue JS_Call(JSContext *ctx, int call_flags)
     ctx->fp = fp;
     ctx->js_call_rec_count--;
     return val;
+ suspend:
+    /* the frames stay on the stack, SAVE() was done */
+    ctx->is_suspended = TRUE;
+    ctx->suspended_fp = initial_fp;
+    ctx->js_call_rec_count--;
+    return JS_EXCEPTION;
+}
+
+JSValue JS_Resume(JSContext *ctx)
+{
+    if (!ctx->is_suspended)
+        return JS_ThrowTypeError(ctx, "no suspended execution");
+    ctx->is_suspended = FALSE;
+    return JS_Call(ctx, FRAME_CF_RESUME);
+}
+
+JS_BOOL JS_IsSuspended(JSContext *ctx)
+{
+    return ctx->is_suspended;
 }
 
 #undef SAVE
@@ -6654,10 +8729,11 @@ static void js_dump_error(JSContext *ctx, JSObject *p)
     if (p->proto != JS_NULL) 
         p1 = JS_VALUE_TO_PTR(p->proto);
     pr = find_own_property(ctx, p1, js_get_atom(ctx, JS_ATOM_name));
-    if (!pr || !JS_IsString(ctx, pr->value))
+    if (!pr || pr->prop_type != JS_PROP_NORMAL ||
+        !JS_IsString(ctx, *js_get_prop_value_ptr(p1, pr)))
         name = js_get_atom(ctx, JS_ATOM_Error);
     else
-        name = pr->value;
+        name = *js_get_prop_value_ptr(p1, pr);
     js_printf(ctx, "%" JSValue_PRI, name);
     if (p->u.error.message != JS_NULL) {
         js_printf(ctx, ": %" JSValue_PRI, p->u.error.message);
@@ -6682,7 +8758,7 @@ static void js_dump_object(JSContext *ctx, JSObject *p, int flags)
             break;
         case JS_CLASS_C_FUNCTION:
             js_printf(ctx, "function ");
-            JS_PrintValueF(ctx, reloc_c_func_name(ctx, ctx->c_function_table[p->u.cfunc.idx].name), JS_DUMP_NOQUOTE);
+            JS_PrintValueF(ctx, js_get_c_function_name(ctx, p->u.cfunc.idx), JS_DUMP_NOQUOTE);
             js_printf(ctx, "()");
             break;
         case JS_CLASS_ERROR:
@@ -6751,7 +8827,7 @@ static void js_dump_object(JSContext *ctx, JSObject *p, int flags)
                 JSValueArray *arr;
                 BOOL is_first = TRUE;
 
-                arr = JS_VALUE_TO_PTR(p->props);
+                arr = js_get_prop_keys(p);
                 prop_count = JS_VALUE_GET_INT(arr->arr[0]);
                 hash_mask = JS_VALUE_GET_INT(arr->arr[1]);
                 if (p->class_id == JS_CLASS_ARRAY) {
@@ -6782,7 +8858,7 @@ static void js_dump_object(JSContext *ctx, JSObject *p, int flags)
                         if (!(flags & JS_DUMP_RAW) && pr->prop_type == JS_PROP_SPECIAL) {
                             JS_PrintValue(ctx, get_special_prop(ctx, pr->value));
                         } else {
-                            JS_PrintValue(ctx, pr->value);
+                            JS_PrintValue(ctx, *js_get_prop_value_ptr(p, pr));
                         }
                         is_first = FALSE;
                         j++;
@@ -7055,8 +9131,16 @@ void JS_DumpMemory(JSContext *ctx, BOOL is_long)
     }
     js_printf(ctx, "heap size=%u/%u stack_size=%u\n",
            (unsigned int)(ctx->heap_free - ctx->heap_base),
-           (unsigned int)(ctx->stack_top - ctx->heap_base),
+           (unsigned int)(ctx->stack_top - ctx->heap_base - ctx->mem_reserve),
            (unsigned int)(ctx->stack_top - (uint8_t *)ctx->sp));
+    js_update_max_heap_size(ctx);
+    js_printf(ctx, "gc count=%u minor=%u reclaimed=%llu max_pause=%lld total_pause=%lld max_heap_size=%llu\n",
+              (unsigned int)ctx->gc_stats.gc_count,
+              (unsigned int)ctx->gc_stats.minor_gc_count,
+              (unsigned long long)ctx->gc_stats.reclaimed_bytes,
+              (long long)ctx->gc_stats.max_pause,
+              (long long)ctx->gc_stats.total_pause,
+              (unsigned long long)ctx->gc_stats.max_heap_size);
 }
 
 static __maybe_unused void JS_DumpUniqueStrings(JSContext *ctx)
@@ -7064,9 +9148,13 @@ static __maybe_unused void JS_DumpUniqueStrings(JSContext *ctx)
     int i;
     JSValueArray *arr;
     
-    arr = JS_VALUE_TO_PTR( ctx->unique_strings);
     js_printf(ctx, "%5s %s\n", "N", "UNIQUE_STRING");
-    for(i = 0; i < ctx->unique_strings_len; i++) {
+    if (JS_IsNull(ctx->unique_strings))
+        return;
+    arr = JS_VALUE_TO_PTR(ctx->unique_strings);
+    for(i = 0; i < arr->size; i++) {
+        if (!JS_IsPtr(arr->arr[i]))
+            continue;
         js_printf(ctx, "%5d ", i);
         JS_PrintValue(ctx, arr->arr[i]);
         js_printf(ctx, "\n");
@@ -7231,6 +9319,7 @@ typedef struct JSParseState {
     BOOL has_column : 8; /* column debug info is present */
     /* TRUE if the expression result has been dropped (see PF_DROP) */
     BOOL dropped_result : 8;
+    BOOL is_lazy : 8; /* compile the local functions at their first call */
     JSValue source_str; /* source string or JS_NULL */
     JSValue filename_str; /* 'filename' converted to string */
     /* zero terminated source buffer. Automatically updated by the GC
@@ -7256,11 +9345,18 @@ typedef struct JSParseState {
     
     /* argument + defined local variable count */
     uint16_t local_vars_len;
+    /* lazy compilation: number of external variables whose index is
+       already used by the closures */
+    uint16_t lazy_ext_vars_len;
     
     int eval_ret_idx; /* variable index for the eval return value, -1
                          if no return value */
     JSValue top_break; /* JS_NULL or SP_TO_VALUE(BlockEnv *) */
 
+    /* JSON parsing only: JS_NULL or JSValueArray of the last property
+       keys, indexed by the hash of their UTF-8 bytes */
+    JSValue json_keys;
+
     /* regexp parsing only */
     uint8_t capture_count;
     uint8_t re_in_js: 1;
@@ -7486,6 +9582,21 @@ static __maybe_unused void dump_byte_code(JSContext *ctx, JSFunctionBytecode *b)
             idx = get_u32(tab + pos);
             JS_PrintValue(ctx, idx);
             break;
+        case OP_FMT_loc_const16:
+        case OP_FMT_arg_const16:
+            idx = get_u16(tab + pos);
+            js_printf(ctx, " %d: ", idx);
+            if (oi->fmt == OP_FMT_loc_const16)
+                idx += arg_count;
+            if (idx < vars->size) {
+                JS_PrintValue(ctx, vars->arr[idx]);
+            }
+            idx = get_u16(tab + pos + 2);
+            js_printf(ctx, ", %u: ", idx);
+            if (idx < cpool->size) {
+                JS_PrintValue(ctx, cpool->arr[idx]);
+            }
+            break;
         default:
             break;
         }
@@ -8342,6 +10453,7 @@ static void pc2line_put_bits_short(JSParseState *s, int n, uint32_t bits)
         js_parse_error_mem(s);
     b = JS_VALUE_TO_PTR(s->cur_func);
     b->pc2line = val1;
+    js_write_barrier(s->ctx, &b->pc2line);
 
     arr = JS_VALUE_TO_PTR(val1);
     p = arr->buf + pos;
@@ -8644,9 +10756,40 @@ static void emit_label(JSParseState *s, JSValue *plabel)
     s->last_opcode_pos = -1;
 }
 
+#ifdef JS_FUSED_OPCODES
+/* return the fused opcode for 'opcode' followed by if_false or
+   OP_invalid */
+static int get_cmp_if_false_opcode(int opcode)
+{
+    switch(opcode) {
+    case OP_lt:
+    case OP_lte:
+    case OP_gt:
+    case OP_gte:
+        return OP_lt_if_false + opcode - OP_lt;
+    case OP_eq:
+    case OP_neq:
+    case OP_strict_eq:
+    case OP_strict_neq:
+        return OP_eq_if_false + opcode - OP_eq;
+    default:
+        return OP_invalid;
+    }
+}
+#endif
+
 static void emit_goto(JSParseState *s, int opcode, JSValue *plabel)
 {
     int label;
+#ifdef JS_FUSED_OPCODES
+    if (opcode == OP_if_false) {
+        int op1 = get_cmp_if_false_opcode(get_prev_opcode(s));
+        /* the comparison is replaced in place. The if_false opcode
+           is kept because the fused opcode reads its label. */
+        if (op1 != OP_invalid)
+            get_byte_code(s)[s->last_opcode_pos] = op1;
+    }
+#endif
     /* XXX: generate smaller gotos when possible */
     emit_op(s, opcode);
     label = JS_VALUE_GET_INT(*plabel);
@@ -8684,8 +10827,11 @@ static int cpool_add(JSParseState *s, JSValue val)
         js_parse_error_mem(s);
     b = JS_VALUE_TO_PTR(s->cur_func);
     b->cpool = new_cpool;
+    js_write_barrier(s->ctx, &b->cpool);
     arr = JS_VALUE_TO_PTR(b->cpool);
-    arr->arr[s->cpool_len++] = val;
+    arr->arr[s->cpool_len] = val;
+    js_write_barrier(s->ctx, &arr->arr[s->cpool_len]);
+    s->cpool_len++;
     return s->cpool_len - 1;
 }
 
@@ -8794,8 +10940,10 @@ static int add_func_ext_var(JSParseState *s, JSValue func, JSValue name, int dec
         js_parse_error_mem(s);
     b = JS_VALUE_TO_PTR(func);
     b->ext_vars = new_ext_vars;
+    js_write_barrier(s->ctx, &b->ext_vars);
     arr = JS_VALUE_TO_PTR(b->ext_vars);
     arr->arr[2 * b->ext_vars_len] = name;
+    js_write_barrier(s->ctx, &arr->arr[2 * b->ext_vars_len]);
     arr->arr[2 * b->ext_vars_len + 1] = JS_NewShortInt(decl);
     b->ext_vars_len++;
     return b->ext_vars_len - 1;
@@ -8825,11 +10973,88 @@ static int add_var(JSParseState *s, JSValue name)
         js_parse_error_mem(s);
     b = JS_VALUE_TO_PTR(s->cur_func);
     b->vars = new_vars;
+    js_write_barrier(s->ctx, &b->vars);
     arr = JS_VALUE_TO_PTR(b->vars);
-    arr->arr[s->local_vars_len++] = name;
+    arr->arr[s->local_vars_len] = name;
+    js_write_barrier(s->ctx, &arr->arr[s->local_vars_len]);
+    s->local_vars_len++;
     return s->local_vars_len - 1;
 }
 
+/* emit 'get_field prop_idx'. It is fused with the previous opcode
+   if it reads a local variable or an argument. */
+static void emit_get_field(JSParseState *s, int prop_idx,
+                           JSSourcePos source_pos)
+{
+#ifdef JS_FUSED_OPCODES
+    int opcode, var_idx;
+
+    opcode = get_prev_opcode(s);
+    switch(opcode) {
+    case OP_get_loc0:
+    case OP_get_loc1:
+    case OP_get_loc2:
+    case OP_get_loc3:
+        var_idx = opcode - OP_get_loc0;
+        opcode = OP_get_loc_field;
+        break;
+    case OP_get_loc8:
+        var_idx = get_u8(get_byte_code(s) + s->last_opcode_pos + 1);
+        opcode = OP_get_loc_field;
+        break;
+    case OP_get_loc:
+        var_idx = get_u16(get_byte_code(s) + s->last_opcode_pos + 1);
+        opcode = OP_get_loc_field;
+        break;
+    case OP_get_arg0:
+    case OP_get_arg1:
+    case OP_get_arg2:
+    case OP_get_arg3:
+        var_idx = opcode - OP_get_arg0;
+        opcode = OP_get_arg_field;
+        break;
+    case OP_get_arg:
+        var_idx = get_u16(get_byte_code(s) + s->last_opcode_pos + 1);
+        opcode = OP_get_arg_field;
+        break;
+    default:
+        goto no_fuse;
+    }
+    remove_last_op(s);
+    emit_op_pos(s, opcode, source_pos);
+    emit_u16(s, var_idx);
+    emit_u16(s, prop_idx);
+    return;
+ no_fuse:
+#endif
+    emit_op_pos(s, OP_get_field, source_pos);
+    emit_u16(s, prop_idx);
+}
+
+/* split the last opcode if it was fused by emit_get_field() so that
+   it can be modified */
+static void unfuse_get_field(JSParseState *s)
+{
+#ifdef JS_FUSED_OPCODES
+    int opcode, var_idx, prop_idx;
+    JSSourcePos source_pos;
+    uint8_t *byte_code;
+
+    opcode = get_prev_opcode(s);
+    if (opcode == OP_get_loc_field || opcode == OP_get_arg_field) {
+        byte_code = get_byte_code(s);
+        var_idx = get_u16(byte_code + s->last_opcode_pos + 1);
+        prop_idx = get_u16(byte_code + s->last_opcode_pos + 3);
+        source_pos = s->pc2line_source_pos;
+        remove_last_op(s);
+        emit_var(s, opcode == OP_get_loc_field ? OP_get_loc : OP_get_arg,
+                 var_idx, s->pc2line_source_pos);
+        emit_op_pos(s, OP_get_field, source_pos);
+        emit_u16(s, prop_idx);
+    }
+#endif
+}
+
 static void get_lvalue(JSParseState *s, int *popcode,
                        int *pvar_idx, JSSourcePos *psource_pos, BOOL keep)
 {
@@ -8837,6 +11062,7 @@ static void get_lvalue(JSParseState *s, int *popcode,
     JSSourcePos source_pos;
     
     /* we check the last opcode to get the lvalue type */
+    unfuse_get_field(s);
     opcode = get_prev_opcode(s);
     switch(opcode) {
     case OP_get_loc0:
@@ -8972,6 +11198,23 @@ static void put_lvalue(JSParseState *s, int opcode,
     }
 }
 
+/* emit '++x', '--x', 'x++' or 'x--' when the result is not used
+   ('op' is TOK_INC or TOK_DEC). Return FALSE if not possible. */
+static BOOL emit_inc_loc(JSParseState *s, int op, int opcode, int var_idx,
+                         JSSourcePos source_pos)
+{
+#ifdef JS_FUSED_OPCODES
+    if (opcode == OP_get_loc) {
+        /* remove the get_loc emitted by get_lvalue() */
+        remove_last_op(s);
+        emit_op_pos(s, OP_dec_loc + op - TOK_DEC, source_pos);
+        emit_u16(s, var_idx);
+        return TRUE;
+    }
+#endif
+    return FALSE;
+}
+
 enum {
     PARSE_PROP_FIELD,
     PARSE_PROP_GET,
@@ -9303,6 +11546,7 @@ static int js_parse_postfix_expr(JSParseState *s, int state, int parse_flags)
             /* save the current bytecode back to the function */
             b = JS_VALUE_TO_PTR(s->cur_func);
             b->byte_code = s->byte_code;
+            js_write_barrier(s->ctx, &b->byte_code);
             saved_byte_code_len = s->byte_code_len;
             
             /* modify the parser to parse the regexp. This way we
@@ -9505,6 +11749,7 @@ static int js_parse_postfix_expr(JSParseState *s, int state, int parse_flags)
             next_token(s);
 
             if (!is_new) {
+                unfuse_get_field(s);
                 opcode = get_prev_opcode(s);
                 byte_code = get_byte_code(s);
                 switch(opcode) {
@@ -9579,8 +11824,7 @@ static int js_parse_postfix_expr(JSParseState *s, int state, int parse_flags)
                 emit_op_pos(s, OP_get_length, op_source_pos);
             } else {
                 prop_idx = cpool_add(s, s->token.value);
-                emit_op_pos(s, OP_get_field, op_source_pos);
-                emit_u16(s, prop_idx);
+                emit_get_field(s, prop_idx, op_source_pos);
             }
             next_token(s);
         } else if (s->token.val == '[') {
@@ -9601,8 +11845,10 @@ static int js_parse_postfix_expr(JSParseState *s, int state, int parse_flags)
             get_lvalue(s, &opcode, &var_idx, &source_pos, TRUE);
             if (may_drop_result(s, parse_flags)) {
                 s->dropped_result = TRUE;
-                emit_op_pos(s, OP_dec + op - TOK_DEC, op_source_pos);
-                put_lvalue(s, opcode, var_idx, source_pos, PUT_LVALUE_NOKEEP_TOP);
+                if (!emit_inc_loc(s, op, opcode, var_idx, op_source_pos)) {
+                    emit_op_pos(s, OP_dec + op - TOK_DEC, op_source_pos);
+                    put_lvalue(s, opcode, var_idx, source_pos, PUT_LVALUE_NOKEEP_TOP);
+                }
             } else {
                 emit_op_pos(s, OP_post_dec + op - TOK_DEC, op_source_pos);
                 put_lvalue(s, opcode, var_idx, source_pos, PUT_LVALUE_KEEP_SECOND);
@@ -9618,6 +11864,7 @@ static void js_emit_delete(JSParseState *s)
 {
     int opcode;
     
+    unfuse_get_field(s);
     opcode = get_prev_opcode(s);
     switch(opcode) {
     case OP_get_field:
@@ -9707,14 +11954,15 @@ static int js_parse_unary(JSParseState *s, int state, int parse_flags)
             next_token(s);
             PARSE_CALL_SAVE3(s, 2, js_parse_unary, 0, op, parse_flags, op_source_pos);
             get_lvalue(s, &opcode, &var_idx, &source_pos, TRUE);
-            emit_op_pos(s, OP_dec + op - TOK_DEC, op_source_pos);
-
             if (may_drop_result(s, parse_flags)) {
                 special = PUT_LVALUE_NOKEEP_TOP;
                 s->dropped_result = TRUE;
+                if (emit_inc_loc(s, op, opcode, var_idx, op_source_pos))
+                    break;
             } else {
                 special = PUT_LVALUE_KEEP_TOP;
             }
+            emit_op_pos(s, OP_dec + op - TOK_DEC, op_source_pos);
             put_lvalue(s, opcode, var_idx, source_pos, special);
         }
         break;
@@ -9752,9 +12000,54 @@ static int js_parse_unary(JSParseState *s, int state, int parse_flags)
     return PARSE_STATE_RET;
 }
 
+/* return TRUE if the last opcode pushes a new number or string which
+   has no other reference */
+static BOOL is_arith_tmp_result(JSParseState *s)
+{
+    switch(get_prev_opcode(s)) {
+    case OP_neg:
+    case OP_mul:
+    case OP_div:
+    case OP_mod:
+    case OP_add:
+    case OP_sub:
+    case OP_pow:
+    case OP_arith_tmp:
+        return TRUE;
+    default:
+        return FALSE;
+    }
+}
+
+/* emit a binary operation. 'op1_tmp' is TRUE if the first operand
+   is a temporary result (see OP_arith_tmp). */
+static void emit_binary_op(JSParseState *s, int opcode, BOOL op1_tmp,
+                           JSSourcePos source_pos)
+{
+    int flags;
+    BOOL op2_tmp;
+    
+    op2_tmp = is_arith_tmp_result(s);
+    if ((op1_tmp || op2_tmp) &&
+        (opcode == OP_mul || opcode == OP_div ||
+         opcode == OP_add || opcode == OP_sub ||
+         (opcode >= OP_lt && opcode <= OP_gte))) {
+        flags = opcode - OP_mul;
+        if (op1_tmp)
+            flags |= ARITH_TMP_OP1;
+        if (op2_tmp)
+            flags |= ARITH_TMP_OP2;
+        emit_op_pos(s, OP_arith_tmp, source_pos);
+        emit_u8(s, flags);
+    } else {
+        emit_op_pos(s, opcode, source_pos);
+    }
+}
+
 static int js_parse_expr_binary(JSParseState *s, int state, int parse_flags)
 {
     int op, opcode, level;
+    BOOL op1_tmp;
     JSSourcePos op_source_pos;
     
     PARSE_START3();
@@ -9888,9 +12181,10 @@ static int js_parse_expr_binary(JSParseState *s, int state, int parse_flags)
         default:
             abort();
         }
+        op1_tmp = is_arith_tmp_result(s);
         next_token(s);
-        PARSE_CALL_SAVE3(s, 2, js_parse_expr_binary, parse_flags - (1 << PF_LEVEL_SHIFT), parse_flags, opcode, op_source_pos);
-        emit_op_pos(s, opcode, op_source_pos);
+        PARSE_CALL_SAVE4(s, 2, js_parse_expr_binary, parse_flags - (1 << PF_LEVEL_SHIFT), parse_flags, opcode, op_source_pos, op1_tmp);
+        emit_binary_op(s, opcode, op1_tmp, op_source_pos);
     }
     return PARSE_STATE_RET;
 }
@@ -9994,18 +12288,38 @@ static int js_parse_assign_expr(JSParseState *s, int state, int parse_flags)
         op_source_pos = s->token.source_pos;
         next_token(s);
         get_lvalue(s, &opcode, &var_idx, &source_pos, (op != '='));
+        if (op == TOK_PLUS_ASSIGN && opcode == OP_get_loc) {
+            /* string builder (see OP_append_loc) */
+            remove_last_op(s);
+            emit_op_pos(s, OP_get_loc_append, source_pos);
+            emit_u16(s, var_idx);
+        }
 
         PARSE_CALL_SAVE6(s, 0, js_parse_assign_expr, parse_flags & ~PF_DROP,
                          op, opcode, var_idx, parse_flags,
                          op_source_pos, source_pos);
 
+        if (op == TOK_PLUS_ASSIGN && opcode == OP_get_loc) {
+            emit_op_pos(s, OP_append_loc, op_source_pos);
+            emit_u16(s, var_idx);
+            if (may_drop_result(s, parse_flags)) {
+                s->dropped_result = TRUE;
+            } else {
+                emit_var(s, OP_get_loc, var_idx, source_pos);
+                /* not an lvalue */
+                s->last_opcode_pos = -1;
+            }
+            return PARSE_STATE_RET;
+        }
+
         if (op != '=') {
             static const uint8_t assign_opcodes[] = {
                 OP_mul, OP_div, OP_mod, OP_add, OP_sub,
                 OP_shl, OP_sar, OP_shr, OP_and, OP_xor, OP_or,
                 OP_pow,
             };
-            emit_op_pos(s, assign_opcodes[op - TOK_MUL_ASSIGN], op_source_pos);
+            emit_binary_op(s, assign_opcodes[op - TOK_MUL_ASSIGN], FALSE,
+                           op_source_pos);
         }
 
         if (may_drop_result(s, parse_flags)) {
@@ -11090,6 +13404,7 @@ static void js_parse_function(JSParseState *s)
     /* save the bytecode to the function */
     b = JS_VALUE_TO_PTR(s->cur_func);
     b->byte_code = s->byte_code;
+    js_write_barrier(s->ctx, &b->byte_code);
 }
 
 static void js_parse_program(JSParseState *s)
@@ -11119,6 +13434,7 @@ static void js_parse_program(JSParseState *s)
     /* save the bytecode to the function */
     b = JS_VALUE_TO_PTR(s->cur_func);
     b->byte_code = s->byte_code;
+    js_write_barrier(s->ctx, &b->byte_code);
 }
 
 #define CVT_VAR_SIZE_MAX 16
@@ -11174,6 +13490,7 @@ static void convert_ext_vars_to_local_vars(JSParseState *s)
     JSByteArray *bc_arr;
     JSValue var_name, decl;
     int i0, i, j, var_idx, l;
+    BOOL has_local;
     ConvertVarEntry cvt_tab[CVT_VAR_SIZE_MAX];
     
     b = JS_VALUE_TO_PTR(s->cur_func);
@@ -11186,6 +13503,7 @@ static void convert_ext_vars_to_local_vars(JSParseState *s)
     j = 0;
     for(i0 = 0; i0 < b->ext_vars_len; i0 += CVT_VAR_SIZE_MAX) {
         l = min_int(b->ext_vars_len - i0, CVT_VAR_SIZE_MAX);
+        has_local = FALSE;
         for(i = 0; i < l; i++) {
             var_name = ext_vars->arr[2 * (i0 + i)];
             decl = ext_vars->arr[2 * (i0 + i) + 1];
@@ -11194,6 +13512,14 @@ static void convert_ext_vars_to_local_vars(JSParseState *s)
             if (var_idx >= b->arg_count) {
                 cvt_tab[i].new_var_idx = var_idx - b->arg_count;
                 cvt_tab[i].is_local = TRUE;
+                has_local = TRUE;
+                /* the closures of a lazily compiled function
+                   already use these indexes: keep them */
+                if ((i0 + i) < s->lazy_ext_vars_len) {
+                    ext_vars->arr[2 * j] = var_name;
+                    ext_vars->arr[2 * j + 1] = decl;
+                    j++;
+                }
             } else {
                 cvt_tab[i].new_var_idx = j;
                 cvt_tab[i].is_local = FALSE;
@@ -11202,11 +13528,12 @@ static void convert_ext_vars_to_local_vars(JSParseState *s)
                 j++;
             }
         }
-        if (j != (i0 + l)) {
+        if (has_local || j != (i0 + l)) {
             convert_ext_vars_to_local_vars_bytecode(s, bc_arr->buf, s->byte_code_len,
                                                     i0, cvt_tab, l);
         }
     }
+    js_write_barrier_range(s->ctx, ext_vars->arr, 2 * j);
     b->ext_vars_len = j;
 }
 
@@ -11399,19 +13726,311 @@ static void reset_parse_state(JSParseState *s, uint32_t input_pos,
     s->eval_ret_idx = -1;
 }
 
-static void js_parse_local_functions(JSParseState *s, JSValue *pfunc)
+/* Lazy compilation: a local function is not compiled with its parent
+   function. Its source is only scanned to find the variables it may
+   reference in the enclosing functions so that its closures can be
+   created. It is compiled at its first call (js_compile_lazy_function).
+
+   The scan tracks the declarations (parameters, 'var', function
+   statements and catch variables) of each nested function. It may
+   return more variables than the compiler (e.g. labels or method
+   names) but never less. The constructs it does not handle (methods,
+   getters and setters) make the function compiled immediately. */
+
+#define LAZY_SCOPE_MAX 16
+
+typedef enum {
+    LAZY_PAREN_PLAIN,
+    LAZY_PAREN_CONTROL, /* if/while/for/switch/with */
+    LAZY_PAREN_CATCH,
+    LAZY_PAREN_PARAMS, /* function parameters */
+    LAZY_PAREN_BODY, /* function body */
+} JSLazyParenEnum;
+
+typedef struct {
+    int body_level; /* level of the function body, -1 if not known yet */
+    int start; /* index of the first name of the scope */
+} JSLazyScope;
+
+/* add a name to the scope starting at 'start'. The names are stored
+   in '*pnames' as (name, is_decl) pairs. */
+static void lazy_add_name(JSParseState *s, JSValue *pnames, int *pnames_len,
+                          int start, JSValue name, BOOL is_decl)
 {
-    JSContext *ctx = s->ctx;
-    JSValue *pparent_func;
-    JSValueArray *cpool;
-    int err, cpool_pos;
-    JSValue func;
-    JSFunctionBytecode *b, *b1;
-    JSGCRef func_ref;
-    JSValue *stack_top;
+    JSValueArray *arr;
+    JSValue new_names;
+    JSGCRef name_ref;
+    int i, n;
     
-    err = JS_StackCheck(ctx, 3);
-    if (err)
+    /* 'arguments' is always local */
+    if (name == js_get_atom(s->ctx, JS_ATOM_arguments))
+        return;
+    n = *pnames_len;
+    if (*pnames != JS_NULL) {
+        arr = JS_VALUE_TO_PTR(*pnames);
+        for(i = start; i < n; i++) {
+            if (arr->arr[2 * i] == name &&
+                arr->arr[2 * i + 1] == JS_NewShortInt(is_decl))
+                return;
+        }
+    }
+    JS_PUSH_VALUE(s->ctx, name);
+    new_names = js_resize_value_array(s->ctx, *pnames, max_int(n + 1, 8) * 2);
+    JS_POP_VALUE(s->ctx, name);
+    if (JS_IsException(new_names))
+        js_parse_error_mem(s);
+    *pnames = new_names;
+    arr = JS_VALUE_TO_PTR(new_names);
+    arr->arr[2 * n] = name;
+    js_write_barrier(s->ctx, &arr->arr[2 * n]);
+    arr->arr[2 * n + 1] = JS_NewShortInt(is_decl);
+    *pnames_len = n + 1;
+}
+
+/* remove the declarations of the scope starting at 'start' and the
+   references to them. The remaining references belong to the parent
+   scope. Return the new name count. No allocation. */
+static int lazy_close_scope(JSContext *ctx, JSValue names, int start, int len)
+{
+    JSValueArray *arr;
+    int i, j;
+
+    if (names == JS_NULL)
+        return len;
+    arr = JS_VALUE_TO_PTR(names);
+    for(i = start; i < len; i++) {
+        if (arr->arr[2 * i + 1] == JS_NewShortInt(FALSE)) {
+            for(j = start; j < len; j++) {
+                if (arr->arr[2 * j + 1] == JS_NewShortInt(TRUE) &&
+                    arr->arr[2 * j] == arr->arr[2 * i]) {
+                    arr->arr[2 * i] = JS_NULL;
+                    break;
+                }
+            }
+        }
+    }
+    j = start;
+    for(i = start; i < len; i++) {
+        if (arr->arr[2 * i + 1] == JS_NewShortInt(FALSE) &&
+            arr->arr[2 * i] != JS_NULL) {
+            arr->arr[2 * j] = arr->arr[2 * i];
+            arr->arr[2 * j + 1] = JS_NewShortInt(FALSE);
+            j++;
+        }
+    }
+    js_write_barrier_range(ctx, &arr->arr[2 * start], 2 * (j - start));
+    return j;
+}
+
+/* Scan the local function '*pfunc' and add the variables it
+   references in the enclosing functions to its external
+   variables. Return FALSE if the function must be compiled now. */
+static BOOL js_scan_lazy_function(JSParseState *s, JSValue *pfunc)
+{
+    JSContext *ctx = s->ctx;
+    JSLazyScope scopes[LAZY_SCOPE_MAX];
+    uint8_t paren_kind[128];
+    int level, depth, names_len, tok, prev, pending_prev, last_paren_kind;
+    int var_level, arg_count, kind, i;
+    BOOL var_expect_name, func_is_stmt, in_func_head, ret;
+    JSValue names, pending, func_name;
+    JSGCRef names_ref, pending_ref, func_name_ref;
+    JSFunctionBytecode *b;
+    JSValueArray *arr;
+    
+    b = JS_VALUE_TO_PTR(*pfunc);
+    reset_parse_state(s, b->source_pos, *pfunc);
+
+    names = JS_NULL;
+    pending = JS_NULL;
+    /* the name of a function expression is local to it */
+    func_name = b->has_local_func_name ? b->func_name : JS_NULL;
+    JS_PUSH_VALUE(ctx, names);
+    JS_PUSH_VALUE(ctx, pending);
+    JS_PUSH_VALUE(ctx, func_name);
+    
+    ret = FALSE;
+    level = 0;
+    depth = 0;
+    names_len = 0;
+    arg_count = 0;
+    var_level = -1;
+    var_expect_name = FALSE;
+    pending_prev = 0;
+    last_paren_kind = LAZY_PAREN_PLAIN;
+    /* the first token is the '(' of the parameters */
+    in_func_head = TRUE;
+    func_is_stmt = FALSE;
+    prev = TOK_FUNCTION;
+    next_token(s);
+    for(;;) {
+        tok = s->token.val;
+        /* an identifier followed by ':' is a property name or a label
+           if it comes after '{', ',', ';' or '}' */
+        if (pending_ref.val != JS_NULL) {
+            if (tok != ':' ||
+                (pending_prev != '{' && pending_prev != ',' &&
+                 pending_prev != ';' && pending_prev != '}')) {
+                lazy_add_name(s, &names_ref.val, &names_len,
+                              scopes[depth - 1].start, pending_ref.val, FALSE);
+            }
+            pending_ref.val = JS_NULL;
+        }
+        /* a line feed may end the 'var' statement (automatic semicolon
+           insertion) */
+        if (level == var_level && s->got_lf && !var_expect_name)
+            var_level = -1;
+        if (prev == ')' && last_paren_kind == LAZY_PAREN_PARAMS) {
+            if (tok != '{')
+                goto done;
+        } else if (prev == ')' && last_paren_kind == LAZY_PAREN_PLAIN) {
+            /* method, getter or setter */
+            if (tok == '{')
+                goto done;
+        }
+        
+        switch(tok) {
+        case '(':
+            if (in_func_head) {
+                if (depth >= LAZY_SCOPE_MAX)
+                    goto done;
+                scopes[depth].start = names_len;
+                scopes[depth].body_level = -1;
+                depth++;
+                if (func_name_ref.val != JS_NULL) {
+                    lazy_add_name(s, &names_ref.val, &names_len,
+                                  scopes[depth - 1].start, func_name_ref.val, TRUE);
+                    func_name_ref.val = JS_NULL;
+                }
+                in_func_head = FALSE;
+                kind = LAZY_PAREN_PARAMS;
+            } else if (prev == TOK_CATCH) {
+                kind = LAZY_PAREN_CATCH;
+            } else if (prev == TOK_IF || prev == TOK_WHILE || prev == TOK_FOR ||
+                       prev == TOK_SWITCH || prev == TOK_WITH) {
+                kind = LAZY_PAREN_CONTROL;
+            } else {
+                kind = LAZY_PAREN_PLAIN;
+            }
+            goto add_level;
+        case '[':
+        case '{':
+            if (prev == ')' && last_paren_kind == LAZY_PAREN_PARAMS) {
+                kind = LAZY_PAREN_BODY;
+                scopes[depth - 1].body_level = level + 1;
+            } else {
+                kind = LAZY_PAREN_PLAIN;
+            }
+        add_level:
+            if (level >= sizeof(paren_kind))
+                goto done;
+            paren_kind[level++] = kind;
+            break;
+        case ')':
+        case ']':
+        case '}':
+            if (level == 0)
+                goto done;
+            kind = paren_kind[--level];
+            if (var_level > level)
+                var_level = -1;
+            if (tok == ')') {
+                last_paren_kind = kind;
+            } else if (kind == LAZY_PAREN_BODY) {
+                /* end of a function */
+                depth--;
+                names_len = lazy_close_scope(ctx, names_ref.val, scopes[depth].start,
+                                             names_len);
+                if (depth == 0)
+                    goto scan_done;
+            }
+            break;
+        case TOK_FUNCTION:
+            /* function statements are only accepted at the top level
+               of a function body */
+            in_func_head = TRUE;
+            func_is_stmt = (level == scopes[depth - 1].body_level &&
+                            (prev == '{' || prev == ';' || prev == '}'));
+            break;
+        case TOK_VAR:
+            var_level = level;
+            break;
+        case ',':
+            break;
+        case ';':
+        case TOK_IN:
+            if (level == var_level)
+                var_level = -1;
+            break;
+        case TOK_IDENT:
+            if (in_func_head) {
+                if (func_is_stmt) {
+                    lazy_add_name(s, &names_ref.val, &names_len,
+                                  scopes[depth - 1].start, s->token.value, TRUE);
+                } else {
+                    func_name_ref.val = s->token.value;
+                }
+            } else if (level > 0 && paren_kind[level - 1] == LAZY_PAREN_PARAMS) {
+                lazy_add_name(s, &names_ref.val, &names_len,
+                              scopes[depth - 1].start, s->token.value, TRUE);
+                if (depth == 1)
+                    arg_count++;
+            } else if ((level > 0 && paren_kind[level - 1] == LAZY_PAREN_CATCH &&
+                        prev == '(') ||
+                       (level == var_level && var_expect_name)) {
+                lazy_add_name(s, &names_ref.val, &names_len,
+                              scopes[depth - 1].start, s->token.value, TRUE);
+            } else if (prev != '.' && prev != TOK_BREAK && prev != TOK_CONTINUE) {
+                pending_ref.val = s->token.value;
+                pending_prev = prev;
+            }
+            break;
+        case TOK_EOF:
+            goto done;
+        default:
+            break;
+        }
+        var_expect_name = (level == var_level && (tok == TOK_VAR || tok == ','));
+        prev = tok;
+        next_token(s);
+    }
+ scan_done:
+    /* the remaining names are the external variables */
+    for(i = 0; i < names_len; i++) {
+        JSValue name;
+        arr = JS_VALUE_TO_PTR(names_ref.val);
+        name = arr->arr[2 * i];
+        if (find_func_ext_var(s, *pfunc, name) < 0) {
+            /* the kind is set by resolve_var_refs() */
+            add_func_ext_var(s, *pfunc, name, (JS_VARREF_KIND_GLOBAL << 16));
+        }
+    }
+    b = JS_VALUE_TO_PTR(*pfunc);
+    b->arg_count = arg_count;
+    /* the source is kept in 'cpool' until the function is compiled */
+    b->cpool = s->source_str;
+    js_write_barrier(ctx, &b->cpool);
+    ret = TRUE;
+ done:
+    JS_POP_VALUE(ctx, func_name);
+    JS_POP_VALUE(ctx, pending);
+    JS_POP_VALUE(ctx, names);
+    return ret;
+}
+
+static void js_parse_local_functions(JSParseState *s, JSValue *pfunc)
+{
+    JSContext *ctx = s->ctx;
+    JSValue *pparent_func;
+    JSValueArray *cpool;
+    int err, cpool_pos;
+    JSValue func;
+    JSFunctionBytecode *b, *b1;
+    JSGCRef func_ref;
+    JSValue *stack_top;
+    
+    err = JS_StackCheck(ctx, 3);
+    if (err)
         js_parse_error_stack_overflow(s);
     stack_top = ctx->sp;
     
@@ -11428,10 +14047,12 @@ static void js_parse_local_functions(JSParseState *s, JSValue *pfunc)
         JS_DumpValue(ctx, "parent", *pparent_func);
         JS_DumpValue(ctx, "cpool_pos", ctx->sp[0]);
 #endif
-        if (cpool_pos == 0) {
-            b = JS_VALUE_TO_PTR(*pfunc);
-            
+        b = JS_VALUE_TO_PTR(*pfunc);
+        if (cpool_pos == 0 && b->byte_code != JS_NULL) {
             convert_ext_vars_to_local_vars(s);
+            /* only the function being lazily compiled has fixed
+               external variables */
+            s->lazy_ext_vars_len = 0;
             
             js_shrink_byte_array(ctx, &b->byte_code, s->byte_code_len);
             js_shrink_value_array(ctx, &b->cpool, s->cpool_len);
@@ -11442,7 +14063,7 @@ static void js_parse_local_functions(JSParseState *s, JSValue *pfunc)
         }
 
         b = JS_VALUE_TO_PTR(*pfunc);
-        if (b->cpool != JS_NULL) {
+        if (b->byte_code != JS_NULL && b->cpool != JS_NULL) {
             int cpool_size;
             cpool = JS_VALUE_TO_PTR(b->cpool);
             cpool_size = cpool->size;
@@ -11456,14 +14077,16 @@ static void js_parse_local_functions(JSParseState *s, JSValue *pfunc)
                 if (b1->mtag != JS_MTAG_FUNCTION_BYTECODE)
                     continue;
                 
-                reset_parse_state(s, b1->source_pos, func);
-                
                 s->is_eval = FALSE;
                 s->is_repl = FALSE;
                 s->has_retval = FALSE;
                 
                 JS_PUSH_VALUE(ctx, func);
-                js_parse_function(s);
+                if (!s->is_lazy || !js_scan_lazy_function(s, &func_ref.val)) {
+                    b1 = JS_VALUE_TO_PTR(func_ref.val);
+                    reset_parse_state(s, b1->source_pos, func_ref.val);
+                    js_parse_function(s);
+                }
                 
                 /* parse a local function */
                 err = JS_StackCheck(ctx, 3);
@@ -11487,7 +14110,8 @@ static void js_parse_local_functions(JSParseState *s, JSValue *pfunc)
         b = JS_VALUE_TO_PTR(*pfunc);
         js_shrink_value_array(ctx, &b->ext_vars, 2 * b->ext_vars_len);
 #ifdef DUMP_FUNC_BYTECODE
-        dump_byte_code(ctx, b);
+        if (b->byte_code != JS_NULL)
+            dump_byte_code(ctx, b);
 #endif
         /* remove the stack entry */
         ctx->sp += 3;
@@ -11496,7 +14120,104 @@ static void js_parse_local_functions(JSParseState *s, JSValue *pfunc)
     }
 }
 
-/* return the parsed value in s->token.value */
+#define JSON_KEY_CACHE_SIZE 64 /* must be a power of two */
+
+/* return a string containing the source bytes from 'start' to 'end' */
+static JSValue json_new_string(JSParseState *s, uint32_t start, uint32_t end)
+{
+    if (JS_IsPtr(s->source_str))
+        return js_sub_string_utf8(s->ctx, s->source_str, start * 2, end * 2);
+    else
+        return JS_NewStringLen(s->ctx, (const char *)s->source_buf + start,
+                               end - start);
+}
+
+/* Parse a JSON string starting after the quote at '*ppos'. Strings
+   without escape sequence are directly copied from the source. If
+   'is_key' is TRUE, return a property key. The keys are cached so that
+   the repeated keys of a document are converted only once. */
+static JSValue json_parse_string(JSParseState *s, uint32_t *ppos, BOOL is_key)
+{
+    JSContext *ctx = s->ctx;
+    const uint8_t *buf = s->source_buf;
+    uint32_t start, end, h;
+    JSValueArray *arr;
+    JSValue val;
+    JSString *p;
+    JSStringCharBuf cbuf;
+    int c;
+    
+    start = *ppos;
+    end = start;
+    h = 0;
+    for(;;) {
+        c = buf[end];
+        if (c == '\"' || c == '\\' || c == '\0' || c == '\n' || c == '\r')
+            break;
+        h = h * 31 + c;
+        end++;
+    }
+    if (c != '\"') {
+        /* escape sequence or error */
+        val = js_parse_string(s, ppos, '\"');
+        if (is_key) {
+            val = JS_ToPropertyKey(ctx, val);
+            if (JS_IsException(val))
+                js_parse_error_mem(s);
+        }
+        return val;
+    }
+    *ppos = end + 1;
+    
+    if (!is_key)
+        goto new_string;
+    h &= JSON_KEY_CACHE_SIZE - 1;
+    if (s->json_keys != JS_NULL) {
+        arr = JS_VALUE_TO_PTR(s->json_keys);
+        val = arr->arr[h];
+        if (val != JS_NULL) {
+            p = get_string_ptr(ctx, &cbuf, val);
+            if (p->len == end - start && !memcmp(p->buf, buf + start, end - start))
+                return val;
+        }
+    } else {
+        arr = js_alloc_value_array(ctx, 0, JSON_KEY_CACHE_SIZE);
+        if (!arr)
+            js_parse_error_mem(s);
+        for(c = 0; c < JSON_KEY_CACHE_SIZE; c++)
+            arr->arr[c] = JS_NULL;
+        s->json_keys = JS_VALUE_FROM_PTR(arr);
+    }
+ new_string:
+    val = json_new_string(s, start, end);
+    if (JS_IsException(val))
+        js_parse_error_mem(s);
+    if (is_key) {
+        val = JS_ToPropertyKey(ctx, val);
+        if (JS_IsException(val))
+            js_parse_error_mem(s);
+        /* numeric keys are not cached */
+        if (!JS_IsInt(val)) {
+            arr = JS_VALUE_TO_PTR(s->json_keys);
+            arr->arr[h] = val;
+            js_write_barrier(ctx, &arr->arr[h]);
+        }
+    }
+    return val;
+}
+
+/* remove 'n' values from the parse stack */
+static void js_parse_pop_vals(JSParseState *s, int n)
+{
+    JSContext *ctx = s->ctx;
+    ctx->sp += n;
+    if (unlikely(ctx->sp - JS_STACK_SLACK > ctx->stack_bottom))
+        ctx->stack_bottom = ctx->sp - JS_STACK_SLACK;
+}
+
+/* return the parsed value in s->token.value. The array elements and
+   the object properties are kept on the stack so that the arrays and
+   objects are allocated with their final size. */
 /* XXX: use exact JSON white space definition */
 static int js_parse_json_value(JSParseState *s, int state, int dummy_param)
 {
@@ -11510,18 +14231,44 @@ static int js_parse_json_value(JSParseState *s, int state, int dummy_param)
     p += skip_spaces((const char *)p);
     s->buf_pos = p - s->source_buf;
     if ((*p >= '0' && *p <= '9') || *p == '-') {
-        double d;
-        JSByteArray *tmp_arr;
-        tmp_arr = js_alloc_byte_array(s->ctx, sizeof(JSATODTempMem));
-        if (!tmp_arr)
-            js_parse_error_mem(s);
-        p = s->source_buf + s->buf_pos;
-        d = js_atod((const char *)p, (const char **)&p, 10, 0,
-                    (JSATODTempMem *)tmp_arr->buf);
-        js_free(s->ctx, tmp_arr);
-        if (isnan(d))
-            js_parse_error(s, "invalid number literal");
-        val = JS_NewFloat64(s->ctx, d);
+        const uint8_t *q;
+        int v, n_digits;
+
+        /* fast case for small integers */
+        q = p + (*p == '-');
+        v = 0;
+        n_digits = 0;
+        if (*q == '0') {
+            q++;
+            n_digits = 1;
+        } else {
+            while (*q >= '0' && *q <= '9' && n_digits < 9) {
+                v = v * 10 + *q++ - '0';
+                n_digits++;
+            }
+        }
+        if (n_digits > 0 && !(*q >= '0' && *q <= '9') &&
+            *q != '.' && *q != 'e' && *q != 'E' && !(*p == '-' && v == 0)) {
+            val = JS_NewShortInt(*p == '-' ? -v : v);
+            p = q;
+        } else {
+            double d;
+            JSByteArray *tmp_arr;
+            tmp_arr = js_alloc_byte_array(s->ctx, sizeof(JSATODTempMem));
+            if (!tmp_arr)
+                js_parse_error_mem(s);
+            p = s->source_buf + s->buf_pos;
+            d = js_atod((const char *)p, (const char **)&p, 10, 0,
+                        (JSATODTempMem *)tmp_arr->buf);
+            js_free(s->ctx, tmp_arr);
+            if (isnan(d))
+                js_parse_error(s, "invalid number literal");
+            s->buf_pos = p - s->source_buf;
+            val = JS_NewFloat64(s->ctx, d);
+            if (JS_IsException(val))
+                js_parse_error_mem(s);
+            p = s->source_buf + s->buf_pos; /* may be reallocated */
+        }
     } else if (*p == 't' &&
                p[1] == 'r' && p[2] == 'u' && p[3] == 'e') {
         p += 4;
@@ -11537,30 +14284,24 @@ static int js_parse_json_value(JSParseState *s, int state, int dummy_param)
     } else if (*p == '\"') {
         uint32_t pos;
         pos = p + 1 - s->source_buf;
-        val = js_parse_string(s, &pos, '\"');
+        val = json_parse_string(s, &pos, FALSE);
         p = s->source_buf + pos;
     } else if (*p == '[') {
-        JSValue val2;
-        uint32_t idx;
+        JSValueArray *arr;
+        JSObject *pa;
+        uint32_t idx, n;
         
-        val = JS_NewArray(ctx, 0);
-        if (JS_IsException(val))
-            js_parse_error_mem(s);
-        PARSE_PUSH_VAL(s, val); /* 'val' is not usable after this call */
         p = s->source_buf + s->buf_pos + 1;
         p += skip_spaces((const char *)p);
+        n = 0;
         if (*p != ']') {
-            idx = 0;
             for(;;) {
                 s->buf_pos = p - s->source_buf;
-                PARSE_PUSH_INT(s, idx);
+                PARSE_PUSH_INT(s, n);
                 PARSE_CALL(s, 0, js_parse_json_value, 0);
-                PARSE_POP_INT(s, idx);
-                val2 = s->token.value;
-                val2 = JS_SetPropertyUint32(ctx, *ctx->sp, idx, val2);
-                if (JS_IsException(val2))
-                    js_parse_error_mem(s);
-                idx++;
+                PARSE_POP_INT(s, n);
+                PARSE_PUSH_VAL(s, s->token.value);
+                n++;
                 p = s->source_buf + s->buf_pos;
                 p += skip_spaces((const char *)p);
                 if (*p != ',')
@@ -11571,17 +14312,26 @@ static int js_parse_json_value(JSParseState *s, int state, int dummy_param)
         if (*p != ']')
             js_parse_error(s, "expecting ']'");
         p++;
-        PARSE_POP_VAL(s, val);
-    } else if (*p == '{') {
-        JSValue val2, prop;
-        uint32_t pos;
-        
-        val = JS_NewObject(ctx);
+        s->buf_pos = p - s->source_buf;
+        val = JS_NewArray(ctx, n);
         if (JS_IsException(val))
             js_parse_error_mem(s);
-        PARSE_PUSH_VAL(s, val); /* 'val' is not usable after this call */
+        if (n != 0) {
+            pa = JS_VALUE_TO_PTR(val);
+            arr = JS_VALUE_TO_PTR(pa->u.array.tab);
+            for(idx = 0; idx < n; idx++)
+                arr->arr[idx] = ctx->sp[n - 1 - idx];
+            js_parse_pop_vals(s, n);
+        }
+        p = s->source_buf + s->buf_pos;
+    } else if (*p == '{') {
+        JSValue val2;
+        JSGCRef val_ref;
+        uint32_t pos, idx, n;
+        
         p = s->source_buf + s->buf_pos + 1;
         p += skip_spaces((const char *)p);
+        n = 0;
         if (*p != '}') {
             for(;;) {
                 p += skip_spaces((const char *)p);
@@ -11589,23 +14339,19 @@ static int js_parse_json_value(JSParseState *s, int state, int dummy_param)
                 if (*p != '\"')
                     js_parse_error(s, "expecting '\"'");
                 pos = p + 1 - s->source_buf;
-                prop = js_parse_string(s, &pos, '\"');
-                prop = JS_ToPropertyKey(ctx, prop);
-                if (JS_IsException(prop))
-                    js_parse_error_mem(s);
+                val2 = json_parse_string(s, &pos, TRUE);
                 p = s->source_buf + pos;
                 p += skip_spaces((const char *)p);
                 if (*p != ':')
                     js_parse_error(s, "expecting ':'");
                 p++;
                 s->buf_pos = p - s->source_buf;
-                PARSE_PUSH_VAL(s, prop);
+                PARSE_PUSH_VAL(s, val2);
+                PARSE_PUSH_INT(s, n);
                 PARSE_CALL(s, 1, js_parse_json_value, 0);
-                val2 = s->token.value;
-                PARSE_POP_VAL(s, prop);
-                val2 = JS_DefinePropertyValue(ctx, *ctx->sp, prop, val2);
-                if (JS_IsException(val2))
-                    js_parse_error_mem(s);
+                PARSE_POP_INT(s, n);
+                PARSE_PUSH_VAL(s, s->token.value);
+                n++;
                 p = s->source_buf + s->buf_pos;
                 p += skip_spaces((const char *)p);
                 if (*p != ',')
@@ -11616,7 +14362,21 @@ static int js_parse_json_value(JSParseState *s, int state, int dummy_param)
         if (*p != '}')
             js_parse_error(s, "expecting '}'");
         p++;
-        PARSE_POP_VAL(s, val);
+        s->buf_pos = p - s->source_buf;
+        val = JS_NewObjectPrealloc(ctx, n);
+        if (JS_IsException(val))
+            js_parse_error_mem(s);
+        JS_PUSH_VALUE(ctx, val);
+        for(idx = 0; idx < n; idx++) {
+            val2 = JS_DefinePropertyValue(ctx, val_ref.val,
+                                          ctx->sp[2 * (n - idx) - 1],
+                                          ctx->sp[2 * (n - idx) - 2]);
+            if (JS_IsException(val2))
+                js_parse_error_mem(s);
+        }
+        JS_POP_VALUE(ctx, val);
+        js_parse_pop_vals(s, 2 * n);
+        p = s->source_buf + s->buf_pos;
     } else {
         js_parse_error(s, "unexpected character");
     }
@@ -11657,6 +14417,7 @@ static JSValue JS_Parse2(JSContext *ctx, JSValue source_str,
     ctx->parse_state = s;
     s->source_str = JS_NULL;
     s->filename_str = JS_NULL;
+    s->json_keys = JS_NULL;
     s->has_column = ((eval_flags & JS_EVAL_STRIP_COL) == 0);
 
     if (JS_IsPtr(source_str)) {
@@ -11701,6 +14462,22 @@ static JSValue JS_Parse2(JSContext *ctx, JSValue source_str,
         if (JS_IsException(s->filename_str))
             js_parse_error_mem(s);
         
+        if (eval_flags & JS_EVAL_LAZY) {
+            /* the source must be kept to compile the functions later */
+            if (s->source_str == JS_NULL) {
+                JSValue str;
+                str = JS_NewStringLen(ctx, input, input_len);
+                if (JS_IsException(str))
+                    js_parse_error_mem(s);
+                if (JS_IsPtr(str)) {
+                    JSString *p = JS_VALUE_TO_PTR(str);
+                    s->source_str = str;
+                    s->source_buf = p->buf;
+                }
+            }
+            s->is_lazy = (s->source_str != JS_NULL);
+        }
+        
         b = js_alloc_function_bytecode(ctx);
         if (!b)
             js_parse_error_mem(s);
@@ -11727,6 +14504,92 @@ static JSValue JS_Parse2(JSContext *ctx, JSValue source_str,
     return top_func;
 }
 
+/* compile the function 'func' whose compilation was deferred by
+   JS_EVAL_LAZY. Return 0 if OK, -1 if exception. */
+static int js_compile_lazy_function(JSContext *ctx, JSValue func)
+{
+    JSParseState parse_state, *s, *saved_parse_state;
+    JSFunctionBytecode *b;
+    JSString *p;
+    JSValue *saved_sp;
+    JSGCRef func_ref, *saved_top_gc_ref;
+    int ext_vars_len, err;
+    
+    /* the interpreter may have pushed the frame header below the
+       stack bottom */
+    JS_PUSH_VALUE(ctx, func);
+    err = JS_StackCheck(ctx, 0);
+    JS_POP_VALUE(ctx, func);
+    if (err)
+        return -1;
+    
+    s = &parse_state;
+    memset(s, 0, sizeof(*s));
+    
+    b = JS_VALUE_TO_PTR(func);
+    p = JS_VALUE_TO_PTR(b->cpool);
+    s->ctx = ctx;
+    s->source_str = b->cpool;
+    s->source_buf = p->buf;
+    s->buf_len = p->len;
+    s->filename_str = b->filename;
+    s->has_column = b->has_column;
+    s->is_lazy = TRUE;
+    s->top_break = JS_NULL;
+    /* the existing closures already reference these variables */
+    ext_vars_len = b->ext_vars_len;
+    s->lazy_ext_vars_len = ext_vars_len;
+    b->cpool = JS_NULL;
+    
+    JS_PUSH_VALUE(ctx, func);
+    saved_parse_state = ctx->parse_state;
+    ctx->parse_state = s;
+    saved_top_gc_ref = ctx->top_gc_ref;
+    saved_sp = ctx->sp;
+
+    if (setjmp(s->jmp_env)) {
+        int line_num, col_num;
+        JSCStringBuf buf;
+        const char *filename;
+        
+        ctx->parse_state = saved_parse_state;
+        ctx->top_gc_ref = saved_top_gc_ref;
+        ctx->sp = saved_sp;
+        ctx->stack_bottom = ctx->sp;
+
+        /* the function stays uncompiled */
+        b = JS_VALUE_TO_PTR(func_ref.val);
+        b->byte_code = JS_NULL;
+        b->cpool = s->source_str;
+        js_write_barrier(ctx, &b->cpool);
+        b->vars = JS_NULL;
+        b->pc2line = JS_NULL;
+        b->ext_vars_len = ext_vars_len;
+        
+        line_num = get_line_col(&col_num, s->source_buf, s->token.source_pos);
+        JS_ThrowError(ctx, JS_CLASS_SYNTAX_ERROR, "%s", s->error_msg);
+        b = JS_VALUE_TO_PTR(func_ref.val);
+        filename = JS_ToCString(ctx, b->filename, &buf);
+        build_backtrace(ctx, ctx->current_exception, filename,
+                        line_num + 1, col_num + 1, 0);
+        JS_POP_VALUE(ctx, func);
+        return -1;
+    }
+    
+    reset_parse_state(s, b->source_pos, func);
+    js_parse_function(s);
+    js_parse_local_functions(s, &func_ref.val);
+    
+    /* cannot happen unless the scan missed a variable */
+    b = JS_VALUE_TO_PTR(func_ref.val);
+    if (b->ext_vars_len != ext_vars_len)
+        js_parse_error(s, "unexpected variable reference");
+    
+    JS_POP_VALUE(ctx, func);
+    ctx->parse_state = saved_parse_state;
+    return 0;
+}
+
 JSValue JS_Parse(JSContext *ctx, const char *input, size_t input_len,
                  const char *filename, int eval_flags)
 {
@@ -11849,6 +14712,82 @@ static BOOL mtag_has_references(int mtag)
             mtag == JS_MTAG_FUNCTION_BYTECODE);
 }
 
+/* iterate over the old blocks with references which overlap the dirty
+   cards */
+typedef struct {
+    JSContext *ctx;
+    uint32_t card; /* next card to examine */
+    uint8_t *ptr; /* next block of the current run of dirty cards */
+    uint8_t *run_start;
+    uint8_t *run_end;
+    uint8_t *done; /* end of the last block returned whole */
+} GCCardIter;
+
+static void gc_card_iter_init(GCCardIter *it, JSContext *ctx)
+{
+    it->ctx = ctx;
+    it->card = 0;
+    it->ptr = NULL;
+    it->run_start = NULL;
+    it->run_end = NULL;
+    it->done = NULL;
+}
+
+/* Return the next block or NULL. For a value array, [*pstart, *pend)
+   are its elements inside the dirty cards and it may be returned
+   several times with distinct elements. The other blocks are returned
+   once with *pstart = *pend = NULL. */
+static uint8_t *gc_card_next(GCCardIter *it, JSValue **pstart, JSValue **pend)
+{
+    JSContext *ctx = it->ctx;
+    const uint8_t *dirty = js_gc_card_dirty(ctx);
+    uint8_t *ptr, *end;
+    uint32_t c, c_end;
+    int shift = ctx->gc_card_shift;
+    
+    for(;;) {
+        if (it->ptr >= it->run_end) {
+            /* next run of dirty cards */
+            c = it->card;
+            while (c < ctx->gc_card_count && !dirty[c])
+                c++;
+            if (c >= ctx->gc_card_count ||
+                ctx->heap_base + ((size_t)c << shift) >= ctx->gc_young_start)
+                return NULL;
+            c_end = c + 1;
+            while (c_end < ctx->gc_card_count && dirty[c_end])
+                c_end++;
+            it->card = c_end;
+            it->run_start = ctx->heap_base + ((size_t)c << shift);
+            it->run_end = ctx->heap_base + ((size_t)c_end << shift);
+            if (it->run_end > ctx->gc_young_start)
+                it->run_end = ctx->gc_young_start;
+            it->ptr = ctx->heap_base + js_gc_card_start(ctx)[c];
+        }
+        ptr = it->ptr;
+        end = ptr + get_mblock_size(ptr);
+        it->ptr = end;
+        if (end <= it->run_start || !mtag_has_references(js_get_mtag(ptr)))
+            continue;
+        if (js_get_mtag(ptr) == JS_MTAG_VALUE_ARRAY) {
+            JSValueArray *arr = (JSValueArray *)ptr;
+            *pstart = arr->arr;
+            if (*pstart < (JSValue *)it->run_start)
+                *pstart = (JSValue *)it->run_start;
+            *pend = arr->arr + arr->size;
+            if (*pend > (JSValue *)it->run_end)
+                *pend = (JSValue *)it->run_end;
+            if (*pstart < *pend)
+                return ptr;
+        } else if (ptr >= it->done) {
+            it->done = end;
+            *pstart = NULL;
+            *pend = NULL;
+            return ptr;
+        }
+    }
+}
+
 static void gc_mark(GCMarkState *s, JSValue val)
 {
     JSContext *ctx = s->ctx;
@@ -11858,7 +14797,7 @@ static void gc_mark(GCMarkState *s, JSValue val)
     if (!JS_IsPtr(val))
         return;
     ptr = JS_VALUE_TO_PTR(val);
-    if (JS_IS_ROM_PTR(ctx, ptr))
+    if (JS_IS_ROM_PTR(ctx, ptr) || (uint8_t *)ptr < ctx->gc_young_start)
         return;
     mb = ptr;
     if (mb->gc_mark)
@@ -11995,12 +14934,14 @@ static void gc_mark_root(GCMarkState *s, JSValue val)
 }
 
 /* return true if the memory block is marked i.e. it won't be freed by the GC */
-static BOOL gc_mb_is_marked(JSValue val)
+static BOOL gc_mb_is_marked(JSContext *ctx, JSValue val)
 {
     JSFreeBlock *b;
     if (!JS_IsPtr(val))
         return FALSE;
     b = (JSFreeBlock *)JS_VALUE_TO_PTR(val);
+    if ((uint8_t *)b < ctx->gc_young_start)
+        return TRUE; /* old block during a minor GC */
     return b->gc_mark;
 }
 
@@ -12050,6 +14991,16 @@ static void gc_mark_all(JSContext *ctx, BOOL keep_atoms)
             gc_mark_root(s, ref->val);
         }
     }
+    {
+        int i, j, n;
+        JSProfileSample *ps;
+        n = js_profile_len(ctx);
+        for(i = 0; i < n; i++) {
+            ps = &ctx->profile_samples[i];
+            for(j = 0; j < ps->depth; j++)
+                gc_mark_root(s, ps->func[j]);
+        }
+    }
     if (ctx->parse_state) {
         JSParseState *ps = ctx->parse_state;
 
@@ -12058,21 +15009,42 @@ static void gc_mark_all(JSContext *ctx, BOOL keep_atoms)
         gc_mark_root(s, ps->token.value);
         gc_mark_root(s, ps->cur_func);
         gc_mark_root(s, ps->byte_code);
+        gc_mark_root(s, ps->json_keys);
     }
 
-    /* if the mark stack overflowed, need to scan the heap */
-    while (s->overflow) {
+    /* minor GC: the old blocks are not marked. The references stored
+       in them since the last GC are roots. */
+    if (ctx->gc_young_start != ctx->heap_base) {
+        GCCardIter it;
         uint8_t *ptr;
-        int size;
-        JSMemBlockHeader *mb;
-        
-        s->overflow = FALSE;
-        
-        ptr = ctx->heap_base;
+        JSValue *pv, *pv_end;
+
+        gc_card_iter_init(&it, ctx);
+        while ((ptr = gc_card_next(&it, &pv, &pv_end)) != NULL) {
+            if (pv) {
+                for(; pv < pv_end; pv++)
+                    gc_mark_root(s, *pv);
+            } else {
+                *--s->gsp = JS_VALUE_FROM_PTR(ptr);
+                gc_mark_flush(s);
+            }
+        }
+    }
+    
+    /* if the mark stack overflowed, need to scan the heap */
+    while (s->overflow) {
+        uint8_t *ptr;
+        int size;
+        JSMemBlockHeader *mb;
+        
+        s->overflow = FALSE;
+        
+        ptr = ctx->heap_base;
         while (ptr < ctx->heap_free) {
             size = get_mblock_size(ptr);
             mb = (JSMemBlockHeader *)ptr;
-            if (mb->gc_mark && mtag_has_references(mb->mtag)) {
+            if ((mb->gc_mark || ptr < ctx->gc_young_start) &&
+                mtag_has_references(mb->mtag)) {
                 if (mb->mtag == JS_MTAG_VALUE_ARRAY)
                     *--s->gsp = 0;
                 *--s->gsp = JS_VALUE_FROM_PTR(ptr);
@@ -12083,28 +15055,31 @@ static void gc_mark_all(JSContext *ctx, BOOL keep_atoms)
     }
 
     /* update the unique string table (its elements are considered as
-       weak string references) */
+       weak string references). The unreferenced strings are marked as
+       deleted so that the hash chains are preserved. */
     if (!JS_IsNull(ctx->unique_strings)) {
         JSValueArray *arr = JS_VALUE_TO_PTR(ctx->unique_strings);
-        int i, j;
+        JSValue val;
+        int i;
 
-        j = 0;
+        BOOL is_old = ((uint8_t *)arr < ctx->gc_young_start);
+        
         for(i = 0; i < arr->size; i++) {
-            if (gc_mb_is_marked(arr->arr[i])) {
-                arr->arr[j++] = arr->arr[i];
+            val = arr->arr[i];
+            if (JS_IsPtr(val) && !gc_mb_is_marked(ctx, val)) {
+                arr->arr[i] = JS_NULL;
+                ctx->unique_strings_len--;
+                ctx->unique_strings_deleted++;
             }
         }
-        ctx->unique_strings_len = j;
-        if (j > 0) {
-            arr->gc_mark = 1;
-            if (j < arr->size) {
-                /* shrink the array */
-                set_free_block(&arr->arr[j], (arr->size - j) * sizeof(JSValue));
-                arr->size = j;
-            }
+        if (ctx->unique_strings_len > 0) {
+            if (!is_old)
+                arr->gc_mark = 1;
         } else {
-            arr->gc_mark = 0;
+            if (!is_old)
+                arr->gc_mark = 0;
             ctx->unique_strings = JS_NULL;
+            ctx->unique_strings_deleted = 0;
         }
     }
 
@@ -12114,10 +15089,30 @@ static void gc_mark_all(JSContext *ctx, BOOL keep_atoms)
         JSStringPosCacheEntry *ce;
         for(i = 0; i < JS_STRING_POS_CACHE_SIZE; i++) {
             ce = &ctx->string_pos_cache[i];
-            if (!gc_mb_is_marked(ce->str))
+            if (!gc_mb_is_marked(ctx, ce->str))
                 ce->str = JS_NULL;
         }
     }
+
+    /* the string indexes are freed with their string */
+    {
+        int i;
+        JSStringIndexEntry *e;
+        JSMemBlockHeader *mb;
+        for(i = 0; i < JS_STRING_INDEX_SIZE; i++) {
+            e = &ctx->string_index[i];
+            if (e->str == JS_NULL)
+                continue;
+            if (gc_mb_is_marked(ctx, e->str)) {
+                mb = JS_VALUE_TO_PTR(e->index);
+                if ((uint8_t *)mb >= ctx->gc_young_start)
+                    mb->gc_mark = 1;
+            } else {
+                e->str = JS_NULL;
+                e->index = JS_NULL;
+            }
+        }
+    }
     
     /* reset the gc marks and mark the free blocks as free */
     {
@@ -12125,7 +15120,7 @@ static void gc_mark_all(JSContext *ctx, BOOL keep_atoms)
         int size;
         JSFreeBlock *b;
 
-        ptr = ctx->heap_base;
+        ptr = ctx->gc_young_start;
         while (ptr < ctx->heap_free) {
             size = get_mblock_size(ptr);
             b = (JSFreeBlock *)ptr;
@@ -12170,8 +15165,16 @@ static void gc_thread_pointer(JSContext *ctx, JSValue *pval)
     if (!JS_IsPtr(val))
         return;
     ptr = JS_VALUE_TO_PTR(val);
-    if (JS_IS_ROM_PTR(ctx, ptr))
+    if (JS_IS_ROM_PTR(ctx, ptr) || (uint8_t *)ptr < ctx->gc_young_start)
         return;
+#ifdef DEBUG_GC
+    if (ctx->gc_check_cards) {
+        /* an old block referencing a young one must be scanned */
+        assert(js_gc_card_dirty(ctx)[((uint8_t *)pval - ctx->heap_base) >>
+                                     ctx->gc_card_shift]);
+        return;
+    }
+#endif
     /* gc_mark = 0 indicates a normal memory block header, gc_mark = 1
        indicates a pointer to another element */
     *pval = *ptr;
@@ -12282,6 +15285,100 @@ static void gc_thread_block(JSContext *ctx, void *ptr)
     }
 }
 
+/* minor GC: return TRUE if the old object 'p' may have property keys
+   which were moved */
+static BOOL gc_has_young_keys(JSContext *ctx, JSObject *p)
+{
+    JSValueArray *arr;
+    JSProperty *pr;
+    int prop_count, hash_mask, j;
+    uint8_t *key;
+
+    arr = JS_VALUE_TO_PTR(p->props);
+    if (JS_IS_ROM_PTR(ctx, arr))
+        return FALSE;
+    if ((uint8_t *)arr >= ctx->gc_young_start)
+        return TRUE;
+    if (js_is_shaped_props(arr)) {
+        arr = JS_VALUE_TO_PTR(arr->arr[0]);
+        if ((uint8_t *)arr >= ctx->gc_young_start)
+            return TRUE;
+    }
+    prop_count = JS_VALUE_GET_INT(arr->arr[0]);
+    hash_mask = JS_VALUE_GET_INT(arr->arr[1]);
+    pr = (JSProperty *)&arr->arr[2 + hash_mask + 1];
+    for(j = 0; j < prop_count; pr++) {
+        if (pr->key != JS_UNINITIALIZED) {
+            if (JS_IsPtr(pr->key)) {
+                key = JS_VALUE_TO_PTR(pr->key);
+                if (key >= ctx->gc_young_start && key < ctx->heap_free)
+                    return TRUE;
+            }
+            j++;
+        }
+    }
+    return FALSE;
+}
+
+/* the shape cache and the property cache entries designating a shape
+   are weak references which are not updated by the compaction */
+static void js_shape_cache_gc(JSContext *ctx)
+{
+    int i;
+    js_shape_cache_reset(ctx);
+    ctx->free_for_in_iter = JS_NULL;
+    for(i = 0; i < JS_PROP_CACHE_SIZE; i++) {
+        if (JS_IsPtr(ctx->prop_cache[i].hash_mask) ||
+            JS_IsPtr(ctx->prop_cache[i].recv_shape))
+            ctx->prop_cache[i].pc = NULL;
+    }
+}
+
+typedef struct {
+    JSContext *ctx;
+    JSValueArray *arr;
+} JSUniqueStringSortContext;
+
+static int js_unique_string_cmp(size_t i1, size_t i2, void *opaque)
+{
+    JSUniqueStringSortContext *s = opaque;
+    return js_string_compare(s->ctx, s->arr->arr[i1], s->arr->arr[i2]);
+}
+
+static void js_unique_string_swap(size_t i1, size_t i2, void *opaque)
+{
+    JSUniqueStringSortContext *s = opaque;
+    JSValue tmp;
+    tmp = s->arr->arr[i1];
+    s->arr->arr[i1] = s->arr->arr[i2];
+    s->arr->arr[i2] = tmp;
+}
+
+/* Convert the unique string hash table to the sorted array used by
+   the atom tables of the bytecode files (see find_atom()). A free
+   block may be created at the end of the array. The table can no
+   longer be modified afterwards. */
+static void js_sort_unique_strings(JSContext *ctx)
+{
+    JSUniqueStringSortContext s_s, *s = &s_s;
+    JSValueArray *arr;
+    int i, j;
+
+    if (JS_IsNull(ctx->unique_strings))
+        return;
+    arr = JS_VALUE_TO_PTR(ctx->unique_strings);
+    j = 0;
+    for(i = 0; i < arr->size; i++) {
+        if (JS_IsPtr(arr->arr[i]))
+            arr->arr[j++] = arr->arr[i];
+    }
+    s->ctx = ctx;
+    s->arr = arr;
+    rqsort_idx(j, js_unique_string_cmp, js_unique_string_swap, s);
+    js_shrink_value_array(ctx, &ctx->unique_strings, j);
+    ctx->unique_strings_deleted = 0;
+}
+
 /* Heap compaction using Jonkers algorithm */
 static void gc_compact_heap(JSContext *ctx)
 {
@@ -12301,6 +15398,10 @@ static void gc_compact_heap(JSContext *ctx)
             ce = &ctx->string_pos_cache[i];
             gc_thread_pointer(ctx, &ce->str);
         }
+        for(i = 0; i < JS_STRING_INDEX_SIZE; i++) {
+            gc_thread_pointer(ctx, &ctx->string_index[i].str);
+            gc_thread_pointer(ctx, &ctx->string_index[i].index);
+        }
     }
     
     for(sp = ctx->sp; sp < (JSValue *)ctx->stack_top; sp++) {
@@ -12317,6 +15418,17 @@ static void gc_compact_heap(JSContext *ctx)
         }
     }
 
+    {
+        int i, j, n;
+        JSProfileSample *ps;
+        n = js_profile_len(ctx);
+        for(i = 0; i < n; i++) {
+            ps = &ctx->profile_samples[i];
+            for(j = 0; j < ps->depth; j++)
+                gc_thread_pointer(ctx, &ps->func[j]);
+        }
+    }
+
     if (ctx->parse_state) {
         JSParseState *ps = ctx->parse_state;
 
@@ -12325,11 +15437,29 @@ static void gc_compact_heap(JSContext *ctx)
         gc_thread_pointer(ctx, &ps->token.value);
         gc_thread_pointer(ctx, &ps->cur_func);
         gc_thread_pointer(ctx, &ps->byte_code);
+        gc_thread_pointer(ctx, &ps->json_keys);
     }
 
+    /* minor GC: the old blocks are not moved but the ones in the dirty
+       cards may reference young blocks */
+    if (ctx->gc_young_start != ctx->heap_base) {
+        GCCardIter it;
+        JSValue *pv, *pv_end;
+
+        gc_card_iter_init(&it, ctx);
+        while ((ptr = gc_card_next(&it, &pv, &pv_end)) != NULL) {
+            if (pv) {
+                for(; pv < pv_end; pv++)
+                    gc_thread_pointer(ctx, pv);
+            } else {
+                gc_thread_block(ctx, ptr);
+            }
+        }
+    }
+    
     /* pass 1: thread the pointers and update the previous ones */
-    new_ptr = ctx->heap_base;
-    ptr = ctx->heap_base;
+    new_ptr = ctx->gc_young_start;
+    ptr = ctx->gc_young_start;
     while (ptr < ctx->heap_free) {
         gc_update_threaded_pointers(ctx, ptr, new_ptr);
         size = get_mblock_size(ptr);
@@ -12342,8 +15472,8 @@ static void gc_compact_heap(JSContext *ctx)
     
     /* pass 2: update the threaded pointers and move the block to its
        final position */
-    new_ptr = ctx->heap_base;
-    ptr = ctx->heap_base;
+    new_ptr = ctx->gc_young_start;
+    ptr = ctx->gc_young_start;
     while (ptr < ctx->heap_free) {
         gc_update_threaded_pointers(ctx, ptr, new_ptr);
         size = get_mblock_size(ptr);
@@ -12366,20 +15496,83 @@ static void gc_compact_heap(JSContext *ctx)
         }
     }
     
-    /* rehash the object properties */
+    /* rehash the object properties. The keys of an old object are
+       only modified with a write barrier on the object. */
     /* XXX: try to do it in the previous pass (add a specific tag ?) */
-    ptr = ctx->heap_base;
+    if (ctx->gc_young_start != ctx->heap_base) {
+        GCCardIter it;
+        JSValue *pv, *pv_end;
+
+        gc_card_iter_init(&it, ctx);
+        while ((ptr = gc_card_next(&it, &pv, &pv_end)) != NULL) {
+            if (js_get_mtag(ptr) == JS_MTAG_OBJECT &&
+                gc_has_young_keys(ctx, (JSObject *)ptr)) {
+                js_rehash_props(ctx, (JSObject *)ptr, TRUE);
+            }
+        }
+    }
+    ptr = ctx->gc_young_start;
     while (ptr < ctx->heap_free) {
         size = get_mblock_size(ptr);
-        if (js_get_mtag(ptr) == JS_MTAG_OBJECT) {
+        if (js_get_mtag(ptr) == JS_MTAG_OBJECT)
             js_rehash_props(ctx, (JSObject *)ptr, TRUE);
-        }
         ptr += size;
     }
 }
 
-static void JS_GC2(JSContext *ctx, BOOL keep_atoms)
+/* the blocks allocated since the last GC become old */
+static void gc_promote_blocks(JSContext *ctx)
+{
+    uint8_t *ptr, *end;
+
+    for(ptr = ctx->gc_young_start; ptr < ctx->heap_free; ptr = end) {
+        end = ptr + get_mblock_size(ptr);
+        js_gc_set_card_start(ctx, ptr, end);
+    }
+    memset(js_gc_card_dirty(ctx), 0, ctx->gc_card_count);
+    ctx->gc_young_start = ctx->heap_free;
+}
+
+#ifdef DEBUG_GC
+/* check the write barriers: the old blocks referencing young blocks
+   and the old objects with young property keys must be in dirty
+   cards */
+static void gc_check_cards(JSContext *ctx)
+{
+    const uint8_t *dirty = js_gc_card_dirty(ctx);
+    uint8_t *ptr, *end;
+    uint32_t c;
+    
+    ctx->gc_check_cards = TRUE;
+    for(ptr = ctx->heap_base; ptr < ctx->gc_young_start; ptr = end) {
+        end = ptr + get_mblock_size(ptr);
+        gc_thread_block(ctx, ptr);
+        if (js_get_mtag(ptr) == JS_MTAG_OBJECT &&
+            gc_has_young_keys(ctx, (JSObject *)ptr)) {
+            for(c = (ptr - ctx->heap_base) >> ctx->gc_card_shift;
+                !dirty[c]; c++) {
+                assert(ctx->heap_base + ((size_t)(c + 1) << ctx->gc_card_shift) < end);
+            }
+        }
+    }
+    ctx->gc_check_cards = FALSE;
+}
+#endif
+
+/* if 'minor' is TRUE, only the blocks allocated since the last GC are
+   collected */
+static void JS_GC2(JSContext *ctx, BOOL keep_atoms, BOOL minor)
 {
+    int64_t t0;
+    uint8_t *heap_free;
+    
+    t0 = 0;
+    if (ctx->gc_clock)
+        t0 = ctx->gc_clock(ctx->opaque);
+    heap_free = ctx->heap_free;
+    js_update_max_heap_size(ctx);
+    if (!minor)
+        ctx->gc_young_start = ctx->heap_base;
 #ifdef DUMP_GC
     js_printf(ctx, "GC   : heap size=%u/%u stack_size=%u\n",
            (uint32_t)(ctx->heap_free - ctx->heap_base),
@@ -12402,7 +15595,10 @@ static void JS_GC2(JSContext *ctx, BOOL keep_atoms)
             }
         }
     }
+    if (ctx->gc_young_start != ctx->heap_base)
+        gc_check_cards(ctx);
 #endif
+    js_shape_cache_gc(ctx);
     gc_mark_all(ctx, keep_atoms);
     gc_compact_heap(ctx);
 #ifdef DUMP_GC
@@ -12411,16 +15607,39 @@ static void JS_GC2(JSContext *ctx, BOOL keep_atoms)
            (uint32_t)(ctx->stack_top - ctx->heap_base),
            (uint32_t)(ctx->stack_top - (uint8_t *)ctx->sp));
 #endif
+    /* the surviving blocks are promoted */
+    if (ctx->gc_mode == JS_GC_MODE_GENERATIONAL)
+        gc_promote_blocks(ctx);
+    else
+        ctx->gc_young_start = ctx->heap_base;
+
+    if (minor)
+        ctx->gc_stats.minor_gc_count++;
+    else
+        ctx->gc_stats.gc_count++;
+    ctx->gc_stats.reclaimed_bytes += heap_free - ctx->heap_free;
+    ctx->meter_freed_bytes += heap_free - ctx->heap_free;
+    if (ctx->gc_clock) {
+        int64_t d = ctx->gc_clock(ctx->opaque) - t0;
+        ctx->gc_stats.last_pause = d;
+        ctx->gc_stats.max_pause = max_int64(ctx->gc_stats.max_pause, d);
+        ctx->gc_stats.total_pause += d;
+    }
 }
 
 void JS_GC(JSContext *ctx)
 {
-    JS_GC2(ctx, TRUE);
+    JS_GC2(ctx, TRUE, FALSE);
 }
 
 /* bytecode saving and loading */
 
-#define JS_BYTECODE_VERSION_32 0x0001
+#ifdef JS_FUSED_OPCODES
+/* bit 14 of bytecode version indicates fused opcodes */
+#define JS_BYTECODE_VERSION_32 (0x0003 | 0x4000)
+#else
+#define JS_BYTECODE_VERSION_32 0x0003
+#endif
 /* bit 15 of bytecode version is a 64-bit indicator */
 #define JS_BYTECODE_VERSION (JS_BYTECODE_VERSION_32 | ((JSW & 8) << 12))
 
@@ -12433,6 +15652,7 @@ void JS_PrepareBytecode(JSContext *ctx,
     int i;
     
     /* remove all the objects except the compiled code */
+    JS_SetGCMode(ctx, JS_GC_MODE_FULL, 0);
     ctx->empty_props = JS_NULL;
     for(i = 0; i < ctx->class_count; i++) {
         ctx->class_proto[i] = JS_NULL;
@@ -12444,7 +15664,10 @@ void JS_PrepareBytecode(JSContext *ctx,
 #endif
     
     JS_PUSH_VALUE(ctx, eval_code);
-    JS_GC2(ctx, FALSE);
+    JS_GC2(ctx, FALSE, FALSE);
+    js_sort_unique_strings(ctx);
+    /* remove the free block at the end of the unique strings */
+    JS_GC2(ctx, FALSE, FALSE);
     JS_POP_VALUE(ctx, eval_code);
 
     hdr->magic = JS_BYTECODE_MAGIC;
@@ -12779,12 +16002,13 @@ int JS_PrepareBytecode64to32(JSContext *ctx,
     
     JS_PUSH_VALUE(ctx, eval_code);
 #ifdef JS_USE_SHORT_FLOAT
-    JS_GC2(ctx, FALSE);
+    JS_GC2(ctx, FALSE, FALSE);
     if (expand_short_floats(ctx))
         return -1;
 #else
     gc_mark_all(ctx, FALSE);
 #endif    
+    js_sort_unique_strings(ctx);
     if (gc_compact_heap_64to32(ctx))
         return -1;
     JS_POP_VALUE(ctx, eval_code);
@@ -12922,6 +16146,23 @@ int JS_RelocateBytecode(JSContext *ctx,
                                 (uintptr_t)data_ptr, TRUE);
 }
 
+/* return TRUE if one of the atoms of the ROM table 'arr1' is also a
+   unique string in RAM */
+static BOOL js_rom_atoms_in_ram(JSContext *ctx, const JSValueArray *arr1)
+{
+    JSValueArray *arr;
+    int i, a;
+
+    if (ctx->unique_strings_len == 0)
+        return FALSE;
+    arr = JS_VALUE_TO_PTR(ctx->unique_strings);
+    for(i = 0; i < arr1->size; i++) {
+        if (!JS_IsNull(find_unique_string(arr, &a, arr1->arr[i])))
+            return TRUE;
+    }
+    return FALSE;
+}
+
 /* Load the precompiled bytecode from 'buf'. 'buf' must be allocated
    as long as the JSContext exists. Use JS_Run() to execute
    it. warning: the bytecode is not checked so it should come from a
@@ -12929,10 +16170,8 @@ int JS_RelocateBytecode(JSContext *ctx,
 JSValue JS_LoadBytecode(JSContext *ctx, const uint8_t *buf)
 {
     const JSBytecodeHeader *hdr = (const JSBytecodeHeader *)buf;
+    const JSValueArray *atoms;
     
-    if (ctx->unique_strings_len != 0)
-        return JS_ThrowInternalError(ctx, "no atom must be defined in RAM");
-    /* XXX: could stack atom_tables */
     if (ctx->n_rom_atom_tables >= N_ROM_ATOM_TABLES_MAX)
         return JS_ThrowInternalError(ctx, "too many rom atom tables");
     if (hdr->magic != JS_BYTECODE_MAGIC)
@@ -12943,138 +16182,451 @@ JSValue JS_LoadBytecode(JSContext *ctx, const uint8_t *buf)
         return JS_ThrowInternalError(ctx, "invalid bytecode version");
     if (hdr->base_addr != (uintptr_t)(hdr + 1))
         return JS_ThrowInternalError(ctx, "bytecode not relocated");
-    ctx->rom_atom_tables[ctx->n_rom_atom_tables++] = (JSValueArray *)JS_VALUE_TO_PTR(hdr->unique_strings);
+    /* the bytecode is never scanned nor moved by the GC, so it must
+       not be located in the context memory */
+    if (!JS_IS_ROM_PTR(ctx, buf))
+        return JS_ThrowInternalError(ctx, "bytecode must be outside the context memory");
+    /* an atom cannot be both in RAM and in ROM. The atoms created by
+       the previous scripts are usually no longer referenced, so run a
+       GC before failing. */
+    atoms = JS_VALUE_TO_PTR(hdr->unique_strings);
+    if (js_rom_atoms_in_ram(ctx, atoms)) {
+        JS_GC(ctx);
+        if (js_rom_atoms_in_ram(ctx, atoms))
+            return JS_ThrowInternalError(ctx, "bytecode atom already defined in RAM");
+    }
+    ctx->rom_atom_tables[ctx->n_rom_atom_tables++] = atoms;
     return hdr->main_func;
 }
 
-/**********************************************************************/
-/* runtime */
+/* context snapshots */
 
-JSValue js_function_constructor(JSContext *ctx, JSValue *this_val,
-                                int argc, JSValue *argv)
-{
-    StringBuffer b_s, *b = &b_s;
-    JSValue val;
-    int i, n;
-    
-    argc &= ~FRAME_CF_CTOR;
-    string_buffer_init(ctx, b, 0);
-    string_buffer_puts(ctx, b, "(function anonymous(");
-    n = argc - 1;
-    for(i = 0; i < n; i++) {
-        if (i != 0) {
-            string_buffer_putc(ctx, b, ',');
-        }
-        if (string_buffer_concat(ctx, b, argv[i]))
-            return JS_EXCEPTION;
-    }
-    string_buffer_puts(ctx, b, "\n) {\n");
-    if (n >= 0) {
-        if (string_buffer_concat(ctx, b, argv[n]))
-            return JS_EXCEPTION;
-    }
-    string_buffer_puts(ctx, b, "\n})");
-    val = string_buffer_end(ctx, b);
-    if (JS_IsException(val))
-        return val;
-    val = JS_Parse2(ctx, val, NULL, 0, "<input>", JS_EVAL_RETVAL);
-    if (JS_IsException(val))
-        return val;
-    return JS_Run(ctx, val);
-}
+#define JS_SNAPSHOT_MAGIC 0xacfc
+/* bit 15 is a 64-bit indicator */
+#define JS_SNAPSHOT_VERSION (0x0001 | ((JSW & 8) << 12))
 
-JSValue js_function_get_prototype(JSContext *ctx, JSValue *this_val,
-                                  int argc, JSValue *argv)
+typedef struct {
+    uint16_t magic; /* JS_SNAPSHOT_MAGIC */
+    uint16_t version; /* JS_SNAPSHOT_VERSION */
+    uint32_t image_len; /* size of the JSContext and of the heap */
+    uintptr_t base_addr; /* address of the context memory */
+} JSSnapshotHeader;
+
+typedef struct {
+    uintptr_t start; /* old memory area */
+    uintptr_t end;
+    uintptr_t offset;
+} SnapshotRelocState;
+
+/* Save the context memory (JSContext and heap) to 'buf' after a
+   garbage collection. No JS code must be running. JSGCRef are not
+   saved. Return the size of the snapshot (only the size is returned
+   if 'buf_len' is too small) or 0 if the context cannot be saved. */
+size_t JS_SnapshotContext(JSContext *ctx, void *buf, size_t buf_len)
 {
-    JSValue obj;
-    JSGCRef obj_ref;
+    JSSnapshotHeader *hdr;
+    size_t image_len;
     
-    if (!JS_IsPtr(*this_val)) {
-        if (JS_VALUE_GET_SPECIAL_TAG(*this_val) != JS_TAG_SHORT_FUNC)
-            goto fail;
-        return JS_UNDEFINED;
-    } else {
-        JSObject *p = JS_VALUE_TO_PTR(*this_val);
-        if (p->mtag != JS_MTAG_OBJECT)
-            goto fail;
-        if (p->class_id == JS_CLASS_CLOSURE) {
-            obj = JS_NewObject(ctx);
-            if (JS_IsException(obj))
-                return obj;
-        } else if (p->class_id == JS_CLASS_C_FUNCTION) {
-            /* for C constructors, the prototype property is already present */
-            return JS_UNDEFINED;
-        } else {
-        fail:
-            return JS_ThrowTypeError(ctx, "not a function");
-        }
-        JS_PUSH_VALUE(ctx, obj);
-        JS_DefinePropertyValue(ctx, obj, js_get_atom(ctx, JS_ATOM_constructor),
-                               *this_val);
-        JS_POP_VALUE(ctx, obj);
-        JS_PUSH_VALUE(ctx, obj);
-        JS_DefinePropertyValue(ctx, *this_val, js_get_atom(ctx, JS_ATOM_prototype),
-                               obj);
-        JS_POP_VALUE(ctx, obj);
+    if (ctx->sp != (JSValue *)ctx->stack_top || ctx->parse_state ||
+        ctx->top_gc_ref)
+        return 0;
+    JS_GC(ctx);
+    image_len = ctx->heap_free - (uint8_t *)ctx;
+    if (buf_len >= sizeof(JSSnapshotHeader) + image_len) {
+        hdr = buf;
+        hdr->magic = JS_SNAPSHOT_MAGIC;
+        hdr->version = JS_SNAPSHOT_VERSION;
+        hdr->image_len = image_len;
+        hdr->base_addr = (uintptr_t)ctx;
+        memcpy(hdr + 1, ctx, image_len);
     }
-    return obj;
-}
-
-JSValue js_function_set_prototype(JSContext *ctx, JSValue *this_val,
-                                  int argc, JSValue *argv)
-{
-    if (!JS_IsFunctionObject(ctx, *this_val))
-        return JS_ThrowTypeError(ctx, "not a function");
-
-    JS_DefinePropertyValue(ctx, *this_val, js_get_atom(ctx, JS_ATOM_prototype),
-                           argv[0]);
-    return JS_UNDEFINED;
+    return sizeof(JSSnapshotHeader) + image_len;
 }
 
-JSValue js_function_get_length_name(JSContext *ctx, JSValue *this_val,
-                                    int argc, JSValue *argv, int is_name)
+static void snapshot_reloc_value(SnapshotRelocState *s, JSValue *pval)
 {
-    JSFunctionBytecode *b;
-    JSValue ret = js_function_get_length_name1(ctx, this_val, is_name, &b);
-    if (JS_IsNull(ret))
-        return JS_ThrowTypeError(ctx, "not a function");
-    return ret;
+    JSValue val = *pval;
+    uintptr_t addr;
+    if (JS_IsPtr(val)) {
+        addr = (uintptr_t)JS_VALUE_TO_PTR(val);
+        /* ROM values are not modified */
+        if (addr >= s->start && addr < s->end)
+            *pval = val + s->offset;
+    }
 }
 
-JSValue js_function_toString(JSContext *ctx, JSValue *this_val,
-                             int argc, JSValue *argv)
+static void *snapshot_reloc_ptr(SnapshotRelocState *s, const void *ptr)
 {
-    JSValue str, val;
-    JSGCRef str_ref;
-
-    str = js_function_get_length_name(ctx, this_val, 0, NULL, 1);
-    if (JS_IsException(str))
-        return str;
-    JS_PUSH_VALUE(ctx, str);
-    val = JS_NewString(ctx, "function ");
-    JS_POP_VALUE(ctx, str);
-    str = JS_ConcatString(ctx, val, str);
-    JS_PUSH_VALUE(ctx, str);
-    val = JS_NewString(ctx, "() {\n    [native code]\n}");
-    JS_POP_VALUE(ctx, str);
-    return JS_ConcatString(ctx, str, val);
+    return (uint8_t *)ptr + s->offset;
 }
 
-JSValue js_function_call(JSContext *ctx, JSValue *this_val,
-                         int argc, JSValue *argv)
+/* same pointers as gc_thread_block() */
+static void snapshot_reloc_block(SnapshotRelocState *s, void *ptr)
 {
-    int i;
-    argc = max_int(argc, 1);
-    if (JS_StackCheck(ctx, argc + 1))
-        return JS_EXCEPTION;
-    for(i = 0; i < argc - 1; i++)
-        JS_PushArg(ctx, argv[argc - 1 - i]);
-    JS_PushArg(ctx, *this_val);
-    JS_PushArg(ctx, argv[0]);
-    /* we avoid recursing on the C stack */
-    return JS_NewTailCall(argc - 1);
-}
-
+    int mtag, i;
+    
+    mtag = ((JSMemBlockHeader *)ptr)->mtag;
+    switch(mtag) {
+    case JS_MTAG_OBJECT:
+        {
+            JSObject *p = ptr;
+            snapshot_reloc_value(s, &p->proto);
+            snapshot_reloc_value(s, &p->props);
+            switch(p->class_id) {
+            case JS_CLASS_CLOSURE:
+                snapshot_reloc_value(s, &p->u.closure.func_bytecode);
+                for(i = 0; i < p->extra_size - 1; i++)
+                    snapshot_reloc_value(s, &p->u.closure.var_refs[i]);
+                break;
+            case JS_CLASS_C_FUNCTION:
+                if (p->extra_size > 1)
+                    snapshot_reloc_value(s, &p->u.cfunc.params);
+                break;
+            case JS_CLASS_ARRAY:
+                snapshot_reloc_value(s, &p->u.array.tab);
+                break;
+            case JS_CLASS_ERROR:
+                snapshot_reloc_value(s, &p->u.error.message);
+                snapshot_reloc_value(s, &p->u.error.stack);
+                break;
+            case JS_CLASS_ARRAY_BUFFER:
+                snapshot_reloc_value(s, &p->u.array_buffer.byte_buffer);
+                break;
+            case JS_CLASS_UINT8C_ARRAY:
+            case JS_CLASS_INT8_ARRAY:
+            case JS_CLASS_UINT8_ARRAY:
+            case JS_CLASS_INT16_ARRAY:
+            case JS_CLASS_UINT16_ARRAY:
+            case JS_CLASS_INT32_ARRAY:
+            case JS_CLASS_UINT32_ARRAY:
+            case JS_CLASS_FLOAT32_ARRAY:
+            case JS_CLASS_FLOAT64_ARRAY:
+                snapshot_reloc_value(s, &p->u.typed_array.buffer);
+                break;
+            case JS_CLASS_REGEXP:
+                snapshot_reloc_value(s, &p->u.regexp.source);
+                snapshot_reloc_value(s, &p->u.regexp.byte_code);
+                break;
+            }
+        }
+        break;
+    case JS_MTAG_VALUE_ARRAY:
+        {
+            JSValueArray *p = ptr;
+            for(i = 0; i < p->size; i++)
+                snapshot_reloc_value(s, &p->arr[i]);
+        }
+        break;
+    case JS_MTAG_VARREF:
+        {
+            JSVarRef *p = ptr;
+            /* no JS code is running, so all the references are detached */
+            snapshot_reloc_value(s, &p->u.value);
+        }
+        break;
+    case JS_MTAG_FUNCTION_BYTECODE:
+        {
+            JSFunctionBytecode *b = ptr;
+            snapshot_reloc_value(s, &b->func_name);
+            snapshot_reloc_value(s, &b->byte_code);
+            snapshot_reloc_value(s, &b->cpool);
+            snapshot_reloc_value(s, &b->vars);
+            snapshot_reloc_value(s, &b->ext_vars);
+            snapshot_reloc_value(s, &b->filename);
+            snapshot_reloc_value(s, &b->pc2line);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+/* Relocate the pointers of a context copied from the memory area
+   [s->start, s->end). 'stack_top' must be set. The stack and the
+   JSGCRef are not modified. */
+static void js_relocate_context(JSContext *ctx, SnapshotRelocState *s)
+{
+    JSValue *sp, *sp_end;
+    uint8_t *ptr;
+    int i;
+    
+    ctx->heap_base = snapshot_reloc_ptr(s, ctx->heap_base);
+    ctx->heap_free = snapshot_reloc_ptr(s, ctx->heap_free);
+    ctx->gc_young_start = snapshot_reloc_ptr(s, ctx->gc_young_start);
+    if ((uintptr_t)ctx->atom_table >= s->start &&
+        (uintptr_t)ctx->atom_table < s->end)
+        ctx->atom_table = snapshot_reloc_ptr(s, ctx->atom_table);
+    ctx->class_obj = ctx->class_proto + ctx->class_count;
+    for(i = 0; i < JS_STRING_POS_CACHE_SIZE; i++)
+        snapshot_reloc_value(s, &ctx->string_pos_cache[i].str);
+    for(i = 0; i < JS_STRING_INDEX_SIZE; i++) {
+        snapshot_reloc_value(s, &ctx->string_index[i].str);
+        snapshot_reloc_value(s, &ctx->string_index[i].index);
+    }
+    for(i = 0; i < JS_PROP_CACHE_SIZE; i++)
+        ctx->prop_cache[i].pc = NULL;
+    js_shape_cache_reset(ctx);
+    ctx->free_for_in_iter = JS_NULL;
+    
+    sp_end = ctx->class_proto + 2 * ctx->class_count;
+    for(sp = &ctx->unique_strings; sp < sp_end; sp++)
+        snapshot_reloc_value(s, sp);
+
+    ptr = ctx->heap_base;
+    while (ptr < ctx->heap_free) {
+        snapshot_reloc_block(s, ptr);
+        ptr += get_mblock_size(ptr);
+    }
+
+    /* the property hash depends on the address of the keys */
+    if (s->offset != 0) {
+        ptr = ctx->heap_base;
+        while (ptr < ctx->heap_free) {
+            if (js_get_mtag(ptr) == JS_MTAG_OBJECT)
+                js_rehash_props(ctx, (JSObject *)ptr, TRUE);
+            ptr += get_mblock_size(ptr);
+        }
+    }
+}
+
+/* Create a context in 'mem_start' from a snapshot made with
+   JS_SnapshotContext() in the same program. 'mem_size' can differ from
+   the size of the saved context. Return NULL if error. */
+JSContext *JS_RestoreContext(void *mem_start, size_t mem_size,
+                             const void *buf, size_t buf_len)
+{
+    const JSSnapshotHeader *hdr = buf;
+    SnapshotRelocState ss, *s = &ss;
+    JSContext *ctx;
+    
+    if (buf_len < sizeof(JSSnapshotHeader) ||
+        hdr->magic != JS_SNAPSHOT_MAGIC ||
+        hdr->version != JS_SNAPSHOT_VERSION ||
+        buf_len != sizeof(JSSnapshotHeader) + hdr->image_len)
+        return NULL;
+    if (((uintptr_t)mem_start & (JSW - 1)) != 0)
+        return NULL;
+    mem_size = mem_size & ~(JSW - 1);
+    if (mem_size < hdr->image_len + JS_MIN_FREE_SIZE + JS_STACK_SLACK * sizeof(JSValue))
+        return NULL;
+    memcpy(mem_start, hdr + 1, hdr->image_len);
+
+    s->start = hdr->base_addr;
+    s->end = hdr->base_addr + hdr->image_len;
+    s->offset = (uintptr_t)mem_start - hdr->base_addr;
+    
+    ctx = mem_start;
+    ctx->stack_top = (uint8_t *)mem_start + mem_size;
+    js_relocate_context(ctx, s);
+    ctx->gc_young_start = ctx->heap_base;
+    /* the whole memory block is usable */
+    ctx->mem_reserve = 0;
+    js_update_heap_reserve(ctx);
+    ctx->profile_samples = NULL;
+    ctx->profile_sample_count = 0;
+    ctx->sp = (JSValue *)ctx->stack_top;
+    ctx->stack_bottom = ctx->sp;
+    ctx->fp = ctx->sp;
+    ctx->top_gc_ref = NULL;
+    ctx->last_gc_ref = NULL;
+    /* the card table depends on the memory size */
+    if (ctx->gc_mode == JS_GC_MODE_GENERATIONAL)
+        JS_SetGCMode(ctx, ctx->gc_mode, ctx->gc_nursery_size);
+    return ctx;
+}
+
+JSContext *JS_ExtendHeap(JSContext *ctx, void *mem_start, size_t mem_size)
+{
+    SnapshotRelocState ss, *s = &ss;
+    JSContext *new_ctx;
+    size_t image_len, stack_len;
+    intptr_t stack_delta;
+    JSValue *sp;
+    JSGCRef *ref;
+    int i, j, n;
+    
+    /* the C code must not hold pointers to the stack */
+    if (ctx->js_call_rec_count != 0 || ctx->parse_state || ctx->is_suspended)
+        return NULL;
+    if (((uintptr_t)mem_start & (JSW - 1)) != 0)
+        return NULL;
+    mem_size = mem_size & ~(JSW - 1);
+    if (mem_size < ctx->stack_top - (uint8_t *)ctx)
+        return NULL;
+    if (mem_start == ctx) {
+        js_move_stack(ctx, (uint8_t *)ctx + mem_size);
+        js_update_heap_reserve(ctx);
+        goto done;
+    }
+    
+    image_len = ctx->heap_free - (uint8_t *)ctx;
+    stack_len = ctx->stack_top - (uint8_t *)ctx->sp;
+    new_ctx = mem_start;
+    memcpy(new_ctx, ctx, image_len);
+    memcpy((uint8_t *)new_ctx + mem_size - stack_len, ctx->sp, stack_len);
+
+    s->start = (uintptr_t)ctx;
+    s->end = (uintptr_t)ctx->heap_free;
+    s->offset = (uintptr_t)new_ctx - (uintptr_t)ctx;
+    stack_delta = ((uint8_t *)new_ctx + mem_size) - ctx->stack_top;
+    
+    ctx = new_ctx;
+    ctx->stack_top = (uint8_t *)ctx + mem_size;
+    ctx->sp = (JSValue *)((uint8_t *)ctx->sp + stack_delta);
+    ctx->fp = (JSValue *)((uint8_t *)ctx->fp + stack_delta);
+    ctx->stack_bottom = (JSValue *)((uint8_t *)ctx->stack_bottom + stack_delta);
+    js_relocate_context(ctx, s);
+
+    /* no JS code is running: the stack only contains values */
+    for(sp = ctx->sp; sp < (JSValue *)ctx->stack_top; sp++)
+        snapshot_reloc_value(s, sp);
+    for(ref = ctx->top_gc_ref; ref != NULL; ref = ref->prev)
+        snapshot_reloc_value(s, &ref->val);
+    for(ref = ctx->last_gc_ref; ref != NULL; ref = ref->prev)
+        snapshot_reloc_value(s, &ref->val);
+    n = js_profile_len(ctx);
+    for(i = 0; i < n; i++) {
+        JSProfileSample *ps = &ctx->profile_samples[i];
+        for(j = 0; j < ps->depth; j++)
+            snapshot_reloc_value(s, &ps->func[j]);
+    }
+    js_update_heap_reserve(ctx);
+ done:
+    /* the card table depends on the memory size */
+    if (ctx->gc_mode == JS_GC_MODE_GENERATIONAL)
+        JS_SetGCMode(ctx, ctx->gc_mode, ctx->gc_nursery_size);
+    ctx->gc_stats.heap_grow_count++;
+    return ctx;
+}
+
+/**********************************************************************/
+/* runtime */
+
+JSValue js_function_constructor(JSContext *ctx, JSValue *this_val,
+                                int argc, JSValue *argv)
+{
+    StringBuffer b_s, *b = &b_s;
+    JSValue val;
+    int i, n;
+    
+    argc &= ~FRAME_CF_CTOR;
+    string_buffer_init(ctx, b, 0);
+    string_buffer_puts(ctx, b, "(function anonymous(");
+    n = argc - 1;
+    for(i = 0; i < n; i++) {
+        if (i != 0) {
+            string_buffer_putc(ctx, b, ',');
+        }
+        if (string_buffer_concat(ctx, b, argv[i]))
+            return JS_EXCEPTION;
+    }
+    string_buffer_puts(ctx, b, "\n) {\n");
+    if (n >= 0) {
+        if (string_buffer_concat(ctx, b, argv[n]))
+            return JS_EXCEPTION;
+    }
+    string_buffer_puts(ctx, b, "\n})");
+    val = string_buffer_end(ctx, b);
+    if (JS_IsException(val))
+        return val;
+    val = JS_Parse2(ctx, val, NULL, 0, "<input>", JS_EVAL_RETVAL);
+    if (JS_IsException(val))
+        return val;
+    return JS_Run(ctx, val);
+}
+
+JSValue js_function_get_prototype(JSContext *ctx, JSValue *this_val,
+                                  int argc, JSValue *argv)
+{
+    JSValue obj;
+    JSGCRef obj_ref;
+    
+    if (!JS_IsPtr(*this_val)) {
+        if (JS_VALUE_GET_SPECIAL_TAG(*this_val) != JS_TAG_SHORT_FUNC)
+            goto fail;
+        return JS_UNDEFINED;
+    } else {
+        JSObject *p = JS_VALUE_TO_PTR(*this_val);
+        if (p->mtag != JS_MTAG_OBJECT)
+            goto fail;
+        if (p->class_id == JS_CLASS_CLOSURE) {
+            obj = JS_NewObject(ctx);
+            if (JS_IsException(obj))
+                return obj;
+        } else if (p->class_id == JS_CLASS_C_FUNCTION) {
+            /* for C constructors, the prototype property is already present */
+            return JS_UNDEFINED;
+        } else {
+        fail:
+            return JS_ThrowTypeError(ctx, "not a function");
+        }
+        JS_PUSH_VALUE(ctx, obj);
+        JS_DefinePropertyValue(ctx, obj, js_get_atom(ctx, JS_ATOM_constructor),
+                               *this_val);
+        JS_POP_VALUE(ctx, obj);
+        JS_PUSH_VALUE(ctx, obj);
+        JS_DefinePropertyValue(ctx, *this_val, js_get_atom(ctx, JS_ATOM_prototype),
+                               obj);
+        JS_POP_VALUE(ctx, obj);
+    }
+    return obj;
+}
+
+JSValue js_function_set_prototype(JSContext *ctx, JSValue *this_val,
+                                  int argc, JSValue *argv)
+{
+    if (!JS_IsFunctionObject(ctx, *this_val))
+        return JS_ThrowTypeError(ctx, "not a function");
+
+    JS_DefinePropertyValue(ctx, *this_val, js_get_atom(ctx, JS_ATOM_prototype),
+                           argv[0]);
+    return JS_UNDEFINED;
+}
+
+JSValue js_function_get_length_name(JSContext *ctx, JSValue *this_val,
+                                    int argc, JSValue *argv, int is_name)
+{
+    JSFunctionBytecode *b;
+    JSValue ret = js_function_get_length_name1(ctx, this_val, is_name, &b);
+    if (JS_IsNull(ret))
+        return JS_ThrowTypeError(ctx, "not a function");
+    return ret;
+}
+
+JSValue js_function_toString(JSContext *ctx, JSValue *this_val,
+                             int argc, JSValue *argv)
+{
+    JSValue str, val;
+    JSGCRef str_ref;
+
+    str = js_function_get_length_name(ctx, this_val, 0, NULL, 1);
+    if (JS_IsException(str))
+        return str;
+    JS_PUSH_VALUE(ctx, str);
+    val = JS_NewString(ctx, "function ");
+    JS_POP_VALUE(ctx, str);
+    str = JS_ConcatString(ctx, val, str);
+    JS_PUSH_VALUE(ctx, str);
+    val = JS_NewString(ctx, "() {\n    [native code]\n}");
+    JS_POP_VALUE(ctx, str);
+    return JS_ConcatString(ctx, str, val);
+}
+
+JSValue js_function_call(JSContext *ctx, JSValue *this_val,
+                         int argc, JSValue *argv)
+{
+    int i;
+    argc = max_int(argc, 1);
+    if (JS_StackCheck(ctx, argc + 1))
+        return JS_EXCEPTION;
+    for(i = 0; i < argc - 1; i++)
+        JS_PushArg(ctx, argv[argc - 1 - i]);
+    JS_PushArg(ctx, *this_val);
+    JS_PushArg(ctx, argv[0]);
+    /* we avoid recursing on the C stack */
+    return JS_NewTailCall(argc - 1);
+}
+
 JSValue js_function_apply(JSContext *ctx, JSValue *this_val,
                          int argc, JSValue *argv)
 {
@@ -13707,6 +17259,7 @@ static JSValue js_set_prototype_internal(JSContext *ctx, JSValue obj, JSValue pr
         }
         
         p->proto = proto;
+        js_write_barrier(ctx, &p->proto);
     }
     return JS_UNDEFINED;
 }
@@ -13759,7 +17312,7 @@ JSValue js_object_keys(JSContext *ctx, JSValue *this_val,
         array_len = 0;
     }
             
-    arr = JS_VALUE_TO_PTR(p->props);
+    arr = js_get_prop_keys(p);
     prop_count = JS_VALUE_GET_INT(arr->arr[0]);
     hash_mask = JS_VALUE_GET_INT(arr->arr[1]);
 
@@ -13778,24 +17331,33 @@ JSValue js_object_keys(JSContext *ctx, JSValue *this_val,
             return str;
         pret = JS_VALUE_TO_PTR(ret);
         ret_arr = JS_VALUE_TO_PTR(pret->u.array.tab);
-        ret_arr->arr[pos++] = str;
+        ret_arr->arr[pos] = str;
+        js_write_barrier(ctx, &ret_arr->arr[pos]);
+        pos++;
     }
     
     for(i = 0, j = 0; j < prop_count; i++) {
         JSProperty *pr;
         p = JS_VALUE_TO_PTR(argv[0]);
-        arr = JS_VALUE_TO_PTR(p->props);
+        arr = js_get_prop_keys(p);
         pr = (JSProperty *)&arr->arr[2 + hash_mask + 1 + 3 * i];
         /* exclude deleted properties */
         if (pr->key != JS_UNINITIALIZED) {
-            JS_PUSH_VALUE(ctx, ret);
-            str = JS_ToString(ctx, pr->key);
-            JS_POP_VALUE(ctx, ret);
-            if (JS_IsException(str))
-                return str;
+            if (JS_IsPtr(pr->key)) {
+                /* already a string */
+                str = pr->key;
+            } else {
+                JS_PUSH_VALUE(ctx, ret);
+                str = JS_ToString(ctx, pr->key);
+                JS_POP_VALUE(ctx, ret);
+                if (JS_IsException(str))
+                    return str;
+            }
             pret = JS_VALUE_TO_PTR(ret);
             ret_arr = JS_VALUE_TO_PTR(pret->u.array.tab);
-            ret_arr->arr[pos++] = str;
+            ret_arr->arr[pos] = str;
+            js_write_barrier(ctx, &ret_arr->arr[pos]);
+            pos++;
             j++;
         }
     }
@@ -13926,6 +17488,7 @@ JSValue js_error_constructor(JSContext *ctx, JSValue *this_val,
         p = JS_VALUE_TO_PTR(obj);
         p->u.error.message = js_get_atom(ctx, JS_ATOM_empty);
     }
+    js_write_barrier(ctx, &p->u.error.message);
     JS_PUSH_VALUE(ctx, obj);
     build_backtrace(ctx, obj, NULL, 0, 0, 1);
     JS_POP_VALUE(ctx, obj);
@@ -14024,6 +17587,7 @@ static int js_array_resize(JSContext *ctx, JSValue *this_val, int new_len)
             return -1;
         p = JS_VALUE_TO_PTR(*this_val);
         p->u.array.tab = new_tab;
+        js_write_barrier(ctx, &p->u.array.tab);
         arr = JS_VALUE_TO_PTR(p->u.array.tab);
         for(i = p->u.array.len; i < new_len; i++)
             arr->arr[i] = JS_UNDEFINED;
@@ -14112,6 +17676,8 @@ JSValue js_array_push(JSContext *ctx, JSValue *this_val,
     for(i = 0; i < argc; i++) {
         arr->arr[from + i] = argv[i];
     }
+    js_write_barrier(ctx, &p->u.array.tab);
+    js_write_barrier_range(ctx, arr->arr, new_len);
     return JS_NewShortInt(new_len);
 }
 
@@ -14147,6 +17713,7 @@ JSValue js_array_shift(JSContext *ctx, JSValue *this_val,
         ret = arr->arr[0];
         p->u.array.len--;
         memmove(arr->arr, arr->arr + 1, p->u.array.len * sizeof(JSValue));
+        js_write_barrier_range(ctx, arr->arr, p->u.array.len);
     } else {
         ret = JS_UNDEFINED;
     }
@@ -14234,6 +17801,7 @@ JSValue js_array_reverse(JSContext *ctx, JSValue *this_val,
     len = p->u.array.len;
     arr = JS_VALUE_TO_PTR(p->u.array.tab);
     js_reverse_val(arr->arr, len);
+    js_write_barrier_range(ctx, arr->arr, len);
     return *this_val;
 }
 
@@ -14433,6 +18001,7 @@ JSValue js_array_splice(JSContext *ctx, JSValue *this_val,
 
     for(i = 0; i < item_count; i++)
         arr->arr[start + i] = argv[2 + i];
+    js_write_barrier_range(ctx, arr->arr + start, new_len - start);
     
     return obj;
 }
@@ -14735,31 +18304,249 @@ static void js_array_sort_swap(size_t i1, size_t i2, void *opaque)
     tmp = tab[2 * i1 + 1];
     tab[2 * i1 + 1] = tab[2 * i2 + 1];
     tab[2 * i2 + 1] = tmp;
+    /* the compare function may have promoted 'tab' */
+    js_write_barrier(s->ctx, &tab[2 * i1]);
+    js_write_barrier(s->ctx, &tab[2 * i2]);
 }
 
-JSValue js_array_sort(JSContext *ctx, JSValue *this_val,
-                      int argc, JSValue *argv)
+/* specialized sorts: the comparisons are done natively and cannot
+   allocate memory or call JS code */
+typedef enum {
+    JS_SORT_GENERIC,
+    JS_SORT_INT_AS_STRING, /* short integers, default comparison */
+    JS_SORT_STRING, /* strings, default comparison */
+    JS_SORT_NUMBER_ASC, /* numbers, function (a, b) { return a - b; } */
+    JS_SORT_NUMBER_DESC, /* numbers, function (a, b) { return b - a; } */
+} JSSortKindEnum;
+
+typedef int JSSortCmpFunc(JSContext *ctx, JSValue a, JSValue b);
+
+static int js_count_digits(uint32_t a)
 {
-    JSValue *pfunc = &argv[0];
-    JSObject *p;
-    JSValue tab_val;
-    JSGCRef tab_val_ref;
-    JSValueArray *tab, *arr;
-    int i, len, n;
-    JSArraySortContext ss, *s = &ss;
-    
-    if (!JS_IsUndefined(*pfunc)) {
-        if (!JS_IsFunction(ctx, *pfunc))
-            return JS_ThrowTypeError(ctx, "not a function");
-    } else {
-        pfunc = NULL;
+    int n = 1;
+    while (a >= 10) {
+        a /= 10;
+        n++;
+    }
+    return n;
+}
+
+/* compare two integers as their decimal string representation */
+static int js_sort_cmp_int_as_string(JSContext *ctx, JSValue val1, JSValue val2)
+{
+    int a = JS_VALUE_GET_INT(val1), b = JS_VALUE_GET_INT(val2);
+    uint64_t a1, b1;
+    int la, lb, la0, lb0;
+
+    if (a == b)
+        return 0;
+    /* '-' is before the digits */
+    if (a < 0 || b < 0) {
+        if (a >= 0)
+            return 1;
+        if (b >= 0)
+            return -1;
+        a1 = -(int64_t)a;
+        b1 = -(int64_t)b;
+    } else {
+        a1 = a;
+        b1 = b;
+    }
+    /* scale the shortest number to the same number of digits */
+    la0 = la = js_count_digits(a1);
+    lb0 = lb = js_count_digits(b1);
+    for(; la < lb; la++)
+        a1 *= 10;
+    for(; lb < la; lb++)
+        b1 *= 10;
+    if (a1 != b1)
+        return (a1 > b1) - (a1 < b1);
+    /* a prefix is before the longer string */
+    return (la0 > lb0) - (la0 < lb0);
+}
+
+static int js_sort_cmp_string(JSContext *ctx, JSValue val1, JSValue val2)
+{
+    return js_string_compare(ctx, val1, val2);
+}
+
+static int js_sort_cmp_number_asc(JSContext *ctx, JSValue val1, JSValue val2)
+{
+    /* js_get_sort_kind() checked that the values are numbers */
+    double d1 = 0, d2 = 0;
+    if (JS_IsInt(val1) && JS_IsInt(val2)) {
+        int a = JS_VALUE_GET_INT(val1), b = JS_VALUE_GET_INT(val2);
+        return (a > b) - (a < b);
+    }
+    js_get_number(val1, &d1);
+    js_get_number(val2, &d2);
+    return (d1 > d2) - (d1 < d2);
+}
+
+static int js_sort_cmp_number_desc(JSContext *ctx, JSValue val1, JSValue val2)
+{
+    return js_sort_cmp_number_asc(ctx, val2, val1);
+}
+
+/* stable merge sort. 'tmp' must have at least 'n' elements. */
+static void js_merge_sort(JSContext *ctx, JSValue *tab, JSValue *tmp, int n,
+                          JSSortCmpFunc *cmp)
+{
+    JSValue *src, *dst, *t, v;
+    int width, i, j, k, lo, mid, hi;
+
+    /* insertion sort of small runs */
+    for(lo = 0; lo < n; lo += 8) {
+        hi = min_int(lo + 8, n);
+        for(i = lo + 1; i < hi; i++) {
+            v = tab[i];
+            for(j = i; j > lo && cmp(ctx, tab[j - 1], v) > 0; j--)
+                tab[j] = tab[j - 1];
+            tab[j] = v;
+        }
+    }
+    src = tab;
+    dst = tmp;
+    for(width = 8; width < n; width *= 2) {
+        for(lo = 0; lo < n; lo += 2 * width) {
+            mid = min_int(lo + width, n);
+            hi = min_int(mid + width, n);
+            i = lo;
+            j = mid;
+            k = lo;
+            while (i < mid && j < hi) {
+                if (cmp(ctx, src[j], src[i]) < 0)
+                    dst[k++] = src[j++];
+                else
+                    dst[k++] = src[i++];
+            }
+            while (i < mid)
+                dst[k++] = src[i++];
+            while (j < hi)
+                dst[k++] = src[j++];
+        }
+        t = src;
+        src = dst;
+        dst = t;
+    }
+    if (src != tab)
+        memcpy(tab, src, n * sizeof(JSValue));
+}
+
+/* return the number comparison implemented by the function 'func'
+   or JS_SORT_GENERIC */
+static JSSortKindEnum js_get_sort_func_kind(JSContext *ctx, JSValue func)
+{
+    JSObject *p;
+    JSFunctionBytecode *b;
+    JSByteArray *arr;
+
+    p = JS_VALUE_TO_PTR(func);
+    if (p->class_id != JS_CLASS_CLOSURE)
+        return JS_SORT_GENERIC;
+    b = JS_VALUE_TO_PTR(p->u.closure.func_bytecode);
+    if (b->byte_code == JS_NULL || b->arg_count != 2)
+        return JS_SORT_GENERIC;
+    arr = JS_VALUE_TO_PTR(b->byte_code);
+    if (arr->size != 4 || arr->buf[2] != OP_sub || arr->buf[3] != OP_return)
+        return JS_SORT_GENERIC;
+    if (arr->buf[0] == OP_get_arg0 && arr->buf[1] == OP_get_arg1)
+        return JS_SORT_NUMBER_ASC;
+    else if (arr->buf[0] == OP_get_arg1 && arr->buf[1] == OP_get_arg0)
+        return JS_SORT_NUMBER_DESC;
+    else
+        return JS_SORT_GENERIC;
+}
+
+static JSSortKindEnum js_get_sort_kind(JSContext *ctx, JSObject *p,
+                                       JSValue *pfunc)
+{
+    JSValueArray *arr;
+    JSValue val;
+    JSSortKindEnum kind;
+    int i, len;
+    double d;
+    
+    len = p->u.array.len;
+    if (len < 2)
+        return JS_SORT_GENERIC;
+    arr = JS_VALUE_TO_PTR(p->u.array.tab);
+    if (pfunc) {
+        kind = js_get_sort_func_kind(ctx, *pfunc);
+        if (kind == JS_SORT_GENERIC)
+            return kind;
+        /* the subtraction of NaN values is not a consistent
+           comparison */
+        for(i = 0; i < len; i++) {
+            if (!js_get_number(arr->arr[i], &d) || isnan(d))
+                return JS_SORT_GENERIC;
+        }
+    } else {
+        val = arr->arr[0];
+        if (JS_IsInt(val)) {
+            kind = JS_SORT_INT_AS_STRING;
+            for(i = 1; i < len; i++) {
+                if (!JS_IsInt(arr->arr[i]))
+                    return JS_SORT_GENERIC;
+            }
+        } else if (JS_IsString(ctx, val)) {
+            kind = JS_SORT_STRING;
+            for(i = 1; i < len; i++) {
+                if (!JS_IsString(ctx, arr->arr[i]))
+                    return JS_SORT_GENERIC;
+            }
+        } else {
+            kind = JS_SORT_GENERIC;
+        }
+    }
+    return kind;
+}
+
+JSValue js_array_sort(JSContext *ctx, JSValue *this_val,
+                      int argc, JSValue *argv)
+{
+    JSValue *pfunc = &argv[0];
+    JSObject *p;
+    JSValue tab_val;
+    JSGCRef tab_val_ref;
+    JSValueArray *tab, *arr;
+    int i, len, n;
+    JSArraySortContext ss, *s = &ss;
+    JSSortKindEnum kind;
+    
+    if (!JS_IsUndefined(*pfunc)) {
+        if (!JS_IsFunction(ctx, *pfunc))
+            return JS_ThrowTypeError(ctx, "not a function");
+    } else {
+        pfunc = NULL;
     }
     p = js_get_array(ctx, *this_val);
     if (!p)
         return JS_EXCEPTION;
 
-    /* create a temporary array for sorting */
     len = p->u.array.len;
+    kind = js_get_sort_kind(ctx, p, pfunc);
+    if (kind != JS_SORT_GENERIC) {
+        static JSSortCmpFunc * const sort_cmp_func[] = {
+            [JS_SORT_INT_AS_STRING] = js_sort_cmp_int_as_string,
+            [JS_SORT_STRING] = js_sort_cmp_string,
+            [JS_SORT_NUMBER_ASC] = js_sort_cmp_number_asc,
+            [JS_SORT_NUMBER_DESC] = js_sort_cmp_number_desc,
+        };
+        /* no JS code is called, so the array cannot be modified
+           during the sort */
+        tab = js_alloc_value_array(ctx, 0, len);
+        if (!tab)
+            return JS_EXCEPTION;
+        p = JS_VALUE_TO_PTR(*this_val);
+        arr = JS_VALUE_TO_PTR(p->u.array.tab);
+        js_merge_sort(ctx, arr->arr, tab->arr, len, sort_cmp_func[kind]);
+        js_write_barrier_range(ctx, arr->arr, len);
+        js_free(ctx, tab);
+        return *this_val;
+    }
+    
+    /* create a temporary array for sorting */
     tab = js_alloc_value_array(ctx, 0, len * 2);
     if (!tab)
         return JS_EXCEPTION;
@@ -14797,6 +18584,7 @@ JSValue js_array_sort(JSContext *ctx, JSValue *this_val,
     for(i = 0; i < len; i++) {
         arr->arr[i] = tab->arr[2 * i];
     }
+    js_write_barrier_range(ctx, arr->arr, len);
     js_free(ctx, tab);
     return *this_val;
 }
@@ -14891,17 +18679,10 @@ double js_math_fround(double a)
     return (float)a;
 }
 
-JSValue js_math_imul(JSContext *ctx, JSValue *this_val,
-                     int argc, JSValue *argv)
+int32_t js_math_imul(int32_t a, int32_t b)
 {
-    int a, b;
-
-    if (JS_ToInt32(ctx, &a, argv[0]))
-        return JS_EXCEPTION;
-    if (JS_ToInt32(ctx, &b, argv[1]))
-        return JS_EXCEPTION;
     /* purposely ignoring overflow */
-    return JS_NewInt32(ctx, (uint32_t)a * (uint32_t)b);
+    return (uint32_t)a * (uint32_t)b;
 }
 
 JSValue js_math_clz32(JSContext *ctx, JSValue *this_val,
@@ -14918,30 +18699,6 @@ JSValue js_math_clz32(JSContext *ctx, JSValue *this_val,
     return JS_NewInt32(ctx, r);
 }
 
-JSValue js_math_atan2(JSContext *ctx, JSValue *this_val,
-                      int argc, JSValue *argv)
-{
-    double y, x;
-    
-    if (JS_ToNumber(ctx, &y, argv[0]))
-        return JS_EXCEPTION;
-    if (JS_ToNumber(ctx, &x, argv[1]))
-        return JS_EXCEPTION;
-    return JS_NewFloat64(ctx, js_atan2(y, x));
-}
-
-JSValue js_math_pow(JSContext *ctx, JSValue *this_val,
-                    int argc, JSValue *argv)
-{
-    double y, x;
-    
-    if (JS_ToNumber(ctx, &x, argv[0]))
-        return JS_EXCEPTION;
-    if (JS_ToNumber(ctx, &y, argv[1]))
-        return JS_EXCEPTION;
-    return JS_NewFloat64(ctx, js_pow(x, y));
-}
-
 /* xorshift* random number generator by Marsaglia */
 static uint64_t xorshift64star(uint64_t *pstate)
 {
@@ -15151,6 +18908,75 @@ static JSObject *get_typed_array(JSContext *ctx, JSValue val)
     return p;
 }
 
+/* Return a pointer to the first element of the typed array. It is
+   only valid until the next allocation. */
+static uint8_t *typed_array_get_buf(JSObject *p)
+{
+    JSObject *pbuffer;
+    JSByteArray *arr;
+    int size_log2;
+    
+    size_log2 = typed_array_size_log2[p->class_id - JS_CLASS_UINT8C_ARRAY];
+    pbuffer = JS_VALUE_TO_PTR(p->u.typed_array.buffer);
+    arr = JS_VALUE_TO_PTR(pbuffer->u.array_buffer.byte_buffer);
+    return arr->buf + ((size_t)p->u.typed_array.offset << size_log2);
+}
+
+static double typed_array_get_float64(int class_id, const uint8_t *buf,
+                                      uint32_t idx)
+{
+    switch(class_id) {
+    default:
+    case JS_CLASS_UINT8C_ARRAY:
+    case JS_CLASS_UINT8_ARRAY:
+        return *((uint8_t *)buf + idx);
+    case JS_CLASS_INT8_ARRAY:
+        return *((int8_t *)buf + idx);
+    case JS_CLASS_INT16_ARRAY:
+        return *((int16_t *)buf + idx);
+    case JS_CLASS_UINT16_ARRAY:
+        return *((uint16_t *)buf + idx);
+    case JS_CLASS_INT32_ARRAY:
+        return *((int32_t *)buf + idx);
+    case JS_CLASS_UINT32_ARRAY:
+        return *((uint32_t *)buf + idx);
+    case JS_CLASS_FLOAT32_ARRAY:
+        return *((float *)buf + idx);
+    case JS_CLASS_FLOAT64_ARRAY:
+        return *((double *)buf + idx);
+    }
+}
+
+/* same conversion as an assignment to the element */
+static void typed_array_set_float64(int class_id, uint8_t *buf,
+                                    uint32_t idx, double d)
+{
+    switch(class_id) {
+    default:
+    case JS_CLASS_UINT8C_ARRAY:
+        *((uint8_t *)buf + idx) = js_float64_to_uint8_clamp(d);
+        break;
+    case JS_CLASS_INT8_ARRAY:
+    case JS_CLASS_UINT8_ARRAY:
+        *((uint8_t *)buf + idx) = js_float64_to_int32(d);
+        break;
+    case JS_CLASS_INT16_ARRAY:
+    case JS_CLASS_UINT16_ARRAY:
+        *((uint16_t *)buf + idx) = js_float64_to_int32(d);
+        break;
+    case JS_CLASS_INT32_ARRAY:
+    case JS_CLASS_UINT32_ARRAY:
+        *((uint32_t *)buf + idx) = js_float64_to_int32(d);
+        break;
+    case JS_CLASS_FLOAT32_ARRAY:
+        *((float *)buf + idx) = d;
+        break;
+    case JS_CLASS_FLOAT64_ARRAY:
+        *((double *)buf + idx) = d;
+        break;
+    }
+}
+
 JSValue js_typed_array_get_length(JSContext *ctx, JSValue *this_val,
                                   int argc, JSValue *argv, int magic)
 {
@@ -15216,6 +19042,457 @@ JSValue js_typed_array_subarray(JSContext *ctx, JSValue *this_val,
     return obj;
 }
 
+JSValue js_typed_array_set(JSContext *ctx, JSValue *this_val,
+                           int argc, JSValue *argv)
+{
+    JSObject *p, *p1;
+    JSByteArray *tmp;
+    uint8_t *dst, *src;
+    int offset, len, src_len, size_log2, i;
+    JSValue val;
+    
+    p = get_typed_array(ctx, *this_val);
+    if (!p)
+        return JS_EXCEPTION;
+    offset = 0;
+    if (argc > 1) {
+        if (JS_ToInt32Sat(ctx, &offset, argv[1]))
+            return JS_EXCEPTION;
+        if (offset < 0)
+            goto invalid_offset;
+    }
+    if (!JS_IsObject(ctx, argv[0]))
+        return JS_ThrowTypeError(ctx, "not an object");
+    p = JS_VALUE_TO_PTR(*this_val);
+    p1 = JS_VALUE_TO_PTR(argv[0]);
+    len = p->u.typed_array.len;
+    if (p1->class_id >= JS_CLASS_UINT8C_ARRAY &&
+        p1->class_id <= JS_CLASS_FLOAT64_ARRAY) {
+        src_len = p1->u.typed_array.len;
+        if (offset > len || src_len > len - offset)
+            goto invalid_offset;
+        size_log2 = typed_array_size_log2[p->class_id - JS_CLASS_UINT8C_ARRAY];
+        if (p1->class_id == p->class_id) {
+            /* same element type: raw copy. The arrays may overlap. */
+            memmove(typed_array_get_buf(p) + ((size_t)offset << size_log2),
+                    typed_array_get_buf(p1), (size_t)src_len << size_log2);
+        } else {
+            tmp = NULL;
+            if (p1->u.typed_array.buffer == p->u.typed_array.buffer) {
+                /* the source must be copied before being converted */
+                size_log2 = typed_array_size_log2[p1->class_id - JS_CLASS_UINT8C_ARRAY];
+                tmp = js_alloc_byte_array(ctx, src_len << size_log2);
+                if (!tmp)
+                    return JS_EXCEPTION;
+                p = JS_VALUE_TO_PTR(*this_val);
+                p1 = JS_VALUE_TO_PTR(argv[0]);
+                memcpy(tmp->buf, typed_array_get_buf(p1), src_len << size_log2);
+                src = tmp->buf;
+            } else {
+                src = typed_array_get_buf(p1);
+            }
+            dst = typed_array_get_buf(p);
+            for(i = 0; i < src_len; i++) {
+                typed_array_set_float64(p->class_id, dst, offset + i,
+                                        typed_array_get_float64(p1->class_id, src, i));
+            }
+            if (tmp)
+                js_free(ctx, tmp);
+        }
+    } else if (p1->class_id == JS_CLASS_ARRAY) {
+        src_len = p1->u.array.len;
+        if (offset > len || src_len > len - offset)
+            goto invalid_offset;
+        /* the elements may be arbitrary values, so use the generic
+           conversion */
+        for(i = 0; i < src_len; i++) {
+            val = JS_GetProperty(ctx, argv[0], JS_NewShortInt(i));
+            if (JS_IsException(val))
+                return val;
+            val = JS_SetPropertyInternal(ctx, *this_val,
+                                         JS_NewShortInt(offset + i), val, FALSE);
+            if (JS_IsException(val))
+                return val;
+        }
+    } else {
+        return JS_ThrowTypeError(ctx, "unsupported object class");
+    }
+    return JS_UNDEFINED;
+ invalid_offset:
+    return JS_ThrowRangeError(ctx, "invalid offset");
+}
+
+JSValue js_typed_array_fill(JSContext *ctx, JSValue *this_val,
+                            int argc, JSValue *argv)
+{
+    JSObject *p;
+    uint8_t *buf;
+    int len, start, final, v, i;
+    double d;
+    
+    p = get_typed_array(ctx, *this_val);
+    if (!p)
+        return JS_EXCEPTION;
+    len = p->u.typed_array.len;
+    v = 0;
+    d = 0;
+    /* the value is converted once */
+    switch(p->class_id) {
+    case JS_CLASS_UINT8C_ARRAY:
+        if (JS_ToUint8Clamp(ctx, &v, argv[0]))
+            return JS_EXCEPTION;
+        break;
+    case JS_CLASS_FLOAT32_ARRAY:
+    case JS_CLASS_FLOAT64_ARRAY:
+        if (JS_ToNumber(ctx, &d, argv[0]))
+            return JS_EXCEPTION;
+        break;
+    default:
+        if (JS_ToInt32(ctx, &v, argv[0]))
+            return JS_EXCEPTION;
+        break;
+    }
+    start = 0;
+    if (argc > 1) {
+        if (JS_ToInt32Clamp(ctx, &start, argv[1], 0, len, len))
+            return JS_EXCEPTION;
+    }
+    final = len;
+    if (argc > 2 && !JS_IsUndefined(argv[2])) {
+        if (JS_ToInt32Clamp(ctx, &final, argv[2], 0, len, len))
+            return JS_EXCEPTION;
+    }
+    p = JS_VALUE_TO_PTR(*this_val);
+    buf = typed_array_get_buf(p);
+    switch(p->class_id) {
+    default:
+    case JS_CLASS_UINT8C_ARRAY:
+    case JS_CLASS_INT8_ARRAY:
+    case JS_CLASS_UINT8_ARRAY:
+        if (final > start)
+            memset(buf + start, v, final - start);
+        break;
+    case JS_CLASS_INT16_ARRAY:
+    case JS_CLASS_UINT16_ARRAY:
+        for(i = start; i < final; i++)
+            ((uint16_t *)buf)[i] = v;
+        break;
+    case JS_CLASS_INT32_ARRAY:
+    case JS_CLASS_UINT32_ARRAY:
+        for(i = start; i < final; i++)
+            ((uint32_t *)buf)[i] = v;
+        break;
+    case JS_CLASS_FLOAT32_ARRAY:
+        {
+            float f = d;
+            for(i = start; i < final; i++)
+                ((float *)buf)[i] = f;
+        }
+        break;
+    case JS_CLASS_FLOAT64_ARRAY:
+        for(i = start; i < final; i++)
+            ((double *)buf)[i] = d;
+        break;
+    }
+    return *this_val;
+}
+
+JSValue js_typed_array_copyWithin(JSContext *ctx, JSValue *this_val,
+                                  int argc, JSValue *argv)
+{
+    JSObject *p;
+    uint8_t *buf;
+    int len, to, from, final, count, size_log2;
+    
+    p = get_typed_array(ctx, *this_val);
+    if (!p)
+        return JS_EXCEPTION;
+    len = p->u.typed_array.len;
+    if (JS_ToInt32Clamp(ctx, &to, argv[0], 0, len, len))
+        return JS_EXCEPTION;
+    if (JS_ToInt32Clamp(ctx, &from, argv[1], 0, len, len))
+        return JS_EXCEPTION;
+    final = len;
+    if (argc > 2 && !JS_IsUndefined(argv[2])) {
+        if (JS_ToInt32Clamp(ctx, &final, argv[2], 0, len, len))
+            return JS_EXCEPTION;
+    }
+    count = min_int(final - from, len - to);
+    if (count > 0) {
+        p = JS_VALUE_TO_PTR(*this_val);
+        size_log2 = typed_array_size_log2[p->class_id - JS_CLASS_UINT8C_ARRAY];
+        buf = typed_array_get_buf(p);
+        memmove(buf + ((size_t)to << size_log2),
+                buf + ((size_t)from << size_log2),
+                (size_t)count << size_log2);
+    }
+    return *this_val;
+}
+
+JSValue js_typed_array_slice(JSContext *ctx, JSValue *this_val,
+                             int argc, JSValue *argv)
+{
+    JSObject *p, *p1;
+    int len, start, final, count, size_log2;
+    JSValue val, obj;
+    
+    p = get_typed_array(ctx, *this_val);
+    if (!p)
+        return JS_EXCEPTION;
+    len = p->u.typed_array.len;
+    if (JS_ToInt32Clamp(ctx, &start, argv[0], 0, len, len))
+        return JS_EXCEPTION;
+    final = len;
+    if (!JS_IsUndefined(argv[1])) {
+        if (JS_ToInt32Clamp(ctx, &final, argv[1], 0, len, len))
+            return JS_EXCEPTION;
+    }
+    count = max_int(final - start, 0);
+    p = JS_VALUE_TO_PTR(*this_val);
+    val = JS_NewShortInt(count);
+    obj = js_typed_array_constructor(ctx, NULL, 1 | FRAME_CF_CTOR, &val,
+                                     p->class_id);
+    if (JS_IsException(obj))
+        return obj;
+    p = JS_VALUE_TO_PTR(*this_val);
+    p1 = JS_VALUE_TO_PTR(obj);
+    size_log2 = typed_array_size_log2[p->class_id - JS_CLASS_UINT8C_ARRAY];
+    memcpy(typed_array_get_buf(p1),
+           typed_array_get_buf(p) + ((size_t)start << size_log2),
+           (size_t)count << size_log2);
+    return obj;
+}
+
+/* return the index of 'd' in the elements [k, len) (or [0, k] if
+   'is_lastIndexOf') or -1 if not found */
+static int typed_array_index_of(JSObject *p, double d, int k,
+                                BOOL is_lastIndexOf, BOOL is_includes)
+{
+    uint8_t *buf, *ptr;
+    int len, v;
+    double min, max;
+
+    buf = typed_array_get_buf(p);
+    len = p->u.typed_array.len;
+
+#define TA_SEARCH(type, val)                    \
+    do {                                        \
+        type v1 = (val);                        \
+        if (is_lastIndexOf) {                   \
+            for(; k >= 0; k--) {                \
+                if (((type *)buf)[k] == v1)     \
+                    return k;                   \
+            }                                   \
+        } else {                                \
+            for(; k < len; k++) {               \
+                if (((type *)buf)[k] == v1)     \
+                    return k;                   \
+            }                                   \
+        }                                       \
+    } while (0)
+
+    switch(p->class_id) {
+    case JS_CLASS_FLOAT32_ARRAY:
+    case JS_CLASS_FLOAT64_ARRAY:
+        if (isnan(d)) {
+            /* NaN is only found by includes() */
+            if (!is_includes)
+                return -1;
+            for(; k < len; k++) {
+                if (isnan(typed_array_get_float64(p->class_id, buf, k)))
+                    return k;
+            }
+            return -1;
+        }
+        if (p->class_id == JS_CLASS_FLOAT32_ARRAY) {
+            /* a float32 element can only be equal to a float32 value */
+            if ((float)d != d)
+                return -1;
+            TA_SEARCH(float, d);
+        } else {
+            TA_SEARCH(double, d);
+        }
+        return -1;
+    default:
+        break;
+    }
+
+    /* the integer arrays can only contain the integers in the range
+       of their type */
+    switch(p->class_id) {
+    default:
+    case JS_CLASS_UINT8C_ARRAY:
+    case JS_CLASS_UINT8_ARRAY:
+        min = 0;
+        max = UINT8_MAX;
+        break;
+    case JS_CLASS_INT8_ARRAY:
+        min = INT8_MIN;
+        max = INT8_MAX;
+        break;
+    case JS_CLASS_INT16_ARRAY:
+        min = INT16_MIN;
+        max = INT16_MAX;
+        break;
+    case JS_CLASS_UINT16_ARRAY:
+        min = 0;
+        max = UINT16_MAX;
+        break;
+    case JS_CLASS_INT32_ARRAY:
+        min = INT32_MIN;
+        max = INT32_MAX;
+        break;
+    case JS_CLASS_UINT32_ARRAY:
+        min = 0;
+        max = UINT32_MAX;
+        break;
+    }
+    if (!(d >= min && d <= max) || (int64_t)d != d)
+        return -1;
+    v = (int64_t)d;
+    switch(p->class_id) {
+    default:
+    case JS_CLASS_UINT8C_ARRAY:
+    case JS_CLASS_INT8_ARRAY:
+    case JS_CLASS_UINT8_ARRAY:
+        if (!is_lastIndexOf) {
+            if (k >= len)
+                return -1;
+            ptr = memchr(buf + k, v & 0xff, len - k);
+            return ptr ? ptr - buf : -1;
+        }
+        TA_SEARCH(uint8_t, v);
+        break;
+    case JS_CLASS_INT16_ARRAY:
+    case JS_CLASS_UINT16_ARRAY:
+        TA_SEARCH(uint16_t, v);
+        break;
+    case JS_CLASS_INT32_ARRAY:
+    case JS_CLASS_UINT32_ARRAY:
+        TA_SEARCH(uint32_t, v);
+        break;
+    }
+#undef TA_SEARCH
+    return -1;
+}
+
+JSValue js_typed_array_indexOf(JSContext *ctx, JSValue *this_val,
+                               int argc, JSValue *argv, int magic)
+{
+    JSObject *p;
+    int len, n, res;
+    BOOL is_lastIndexOf;
+    double d;
+    
+    p = get_typed_array(ctx, *this_val);
+    if (!p)
+        return JS_EXCEPTION;
+    len = p->u.typed_array.len;
+    is_lastIndexOf = (magic == 1);
+    if (is_lastIndexOf) {
+        n = len - 1;
+    } else {
+        n = 0;
+    }
+    if (argc > 1) {
+        if (JS_ToInt32Clamp(ctx, &n, argv[1],
+                            -is_lastIndexOf, len - is_lastIndexOf, len))
+            return JS_EXCEPTION;
+    }
+    res = -1;
+    /* the elements are numbers so no other value can be found */
+    if (JS_IsNumber(ctx, argv[0])) {
+        JS_ToNumber(ctx, &d, argv[0]); /* cannot fail */
+        p = JS_VALUE_TO_PTR(*this_val);
+        res = typed_array_index_of(p, d, n, is_lastIndexOf, magic == 2);
+    }
+    if (magic == 2)
+        return JS_NewBool(res >= 0);
+    else
+        return JS_NewShortInt(res);
+}
+
+JSValue js_typed_array_reduce(JSContext *ctx, JSValue *this_val,
+                              int argc, JSValue *argv, int special)
+{
+    JSObject *p;
+    JSValue acc, val, *pfunc;
+    JSGCRef acc_ref;
+    int len, k, k1, ret;
+
+    p = get_typed_array(ctx, *this_val);
+    if (!p)
+        return JS_EXCEPTION;
+    len = p->u.typed_array.len;
+    pfunc = &argv[0];
+
+    if (!JS_IsFunction(ctx, *pfunc))
+        return JS_ThrowTypeError(ctx, "not a function");
+
+    k = 0;
+    if (argc > 1) {
+        acc = argv[1];
+    } else {
+        if (len == 0)
+            return JS_ThrowTypeError(ctx, "empty array");
+        k1 = (special == js_special_reduceRight) ? len - k - 1 : k;
+        acc = JS_GetProperty(ctx, *this_val, JS_NewShortInt(k1));
+        if (JS_IsException(acc))
+            return JS_EXCEPTION;
+        k++;
+    }
+    for (; k < len; k++) {
+        k1 = (special == js_special_reduceRight) ? len - k - 1 : k;
+        JS_PUSH_VALUE(ctx, acc);
+        ret = JS_StackCheck(ctx, 6);
+        if (!ret) {
+            /* the length of a typed array cannot change */
+            val = JS_GetProperty(ctx, *this_val, JS_NewShortInt(k1));
+            ret = JS_IsException(val);
+        }
+        JS_POP_VALUE(ctx, acc);
+        if (ret)
+            return JS_EXCEPTION;
+        JS_PushArg(ctx, *this_val);
+        JS_PushArg(ctx, JS_NewShortInt(k1));
+        JS_PushArg(ctx, val);
+        JS_PushArg(ctx, acc); /* arg0 */
+        JS_PushArg(ctx, *pfunc); /* func */
+        JS_PushArg(ctx, JS_UNDEFINED); /* this */
+        acc = JS_Call(ctx, 4);
+        if (JS_IsException(acc))
+            return JS_EXCEPTION;
+    }
+    return acc;
+}
+
+/* Return a pointer to the contents of an ArrayBuffer or to the
+   elements of a typed array and its length in bytes in '*plen'. Return
+   NULL if 'val' is neither. The pointer is only valid until the next
+   allocation in the context because the GC may move the data. */
+uint8_t *JS_GetArrayBuffer(JSContext *ctx, size_t *plen, JSValue val)
+{
+    JSObject *p;
+    JSByteArray *arr;
+    int size_log2;
+
+    if (!JS_IsObject(ctx, val))
+        return NULL;
+    p = JS_VALUE_TO_PTR(val);
+    if (p->class_id == JS_CLASS_ARRAY_BUFFER) {
+        arr = JS_VALUE_TO_PTR(p->u.array_buffer.byte_buffer);
+        *plen = arr->size;
+        return arr->buf;
+    } else if (p->class_id >= JS_CLASS_UINT8C_ARRAY &&
+               p->class_id <= JS_CLASS_FLOAT64_ARRAY) {
+        size_log2 = typed_array_size_log2[p->class_id - JS_CLASS_UINT8C_ARRAY];
+        *plen = (size_t)p->u.typed_array.len << size_log2;
+        return typed_array_get_buf(p);
+    } else {
+        return NULL;
+    }
+}
+
 /* Date */
 
 JSValue js_date_constructor(JSContext *ctx, JSValue *this_val,
@@ -15270,66 +19547,155 @@ JSValue js_json_parse(JSContext *ctx, JSValue *this_val,
     return JS_Parse2(ctx, val, NULL, 0, "<input>", JS_EVAL_JSON);
 }
 
+/* return the escaped length of the UTF-8 sequence starting at 'p', 0
+   if no escape is necessary. Unpaired surrogates are escaped. */
+static inline int json_escape_len(const uint8_t *p)
+{
+    int c = p[0];
+    if (c < 32) {
+        if (c == '\t' || c == '\r' || c == '\n' || c == '\b' || c == '\f')
+            return 2;
+        else
+            return 6;
+    } else if (c == '\"' || c == '\\') {
+        return 2;
+    } else if (c == 0xed && p[1] >= 0xa0) {
+        return 6;
+    } else {
+        return 0;
+    }
+}
+
 static int js_to_quoted_string(JSContext *ctx, StringBuffer *b, JSValue str)
 {
-    int i, c;
+    int i, c, len, out_len, n;
+    BOOL is_ascii;
     JSStringCharBuf buf;
     JSString *p;
     JSGCRef str_ref;
+    uint8_t *q;
     size_t clen;
-
+    static const char hex_digits[16] = "0123456789abcdef";
+    
+    /* compute the quoted length so that the output is written at once */
+    p = get_string_ptr(ctx, &buf, str);
+    len = p->len;
+    out_len = len + 2;
+    is_ascii = TRUE;
+    for(i = 0; i < len; i++) {
+        c = p->buf[i];
+        if (c >= 0x80) {
+            if (c == 0xed && p->buf[i + 1] >= 0xa0) {
+                /* unpaired surrogate */
+                out_len += 3;
+                i += 2;
+            } else {
+                is_ascii = FALSE;
+            }
+        } else {
+            n = json_escape_len(p->buf + i);
+            if (n != 0)
+                out_len += n - 1;
+        }
+    }
+    
     JS_PUSH_VALUE(ctx, str);
-    string_buffer_putc(ctx, b, '\"');
+    q = string_buffer_reserve(ctx, b, out_len);
+    JS_POP_VALUE(ctx, str);
+    if (!q)
+        return -1;
+    p = get_string_ptr(ctx, &buf, str);
+    b->len += out_len;
+    b->is_ascii &= is_ascii;
 
+    *q++ = '\"';
     i = 0;
-    for(;;) {
-        /* XXX: inefficient */
-        p = get_string_ptr(ctx, &buf, str_ref.val);
-        if (i >= p->len)
+    while (i < len) {
+        c = p->buf[i];
+        switch(json_escape_len(p->buf + i)) {
+        case 0:
+            *q++ = c;
+            i++;
             break;
-        c = utf8_get(p->buf + i, &clen);
-        i += clen;
-
-        switch(c) {
-        case '\t':
-            c = 't';
-            goto quote;
-        case '\r':
-            c = 'r';
-            goto quote;
-        case '\n':
-            c = 'n';
-            goto quote;
-        case '\b':
-            c = 'b';
-            goto quote;
-        case '\f':
-            c = 'f';
-            goto quote;
-        case '\"':
-        case '\\':
-        quote:
-            string_buffer_putc(ctx, b, '\\');
-            string_buffer_putc(ctx, b, c);
+        case 2:
+            switch(c) {
+            case '\t':
+                c = 't';
+                break;
+            case '\r':
+                c = 'r';
+                break;
+            case '\n':
+                c = 'n';
+                break;
+            case '\b':
+                c = 'b';
+                break;
+            case '\f':
+                c = 'f';
+                break;
+            }
+            *q++ = '\\';
+            *q++ = c;
+            i++;
             break;
         default:
-            if (c < 32 || (c >= 0xd800 && c < 0xe000)) {
-                char buf[7];
-                js_snprintf(buf, sizeof(buf), "\\u%04x", c);
-                string_buffer_puts(ctx, b, buf);
-            } else {
-                string_buffer_putc(ctx, b, c);
-            }
+            c = utf8_get(p->buf + i, &clen);
+            i += clen;
+            *q++ = '\\';
+            *q++ = 'u';
+            *q++ = hex_digits[(c >> 12) & 0xf];
+            *q++ = hex_digits[(c >> 8) & 0xf];
+            *q++ = hex_digits[(c >> 4) & 0xf];
+            *q++ = hex_digits[c & 0xf];
             break;
         }
     }
-    string_buffer_putc(ctx, b, '\"');
-    JS_POP_VALUE(ctx, str);
+    *q++ = '\"';
     return 0;
 }
 
 #define JSON_REC_SIZE 3
 
+static int json_put_ascii(JSContext *ctx, StringBuffer *b, const char *str, int len)
+{
+    uint8_t *q;
+    q = string_buffer_reserve(ctx, b, len);
+    if (!q)
+        return -1;
+    memcpy(q, str, len);
+    b->len += len;
+    return 0;
+}
+
+/* output 'val' if it does not need a stack frame. Return 1 if done,
+   0 if not handled, -1 if exception. */
+static int json_put_primitive(JSContext *ctx, StringBuffer *b, JSValue val)
+{
+    char buf[32]; /* enough for js_dtoa() */
+    double d;
+    
+    if (JS_IsInt(val)) {
+        return json_put_ascii(ctx, b, buf, i32toa(buf, JS_VALUE_GET_INT(val))) ? -1 : 1;
+    } else if (js_get_number(val, &d)) {
+        JSDTOATempMem tmp_mem; /* XXX: potentially large stack size */
+        if (!isfinite(d))
+            return json_put_ascii(ctx, b, "null", 4) ? -1 : 1;
+        return json_put_ascii(ctx, b, buf, js_dtoa(buf, d, 10, 0, JS_DTOA_FORMAT_FREE,
+                                                   &tmp_mem)) ? -1 : 1;
+    } else if (val == JS_TRUE) {
+        return json_put_ascii(ctx, b, "true", 4) ? -1 : 1;
+    } else if (val == JS_FALSE) {
+        return json_put_ascii(ctx, b, "false", 5) ? -1 : 1;
+    } else if (val == JS_NULL || val == JS_UNDEFINED) {
+        return json_put_ascii(ctx, b, "null", 4) ? -1 : 1;
+    } else if (JS_IsString(ctx, val)) {
+        return js_to_quoted_string(ctx, b, val) ? -1 : 1;
+    } else {
+        return 0;
+    }
+}
+
 static int check_circular_ref(JSContext *ctx, JSValue *stack_top, JSValue val)
 {
     JSValue *sp;
@@ -15390,28 +19756,127 @@ JSValue js_json_stringify(JSContext *ctx, JSValue *this_val,
                 /* array */
                 if (idx == 0)
                     string_buffer_putc(ctx, b, '[');
-                p = JS_VALUE_TO_PTR(ctx->sp[0]);
-                if (idx >= p->u.array.len) {
-                    /* end of array */
-                    string_buffer_putc(ctx, b, ']');
-                    ctx->sp += JSON_REC_SIZE;
-                } else {
+                for(;;) {
+                    p = JS_VALUE_TO_PTR(ctx->sp[0]);
+                    if (idx >= p->u.array.len) {
+                        /* end of array */
+                        string_buffer_putc(ctx, b, ']');
+                        ctx->sp += JSON_REC_SIZE;
+                        break;
+                    }
                     if (idx != 0)
                         string_buffer_putc(ctx, b, ',');
                     ctx->sp[1] = JS_NewShortInt(idx + 1);
-                    JS_PUSH_STRING_BUFFER(ctx, b);
-                    ret = JS_StackCheck(ctx, JSON_REC_SIZE);
-                    JS_POP_STRING_BUFFER(ctx, b);
-                    if (ret)
-                        goto fail;
                     p = JS_VALUE_TO_PTR(ctx->sp[0]);
                     arr = JS_VALUE_TO_PTR(p->u.array.tab);
-                    val = arr->arr[idx];
-                    if (check_circular_ref(ctx, stack_top, val))
+                    ret = json_put_primitive(ctx, b, arr->arr[idx]);
+                    if (ret < 0)
+                        goto fail;
+                    if (ret == 0) {
+                        JS_PUSH_STRING_BUFFER(ctx, b);
+                        ret = JS_StackCheck(ctx, JSON_REC_SIZE);
+                        JS_POP_STRING_BUFFER(ctx, b);
+                        if (ret)
+                            goto fail;
+                        p = JS_VALUE_TO_PTR(ctx->sp[0]);
+                        arr = JS_VALUE_TO_PTR(p->u.array.tab);
+                        val = arr->arr[idx];
+                        if (check_circular_ref(ctx, stack_top, val))
+                            goto fail;
+                        *--ctx->sp = JS_NULL;
+                        *--ctx->sp = JS_NewShortInt(0);
+                        *--ctx->sp = val;
+                        break;
+                    }
+                    idx++;
+                }
+            } else if (p->class_id == JS_CLASS_OBJECT) {
+                JSValueArray *arr;
+                JSProperty *pr;
+                JSValue val, key;
+                JSGCRef val_ref, key_ref;
+                int prop_count, hash_mask, pos;
+                BOOL first;
+                
+                /* plain object: iterate directly on the property
+                   table. 'keys' contains the next property position. */
+                if (idx == 0) {
+                    string_buffer_putc(ctx, b, '{');
+                    ctx->sp[2] = JS_NewShortInt(0);
+                }
+                first = (idx == 0);
+                for(;;) {
+                    p = JS_VALUE_TO_PTR(ctx->sp[0]);
+                    arr = js_get_prop_keys(p);
+                    prop_count = JS_VALUE_GET_INT(arr->arr[0]);
+                    hash_mask = JS_VALUE_GET_INT(arr->arr[1]);
+                    idx = JS_VALUE_GET_INT(ctx->sp[1]);
+                    pos = 2 + hash_mask + 1 + 3 * JS_VALUE_GET_INT(ctx->sp[2]);
+                    if (idx >= prop_count || pos + 3 > arr->size) {
+                        /* end of object */
+                        string_buffer_putc(ctx, b, '}');
+                        ctx->sp += JSON_REC_SIZE;
+                        break;
+                    }
+                    ctx->sp[2] = JS_NewShortInt(JS_VALUE_GET_INT(ctx->sp[2]) + 1);
+                    pr = (JSProperty *)&arr->arr[pos];
+                    /* exclude deleted properties */
+                    if (pr->key == JS_UNINITIALIZED)
+                        continue;
+                    ctx->sp[1] = JS_NewShortInt(idx + 1);
+                    key = pr->key;
+                    if (likely(pr->prop_type == JS_PROP_NORMAL)) {
+                        val = *js_get_prop_value_ptr(p, pr);
+                    } else {
+                        JS_PUSH_VALUE(ctx, key);
+                        JS_PUSH_STRING_BUFFER(ctx, b);
+                        val = JS_GetProperty(ctx, ctx->sp[0], key);
+                        JS_POP_STRING_BUFFER(ctx, b);
+                        JS_POP_VALUE(ctx, key);
+                        if (JS_IsException(val))
+                            goto fail;
+                    }
+                    /* skip undefined properties */
+                    if (JS_IsUndefined(val))
+                        continue;
+                    
+                    JS_PUSH_VALUE(ctx, val);
+                    JS_PUSH_VALUE(ctx, key);
+                    if (!first)
+                        string_buffer_putc(ctx, b, ',');
+                    first = FALSE;
+                    if (JS_IsInt(key_ref.val)) {
+                        char buf[16];
+                        int len;
+                        buf[0] = '\"';
+                        len = 1 + i32toa(buf + 1, JS_VALUE_GET_INT(key_ref.val));
+                        buf[len++] = '\"';
+                        ret = json_put_ascii(ctx, b, buf, len);
+                    } else {
+                        ret = js_to_quoted_string(ctx, b, key_ref.val);
+                    }
+                    string_buffer_putc(ctx, b, ':');
+                    JS_POP_VALUE(ctx, key);
+                    if (!ret)
+                        ret = json_put_primitive(ctx, b, val_ref.val);
+                    JS_POP_VALUE(ctx, val);
+                    if (ret < 0)
                         goto fail;
-                    *--ctx->sp = JS_NULL;
-                    *--ctx->sp = JS_NewShortInt(0);
-                    *--ctx->sp = val;
+                    if (ret == 0) {
+                        JS_PUSH_VALUE(ctx, val);
+                        JS_PUSH_STRING_BUFFER(ctx, b);
+                        ret = JS_StackCheck(ctx, JSON_REC_SIZE);
+                        JS_POP_STRING_BUFFER(ctx, b);
+                        JS_POP_VALUE(ctx, val);
+                        if (ret)
+                            goto fail;
+                        if (check_circular_ref(ctx, stack_top, val))
+                            goto fail;
+                        *--ctx->sp = JS_NULL;
+                        *--ctx->sp = JS_NewShortInt(0);
+                        *--ctx->sp = val;
+                        break;
+                    }
                 }
             } else {
                 JSValueArray *arr;
@@ -15422,7 +19887,9 @@ JSValue js_json_stringify(JSContext *ctx, JSValue *this_val,
                 /* object */
                 if (idx == 0) {
                     string_buffer_putc(ctx, b, '{');
+                    JS_PUSH_STRING_BUFFER(ctx, b);
                     ctx->sp[2] = js_object_keys(ctx, NULL, 1, &ctx->sp[0]);
+                    JS_POP_STRING_BUFFER(ctx, b);
                     if (JS_IsException(ctx->sp[2]))
                         goto fail;
                 }
@@ -15692,6 +20159,15 @@ static __maybe_unused void lre_dump_bytecode(const uint8_t *buf,
                 }
             }
             break;
+        case REOP_skip_literal:
+            {
+                int n, i;
+                n = buf[pos + 1];
+                len += n;
+                for(i = 0; i < n; i++)
+                    printf(" 0x%02x", buf[pos + 2 + i]);
+            }
+            break;
         default:
             break;
         }
@@ -16680,6 +21156,208 @@ static int re_compute_register_count(JSParseState *s, uint8_t *bc_buf, int bc_bu
     return stack_size_max;
 }
 
+#define RE_LITERAL_PREFIX_MAX 16
+
+static void re_bitmap_add_range(uint8_t *bitmap, uint32_t low, uint32_t high)
+{
+    uint8_t buf[UTF8_CHAR_LEN_MAX];
+    uint32_t c, c1;
+
+    for(c = low; c < high && c < 0x80; c++)
+        bitmap[c >> 3] |= 1 << (c & 7);
+    if (high <= 0x80)
+        return;
+    /* the first byte of the UTF-8 encoding is increasing with the
+       code point */
+    low = max_uint32(low, 0x80);
+    high = min_uint32(high - 1, 0x10ffff);
+    unicode_to_utf8(buf, low);
+    c = buf[0];
+    unicode_to_utf8(buf, high);
+    c1 = buf[0];
+    for(; c <= c1; c++)
+        bitmap[c >> 3] |= 1 << (c & 7);
+}
+
+/* Add to 'bitmap' the bytes which can start a match of the bytecode
+   at 'pos'. Return FALSE if the empty string can be matched or if
+   the bytecode is too complicated. */
+static BOOL re_get_first_bytes(uint8_t *bitmap, const uint8_t *bc_buf,
+                               int bc_len, int pos, int *pcount)
+{
+    int op, len, n, i;
+    uint32_t low, high;
+
+    for(;;) {
+        if (pos >= bc_len || --(*pcount) <= 0)
+            return FALSE;
+        op = bc_buf[pos];
+        len = reopcode_info[op].size;
+        switch(op) {
+        case REOP_char1:
+        case REOP_char2:
+        case REOP_char3:
+        case REOP_char4:
+            i = bc_buf[pos + 1];
+            bitmap[i >> 3] |= 1 << (i & 7);
+            return TRUE;
+        case REOP_dot:
+        case REOP_space:
+        case REOP_not_space:
+            for(i = 0; i < 0x80; i++) {
+                if ((op == REOP_dot && i != '\n' && i != '\r') ||
+                    (op == REOP_space && unicode_is_space_ascii(i)) ||
+                    (op == REOP_not_space && !unicode_is_space_ascii(i)))
+                    bitmap[i >> 3] |= 1 << (i & 7);
+            }
+            re_bitmap_add_range(bitmap, 0x80, 0x110000);
+            return TRUE;
+        case REOP_range8:
+            n = bc_buf[pos + 1];
+            for(i = 0; i < n; i++) {
+                low = bc_buf[pos + 2 + 2 * i];
+                high = bc_buf[pos + 2 + 2 * i + 1];
+                /* 0xff = max code point value */
+                if (i == n - 1 && high == 0xff)
+                    high = 0x110000;
+                re_bitmap_add_range(bitmap, low, high);
+            }
+            return TRUE;
+        case REOP_range:
+            n = get_u16(bc_buf + pos + 1);
+            for(i = 0; i < n; i++) {
+                low = get_u32(bc_buf + pos + 3 + 8 * i);
+                high = get_u32(bc_buf + pos + 3 + 8 * i + 4);
+                re_bitmap_add_range(bitmap, low, high);
+            }
+            return TRUE;
+        case REOP_save_start:
+        case REOP_save_end:
+        case REOP_save_reset:
+        case REOP_set_i32:
+        case REOP_set_char_pos:
+            /* the assertions can be ignored */
+        case REOP_line_start:
+        case REOP_line_start_m:
+        case REOP_line_end:
+        case REOP_line_end_m:
+        case REOP_word_boundary:
+        case REOP_not_word_boundary:
+            pos += len;
+            break;
+        case REOP_goto:
+            pos += len + (int)get_u32(bc_buf + pos + 1);
+            break;
+        case REOP_split_goto_first:
+        case REOP_split_next_first:
+            if (!re_get_first_bytes(bitmap, bc_buf, bc_len,
+                                    pos + len + (int)get_u32(bc_buf + pos + 1),
+                                    pcount))
+                return FALSE;
+            pos += len;
+            break;
+        default:
+            return FALSE;
+        }
+    }
+}
+
+/* return the length of the literal at the start of any match of the
+   bytecode at 'pos' */
+static int re_get_literal_prefix(uint8_t *buf, const uint8_t *bc_buf,
+                                 int bc_len, int pos)
+{
+    int op, len, n;
+
+    n = 0;
+    while (pos < bc_len) {
+        op = bc_buf[pos];
+        len = reopcode_info[op].size;
+        switch(op) {
+        case REOP_char1:
+        case REOP_char2:
+        case REOP_char3:
+        case REOP_char4:
+            if (n + len - 1 > RE_LITERAL_PREFIX_MAX)
+                return n;
+            memcpy(buf + n, bc_buf + pos + 1, len - 1);
+            n += len - 1;
+            break;
+        case REOP_save_start:
+        case REOP_save_end:
+        case REOP_save_reset:
+        case REOP_set_i32:
+        case REOP_set_char_pos:
+            break;
+        case REOP_line_start:
+        case REOP_line_start_m:
+        case REOP_word_boundary:
+        case REOP_not_word_boundary:
+            if (n != 0)
+                return n;
+            break;
+        default:
+            return n;
+        }
+        pos += len;
+    }
+    return n;
+}
+
+/* Insert a prefilter before the loop at the start of the bytecode of
+   non sticky regexps so that the positions which cannot start a
+   match are skipped quickly. */
+static void re_add_prefilter(JSParseState *s)
+{
+    uint8_t bitmap[32], prefix[RE_LITERAL_PREFIX_MAX];
+    uint8_t buf[2 + RE_LITERAL_PREFIX_MAX + 32];
+    JSByteArray *arr;
+    int pos, len, n, i, count, bc_len;
+
+    /* skip the header, the loop (split_goto_first, any, goto) and save_start */
+    pos = RE_HEADER_LEN + 11;
+    arr = JS_VALUE_TO_PTR(s->byte_code);
+    bc_len = s->byte_code_len;
+    n = re_get_literal_prefix(prefix, arr->buf, bc_len, pos);
+    if (n < 2) {
+        memset(bitmap, 0, sizeof(bitmap));
+        count = 256;
+        if (!re_get_first_bytes(bitmap, arr->buf, bc_len, pos, &count))
+            return;
+        n = 0;
+        for(i = 0; i < 256; i++) {
+            if (bitmap[i >> 3] & (1 << (i & 7))) {
+                prefix[0] = i;
+                n++;
+            }
+        }
+        /* not selective enough */
+        if (n > 128)
+            return;
+        /* a single possible first byte is handled as a literal */
+        if (n != 1)
+            n = 0;
+    }
+    if (n != 0) {
+        buf[0] = REOP_skip_literal;
+        buf[1] = n;
+        memcpy(buf + 2, prefix, n);
+        len = 2 + n;
+    } else {
+        buf[0] = REOP_skip_bitmap;
+        memcpy(buf + 1, bitmap, 32);
+        len = 1 + 32;
+    }
+    for(i = 0; i < len; i++)
+        emit_u8(s, 0);
+    arr = JS_VALUE_TO_PTR(s->byte_code);
+    memmove(arr->buf + RE_HEADER_LEN + len, arr->buf + RE_HEADER_LEN,
+            bc_len - RE_HEADER_LEN);
+    memcpy(arr->buf + RE_HEADER_LEN, buf, len);
+    /* the loop goes back to the prefilter */
+    put_u32(arr->buf + RE_HEADER_LEN + len + 7, -(len + 5 + 1 + 5));
+}
+
 /* return a JSByteArray. 'source' must be a string */
 static JSValue js_parse_regexp(JSParseState *s, int re_flags)
 {
@@ -16719,6 +21397,9 @@ static JSValue js_parse_regexp(JSParseState *s, int re_flags)
         re_compute_register_count(s, arr->buf + RE_HEADER_LEN,
                                   s->byte_code_len - RE_HEADER_LEN);
     arr->buf[RE_HEADER_REGISTER_COUNT] = register_count;
+
+    if (!(re_flags & LRE_FLAG_STICKY))
+        re_add_prefilter(s);
     
     js_shrink_byte_array(s->ctx, &s->byte_code, s->byte_code_len);
 
@@ -16820,8 +21501,7 @@ static int lre_exec(JSContext *ctx, JSValue capture_buf,
     
 #define LRE_POLL_INTERRUPT() do {                       \
         if (unlikely(--ctx->interrupt_counter <= 0)) {  \
-            JSValue ret;                                \
-            int saved_pc, saved_cptr;                   \
+            int ret, saved_pc, saved_cptr;              \
             arr = JS_VALUE_TO_PTR(byte_code);      \
             saved_pc = pc - arr->buf;                   \
             saved_cptr = cptr - cbuf;                   \
@@ -16829,11 +21509,11 @@ static int lre_exec(JSContext *ctx, JSValue capture_buf,
             JS_PUSH_VALUE(ctx, byte_code);              \
             JS_PUSH_VALUE(ctx, str);                    \
             ctx->sp = sp;                               \
-            ret = __js_poll_interrupt(ctx);             \
+            ret = __js_poll_interrupt(ctx, FALSE);      \
             JS_POP_VALUE(ctx, str);                     \
             JS_POP_VALUE(ctx, byte_code);               \
             JS_POP_VALUE(ctx, capture_buf);             \
-            if (JS_IsException(ret)) {                  \
+            if (ret) {                                  \
                 ctx->sp = initial_sp;                   \
                 ctx->stack_bottom = saved_stack_bottom; \
                 return -1;                              \
@@ -17242,6 +21922,35 @@ static int lre_exec(JSContext *ctx, JSValue capture_buf,
             if (capture[2 * capture_count + idx] == cptr - cbuf)
                 goto no_match;
             break;
+        case REOP_skip_literal:
+            {
+                const uint8_t *p1;
+                int n = pc[0];
+                for(;;) {
+                    if ((cbuf_end - cptr) < n)
+                        goto no_match;
+                    /* the first byte cannot be an UTF-8 continuation
+                       byte, so 'p1' is a character boundary */
+                    p1 = memchr(cptr, pc[1], cbuf_end - cptr - n + 1);
+                    if (!p1)
+                        goto no_match;
+                    cptr = p1;
+                    if (!memcmp(p1 + 1, pc + 2, n - 1))
+                        break;
+                    cptr++;
+                }
+                pc += 1 + n;
+            }
+            break;
+        case REOP_skip_bitmap:
+            /* only the first bytes of characters are in the bitmap */
+            while (cptr < cbuf_end &&
+                   !(pc[*cptr >> 3] & (1 << (*cptr & 7))))
+                cptr++;
+            if (cptr == cbuf_end)
+                goto no_match;
+            pc += 32;
+            break;
         case REOP_word_boundary:
         case REOP_not_word_boundary:
             {
@@ -17405,10 +22114,15 @@ static size_t js_parse_regexp_flags(int *pre_flags, const uint8_t *buf)
     return p - buf;
 }
 
-/* pattern and flags must be strings */
+/* pattern and flags must be strings. The byte code is immutable so
+   it is shared between the RegExp objects with the same source and
+   flags. */
 static JSValue js_compile_regexp(JSContext *ctx, JSValue pattern, JSValue flags)
 {
-    int re_flags;
+    int re_flags, i;
+    JSValue byte_code;
+    JSByteArray *arr;
+    JSGCRef pattern_ref;
     
     re_flags = 0;
     if (!JS_IsUndefined(flags)) {
@@ -17421,8 +22135,28 @@ static JSValue js_compile_regexp(JSContext *ctx, JSValue pattern, JSValue flags)
             return JS_ThrowSyntaxError(ctx, "invalid regular expression flags");
     }
 
-    return JS_Parse2(ctx, pattern, NULL, 0, "<regexp>",
-                     JS_EVAL_REGEXP | (re_flags << JS_EVAL_REGEXP_FLAGS_SHIFT));
+    for(i = 0; i < JS_REGEXP_CACHE_SIZE; i++) {
+        byte_code = ctx->regexp_cache[2 * i + 1];
+        if (!JS_IsNull(byte_code)) {
+            arr = JS_VALUE_TO_PTR(byte_code);
+            if (lre_get_flags(arr->buf) == re_flags &&
+                js_string_eq(ctx, ctx->regexp_cache[2 * i], pattern))
+                return byte_code;
+        }
+    }
+    
+    JS_PUSH_VALUE(ctx, pattern);
+    byte_code = JS_Parse2(ctx, pattern, NULL, 0, "<regexp>",
+                          JS_EVAL_REGEXP | (re_flags << JS_EVAL_REGEXP_FLAGS_SHIFT));
+    JS_POP_VALUE(ctx, pattern);
+    if (JS_IsException(byte_code))
+        return byte_code;
+    i = ctx->regexp_cache_counter;
+    ctx->regexp_cache[2 * i] = pattern;
+    ctx->regexp_cache[2 * i + 1] = byte_code;
+    if (++ctx->regexp_cache_counter == JS_REGEXP_CACHE_SIZE)
+        ctx->regexp_cache_counter = 0;
+    return byte_code;
 }
 
 static JSRegExp *js_get_regexp(JSContext *ctx, JSValue obj)
@@ -17693,6 +22427,7 @@ JSValue js_regexp_exec(JSContext *ctx, JSValue *this_val,
                     p = JS_VALUE_TO_PTR(obj);
                     arr = JS_VALUE_TO_PTR(p->u.array.tab);
                     arr->arr[i] = val;
+                    js_write_barrier(ctx, &arr->arr[i]);
                 }
             }
         }
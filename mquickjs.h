@@ -223,6 +223,15 @@ typedef enum JSCFunctionDefEnum {  /* XXX: should rename for namespace isolation
     JS_CFUNC_constructor_magic,
     JS_CFUNC_generic_params,
     JS_CFUNC_f_f,
+    /* The typed conventions below are called without JSValue
+       arguments: 'f' arguments are converted with ToNumber() and 'i'
+       arguments with ToInt32(). A missing argument is undefined. For
+       'v_ptr_len', the argument must be an ArrayBuffer or a typed array
+       and undefined is returned. */
+    JS_CFUNC_f_ff,
+    JS_CFUNC_f_fff,
+    JS_CFUNC_i_ii,
+    JS_CFUNC_v_ptr_len,
 } JSCFunctionDefEnum;
 
 typedef union JSCFunctionType {
@@ -232,6 +241,11 @@ typedef union JSCFunctionType {
     JSValue (*constructor_magic)(JSContext *ctx, JSValue *this_val, int argc, JSValue *argv, int magic);
     JSValue (*generic_params)(JSContext *ctx, JSValue *this_val, int argc, JSValue *argv, JSValue params);
     double (*f_f)(double f);
+    double (*f_ff)(double a, double b);
+    double (*f_fff)(double a, double b, double c);
+    int32_t (*i_ii)(int32_t a, int32_t b);
+    /* 'ptr' is only valid during the call */
+    void (*v_ptr_len)(uint8_t *ptr, size_t len);
 } JSCFunctionType;
 
 typedef struct JSCFunctionDef {
@@ -254,8 +268,16 @@ typedef struct {
 } JSSTDLibraryDef;
 
 typedef void JSWriteFunc(void *opaque, const void *buf, size_t buf_len);
-/* return != 0 if the JS code needs to be interrupted */
+/* return != 0 if the JS code needs to be interrupted or
+   JS_INTERRUPT_SUSPEND to suspend it */
 typedef int JSInterruptHandler(JSContext *ctx, void *opaque);
+/* The execution is only suspended at a loop or branch of the
+   outermost JS_Call() (hence JS_Run() or JS_Eval()). The call then
+   returns JS_EXCEPTION and JS_IsSuspended() returns TRUE. The
+   execution is continued with JS_Resume() which returns as the
+   suspended call would have. Only one execution can be suspended at
+   a given time. */
+#define JS_INTERRUPT_SUSPEND 2
 
 JSContext *JS_NewContext(void *mem_start, size_t mem_size, const JSSTDLibraryDef *stdlib_def);
 /* if prepare_compilation is true, the context will be used to compile
@@ -264,6 +286,7 @@ JSContext *JS_NewContext(void *mem_start, size_t mem_size, const JSSTDLibraryDef
 JSContext *JS_NewContext2(void *mem_start, size_t mem_size, const JSSTDLibraryDef *stdlib_def, JS_BOOL prepare_compilation);
 void JS_FreeContext(JSContext *ctx);
 void JS_SetContextOpaque(JSContext *ctx, void *opaque);
+void *JS_GetContextOpaque(JSContext *ctx);
 void JS_SetInterruptHandler(JSContext *ctx, JSInterruptHandler *interrupt_handler);
 void JS_SetRandomSeed(JSContext *ctx, uint64_t seed);
 JSValue JS_GetGlobalObject(JSContext *ctx);
@@ -288,11 +311,27 @@ JSValue JS_NewArray(JSContext *ctx, int initial_len);
 /* create a C function with an object parameter (closure) */
 JSValue JS_NewCFunctionParams(JSContext *ctx, int func_idx, JSValue params);
 
+/* maximum number of functions created with JS_NewCFunction() in a context */
+#define JS_HOST_FUNCTION_MAX 64
+
+/* Create a C function at runtime (the functions of the JSSTDLibraryDef
+   tables are defined at build time). 'def_type' is JS_CFUNC_generic,
+   JS_CFUNC_generic_magic or a typed convention (JS_CFUNC_f_f to
+   JS_CFUNC_v_ptr_len). Creating a function with the same definition
+   again reuses its entry. Return JS_EXCEPTION if more than
+   JS_HOST_FUNCTION_MAX definitions are used. */
+JSValue JS_NewCFunction(JSContext *ctx, const char *name, int def_type,
+                        JSCFunctionType func, int arg_count, int magic);
+
 #define JS_EVAL_RETVAL    (1 << 0) /* return the last value instead of undefined (slower code) */
 #define JS_EVAL_REPL      (1 << 1) /* implicitly defined global variables in assignments */
 #define JS_EVAL_STRIP_COL (1 << 2) /* strip column number debug information (save memory) */
 #define JS_EVAL_JSON      (1 << 3) /* parse as JSON and return the object */
 #define JS_EVAL_REGEXP    (1 << 4) /* internal use */
+/* compile the local functions when they are first called instead of
+   at parse time (faster startup and less memory for code which is
+   seldom called). Cannot be used with JS_PrepareBytecode(). */
+#define JS_EVAL_LAZY      (1 << 5)
 #define JS_EVAL_REGEXP_FLAGS_SHIFT 8  /* internal use */
 JSValue JS_Parse(JSContext *ctx, const char *input, size_t input_len,
                  const char *filename, int eval_flags);
@@ -300,10 +339,155 @@ JSValue JS_Run(JSContext *ctx, JSValue val);
 JSValue JS_Eval(JSContext *ctx, const char *input, size_t input_len,
                 const char *filename, int eval_flags);
 void JS_GC(JSContext *ctx);
+
+/* GC done when the memory is full */
+#define JS_GC_MODE_FULL         0 /* mark and compact the whole heap (default) */
+/* first collect the blocks allocated since the last GC (the
+   nursery). Only the older blocks written since the last GC are
+   scanned and they are neither marked nor moved. A full GC is done
+   when not enough memory is reclaimed. JS_GC_MODE_FULL is used if
+   there is not enough memory for the table of the written blocks. */
+#define JS_GC_MODE_GENERATIONAL 1
+/* In JS_GC_MODE_GENERATIONAL, a minor GC is also done when more than
+   'nursery_size' bytes were allocated since the last GC (0 = only when
+   the memory is full). Smaller values give shorter but more frequent
+   pauses. */
+void JS_SetGCMode(JSContext *ctx, int gc_mode, size_t nursery_size);
+
+/* return a monotonic time in arbitrary units (e.g. microseconds) */
+typedef int64_t JSClockFunc(void *opaque);
+
+typedef struct {
+    uint32_t gc_count; /* number of full GCs */
+    uint32_t minor_gc_count; /* number of GCs limited to the young blocks */
+    uint64_t reclaimed_bytes; /* total bytes reclaimed by the GCs */
+    /* pause times in JSClockFunc units (0 if no clock is set) */
+    int64_t last_pause;
+    int64_t max_pause;
+    int64_t total_pause;
+    /* largest heap size before a GC or at the last JS_GetGCStats() or
+       JS_GetMemoryUsage() call */
+    uint64_t max_heap_size;
+    uint32_t heap_grow_count; /* number of context memory extensions */
+} JSGCStats;
+
+/* set the clock used to measure the GC pauses */
+void JS_SetGCClock(JSContext *ctx, JSClockFunc *clock_func);
+void JS_GetGCStats(JSContext *ctx, JSGCStats *stats);
+void JS_ResetGCStats(JSContext *ctx);
+
+/* Heap growth. The heap and the stack can only use the first
+   'mem_size' bytes of the memory block of the context, up to the whole
+   block as the heap grows. The stack stays at the end of the block so
+   the unused middle part is never accessed: it can be reserved address
+   space whose pages are committed when touched. When less than half of
+   the usable memory is free after a GC, 'func' is called with the
+   usable size 'mem_size'. It returns the new usable size, which should
+   be at least 'min_size', or 0 if the memory cannot grow. As nothing
+   is moved, the growth happens at any allocation. 'func = NULL' makes
+   the whole block usable. */
+typedef size_t JSHeapGrowFunc(void *opaque, void *mem_start, size_t mem_size,
+                              size_t min_size);
+void JS_SetHeapGrowCallback(JSContext *ctx, JSHeapGrowFunc *func, void *opaque,
+                            size_t mem_size);
+/* Move the context to the larger memory block 'mem_start' of
+   'mem_size' bytes. If 'mem_start' is the address of the context, the
+   block is assumed to be extended in place. Otherwise the blocks must
+   not overlap and the old one can be freed afterwards. No JS code must
+   be running. The JSGCRef are updated. The added memory is usable.
+   Return the new context or NULL if error (the context is unchanged). */
+JSContext *JS_ExtendHeap(JSContext *ctx, void *mem_start, size_t mem_size);
+
+/* When enabled, the plain objects created afterwards with the same
+   property key sequence share their key layout (shape) and only store
+   the property values. It reduces the memory usage of the objects with
+   a few properties and gives a layout identity to the property
+   caches. Objects with getters/setters or more than 16 properties
+   fall back to a per object property table. Disabled by default. */
+void JS_SetShapeMode(JSContext *ctx, JS_BOOL enable);
+
+/* number of memory block types (JS_GetMemoryTagName() gives their name) */
+#define JS_MEMORY_TAG_COUNT 8
+
+typedef struct {
+    size_t mem_size; /* size of the context memory */
+    size_t heap_size; /* used heap size (the JSContext is not included) */
+    size_t stack_size; /* used stack size */
+    size_t free_size; /* free space between the heap and the stack */
+    /* number and total size of the heap blocks of each type */
+    uint32_t block_count[JS_MEMORY_TAG_COUNT];
+    size_t block_size[JS_MEMORY_TAG_COUNT];
+    JSGCStats gc;
+} JSMemoryUsage;
+
+/* walk the heap (no allocation is done) */
+void JS_GetMemoryUsage(JSContext *ctx, JSMemoryUsage *s);
+const char *JS_GetMemoryTagName(int tag);
+
+/* sampling profiler */
+
+#define JS_PROFILE_MAX_DEPTH 16
+
+typedef struct {
+    int depth; /* number of recorded frames */
+    /* function object and pc offset of each frame, innermost first */
+    JSValue func[JS_PROFILE_MAX_DEPTH];
+    uint32_t pc[JS_PROFILE_MAX_DEPTH];
+} JSProfileSample;
+
+typedef struct {
+    const char *func_name;
+    const char *filename; /* NULL if native function */
+    int line_num; /* 0 if unknown */
+    int col_num; /* 0 if unknown */
+    JSCStringBuf buf[2];
+} JSProfileFrame;
+
+/* Record the call stack every 'interval' interrupt polls (function
+   calls and backward jumps) in the ring buffer 'samples' of
+   'sample_count' entries. The sampled functions are kept alive by the
+   GC. 'samples' = NULL stops the profiler. */
+void JS_SetProfileBuffer(JSContext *ctx, JSProfileSample *samples,
+                         int sample_count, int interval);
+/* Return the number of samples taken since JS_SetProfileBuffer(). The
+   sample 'n' is at 'samples[n % sample_count]'. */
+uint32_t JS_GetProfileSampleCount(JSContext *ctx);
+/* Resolve the frame 'level' of a sample. Return -1 if there is no such
+   frame. The strings are valid until the next allocation. */
+int JS_GetProfileFrame(JSContext *ctx, JSProfileFrame *f,
+                       const JSProfileSample *s, int level);
+
+/* metering */
+
+typedef struct {
+    /* function calls, jumps and regexp backtracking steps. They are
+       counted by the interrupt poll decrement so that the metering
+       has no cost in the interpreter loop. */
+    uint64_t ticks;
+    uint64_t alloc_bytes; /* allocated heap bytes */
+    /* time spent in the native functions called from JS (including
+       the JS code they call) in JSClockFunc units. Only measured if a
+       clock was set with JS_SetGCClock() before JS_ResetMeter(). */
+    int64_t native_time;
+} JSMeterStats;
+
+/* Reset the metering counters and set the budget of the following
+   runs, e.g. before each JS_Eval() or JS_Call(). A zero field or
+   'budget' = NULL means no limit. The budgets are checked at the
+   interrupt polls: when one is reached, the execution stops with an
+   uncatchable InternalError. Hence the allocation and native time
+   budgets may be exceeded by the work of a single native function. */
+void JS_ResetMeter(JSContext *ctx, const JSMeterStats *budget);
+/* return the counters since the last JS_ResetMeter() */
+void JS_GetMeterStats(JSContext *ctx, JSMeterStats *stats);
+
 JSValue JS_NewStringLen(JSContext *ctx, const char *buf, size_t buf_len);
 JSValue JS_NewString(JSContext *ctx, const char *buf);
 const char *JS_ToCStringLen(JSContext *ctx, size_t *plen, JSValue val, JSCStringBuf *buf);
 const char *JS_ToCString(JSContext *ctx, JSValue val, JSCStringBuf *buf);
+/* return the bytes of an ArrayBuffer or typed array (no copy). Only
+   valid until the next allocation. */
+uint8_t *JS_GetArrayBuffer(JSContext *ctx, size_t *plen, JSValue val);
 JSValue JS_ToString(JSContext *ctx, JSValue val);
 int JS_ToInt32(JSContext *ctx, int *pres, JSValue val);
 int JS_ToUint32(JSContext *ctx, uint32_t *pres, JSValue val);
@@ -316,6 +500,8 @@ void JS_PushArg(JSContext *ctx, JSValue val);
 #define FRAME_CF_CTOR           (1 << 16) /* also ored with argc in
                                              C constructors */
 JSValue JS_Call(JSContext *ctx, int call_flags);
+JSValue JS_Resume(JSContext *ctx);
+JS_BOOL JS_IsSuspended(JSContext *ctx);
 
 #define JS_BYTECODE_MAGIC   0xacfb
 
@@ -360,9 +546,26 @@ int JS_RelocateBytecode(JSContext *ctx,
 /* Load the precompiled bytecode from 'buf'. 'buf' must be allocated
    as long as the JSContext exists. Use JS_Run() to execute
    it. warning: the bytecode is not checked so it should come from a
-   trusted source. */
+   trusted source.
+
+   The bytecode is used in place: it is not copied to the context
+   memory and the GC neither scans nor moves it. Up to 4 bytecode files
+   can be loaded in a context. Each one must be relocated with
+   JS_RelocateBytecode() just before being loaded so that it shares the
+   atoms of the previously loaded files. Loading fails if one of its
+   atoms is still referenced as a RAM atom by the context. */
 JSValue JS_LoadBytecode(JSContext *ctx, const uint8_t *buf);
 
+/* Save the context memory to 'buf' (it runs a GC). No JS code must be
+   running and the JSGCRef are not saved. Return the snapshot size (and
+   only the size if 'buf_len' is too small) or 0 if error. */
+size_t JS_SnapshotContext(JSContext *ctx, void *buf, size_t buf_len);
+/* Create a context in 'mem_start' from a snapshot made in the same
+   program. The snapshot can be restored many times. Return NULL if
+   error. */
+JSContext *JS_RestoreContext(void *mem_start, size_t mem_size,
+                             const void *buf, size_t buf_len);
+
 /* debug functions */
 void JS_SetLogFunc(JSContext *ctx, JSWriteFunc *write_func);
 void JS_PrintValue(JSContext *ctx, JSValue val);
@@ -46,6 +46,8 @@ FMT(i32)
 FMT(const16)
 FMT(label)
 FMT(value)
+FMT(loc_const16)
+FMT(arg_const16)
 #undef FMT
 #endif /* FMT */
 
@@ -121,6 +123,8 @@ DEF(    get_var_ref, 3, 0, 1, var_ref)
 DEF(    put_var_ref, 3, 1, 0, var_ref) /* must come after get_var_ref */
 DEF(get_var_ref_nocheck, 3, 0, 1, var_ref) 
 DEF(put_var_ref_nocheck, 3, 1, 0, var_ref)
+DEF( get_loc_append, 3, 0, 1, loc) /* same as get_loc but keeps the string builder */
+DEF(     append_loc, 3, 2, 0, loc) /* a b ->, loc = a + b */
 DEF(       if_false, 5, 1, 0, label)
 DEF(        if_true, 5, 1, 0, label) /* must come after if_false */
 DEF(           goto, 5, 0, 0, label) /* must come after if_true */
@@ -166,6 +170,7 @@ DEF(     strict_neq, 1, 2, 1, none)
 DEF(            and, 1, 2, 1, none)
 DEF(            xor, 1, 2, 1, none)
 DEF(             or, 1, 2, 1, none)
+DEF(      arith_tmp, 2, 2, 1, u8) /* a b -> a op b, a or b is a temporary number (see OP_arith_tmp) */
 /* must be the last non short and non temporary opcode */
 DEF(            nop, 1, 0, 0, none) 
 
@@ -203,6 +208,22 @@ DEF(       put_arg0, 1, 1, 0, none_arg)  /* must follow get_arg */
 DEF(       put_arg1, 1, 1, 0, none_arg)
 DEF(       put_arg2, 1, 1, 0, none_arg)
 DEF(       put_arg3, 1, 1, 0, none_arg)
+#ifdef JS_FUSED_OPCODES
+/* fused opcodes. The comparisons replace the opcode preceding an
+   if_false which is left in place: the label is read from it. */
+DEF(    lt_if_false, 1, 2, 1, none) /* must be followed by if_false */
+DEF(   lte_if_false, 1, 2, 1, none)
+DEF(    gt_if_false, 1, 2, 1, none)
+DEF(   gte_if_false, 1, 2, 1, none)
+DEF(    eq_if_false, 1, 2, 1, none)
+DEF(   neq_if_false, 1, 2, 1, none)
+DEF(strict_eq_if_false, 1, 2, 1, none)
+DEF(strict_neq_if_false, 1, 2, 1, none)
+DEF(        dec_loc, 3, 0, 0, loc) /* loc = loc - 1 */
+DEF(        inc_loc, 3, 0, 0, loc) /* loc = loc + 1, must come after dec_loc */
+DEF(  get_loc_field, 5, 0, 1, loc_const16) /* get_loc + get_field */
+DEF(  get_arg_field, 5, 0, 1, arg_const16) /* get_arg + get_field */
+#endif
 #if 0
 DEF(      if_false8, 2, 1, 0, label8)
 DEF(       if_true8, 2, 1, 0, label8) /* must come after if_false8 */
@@ -260,5 +281,7 @@ REDEF(lookahead, 5)
 REDEF(negative_lookahead, 5) /* must come after */
 REDEF(set_char_pos, 2) /* store the character position to a register */
 REDEF(check_advance, 2) /* check that the register is different from the character position */
+REDEF(skip_literal, 2) /* variable length. Skip to the next occurrence of the bytes */
+REDEF(skip_bitmap, 33) /* skip to the next character whose first byte is in the bitmap */
 
 #endif /* REDEF */
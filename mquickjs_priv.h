@@ -34,7 +34,7 @@ enum {
     JS_MTAG_BYTE_ARRAY,
     JS_MTAG_VARREF,
 
-    JS_MTAG_COUNT,
+    JS_MTAG_COUNT, /* must be equal to JS_MEMORY_TAG_COUNT */
 };
 
 /* JS_MTAG_BITS bits are reserved at the start of every memory block */
@@ -207,14 +207,9 @@ JSValue js_math_min_max(JSContext *ctx, JSValue *this_val,
                         int argc, JSValue *argv, int magic);
 double js_math_sign(double a);
 double js_math_fround(double a);
-JSValue js_math_imul(JSContext *ctx, JSValue *this_val,
-                     int argc, JSValue *argv);
+int32_t js_math_imul(int32_t a, int32_t b);
 JSValue js_math_clz32(JSContext *ctx, JSValue *this_val,
                       int argc, JSValue *argv);
-JSValue js_math_atan2(JSContext *ctx, JSValue *this_val,
-                      int argc, JSValue *argv);
-JSValue js_math_pow(JSContext *ctx, JSValue *this_val,
-                    int argc, JSValue *argv);
 JSValue js_math_random(JSContext *ctx, JSValue *this_val,
                        int argc, JSValue *argv);
 
@@ -230,6 +225,18 @@ JSValue js_typed_array_get_length(JSContext *ctx, JSValue *this_val,
                                   int argc, JSValue *argv, int magic);
 JSValue js_typed_array_subarray(JSContext *ctx, JSValue *this_val,
                                 int argc, JSValue *argv);
+JSValue js_typed_array_set(JSContext *ctx, JSValue *this_val,
+                           int argc, JSValue *argv);
+JSValue js_typed_array_fill(JSContext *ctx, JSValue *this_val,
+                            int argc, JSValue *argv);
+JSValue js_typed_array_copyWithin(JSContext *ctx, JSValue *this_val,
+                                  int argc, JSValue *argv);
+JSValue js_typed_array_slice(JSContext *ctx, JSValue *this_val,
+                             int argc, JSValue *argv);
+JSValue js_typed_array_indexOf(JSContext *ctx, JSValue *this_val,
+                               int argc, JSValue *argv, int magic);
+JSValue js_typed_array_reduce(JSContext *ctx, JSValue *this_val,
+                              int argc, JSValue *argv, int special);
 
 JSValue js_date_constructor(JSContext *ctx, JSValue *this_val,
                             int argc, JSValue *argv);
@@ -0,0 +1,359 @@
+/*
+ * Benchmark harness for the native and WASM builds (run by "make bench")
+ *
+ * Runs tests/microbench.js, tests/mandelbrot.js and the benchmarkSuite
+ * snippets of dist/benchmark.js with the native mqjs binary and with the
+ * WASM module loaded in node. The results (ns per iteration, GC count
+ * and peak heap size) are saved in JSON and compared with a baseline.
+ *
+ * usage: node tests/bench.js [options] [microbench test names]
+ *   --mqjs FILE        native binary (default ./mqjs)
+ *   --wasm FILE        emscripten module (default dist/mquickjs.js)
+ *   --no-native        skip the native build
+ *   --no-wasm          skip the WASM build
+ *   --out FILE         save the results to FILE (default bench.json)
+ *   --baseline FILE    compare with FILE (default tests/bench_baseline.json)
+ *   --tolerance PCT    allowed slow down in percent (default 15)
+ *   --runs N           runs of each script, the median is kept (default 5)
+ *   --update           save the results as the new baseline
+ *
+ * The exit code is 1 if a result is worse than the baseline by more than
+ * the tolerance. The times depend on the machine: the baseline must be
+ * regenerated with --update ("make bench-baseline") on the machine used
+ * for the comparisons.
+ */
+'use strict';
+
+var fs = require('fs');
+var path = require('path');
+var os = require('os');
+var vm = require('vm');
+var child_process = require('child_process');
+
+var root = path.resolve(__dirname, '..');
+
+var opts = {
+    mqjs: path.join(root, 'mqjs'),
+    wasm: path.join(root, 'dist', 'mquickjs.js'),
+    native: true,
+    wasmEnabled: true,
+    out: 'bench.json',
+    baseline: path.join(root, 'tests', 'bench_baseline.json'),
+    tolerance: 15,
+    runs: 5,
+    update: false,
+    microTests: []
+};
+
+function parseArgs(argv) {
+    var i = 0, a;
+    function next() {
+        if (i >= argv.length) {
+            console.error('missing argument for ' + a);
+            process.exit(2);
+        }
+        return argv[i++];
+    }
+    while (i < argv.length) {
+        a = argv[i++];
+        if (a === '--mqjs') opts.mqjs = path.resolve(next());
+        else if (a === '--wasm') opts.wasm = path.resolve(next());
+        else if (a === '--no-native') opts.native = false;
+        else if (a === '--no-wasm') opts.wasmEnabled = false;
+        else if (a === '--out') opts.out = next();
+        else if (a === '--baseline') opts.baseline = path.resolve(next());
+        else if (a === '--tolerance') opts.tolerance = +next();
+        else if (a === '--runs') opts.runs = Math.max(1, next() | 0);
+        else if (a === '--update') opts.update = true;
+        else if (a[0] === '-') {
+            console.error('unknown option: ' + a);
+            process.exit(2);
+        } else {
+            opts.microTests.push(a);
+        }
+    }
+}
+
+function median(a) {
+    var b = a.slice().sort(function(x, y) { return x - y; });
+    var n = b.length;
+    return n & 1 ? b[n >> 1] : (b[n / 2 - 1] + b[n / 2]) / 2;
+}
+
+function nowNs() {
+    var t = process.hrtime();
+    return t[0] * 1e9 + t[1];
+}
+
+/* the 'full' snippets of dist/benchmark.js */
+function loadSuite() {
+    var src = fs.readFileSync(path.join(root, 'dist', 'benchmark.js'), 'utf8');
+    var start = src.indexOf('full: [');
+    var end = src.indexOf('quick: [', start);
+    var re = /name:\s*'((?:[^'\\]|\\.)*)'[\s\S]*?code:\s*'((?:[^'\\]|\\.)*)'/g;
+    var block, m, suite = [];
+    if (start < 0 || end < 0)
+        throw new Error('benchmarkSuite not found in dist/benchmark.js');
+    block = src.slice(start, end);
+    while ((m = re.exec(block)) !== null) {
+        suite.push({
+            name: vm.runInNewContext("'" + m[1] + "'"),
+            code: vm.runInNewContext("'" + m[2] + "'")
+        });
+    }
+    return suite;
+}
+
+/* "name n time" lines of the microbench.js table */
+function parseMicrobench(output, results) {
+    output.split('\n').forEach(function(line) {
+        var m = /^\s*(\w+)\s+(\d+)\s+([\d.]+)/.exec(line);
+        if (m)
+            results['microbench/' + m[1]] = {ns_per_iter: +m[3]};
+    });
+}
+
+/* each script is a bench name and a source file or code */
+function scriptList() {
+    var list = [];
+    list.push({name: 'mandelbrot', file: path.join(root, 'tests', 'mandelbrot.js')});
+    loadSuite().forEach(function(t) {
+        list.push({name: 'suite/' + t.name, code: t.code});
+    });
+    return list;
+}
+
+/**********************************************************************/
+/* native build */
+
+function runNative(results) {
+    var tmp = fs.mkdtempSync(path.join(os.tmpdir(), 'mqjs-bench-'));
+    var statsFile = path.join(tmp, 'stats.json');
+
+    function run(args) {
+        var r = child_process.spawnSync(opts.mqjs, ['--stats', statsFile].concat(args),
+                                        {encoding: 'utf8', maxBuffer: 64 << 20});
+        if (r.error)
+            throw r.error;
+        if (r.status !== 0)
+            throw new Error(opts.mqjs + ' ' + args.join(' ') + ' failed:\n' + r.stderr);
+        return {
+            stdout: r.stdout,
+            stats: JSON.parse(fs.readFileSync(statsFile, 'utf8'))
+        };
+    }
+
+    function addStats(res, stats) {
+        res.gc_count = stats.gc_count + stats.minor_gc_count;
+        res.max_heap_size = stats.max_heap_size;
+        return res;
+    }
+
+    try {
+        scriptList().forEach(function(s) {
+            var file = s.file, times = [], stats, i, t0;
+            if (!file) {
+                file = path.join(tmp, 'snippet.js');
+                fs.writeFileSync(file, s.code);
+            }
+            for (i = 0; i < opts.runs; i++) {
+                t0 = nowNs();
+                stats = run([file]).stats;
+                times.push(nowNs() - t0);
+            }
+            results[s.name] = addStats({ns_per_iter: median(times)}, stats);
+            process.stderr.write('native ' + s.name + '\n');
+        });
+        process.stderr.write('native microbench...\n');
+        var r = run([path.join(root, 'tests', 'microbench.js')].concat(opts.microTests));
+        parseMicrobench(r.stdout, results);
+        addStats(results['microbench/total'] || (results['microbench/total'] = {}), r.stats);
+    } finally {
+        fs.rmSync(tmp, {recursive: true, force: true});
+    }
+}
+
+/**********************************************************************/
+/* WASM build */
+
+/* load the emscripten module (built for the web) in node */
+function loadWasm() {
+    var wasmFile = opts.wasm.replace(/\.js$/, '.wasm');
+    var wasmBinary = fs.readFileSync(wasmFile);
+    var sandbox = {
+        console: console,
+        performance: performance,
+        TextDecoder: TextDecoder,
+        URL: URL,
+        WebAssembly: WebAssembly,
+        // the module fetches the .wasm file next to the script
+        fetch: function() {
+            return Promise.resolve(new Response(wasmBinary, {
+                headers: {'Content-Type': 'application/wasm'}
+            }));
+        }
+    };
+    sandbox.globalThis = sandbox;
+    vm.createContext(sandbox);
+    vm.runInContext(fs.readFileSync(opts.wasm, 'utf8') + '\n;globalThis.MQuickJS = MQuickJS;',
+                    sandbox, {filename: opts.wasm});
+    return sandbox.MQuickJS({
+        instantiateWasm: function(imports, receiveInstance) {
+            WebAssembly.instantiate(wasmBinary, imports).then(function(r) {
+                receiveInstance(r.instance, r.module);
+            });
+            return {};
+        }
+    });
+}
+
+function runWasm(Module, results) {
+    var run = Module.cwrap('mquickjs_run', 'string', ['string']);
+    var hasStats = typeof Module._mquickjs_memory_usage === 'function';
+
+    /* GC count and peak heap size (only in the recent builds) */
+    function stats(res) {
+        var ptr, u;
+        if (!hasStats)
+            return res;
+        ptr = Module._mquickjs_memory_usage();
+        u = new Float64Array(Module.HEAPU8.buffer, ptr, 27);
+        res.gc_count = u[4] + u[5];
+        res.max_heap_size = u[26] || null;
+        return res;
+    }
+
+    function runOnce(code) {
+        var t0, out;
+        Module._mquickjs_reset();
+        t0 = nowNs();
+        out = run(code);
+        t0 = nowNs() - t0;
+        if (out.lastIndexOf('Error: ', 0) === 0)
+            throw new Error('WASM: ' + out);
+        return {time: t0, output: out};
+    }
+
+    scriptList().forEach(function(s) {
+        var code = s.code || fs.readFileSync(s.file, 'utf8');
+        var times = [], i;
+        for (i = 0; i < opts.runs; i++)
+            times.push(runOnce(code).time);
+        results[s.name] = stats({ns_per_iter: median(times)});
+        process.stderr.write('wasm ' + s.name + '\n');
+    });
+    process.stderr.write('wasm microbench...\n');
+    var r = runOnce('var scriptArgs = ' + JSON.stringify([''].concat(opts.microTests)) + ';\n' +
+                    fs.readFileSync(path.join(root, 'tests', 'microbench.js'), 'utf8'));
+    parseMicrobench(r.output, results);
+    stats(results['microbench/total'] || (results['microbench/total'] = {}));
+}
+
+/**********************************************************************/
+/* comparison with the baseline */
+
+var METRICS = ['ns_per_iter', 'gc_count', 'max_heap_size'];
+
+function compare(baseline, current) {
+    var tol = opts.tolerance / 100;
+    var regressions = [];
+    var lines = [];
+    Object.keys(current.results).forEach(function(target) {
+        var cur = current.results[target];
+        var base = (baseline.results || {})[target];
+        if (!base) {
+            lines.push(target + ': no baseline');
+            return;
+        }
+        Object.keys(cur).forEach(function(name) {
+            var b = base[name];
+            var c = cur[name];
+            if (!b)
+                return;
+            METRICS.forEach(function(metric) {
+                var bv = b[metric], cv = c[metric], limit;
+                if (typeof bv !== 'number' || typeof cv !== 'number')
+                    return;
+                /* allow one more GC for the small counts */
+                limit = bv * (1 + tol) + (metric === 'gc_count' ? 1 : 0);
+                if (cv > limit) {
+                    regressions.push(target + ' ' + name + ' ' + metric + ': ' +
+                                     cv.toFixed(2) + ' > ' + bv.toFixed(2) + ' (' +
+                                     ((cv / bv - 1) * 100).toFixed(1) + '%)');
+                }
+            });
+        });
+    });
+    lines.forEach(function(l) { console.log(l); });
+    return regressions;
+}
+
+function printTable(res) {
+    Object.keys(res.results).forEach(function(target) {
+        var r = res.results[target];
+        console.log('[' + target + ']');
+        Object.keys(r).forEach(function(name) {
+            var e = r[name];
+            console.log('  ' + (name + '                                        ').slice(0, 36) +
+                        ('            ' + (e.ns_per_iter !== undefined ? e.ns_per_iter.toFixed(2) : '-')).slice(-16) + ' ns' +
+                        (e.gc_count !== undefined ? '  gc=' + e.gc_count : '') +
+                        (e.max_heap_size ? '  heap=' + e.max_heap_size : ''));
+        });
+    });
+}
+
+function main() {
+    var res, baseline, regressions;
+
+    parseArgs(process.argv.slice(2));
+    res = {
+        date: new Date().toISOString(),
+        host: os.cpus()[0].model + ', ' + os.platform() + ' ' + os.arch(),
+        runs: opts.runs,
+        results: {}
+    };
+    var done = Promise.resolve();
+    if (opts.native) {
+        res.results.native = {};
+        runNative(res.results.native);
+    }
+    if (opts.wasmEnabled) {
+        if (!fs.existsSync(opts.wasm)) {
+            console.log('WASM module not found, skipped: ' + opts.wasm);
+        } else {
+            done = loadWasm().then(function(Module) {
+                res.results.wasm = {};
+                runWasm(Module, res.results.wasm);
+            });
+        }
+    }
+    return done.then(function() {
+        printTable(res);
+        fs.writeFileSync(opts.out, JSON.stringify(res, null, 2) + '\n');
+        if (opts.update) {
+            fs.writeFileSync(opts.baseline, JSON.stringify(res, null, 2) + '\n');
+            console.log('baseline saved to ' + opts.baseline);
+            return 0;
+        }
+        if (!fs.existsSync(opts.baseline)) {
+            console.log('no baseline: ' + opts.baseline);
+            return 0;
+        }
+        baseline = JSON.parse(fs.readFileSync(opts.baseline, 'utf8'));
+        regressions = compare(baseline, res);
+        if (regressions.length) {
+            console.log('regressions (tolerance ' + opts.tolerance + '%):');
+            regressions.forEach(function(l) { console.log('  ' + l); });
+            return 1;
+        }
+        console.log('no regression (tolerance ' + opts.tolerance + '%)');
+        return 0;
+    });
+}
+
+main().then(function(code) {
+    process.exitCode = code;
+}, function(err) {
+    console.error(err.stack || String(err));
+    process.exitCode = 2;
+});
@@ -0,0 +1,52 @@
+/*
+ * Native build of the WASM wrapper used by tests/test_canvas_bridge.js
+ *
+ * usage: canvas_dump script.js buffer.bin
+ *
+ * Run the script with mquickjs_run(), print its result and save the
+ * command buffer of the native canvas object to 'buffer.bin'.
+ */
+#include "wasm_wrapper.c"
+
+int main(int argc, char **argv)
+{
+    const CanvasBuffer *b;
+    FILE *f;
+    char *code;
+    long len;
+
+    if (argc != 3) {
+        fprintf(stderr, "usage: canvas_dump script.js buffer.bin\n");
+        exit(1);
+    }
+    f = fopen(argv[1], "rb");
+    if (!f) {
+        perror(argv[1]);
+        exit(1);
+    }
+    fseek(f, 0, SEEK_END);
+    len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    code = malloc(len + 1);
+    if (fread(code, 1, len, f) != len) {
+        perror(argv[1]);
+        exit(1);
+    }
+    code[len] = '\0';
+    fclose(f);
+
+    printf("%s\n", mquickjs_run(code));
+    free(code);
+
+    f = fopen(argv[2], "wb");
+    if (!f) {
+        perror(argv[2]);
+        exit(1);
+    }
+    b = mquickjs_canvas_buffer();
+    if (b)
+        fwrite(b, 1, sizeof(*b), f);
+    fclose(f);
+    mquickjs_cleanup();
+    return 0;
+}
@@ -173,9 +173,37 @@ function test_enum()
     assert(tab.toString(), "x,y,z", "keys");
 }
 
+/* property keys created at runtime */
+function test_dynamic_keys()
+{
+    var m, i, n, k, s;
+    m = {};
+    for(i = 0; i < 3000; i++) {
+        k = "key" + (i % 1000);
+        m[k] = (m[k] | 0) + 1;
+    }
+    n = 0;
+    for(k in m)
+        n += m[k];
+    assert(n, 3000, "dynamic keys");
+    assert(Object.keys(m).length, 1000, "dynamic keys");
+    /* the keys must survive the GC and deleted keys must be found again */
+    m = {};
+    m["a" + 1] = 1;
+    m["b" + 2] = 2;
+    gc();
+    for(i = 0; i < 500; i++)
+        s = "tmp" + i + "_";
+    gc();
+    assert(m.a1 + m["b" + 2], 3, "dynamic keys gc");
+    assert(m["tmp" + 3 + "_"], undefined, "dynamic keys gc");
+    m["tmp" + 3 + "_"] = 4;
+    assert(m.tmp3_, 4, "dynamic keys gc");
+}
+
 function test_array()
 {
-    var a, err, i, log;
+    var a, b, err, i, log;
 
     a = [1, 2, 3];
     assert(a.length, 3, "array");
@@ -306,6 +334,47 @@ function test_array()
     a = [ "b0", "z0", undefined, "b1", "a0", undefined, "z1", "a1", "a2"];
     a.sort(function(a, b) { return (a[0] > b[0]) - (a[0] < b[0]) } );
     assert(a.toString(), "a0,a1,a2,b0,b1,z0,z1,,");
+
+    /* specialized sorts */
+    a = [10, 9, -1, 100, -20, 1, 0, -2, 2, 1000000, 99, 11];
+    a.sort();
+    assert(a.toString(), "-1,-2,-20,0,1,10,100,1000000,11,2,9,99");
+    a.sort(function(a, b) { return a - b; });
+    assert(a.toString(), "-20,-2,-1,0,1,2,9,10,11,99,100,1000000");
+    a.sort(function(x, y) { return y - x; });
+    assert(a.toString(), "1000000,100,99,11,10,9,2,1,0,-1,-2,-20");
+    a = [2.5, -0, 1, 0, -Infinity, 0.5];
+    a.sort(function(a, b) { return a - b; });
+    assert(a.toString(), "-Infinity,0,0,0.5,1,2.5");
+    assert(1 / a[1], -Infinity); /* stable */
+    a = ["b", "é", "a", "ab", "", "B"];
+    a.sort();
+    assert(a.toString(), ",B,a,ab,b,é");
+    a = [3, "10", 2];
+    a.sort(function(a, b) { return a - b; });
+    assert(a.toString(), "2,3,10");
+    a = [3, NaN, 1];
+    a.sort(function(a, b) { return a - b; });
+    assert(a.length, 3);
+
+    /* appends to arrays growing in place or moved */
+    a = [];
+    b = [];
+    for(i = 0; i < 1000; i++) {
+        a[i] = i;
+        if (i % 3 == 0)
+            b.push(i);
+        else
+            b[b.length] = { v: i };
+    }
+    assert(a.length, 1000);
+    assert(a[999], 999);
+    assert(b.length, 1000);
+    assert(b[998].v, 998);
+    assert(b[999], 999);
+    a.length = 10;
+    a[10] = "x";
+    assert(a.toString(), "0,1,2,3,4,5,6,7,8,9,x");
 }
 
 /* non standard array behaviors */
@@ -421,6 +490,37 @@ function test_string2()
     assert("\u{101233}" < "\u{101234}", true);
 }
 
+/* random access to several long non ASCII strings */
+function test_string_pos()
+{
+    var tab, codes, str, a, s, i, j, k, c;
+    tab = [ "a", "\xe9", "\u4e2d", "\u{1f600}" ];
+    codes = [];
+    str = [];
+    for(k = 0; k < 5; k++) {
+        a = [];
+        s = "";
+        for(i = 0; i < 1000 + k * 300; i++) {
+            c = tab[(i * 7 + k + (i >> 5)) % 4];
+            s += c;
+            for(j = 0; j < c.length; j++)
+                a.push(c.charCodeAt(j));
+        }
+        str.push(s);
+        codes.push(a);
+    }
+    for(i = 0; i < 5000; i++) {
+        k = i % 5;
+        j = (i * 7919) % codes[k].length;
+        assert(str[k].charCodeAt(j), codes[k][j]);
+        if ((i % 97) == 0) {
+            s = str[k].substring(j, j + 10);
+            assert(str[k].indexOf(s, j), j);
+            assert(s.charCodeAt(0), codes[k][j]);
+        }
+    }
+}
+
 function test_math()
 {
     var a;
@@ -428,6 +528,12 @@ function test_math()
     assert(Math.floor(a), 1);
     assert(Math.ceil(a), 2);
     assert(Math.imul(0x12345678, 123), -1088058456);
+    assert(Math.imul("3", 4.9), 12);
+    assert(Math.imul(3), 0);
+    assert(Math.pow("2", 10), 1024);
+    assert(Math.pow(2), NaN);
+    assert(Math.atan2(1, 1), Math.PI / 4);
+    assert(Math.atan2.length, 2);
     assert(Math.fround(0.1), 0.10000000149011612);
 }
 
@@ -446,6 +552,18 @@ function test_number()
     assert(parseFloat("-Infinity"), -Infinity);
     assert(parseFloat("123.2"), 123.2);
     assert(parseFloat("123.2e3"), 123200);
+    assert(parseFloat("-0.5e-3"), -0.0005);
+    assert(parseFloat("9007199254740993"), 9007199254740992);
+    assert(+"1e30", 1e30);
+
+    assert((0.1).toString(), "0.1");
+    assert((0.1 + 0.2).toString(), "0.30000000000000004");
+    assert((5e-324).toString(), "5e-324");
+    assert((1.7976931348623157e308).toString(), "1.7976931348623157e+308");
+    assert((2.2250738585072014e-308).toString(), "2.2250738585072014e-308");
+    assert((123456789012345680000).toString(), "123456789012345680000");
+    assert((1e21).toString(), "1e+21");
+    assert((-1.5e-7).toString(), "-1.5e-7");
 
     assert((25).toExponential(), "2.5e+1");
     assert((25).toExponential(0), "3e+1");
@@ -528,16 +646,111 @@ function test_typed_array()
 
     a = new Uint8Array([1, 2, 3, 4]);
     assert(a.toString(), "1,2,3,4");
-    if (0) {
-        a.set([10, 11], 2);
-        assert(a.toString(), "1,2,10,11");
-    }
+    a.set([10, 11], 2);
+    assert(a.toString(), "1,2,10,11");
 
     a = new Uint8Array([1, 2, 3, 4]);
     a = a.subarray(1, 3);
     assert(a.toString(), "2,3");
 }
 
+function test_typed_array_bulk()
+{
+    var a, b, i;
+
+    /* set */
+    a = new Uint8ClampedArray(4);
+    a.set([300, -5, 1.5], 1);
+    assert(a.toString(), "0,255,0,2");
+    a.set(new Float64Array([2.5, 1000]));
+    assert(a.toString(), "2,255,0,2");
+    a = new Int16Array([1, 2, 3, 4, 5]);
+    a.set(a.subarray(0, 3), 2); /* overlapping, same type */
+    assert(a.toString(), "1,2,1,2,3");
+    b = new Uint8Array(a.buffer, 0, 4);
+    a.set(b, 1); /* overlapping, different types */
+    assert(a.toString(), "1,1,0,2,0");
+    a = new Int32Array(2);
+    a.set(new Float64Array([-1.5, 4294967297]));
+    assert(a.toString(), "-1,1");
+    assert_throws(RangeError, function () { a.set([1, 2, 3]); } );
+    assert_throws(RangeError, function () { a.set([1], 2); } );
+
+    /* fill */
+    a = new Uint8Array(5);
+    assert(a.fill(7, 1, -1), a);
+    assert(a.toString(), "0,7,7,7,0");
+    a.fill(-1);
+    assert(a.toString(), "255,255,255,255,255");
+    a = new Uint8ClampedArray(3).fill(1000);
+    assert(a.toString(), "255,255,255");
+    a = new Float32Array(3).fill(0.5, 2);
+    assert(a.toString(), "0,0,0.5");
+    a = new Uint16Array(4).fill(65537, -3, 3);
+    assert(a.toString(), "0,1,1,0");
+
+    /* copyWithin */
+    a = new Uint8Array([1, 2, 3, 4, 5]);
+    assert(a.copyWithin(0, 3), a);
+    assert(a.toString(), "4,5,3,4,5");
+    a = new Float64Array([1, 2, 3, 4, 5]);
+    a.copyWithin(1, 0, 3);
+    assert(a.toString(), "1,1,2,3,5");
+    a.copyWithin(-1, 0);
+    assert(a.toString(), "1,1,2,3,1");
+
+    /* slice */
+    a = new Int16Array([1, -2, 3, 4]);
+    b = a.slice(1, 3);
+    assert(b.toString(), "-2,3");
+    assert(b instanceof Int16Array, true);
+    b[0] = 10;
+    assert(a[1], -2);
+    assert(a.slice(-1).toString(), "4");
+    assert(a.slice(3, 1).length, 0);
+
+    /* indexOf, lastIndexOf, includes */
+    a = new Uint8Array([1, 2, 3, 2, 1]);
+    assert(a.indexOf(2), 1);
+    assert(a.indexOf(2, 2), 3);
+    assert(a.indexOf(4), -1);
+    assert(a.indexOf(257), -1);
+    assert(a.indexOf(2.5), -1);
+    assert(a.indexOf("2"), -1);
+    assert(a.lastIndexOf(2), 3);
+    assert(a.lastIndexOf(2, -3), 1);
+    assert(a.lastIndexOf(1, -6), -1);
+    assert(a.includes(3), true);
+    assert(a.includes(3, 3), false);
+    a = new Int32Array([-1, 5, -1]);
+    assert(a.indexOf(-1, 1), 2);
+    a = new Uint32Array([4294967295, 0]);
+    assert(a.indexOf(4294967295), 0);
+    assert(a.indexOf(-1), -1);
+    a = new Float32Array([0.5, NaN, -0]);
+    assert(a.indexOf(0.5), 0);
+    assert(a.indexOf(0.1), -1);
+    assert(a.indexOf(NaN), -1);
+    assert(a.includes(NaN), true);
+    assert(a.indexOf(0), 2);
+
+    /* reduce */
+    a = new Float64Array([1.5, 2, 3]);
+    assert(a.reduce(function (acc, x) { return acc + x; }), 6.5);
+    assert(a.reduce(function (acc, x, i) { return acc + i; }, 10), 13);
+    assert(a.reduceRight(function (acc, x) { return acc + "," + x; }, ""), ",3,2,1.5");
+    assert_throws(TypeError, function () { new Uint8Array(0).reduce(function (a, b) { return a; }); } );
+
+    /* large buffers */
+    a = new Uint8ClampedArray(4096);
+    for(i = 0; i < 4; i++)
+        a[i] = 10 * i;
+    for(i = 4; i < a.length; i *= 2)
+        a.copyWithin(i, 0, i);
+    assert(a[4095], 30);
+    assert(a.lastIndexOf(0), 4092);
+}
+
 function repeat(a, n)
 {
     var i, r;
@@ -631,6 +844,46 @@ function test_json()
     a = JSON.parse(s);
     assert(JSON.stringify(a), s);
 
+    /* numbers */
+    a = JSON.parse("[0,-12,123456789,1234567890,-0,1.5,1e3,-1E-2]");
+    assert(a, [0, -12, 123456789, 1234567890, -0, 1.5, 1000, -0.01]);
+    assert(1 / a[4], -Infinity);
+    assert(JSON.stringify([-0, 1e21, 0.1, NaN, -Infinity]), "[0,1e+21,0.1,null,null]");
+
+    /* strings */
+    assert(JSON.parse('"\\u00e9\\ud83d\\ude00\\n"'), "é😀\n");
+    assert(JSON.parse('"é🐱"'), "é🐱");
+    assert(JSON.stringify("a\"b\\c\n\t\x01é"), '"a\\"b\\\\c\\n\\t\\u0001é"');
+    assert(JSON.stringify("\ud800x\udfff😀"), '"\\ud800x\\udfff😀"');
+
+    /* repeated and duplicated keys */
+    a = JSON.parse('[{"k":1,"k\\"":2},{"k":3,"k\\"":4},{"k":5,"k":6}]');
+    assert(a[1].k, 3);
+    assert(a[1]['k"'], 4);
+    assert(a[2].k, 6);
+    assert(Object.keys(a[2]), ["k"]);
+    assert(JSON.stringify(a), '[{"k":1,"k\\"":2},{"k":3,"k\\"":4},{"k":6}]');
+
+    /* property with a getter and deleted property */
+    a = { b: 1, c: [1] };
+    Object.defineProperty(a, "g", { get: function() { return 5; }, enumerable: true });
+    delete a.b;
+    a[3] = "n";
+    assert(JSON.stringify(a), '{"c":[1],"g":5,"3":"n"}');
+    
+    a = [];
+    for(n = 0; n < 200; n++)
+        a.push({ id: n, s: "v" + n, f: n / 7, t: [n, "é", { z: (n & 1) ? null : true }] });
+    s = JSON.stringify(a);
+    assert(JSON.stringify(JSON.parse(s)), s);
+
+    a = {};
+    a.self = a;
+    assert_throws(TypeError, function() { JSON.stringify(a); });
+    assert_throws(SyntaxError, function() { JSON.parse("[1,]"); });
+    assert_throws(SyntaxError, function() { JSON.parse('{"a" 1}'); });
+    assert_throws(SyntaxError, function() { JSON.parse('"abc'); });
+
 //    assert_json_error('\n"  \\@x"');
 //    assert_json_error('\n{ "a": @x }"');
 }
@@ -745,6 +998,60 @@ function test_regexp()
     assert("A<B>bold</B>and<CODE>coded</CODE>".split(/<(\/)?([^<>]+)>/), ["A", undefined, "B", "bold", "/", "B", "and", undefined, "CODE", "coded", "/", "CODE", ""]);
 }
 
+function test_regexp_prefilter()
+{
+    var a, i, re, str;
+
+    /* literal prefix */
+    str = repeat("x", 100) + "abcd" + repeat("y", 10) + "abce";
+    assert(/abce/.exec(str).index, 114);
+    assert(/ab(c)e/.exec(str)[1], "c");
+    assert(/abcf/.exec(str), null);
+    assert(str.replace(/abc/g, "_").length, str.length - 4);
+    assert("é€a€b".match(/€b/).index, 3);
+    assert("xx🐱🐶".match(/🐶/).index, 4);
+
+    /* first character sets */
+    assert(/[0-9]+/.exec("abc 123")[0], "123");
+    assert(/ERROR|WARN/.exec("INFO WARN ERROR")[0], "WARN");
+    assert(/b?c/.exec("aaabc")[0], "bc");
+    assert(/b?c/.exec("aaac")[0], "c");
+    assert(/abc/i.exec("xxABCxx").index, 2);
+    assert(/\s+x/.exec("ab  x")[0], "  x");
+    assert(/[éè]t/.exec("café été")[0], "ét");
+    assert(/x*/.exec("abc")[0], "");
+    assert(/(?=c)\w/.exec("abc")[0], "c");
+    assert(/\bfoo/.exec("afoo foo").index, 5);
+    assert(/^foo/m.exec("bar\nfoo").index, 4);
+    assert(/^foo/.exec("bar\nfoo"), null);
+
+    /* global and sticky */
+    re = /ab/g;
+    assert(re.exec("xxabab").index, 2);
+    assert(re.lastIndex, 4);
+    assert(re.exec("xxabab").index, 4);
+    assert(re.exec("xxabab"), null);
+    assert(re.lastIndex, 0);
+    re = /ab/y;
+    re.lastIndex = 1;
+    assert(re.exec("xxab"), null);
+    re.lastIndex = 2;
+    assert(re.exec("xxab").index, 2);
+
+    /* compiled regexp cache */
+    for(i = 0; i < 10; i++) {
+        re = new RegExp("a" + (i & 1), (i & 2) ? "g" : "");
+        assert(re.exec("xa0a1")[0], "a" + (i & 1));
+        assert(re.flags, (i & 2) ? "g" : "");
+        assert(re.lastIndex, (i & 2) ? 3 + (i & 1) * 2 : 0);
+    }
+    a = new RegExp("b+", "g");
+    a.lastIndex = 3;
+    re = new RegExp("b+", "g");
+    assert(re.lastIndex, 0);
+    assert(re.source, "b+");
+}
+
 function eval_error(eval_str, expected_error, level)
 {
     var err = false;
@@ -829,18 +1136,47 @@ function test_line_column_numbers()
     eval_error('var a;\n 1 + (a @+= poisoned_number);', Error, 1);
 }
 
+/* large allocations done by the native functions (grows the memory
+   with "mqjs --memory-grow") */
+function test_large_alloc()
+{
+    var a, b, i, n = 20000, s;
+
+    a = new Array(30000);
+    assert(a.length, 30000);
+    a = [];
+    for(i = 0; i < n; i++)
+        a.push((i * 7919) % n);
+    a.sort(function(x, y) { return x - y; });
+    for(i = 0; i < n; i += 997)
+        assert(a[i], i);
+    b = [];
+    for(i = 0; i < 3000; i++)
+        b.push({ id: i, name: "n" + i, tags: [ "a", "b" ] });
+    s = JSON.stringify(b);
+    b = JSON.parse(s);
+    assert(b.length, 3000);
+    assert(b[2999].name, "n2999");
+    assert(JSON.stringify(b) === s);
+}
+
 test();
 test_string();
 test_string2();
+test_string_pos();
 test_array();
 test_array_ext();
 test_enum();
+test_dynamic_keys();
 test_function();
 test_number();
 test_math();
 test_typed_array();
+test_typed_array_bulk();
 test_global_eval();
 test_json();
 test_regexp();
+test_regexp_prefilter();
 test_line_column_numbers();
 test_large_eval_parse_stack();
+test_large_alloc();
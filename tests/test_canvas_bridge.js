@@ -0,0 +1,159 @@
+/*
+ * Canvas bridge test (run by "make -f Makefile.wasm test")
+ *
+ * Runs the same script with the JSON canvas mock of dist/canvas-bridge.js
+ * (in node) and with the native canvas object of the WASM wrapper (built
+ * natively as tests/canvas_dump.c), then checks that both paths draw
+ * with the same styles. The script never sets a style so the defaults
+ * of both paths must match.
+ *
+ * usage: node tests/test_canvas_bridge.js canvas_dump
+ */
+'use strict';
+
+var fs = require('fs');
+var path = require('path');
+var os = require('os');
+var vm = require('vm');
+var child_process = require('child_process');
+
+var root = path.resolve(__dirname, '..');
+var CanvasBridge = require(path.join(root, 'dist', 'canvas-bridge.js'));
+
+var script = [
+    'canvas.fillRect(10, 20, 30, 40);',
+    'canvas.strokeRect(1, 2, 3, 4);',
+    'canvas.fillText("fill", 5, 6);',
+    'canvas.strokeText("stroke", 7, 8);',
+    'canvas.beginPath();',
+    'canvas.moveTo(0, 0);',
+    'canvas.lineTo(10, 10);',
+    'canvas.stroke();',
+    'canvas.rect(2, 4, 6, 8);',
+    'canvas.fill();',
+    'return [canvas.fillStyle, canvas.strokeStyle, canvas.font, canvas.lineWidth].join(",");'
+].join('\n');
+
+function assert(cond, msg) {
+    if (!cond)
+        throw new Error('assertion failed: ' + msg);
+}
+
+/* 2D context recording the draw calls with the styles they use. The
+   initial state is the one of a browser canvas. */
+function Recorder() {
+    this.fillStyle = '#000000';
+    this.strokeStyle = '#000000';
+    this.font = '10px sans-serif';
+    this.lineWidth = 1;
+    this.calls = [];
+}
+
+function recordFill(name) {
+    return function() {
+        this.calls.push(name + ' ' + [].join.call(arguments, ' ') + ' fill=' + this.fillStyle);
+    };
+}
+
+function recordStroke(name) {
+    return function() {
+        this.calls.push(name + ' ' + [].join.call(arguments, ' ') + ' stroke=' + this.strokeStyle +
+                        ' lw=' + this.lineWidth);
+    };
+}
+
+function recordText(record) {
+    return function() {
+        record.apply(this, arguments);
+        this.calls[this.calls.length - 1] += ' font=' + this.font;
+    };
+}
+
+function recordPath(name) {
+    return function() {
+        this.calls.push(name + ' ' + [].join.call(arguments, ' '));
+    };
+}
+
+Recorder.prototype = {
+    fillRect: recordFill('fillRect'),
+    strokeRect: recordStroke('strokeRect'),
+    clearRect: recordPath('clearRect'),
+    fillText: recordText(recordFill('fillText')),
+    strokeText: recordText(recordStroke('strokeText')),
+    beginPath: recordPath('beginPath'),
+    closePath: recordPath('closePath'),
+    moveTo: recordPath('moveTo'),
+    lineTo: recordPath('lineTo'),
+    arc: recordPath('arc'),
+    rect: recordPath('rect'),
+    fill: recordFill('fill'),
+    stroke: recordStroke('stroke')
+};
+
+/* JSON mock run in node */
+function runMock(options) {
+    var res = JSON.parse(vm.runInNewContext(CanvasBridge.wrapUserCode(script, options), {}));
+    var rec = new Recorder();
+    assert(!res.error, res.error);
+    CanvasBridge.executeCommands(rec, res.canvas);
+    return {result: res.result, calls: rec.calls};
+}
+
+/* native canvas object run by canvas_dump. Its command buffer is read
+   by executeBuffer() from a fake module memory. */
+function runNative(canvasDump) {
+    var dir = fs.mkdtempSync(path.join(os.tmpdir(), 'canvas-'));
+    var scriptFile = path.join(dir, 'script.js');
+    var bufferFile = path.join(dir, 'buffer.bin');
+    var out, res, data, heap, rec, Module;
+
+    fs.writeFileSync(scriptFile, CanvasBridge.wrapUserCode(script, {nativeCanvas: true}));
+    out = child_process.execFileSync(canvasDump, [scriptFile, bufferFile], {encoding: 'utf8'});
+    res = JSON.parse(out);
+    assert(!res.error, res.error);
+    assert(res.canvas.length === 0, 'the native canvas must not use the JSON mock');
+    data = fs.readFileSync(bufferFile);
+    fs.rmSync(dir, {recursive: true});
+
+    /* the buffer must be aligned */
+    heap = new Uint8Array(8 + data.length);
+    heap.set(data, 8);
+    Module = {
+        HEAPU8: heap,
+        _mquickjs_canvas_buffer: function() { return 8; },
+        _mquickjs_canvas_flush: function() {},
+        _mquickjs_ctx_canvas_buffer: function() { return 0; },
+        _mquickjs_ctx_canvas_flush: function() {}
+    };
+    rec = new Recorder();
+    assert(CanvasBridge.executeBuffer(rec, Module) > 0, 'no native canvas command');
+    return {result: res.result, calls: rec.calls};
+}
+
+function compare(name, a, b) {
+    var i;
+    assert(a.result === b.result, name + ': result ' + a.result + ' != ' + b.result);
+    assert(a.calls.length === b.calls.length, name + ': call count');
+    for (i = 0; i < a.calls.length; i++)
+        assert(a.calls[i] === b.calls[i], name + ': ' + a.calls[i] + ' != ' + b.calls[i]);
+}
+
+function main() {
+    var mock = runMock();
+
+    assert(mock.calls.length === 10, 'mock call count');
+    assert(mock.result === '#000,#fff,12px sans-serif,1', 'mock defaults ' + mock.result);
+
+    /* without a native canvas object (e.g. a module built before it was
+       added), the native mode falls back to the mock */
+    compare('fallback', mock, runMock({nativeCanvas: true}));
+    assert(!CanvasBridge.hasNativeCanvas({}), 'hasNativeCanvas');
+    assert(CanvasBridge.executeBuffer(new Recorder(), {}) === 0, 'executeBuffer without export');
+
+    if (process.argv[2])
+        compare('native', mock, runNative(process.argv[2]));
+    console.log('OK');
+}
+
+main();
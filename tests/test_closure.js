@@ -101,6 +101,71 @@ function test_closure3()
     assert(fib_func(6) === 8, "fib");
 }
 
+/* variable references which are resolved when the functions are
+   compiled at their first call (mqjs --lazy) */
+function test_closure4()
+{
+    var g = 1;
+
+    function var_after_use() { v = 5; var v; return v; }
+
+    function var_list(a) {
+        var b = 1,
+            c = 2, d
+            = 3;
+        return a + b + c + d + g;
+    }
+
+    function labels_and_keys() {
+        var r = { a: 1, g: 2 };
+        lbl: for (var i = 0; i < 3; i++) {
+            if (i == 1)
+                break lbl;
+        }
+        return r.a + r.g + i + g;
+    }
+
+    function catch_var() {
+        try {
+            throw 3;
+        } catch (e) {
+            return function () { return e + g; };
+        }
+    }
+
+    function hoisted() {
+        return later();
+        function later() { return g + 1; }
+    }
+
+    function methods() {
+        var o = { get v() { return g; }, m(z) { var w = z; return w; } };
+        return o.v + o.m(2);
+    }
+
+    function shadow(x) {
+        function twice(x) { return x * 2; }
+        return twice(x + 1) + x + g;
+    }
+
+    function curry(p) {
+        return function (q) { return function (r) { return p + q + r + g; }; };
+    }
+
+    assert(var_after_use() === 5, "var after use");
+    assert(var_list(1) === 8, "var list");
+    assert(labels_and_keys() === 5, "labels and keys");
+    assert(catch_var()() === 4, "catch");
+    assert(hoisted() === 2, "hoisted");
+    assert(methods() === 3, "methods");
+    assert(shadow(1) === 6, "shadow");
+    assert(curry(1)(2)(3) === 7, "curry");
+    assert(curry.length === 1 && var_list.length === 1, "length");
+    g = 10;
+    assert(hoisted() === 11, "assignment");
+}
+
 test_closure1();
 test_closure2();
 test_closure3();
+test_closure4();
@@ -295,6 +295,75 @@ function test_prototype()
     assert(f.prototype.constructor, f, "prototype");
 }
 
+function test_fused_ops(o)
+{
+    var i, n, x, s, a, b, obj;
+
+    /* compare and branch */
+    n = 0;
+    for(i = 0; i < 10; i++) {
+        if (i == 3 || i === 5)
+            n++;
+        if (i != 4 && i !== 6 && i <= 8 && i >= 1)
+            n += 10;
+    }
+    assert(n, 62, "cmp if_false");
+    n = 0;
+    for(x = 0.5; x < 3; x += 0.5)
+        n++;
+    assert(n, 5, "cmp if_false float");
+    n = 0;
+    if (NaN < 1) n++;
+    if (NaN >= 1) n++;
+    if (!(NaN > 1)) n += 10;
+    assert(n, 10, "cmp if_false NaN");
+    obj = { valueOf: function() { return 2; } };
+    n = 0;
+    if (obj > 1) n++;
+    if (obj == 2) n++;
+    if (obj === 2) n++;
+    if ("b" > "a") n++;
+    assert(n, 3, "cmp if_false objects");
+
+    /* increment of local variables */
+    i = 0x3fffffff;
+    i++;
+    assert(i, 0x40000000, "inc_loc overflow");
+    i = -0x40000000;
+    --i;
+    assert(i, -0x40000001, "dec_loc overflow");
+    x = 0.5;
+    x++;
+    assert(x, 1.5, "inc_loc float");
+    s = "a";
+    s += "b";
+    s++;
+    assert(isNaN(s), true, "inc_loc string");
+    s = "3";
+    s--;
+    assert(s, 2, "dec_loc string");
+    obj = { valueOf: function() { return 7; } };
+    ++obj;
+    assert(obj, 8, "inc_loc valueOf");
+
+    /* field of local variables and arguments */
+    a = { x: 1, y: { z: 2 }, f: function() { return this.x; } };
+    assert(a.x + a.y.z, 3, "get_loc_field");
+    assert(a.f(), 1, "get_loc_field call");
+    a.x = 10;
+    a.x++;
+    a.y.z += 5;
+    assert(a.x, 11, "get_loc_field assign");
+    assert(a.y.z, 7, "get_loc_field assign");
+    assert(delete a.x, true, "get_loc_field delete");
+    assert(a.x, undefined, "get_loc_field delete");
+    assert(o.v * 2, 6, "get_arg_field");
+    o.v--;
+    assert(o.v, 2, "get_arg_field assign");
+    b = null;
+    assert_throws(TypeError, function() { return b.x; });
+}
+
 function test_arguments()
 {
     function f2() {
@@ -305,6 +374,289 @@ function test_arguments()
     f2(1, 3);
 }
 
+function test_prop_cache()
+{
+    var i, a, b, s, proto, obj;
+
+    function get_x(o) { return o.x; }
+    function set_x(o, v) { o.x = v; }
+
+    a = { x: 1, y: 2 };
+    b = { y: 3, x: 4 };
+    s = 0;
+    for(i = 0; i < 10; i++)
+        s += get_x(a) + get_x(b);
+    assert(s, 50, "prop cache");
+    delete a.x;
+    assert(get_x(a), undefined, "prop cache delete");
+    a.x = 5;
+    assert(get_x(a), 5, "prop cache re-add");
+    set_x(a, 6);
+    set_x(a, 7);
+    assert(a.x, 7, "prop cache put");
+
+    /* objects with different layouts at the same site */
+    a = [ { x: 1 }, { y: "x", x: 2 }, { a: 0, b: 1, c: 2, x: 3 }, { y: 4 } ];
+    s = "";
+    for(i = 0; i < 8; i++)
+        s += get_x(a[i & 3]) + ",";
+    assert(s, "1,2,3,undefined,1,2,3,undefined,", "prop cache layouts");
+
+    /* property found in the prototype */
+    proto = { x: 10 };
+    obj = Object.create(proto);
+    assert(get_x(obj), 10, "prop cache proto");
+    assert(get_x(obj), 10, "prop cache proto");
+    obj.x = 11;
+    assert(get_x(obj), 11, "prop cache shadowing");
+    assert(get_x(proto), 10, "prop cache proto");
+    obj = Object.create(proto);
+    get_x(obj);
+    Object.setPrototypeOf(obj, { x: 12 });
+    assert(get_x(obj), 12, "prop cache setPrototypeOf");
+
+    /* the GC moves the objects */
+    a = { x: 13 };
+    get_x(a);
+    gc();
+    assert(get_x(a), 13, "prop cache gc");
+    set_x(a, 14);
+    gc();
+    set_x(a, 15);
+    assert(get_x(a), 15, "prop cache gc");
+
+    /* depth 1 entries check the layout of the receiver */
+    obj = Object.create(proto);
+    obj.a = 1;
+    assert(get_x(obj), 10, "prop cache receiver layout");
+    obj = Object.create(proto);
+    obj.a = 2;
+    obj.x = 20;
+    assert(get_x(obj), 20, "prop cache receiver layout");
+    obj = Object.create(proto);
+    obj.a = 3;
+    assert(get_x(obj), 10, "prop cache receiver layout");
+    obj.x = 30;
+    assert(get_x(obj), 30, "prop cache receiver layout");
+
+    /* more sites than cache entries: the sites share the entries */
+    test_prop_cache_sites(256);
+}
+
+function test_prop_cache_sites(n)
+{
+    var i, j, src, f, o, q, s;
+
+    o = [ {}, {}, {} ];
+    q = [ {}, {}, {} ];
+    src = "var s = 0;\n";
+    s = 0;
+    for(i = 0; i < n; i++) {
+        o[i % 3]["p" + i] = i;
+        src += "o" + (i % 3) + ".p" + i + " += 1; s += o" + (i % 3) + ".p" + i + ";\n";
+        s += i + 1;
+    }
+    src += "return s;";
+    /* same keys with other layouts */
+    for(i = n - 1; i >= 0; i--)
+        q[i % 3]["p" + i] = i;
+    f = Function("o0", "o1", "o2", src);
+    for(j = 0; j < 3; j++)
+        assert(f(o[0], o[1], o[2]), s + j * n, "prop cache sites");
+    assert(f(q[0], q[1], q[2]), s, "prop cache sites layouts");
+    assert(f(o[0], o[1], o[2]), s + 3 * n, "prop cache sites");
+}
+
+/* object layouts (shared with 'mqjs --shapes') */
+function test_shapes()
+{
+    var i, a, b, o, s, tab;
+
+    function get_y(o) { return o.y; }
+
+    tab = [];
+    for(i = 0; i < 4; i++)
+        tab.push({ x: i, y: i * 2, z: i * 3 });
+    s = 0;
+    for(i = 0; i < 4; i++)
+        s += get_y(tab[i]);
+    assert(s, 12, "shapes shared");
+    tab[1].w = 1;
+    delete tab[2].x;
+    assert(Object.keys(tab[1]).join(), "x,y,z,w", "shapes add");
+    assert(Object.keys(tab[2]).join(), "y,z", "shapes delete");
+    assert(get_y(tab[1]) + get_y(tab[2]) + get_y(tab[3]), 12, "shapes transitions");
+    tab[2].x = 5;
+    assert(JSON.stringify(tab[2]), '{"y":4,"z":6,"x":5}', "shapes re-add");
+    gc();
+    assert(get_y(tab[3]), 6, "shapes gc");
+
+    /* delete the last and the only properties */
+    a = { x: 1, y: 2 };
+    delete a.y;
+    delete a.x;
+    assert(Object.keys(a).length, 0, "shapes empty");
+    a.y = 3;
+    assert(a.y, 3, "shapes empty");
+
+    /* for-in order */
+    b = { c: 1 };
+    b.a = 2;
+    b.b = 3;
+    s = "";
+    for(i in b)
+        s += i;
+    assert(s, "cab", "shapes for-in");
+
+    /* many properties */
+    o = {};
+    for(i = 0; i < 40; i++)
+        o["p" + i] = i;
+    delete o.p3;
+    s = 0;
+    for(i in o)
+        s += o[i];
+    assert(s, 40 * 39 / 2 - 3, "shapes many props");
+
+    /* getter and setter */
+    o = { x: 1, y: 2 };
+    Object.defineProperty(o, "z", { get: function () { return this.x + this.y; } });
+    assert(o.z, 3, "shapes getter");
+    o.x = 4;
+    assert(o.z + get_y(o), 8, "shapes getter");
+    assert(Object.keys(o).join(), "x,y,z", "shapes getter");
+}
+
+function test_string_append()
+{
+    var i, s, t, u, a, obj;
+
+    function rep(c, n) {
+        var r = "";
+        for(var j = 0; j < n; j++)
+            r = r + c;
+        return r;
+    }
+
+    s = "";
+    for(i = 0; i < 1000; i++)
+        s += String(i % 10);
+    assert(s.length, 1000, "append");
+    assert(s.substring(990), "0123456789", "append");
+
+    /* aliasing: a copy must not see the next appends */
+    s = "";
+    a = [];
+    for(i = 0; i < 100; i++) {
+        s += "ab";
+        if (i % 10 == 9)
+            a.push(s);
+    }
+    for(i = 0; i < a.length; i++)
+        assert(a[i], rep("ab", (i + 1) * 10), "append alias");
+    t = s;
+    s += "x";
+    assert(t.length, 200, "append alias");
+    assert(s.length, 201, "append alias");
+
+    /* value of the assignment expression */
+    s = rep("a", 40);
+    u = (s += "b");
+    s += "c";
+    assert(u, rep("a", 40) + "b", "append result");
+    assert(s, rep("a", 40) + "bc", "append result");
+
+    /* the right operand reads the variable */
+    s = rep("a", 40);
+    s += s;
+    assert(s, rep("a", 80), "append self");
+
+    /* closures */
+    s = rep("a", 40);
+    function get_s() { return s; }
+    for(i = 0; i < 10; i++) {
+        t = get_s();
+        s += "b";
+    }
+    assert(t, rep("a", 40) + rep("b", 9), "append closure");
+    assert(s, rep("a", 40) + rep("b", 10), "append closure");
+
+    /* side effects of the conversion */
+    s = rep("a", 40);
+    obj = { toString() { t = s; s = "z"; return "y"; } };
+    s += "b";
+    s += obj;
+    assert(t, rep("a", 40) + "b", "append toString");
+    assert(s, rep("a", 40) + "by", "append toString");
+
+    /* exception in the conversion */
+    s = rep("a", 40);
+    try {
+        s += { toString() { throw "e"; } };
+    } catch(e) {
+    }
+    assert(s, rep("a", 40), "append exception");
+
+    /* numbers, surrogate pairs and GC */
+    s = 1;
+    s += 2;
+    assert(s, 3, "append number");
+    s += "x";
+    assert(s, "3x", "append number");
+    s = rep("a", 40) + "\ud83d";
+    s += "\ude00";
+    assert(s.length, 42, "append surrogate");
+    assert(s.codePointAt(40), 0x1f600, "append surrogate");
+    s = rep("a", 40);
+    s += "b";
+    gc();
+    s += "c";
+    gc();
+    assert(s, rep("a", 40) + "bc", "append gc");
+}
+
+function test_float_tmp()
+{
+    var x, y, i, a, t, obj;
+
+    /* intermediate float results are freed by OP_arith_tmp */
+    x = 0.5;
+    y = 0.25;
+    assert(x * x - y * y + 0.1, 0.2875, "float tmp");
+    assert(2 * x * y + 1.5, 1.75, "float tmp");
+    assert(x * x + y * y < 4, true, "float tmp");
+    assert(x * 3 + y * 3 >= 2.25, true, "float tmp");
+    assert((x * 2 + 1) * 5, 10, "float tmp int");
+    assert(1 / (x - 0.5) , Infinity, "float tmp");
+    assert(1 / (-x * 0), -Infinity, "float tmp -0");
+    assert(1 / (-x * 0 + -0), -Infinity, "float tmp -0");
+    assert(isNaN(x * NaN - y), true, "float tmp NaN");
+    assert(x * 3 + "a", "1.5a", "float tmp string");
+    assert("a" + x * 3, "a1.5", "float tmp string");
+    obj = { valueOf: function() { return 0.125; } };
+    assert(x * 3 + obj, 1.625, "float tmp valueOf");
+    assert(obj * x + obj * y, 0.09375, "float tmp valueOf");
+
+    /* the result of an assignment is not a temporary */
+    assert((t = x * 3) + (t * 2), 4.5, "float tmp assign");
+    assert(t, 1.5, "float tmp assign");
+    t = 0.1;
+    t *= x * 3;
+    assert(t, 0.15000000000000002, "float tmp assign");
+
+    /* the stored values must not be overwritten by the next results */
+    a = [];
+    for(i = 0; i < 10; i++) {
+        t = i * 0.5 + 0.25;
+        y = t * t - 0.5;
+        a.push(y);
+    }
+    for(i = 0; i < 10; i++) {
+        t = i * 0.5 + 0.25;
+        assert(a[i], t * t - 0.5, "float tmp store");
+    }
+}
+
 function test_to_primitive()
 {
     var obj;
@@ -343,13 +695,41 @@ function test_labels2()
     assert(i == 1)
 }
 
+/* keeps about 1 MB alive (grows the memory with "mqjs --memory-grow") */
+function test_large_heap()
+{
+    var a = [], count = 0, i, n = 20000;
+    function add(v) { count += v; }
+    function build(k)
+    {
+        var local = k;
+        var get = function() { return local; };
+        for(i = 0; i < n; i++) {
+            a.push({ idx: i, str: "s" + i });
+            add(1);
+            local++;
+        }
+        return get();
+    }
+    assert(build(10), 10 + n);
+    assert(count, n);
+    for(i = 0; i < n; i += 997)
+        assert(a[i].idx === i && a[i].str === "s" + i);
+}
+
 test_op1();
 test_cvt();
 test_eq();
 test_inc_dec();
 test_op2();
 test_prototype();
+test_prop_cache();
+test_shapes();
+test_string_append();
+test_float_tmp();
+test_fused_ops({ v: 3 });
 test_arguments();
 test_to_primitive();
 test_labels();
 test_labels2();
+test_large_heap();
@@ -168,6 +168,54 @@ function test_for_in2()
     assert(tab.toString(), "x,y");
 }
 
+/* same layout objects (shared shapes with mqjs --shapes) */
+function test_for_in3()
+{
+    var rows, i, k, s, tab, o;
+    rows = JSON.parse('[{"id":1,"name":"a"},{"id":2,"name":"b"},{"id":3,"name":"c"}]');
+    s = "";
+    for(i = 0; i < rows.length; i++) {
+        for(k in rows[i]) {
+            s += k + "=" + rows[i][k] + ";";
+        }
+    }
+    assert(s, "id=1;name=a;id=2;name=b;id=3;name=c;");
+
+    /* nested loops on the same layout */
+    tab = [];
+    for(k in rows[0]) {
+        for(i in rows[1]) {
+            if (i === "name")
+                break;
+            tab.push(k + i);
+        }
+    }
+    assert(tab.toString(), "idid,nameid");
+
+    /* integer keys, empty object */
+    o = {};
+    o[1] = 0;
+    o.x = 1;
+    tab = [];
+    for(k in o)
+        tab.push(typeof k + ":" + k);
+    assert(tab.toString(), "string:1,string:x");
+    tab = [];
+    for(k in {})
+        tab.push(k);
+    assert(tab.length, 0);
+
+    /* the keys are those at the start of the loop */
+    o = { a: 1, b: 2 };
+    tab = [];
+    for(k in o) {
+        o.c = 3;
+        tab.push(k);
+    }
+    assert(tab.toString(), "a,b");
+    assert(Object.keys(o).toString(), "a,b,c");
+}
+
 /*
 function test_for_in_proxy() {
     let removed_key = "";
@@ -383,6 +431,7 @@ test_switch1();
 test_switch2();
 test_for_in();
 test_for_in2();
+test_for_in3();
 //test_for_in_proxy();
 
 test_try_catch1();
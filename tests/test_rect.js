@@ -65,4 +65,32 @@ function test()
     assert(Rectangle.call(cb, "abc"), "testabc");
 }
 
+function test_host_functions()
+{
+    var a, err;
+
+    /* added at runtime with typed signatures */
+    assert(lerp(0, 10, 0.25), 2.5);
+    assert(lerp("1", 3, 1), 3);
+    assert(lerp(1), NaN);
+    assert(lerp.name, "lerp");
+    assert(lerp.length, 3);
+
+    assert(imax(3, "7"), 7);
+    assert(imax(1.9, -5), 1);
+    assert(imax(-3), 0);
+
+    a = new Uint8Array([0, 1, 255]);
+    invertBytes(a);
+    assert(a.toString(), "255,254,0");
+    err = false;
+    try {
+        invertBytes([1, 2]);
+    } catch(e) {
+        err = e instanceof TypeError;
+    }
+    assert(err, true);
+}
+
 test();
+test_host_functions();
@@ -0,0 +1,71 @@
+/* run after tests/test_snapshot_init.js with mqjs --snapshot */
+
+function assert(actual, expected, message) {
+    if (arguments.length == 1)
+        expected = true;
+
+    if (actual === expected)
+        return;
+
+    throw Error("assertion failed: got |" + actual + "|" +
+                ", expected |" + expected + "|" +
+                (message ? " (" + message + ")" : ""));
+}
+
+function test_closures()
+{
+    assert(counter.get(), 11, "closure");
+    assert(counter.inc(), 12, "closure update");
+    assert(counter.get(), 12, "shared variable");
+    assert(adders[3](10), 13, "captured loop variable");
+    assert(make_counter(5).inc(), 6, "function defined before the snapshot");
+}
+
+function test_objects()
+{
+    var i, s;
+    assert(points.length, 100);
+    s = 0;
+    for (i = 0; i < points.length; i++)
+        s += points[i].norm2();
+    assert(s, 656700, "prototype method");
+    assert(points[7] instanceof Point, true, "instanceof");
+    assert(nested.a.b.c[3].d, "deep");
+    assert(nested.a.b.c[1], "two");
+    assert(bytes[3], 250, "typed array");
+    assert(bytes.length, 4);
+    assert(err instanceof TypeError, true);
+    assert(err.message, "saved error");
+    var p = new Point(3, 4);
+    p.z = 1;
+    assert(p.norm2(), 25, "new object");
+}
+
+function test_strings()
+{
+    assert(long_str.length, 200);
+    assert(long_str.substring(24, 28), "YZAB");
+    assert(long_str + "!", long_str.concat("!"));
+    assert(re.exec("xx snap42 yy")[1], "42", "regexp");
+}
+
+function test_atoms()
+{
+    var keys;
+    /* the names parsed after the restore must be the atoms of the
+       snapshot */
+    assert(dyn.snapshot_key_0, "value_0", "atom");
+    assert(dyn.snapshot_key_49, "value_49", "atom");
+    assert(dyn["snapshot_key_" + 25], "value_25", "computed atom");
+    keys = Object.keys(dyn);
+    assert(keys.length, 50);
+    assert(keys[10], "snapshot_key_10");
+    dyn.snapshot_key_new = 1;
+    assert(Object.keys(dyn).length, 51, "new property");
+    assert(dyn.hasOwnProperty("snapshot_key_3"), true);
+}
+
+test_closures();
+test_objects();
+test_strings();
+test_atoms();
@@ -0,0 +1,48 @@
+/* state saved by "mqjs --snapshot -I tests/test_snapshot_init.js
+   tests/test_snapshot.js" and checked after the context is restored
+   at another address */
+
+function make_counter(start)
+{
+    var n = start;
+    return {
+        inc: function () { return ++n; },
+        get: function () { return n; },
+    };
+}
+
+function Point(x, y)
+{
+    this.x = x;
+    this.y = y;
+}
+
+Point.prototype.norm2 = function () {
+    return this.x * this.x + this.y * this.y;
+};
+
+var counter = make_counter(10);
+counter.inc();
+
+var adders = [];
+for (var i = 0; i < 4; i++) {
+    adders.push((function (k) { return function (v) { return v + k; }; })(i));
+}
+
+var points = [];
+for (var i = 0; i < 100; i++)
+    points.push(new Point(i, -i));
+
+/* property names which are not in the ROM atoms */
+var dyn = {};
+for (var i = 0; i < 50; i++)
+    dyn["snapshot_key_" + i] = "value_" + i;
+
+var long_str = "";
+for (var i = 0; i < 200; i++)
+    long_str += String.fromCharCode(0x41 + (i % 26));
+
+var nested = { a: { b: { c: [1, "two", 3.5, { d: "deep" }] } } };
+var re = /snap(\d+)/;
+var bytes = new Uint8Array([1, 2, 3, 250]);
+var err = new TypeError("saved error");
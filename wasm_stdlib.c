@@ -0,0 +1,37 @@
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "mquickjs_build.h"
+
+/* native canvas object of the WASM build (see wasm_wrapper.c). The
+   draw calls are encoded in a binary command buffer. */
+
+static const JSPropDef js_canvas[] = {
+    JS_CGETSET_MAGIC_DEF("fillStyle", js_canvas_get_style, js_canvas_set_style, CANVAS_STYLE_FILL ),
+    JS_CGETSET_MAGIC_DEF("strokeStyle", js_canvas_get_style, js_canvas_set_style, CANVAS_STYLE_STROKE ),
+    JS_CGETSET_MAGIC_DEF("font", js_canvas_get_style, js_canvas_set_style, CANVAS_STYLE_FONT ),
+    JS_CGETSET_DEF("lineWidth", js_canvas_get_lineWidth, js_canvas_set_lineWidth ),
+    JS_CFUNC_MAGIC_DEF("fillRect", 4, js_canvas_draw, CANVAS_OP_FILL_RECT ),
+    JS_CFUNC_MAGIC_DEF("strokeRect", 4, js_canvas_draw, CANVAS_OP_STROKE_RECT ),
+    JS_CFUNC_MAGIC_DEF("clearRect", 4, js_canvas_draw, CANVAS_OP_CLEAR_RECT ),
+    JS_CFUNC_MAGIC_DEF("rect", 4, js_canvas_draw, CANVAS_OP_RECT ),
+    JS_CFUNC_MAGIC_DEF("beginPath", 0, js_canvas_draw, CANVAS_OP_BEGIN_PATH ),
+    JS_CFUNC_MAGIC_DEF("closePath", 0, js_canvas_draw, CANVAS_OP_CLOSE_PATH ),
+    JS_CFUNC_MAGIC_DEF("moveTo", 2, js_canvas_draw, CANVAS_OP_MOVE_TO ),
+    JS_CFUNC_MAGIC_DEF("lineTo", 2, js_canvas_draw, CANVAS_OP_LINE_TO ),
+    JS_CFUNC_MAGIC_DEF("arc", 6, js_canvas_draw, CANVAS_OP_ARC ),
+    JS_CFUNC_MAGIC_DEF("fill", 0, js_canvas_draw, CANVAS_OP_FILL ),
+    JS_CFUNC_MAGIC_DEF("stroke", 0, js_canvas_draw, CANVAS_OP_STROKE ),
+    JS_CFUNC_MAGIC_DEF("fillText", 3, js_canvas_text, CANVAS_OP_FILL_TEXT ),
+    JS_CFUNC_MAGIC_DEF("strokeText", 3, js_canvas_text, CANVAS_OP_STROKE_TEXT ),
+    JS_PROP_END,
+};
+
+static const JSClassDef js_canvas_obj =
+    JS_OBJECT_DEF("Canvas", js_canvas);
+
+/* include the full standard library too */
+
+#define CONFIG_WASM_CANVAS
+#include "mqjs_stdlib.c"
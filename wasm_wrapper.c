@@ -14,93 +14,209 @@
  * MIT License - See LICENSE file
  */
 
-#include <emscripten/emscripten.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <math.h>
+#ifdef __EMSCRIPTEN__
+#include <emscripten/emscripten.h>
+#else
+/* native build used by the tests (see "make -f Makefile.wasm test") */
+#include <time.h>
+#define EMSCRIPTEN_KEEPALIVE
+
+static double emscripten_get_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+#endif
 #include "mquickjs.h"
 
 /* Memory pool for the JS engine */
 #define MQUICKJS_MEM_SIZE (1024 * 1024)  /* 1MB default */
 static uint8_t js_memory[MQUICKJS_MEM_SIZE] __attribute__((aligned(8)));
 
-/* Global context */
-static JSContext *global_ctx = NULL;
-
 /* Output buffer for results */
 #define OUTPUT_BUF_SIZE 65536
 static char output_buffer[OUTPUT_BUF_SIZE];
-static size_t output_pos = 0;
+static char result_buffer[OUTPUT_BUF_SIZE];
+
+/* Timers of setTimeout() and setInterval(). The callbacks are called
+   from the host event loop by mquickjs_run_timers(). */
+#define MQUICKJS_MAX_TIMERS 64
+
+typedef struct {
+    int allocated;
+    int ready; /* due at the start of the current mquickjs_run_timers() */
+    JSGCRef func;
+    double due; /* emscripten_get_now() time in ms */
+    double interval; /* in ms, < 0 for setTimeout() */
+} WasmTimer;
+
+/* options of mquickjs_set_options() (off by default as in mqjs) */
+#define MQUICKJS_OPT_SHAPES (1 << 0) /* shared object shapes (mqjs --shapes) */
+#define MQUICKJS_OPT_LAZY   (1 << 1) /* lazy compilation (mqjs --lazy) */
+
+/* task suspended at the end of a time slice */
+#define MQUICKJS_TASK_NONE   0
+#define MQUICKJS_TASK_SCRIPT 1 /* mquickjs_run() */
+#define MQUICKJS_TASK_TIMER  2 /* timer callback */
+
+/* A JS context with its arena and its output sink. It is the context
+   opaque so that console.log() and the log function know where to
+   write. */
+typedef struct {
+    JSContext *ctx;
+    uint8_t *mem;
+    size_t mem_size;
+    char *output;
+    size_t output_size;
+    size_t output_pos;
+    char *result;
+    size_t result_size;
+    /* binary result (see mquickjs_run_binary()) */
+    const uint8_t *result_ptr;
+    size_t result_len;
+    JSCStringBuf result_cbuf;
+    /* native canvas object (allocated on first use) */
+    struct CanvasState *canvas;
+    /* time slicing (see mquickjs_set_time_slice()) */
+    double slice_ms; /* 0 if disabled */
+    double slice_deadline; /* 0 outside of a slice */
+    int task; /* MQUICKJS_TASK_x */
+    WasmTimer timers[MQUICKJS_MAX_TIMERS];
+    /* budget of each run (see mquickjs_set_budget()) */
+    JSMeterStats budget;
+    int options; /* MQUICKJS_OPT_x */
+} WasmContext;
+
+/* Default context used by the mquickjs_xxx() API */
+static WasmContext default_wc = {
+    .mem = js_memory,
+    .mem_size = sizeof(js_memory),
+    .output = output_buffer,
+    .output_size = OUTPUT_BUF_SIZE,
+    .result = result_buffer,
+    .result_size = OUTPUT_BUF_SIZE,
+};
+
+/* Contexts created with mquickjs_ctx_new(). The handle is the index
+   plus one so that 0 is never a valid handle. */
+#define MQUICKJS_MAX_CONTEXTS 64
+#define MQUICKJS_MIN_HEAP_SIZE (32 * 1024)
+#define MQUICKJS_CTX_OUTPUT_SIZE 16384
+static WasmContext *ctx_table[MQUICKJS_MAX_CONTEXTS];
+
+/* Flat memory usage record filled by mquickjs_memory_usage(). All the
+   fields are doubles so that JS can read them with HEAPF64. The block
+   types are in the JS_GetMemoryTagName() order. */
+typedef struct {
+    double mem_size;
+    double heap_size;
+    double stack_size;
+    double free_size;
+    double gc_count;
+    double minor_gc_count;
+    double gc_reclaimed_bytes;
+    double gc_last_pause_ms;
+    double gc_max_pause_ms;
+    double gc_total_pause_ms;
+    double block_count[JS_MEMORY_TAG_COUNT];
+    double block_size[JS_MEMORY_TAG_COUNT];
+    double gc_max_heap_size;
+} WasmMemoryUsage;
+
+static WasmMemoryUsage memory_usage;
+
+/* Work done by the last run, filled by mquickjs_meter(). The fields are
+   doubles so that JS can read them with HEAPF64. */
+typedef struct {
+    double ticks; /* function calls, jumps and regexp steps */
+    double alloc_bytes;
+    double native_time_ms;
+} WasmMeter;
+
+static WasmMeter meter;
+
+/* Precompiled bytecode files (same limit as JS_LoadBytecode()). The
+   buffers are referenced by the context so they must live as long as
+   the context. mquickjs_run_bytecode() runs the last loaded one. */
+#define MQUICKJS_MAX_BYTECODE_FILES 4
+static uint8_t *bytecode_bufs[MQUICKJS_MAX_BYTECODE_FILES];
+static int bytecode_count = 0;
+static JSGCRef bytecode_func_ref;
+
+/* Heap snapshot used by mquickjs_restore() */
+static uint8_t *snapshot_buf = NULL;
+static size_t snapshot_len = 0;
+static int snapshot_bytecode_count = 0;
+static JSValue snapshot_bytecode_func;
+
+/* free the bytecode files from index 'n' */
+static void bytecode_free(int n)
+{
+    while (bytecode_count > n) {
+        bytecode_count--;
+        free(bytecode_bufs[bytecode_count]);
+        bytecode_bufs[bytecode_count] = NULL;
+    }
+}
+
+static void output_clear(WasmContext *wc)
+{
+    wc->output_pos = 0;
+    wc->output[0] = '\0';
+}
+
+/* the output is silently truncated if it does not fit */
+static void output_write(WasmContext *wc, const void *buf, size_t len)
+{
+    if (wc->output_pos + len < wc->output_size - 1) {
+        memcpy(wc->output + wc->output_pos, buf, len);
+        wc->output_pos += len;
+        wc->output[wc->output_pos] = '\0';
+    }
+}
+
+static void output_puts(WasmContext *wc, const char *str)
+{
+    output_write(wc, str, strlen(str));
+}
 
 /* Custom print function implementation for console.log */
 static JSValue js_print(JSContext *ctx, JSValue *this_val, int argc, JSValue *argv)
 {
+    WasmContext *wc = JS_GetContextOpaque(ctx);
     int i;
     JSValue v;
 
     for(i = 0; i < argc; i++) {
-        if (i != 0 && output_pos < OUTPUT_BUF_SIZE - 1) {
-            output_buffer[output_pos++] = ' ';
+        if (i != 0) {
+            output_puts(wc, " ");
         }
         v = argv[i];
-        if (JS_IsString(ctx, v)) {
-            JSCStringBuf buf;
-            const char *str;
-            str = JS_ToCString(ctx, v, &buf);
-            if (str) {
-                size_t len = strlen(str);
-                if (output_pos + len < OUTPUT_BUF_SIZE - 1) {
-                    memcpy(output_buffer + output_pos, str, len);
-                    output_pos += len;
-                }
-            }
-        } else if (JS_IsInt(v)) {
-            int val = JS_VALUE_GET_INT(v);
+        if (JS_IsInt(v)) {
             char num_buf[32];
-            int len = snprintf(num_buf, sizeof(num_buf), "%d", val);
-            if (output_pos + len < OUTPUT_BUF_SIZE - 1) {
-                memcpy(output_buffer + output_pos, num_buf, len);
-                output_pos += len;
-            }
+            int len = snprintf(num_buf, sizeof(num_buf), "%d", JS_VALUE_GET_INT(v));
+            output_write(wc, num_buf, len);
         } else if (JS_IsUndefined(v)) {
-            const char *undef = "undefined";
-            size_t len = strlen(undef);
-            if (output_pos + len < OUTPUT_BUF_SIZE - 1) {
-                memcpy(output_buffer + output_pos, undef, len);
-                output_pos += len;
-            }
+            output_puts(wc, "undefined");
         } else if (JS_IsNull(v)) {
-            const char *null_str = "null";
-            size_t len = strlen(null_str);
-            if (output_pos + len < OUTPUT_BUF_SIZE - 1) {
-                memcpy(output_buffer + output_pos, null_str, len);
-                output_pos += len;
-            }
+            output_puts(wc, "null");
         } else if (JS_IsBool(v)) {
-            const char *bool_str = JS_VALUE_GET_SPECIAL_VALUE(v) ? "true" : "false";
-            size_t len = strlen(bool_str);
-            if (output_pos + len < OUTPUT_BUF_SIZE - 1) {
-                memcpy(output_buffer + output_pos, bool_str, len);
-                output_pos += len;
-            }
+            output_puts(wc, JS_VALUE_GET_SPECIAL_VALUE(v) ? "true" : "false");
         } else {
-            /* For other types, just show [Object] */
+            /* strings and other types */
             JSCStringBuf buf;
             const char *str = JS_ToCString(ctx, v, &buf);
             if (str) {
-                size_t len = strlen(str);
-                if (output_pos + len < OUTPUT_BUF_SIZE - 1) {
-                    memcpy(output_buffer + output_pos, str, len);
-                    output_pos += len;
-                }
+                output_puts(wc, str);
             }
         }
     }
-    if (output_pos < OUTPUT_BUF_SIZE - 1) {
-        output_buffer[output_pos++] = '\n';
-    }
-    output_buffer[output_pos] = '\0';
+    output_puts(wc, "\n");
     return JS_UNDEFINED;
 }
 
@@ -130,66 +246,504 @@ static JSValue js_load(JSContext *ctx, JSValue *this_val, int argc, JSValue *arg
     return JS_ThrowTypeError(ctx, "load() is not supported in browser");
 }
 
-/* Timer stubs - actual timers would require async support */
+/* Return the timer id (index + 1 so that 0 is never a valid id) */
+static JSValue wasm_add_timer(JSContext *ctx, JSValue *argv, int is_interval)
+{
+    WasmContext *wc = JS_GetContextOpaque(ctx);
+    WasmTimer *th;
+    int delay, i;
+
+    if (!JS_IsFunction(ctx, argv[0]))
+        return JS_ThrowTypeError(ctx, "not a function");
+    if (JS_ToInt32(ctx, &delay, argv[1]))
+        return JS_EXCEPTION;
+    /* a null interval would be run in a loop */
+    if (delay < (is_interval ? 1 : 0))
+        delay = is_interval;
+    for(i = 0; i < MQUICKJS_MAX_TIMERS; i++) {
+        th = &wc->timers[i];
+        if (!th->allocated) {
+            *JS_AddGCRef(ctx, &th->func) = argv[0];
+            th->due = emscripten_get_now() + delay;
+            th->interval = is_interval ? delay : -1;
+            th->ready = 0;
+            th->allocated = 1;
+            return JS_NewInt32(ctx, i + 1);
+        }
+    }
+    return JS_ThrowInternalError(ctx, "too many timers");
+}
+
 static JSValue js_setTimeout(JSContext *ctx, JSValue *this_val, int argc, JSValue *argv) {
-    /* Basic stub - timers not fully supported in sync WASM */
-    return JS_ThrowTypeError(ctx, "setTimeout() requires async support");
+    return wasm_add_timer(ctx, argv, 0);
 }
 
+static JSValue js_setInterval(JSContext *ctx, JSValue *this_val, int argc, JSValue *argv) {
+    return wasm_add_timer(ctx, argv, 1);
+}
+
+/* also used for clearInterval() */
 static JSValue js_clearTimeout(JSContext *ctx, JSValue *this_val, int argc, JSValue *argv) {
+    WasmContext *wc = JS_GetContextOpaque(ctx);
+    WasmTimer *th;
+    int timer_id;
+
+    if (JS_ToInt32(ctx, &timer_id, argv[0]))
+        return JS_EXCEPTION;
+    if (timer_id >= 1 && timer_id <= MQUICKJS_MAX_TIMERS) {
+        th = &wc->timers[timer_id - 1];
+        if (th->allocated) {
+            JS_DeleteGCRef(ctx, &th->func);
+            th->allocated = 0;
+        }
+    }
+    return JS_UNDEFINED;
+}
+
+/* Native canvas object. The draw calls are encoded in a ring buffer
+   of 32-bit words which the host decodes in place (see
+   CanvasBridge.executeBuffer() in dist/canvas-bridge.js). Each command
+   is a header word (opcode | (arg_count << 8)) followed by its
+   arguments as float32. The string arguments (styles, fonts and texts)
+   are interned in a string table and passed as an uint32 index. */
+
+enum {
+    CANVAS_OP_WRAP, /* continue at the start of the buffer */
+    CANVAS_OP_FILL_RECT,
+    CANVAS_OP_STROKE_RECT,
+    CANVAS_OP_CLEAR_RECT,
+    CANVAS_OP_RECT,
+    CANVAS_OP_BEGIN_PATH,
+    CANVAS_OP_CLOSE_PATH,
+    CANVAS_OP_MOVE_TO,
+    CANVAS_OP_LINE_TO,
+    CANVAS_OP_ARC,
+    CANVAS_OP_FILL,
+    CANVAS_OP_STROKE,
+    CANVAS_OP_FILL_TEXT, /* string x y */
+    CANVAS_OP_STROKE_TEXT,
+    CANVAS_OP_SET_FILL_STYLE, /* string */
+    CANVAS_OP_SET_STROKE_STYLE,
+    CANVAS_OP_SET_FONT,
+    CANVAS_OP_SET_LINE_WIDTH,
+    CANVAS_OP_COUNT,
+};
+
+/* number of float arguments of the draw commands */
+static const uint8_t canvas_op_arg_count[CANVAS_OP_COUNT] = {
+    [CANVAS_OP_FILL_RECT] = 4,
+    [CANVAS_OP_STROKE_RECT] = 4,
+    [CANVAS_OP_CLEAR_RECT] = 4,
+    [CANVAS_OP_RECT] = 4,
+    [CANVAS_OP_MOVE_TO] = 2,
+    [CANVAS_OP_LINE_TO] = 2,
+    [CANVAS_OP_ARC] = 6,
+};
+
+/* 'magic' of the style properties */
+#define CANVAS_STYLE_FILL   0
+#define CANVAS_STYLE_STROKE 1
+#define CANVAS_STYLE_FONT   2
+#define CANVAS_STYLE_COUNT  3
+
+/* same initial state as the JSON canvas mock of dist/canvas-bridge.js */
+static const char *canvas_style_defaults[CANVAS_STYLE_COUNT] = {
+    "#000", "#fff", "12px sans-serif",
+};
+
+#define CANVAS_BUF_WORDS (64 * 1024)
+#define CANVAS_MAX_STRINGS 1024
+#define CANVAS_STRING_POOL_SIZE (32 * 1024)
+#define CANVAS_HASH_SIZE (2 * CANVAS_MAX_STRINGS) /* must be a power of two */
+
+/* Memory layout read by the host. Only read_pos is written by the
+   host (with mquickjs_canvas_flush()). */
+typedef struct {
+    uint32_t buf_size; /* in words */
+    uint32_t read_pos; /* in words */
+    uint32_t write_pos; /* in words */
+    uint32_t dropped; /* commands dropped because the buffer was full */
+    uint32_t string_gen; /* incremented when the string table is cleared */
+    uint32_t string_count;
+    uint32_t string_offsets[CANVAS_MAX_STRINGS + 1]; /* in string_pool */
+    uint8_t string_pool[CANVAS_STRING_POOL_SIZE];
+    uint32_t buf[CANVAS_BUF_WORDS];
+} CanvasBuffer;
+
+typedef struct CanvasState {
+    CanvasBuffer b;
+    /* current state, -1 if not set */
+    int style[CANVAS_STYLE_COUNT]; /* string index */
+    float line_width;
+    uint16_t hash[CANVAS_HASH_SIZE]; /* string index + 1, 0 if free */
+} CanvasState;
+
+static uint32_t canvas_hash_string(const char *str, size_t len)
+{
+    uint32_t h = 0;
+    size_t i;
+    for(i = 0; i < len; i++)
+        h = h * 263 + (uint8_t)str[i];
+    return h;
+}
+
+/* return the string index or -1 if the table is full */
+static int canvas_intern_string(CanvasState *cs, const char *str, size_t len)
+{
+    CanvasBuffer *b = &cs->b;
+    uint32_t h, start, idx;
+
+    h = canvas_hash_string(str, len) & (CANVAS_HASH_SIZE - 1);
+    while (cs->hash[h] != 0) {
+        idx = cs->hash[h] - 1;
+        start = b->string_offsets[idx];
+        if (b->string_offsets[idx + 1] - start == len &&
+            !memcmp(b->string_pool + start, str, len))
+            return idx;
+        h = (h + 1) & (CANVAS_HASH_SIZE - 1);
+    }
+    idx = b->string_count;
+    start = b->string_offsets[idx];
+    if (idx >= CANVAS_MAX_STRINGS || len > CANVAS_STRING_POOL_SIZE - start)
+        return -1;
+    memcpy(b->string_pool + start, str, len);
+    b->string_offsets[idx + 1] = start + len;
+    b->string_count = idx + 1;
+    cs->hash[h] = idx + 1;
+    return idx;
+}
+
+/* return a pointer to 'n' words or NULL if the buffer is full. The
+   commands are never split at the end of the buffer. */
+static uint32_t *canvas_alloc(CanvasState *cs, int n)
+{
+    CanvasBuffer *b = &cs->b;
+    uint32_t r = b->read_pos, w = b->write_pos, pos;
+
+    /* the buffer is empty when w == r so it must never become full */
+    if (w >= r) {
+        if (b->buf_size - w > n || (b->buf_size - w == n && r != 0)) {
+            pos = w;
+        } else if (r > n) {
+            b->buf[w] = CANVAS_OP_WRAP;
+            pos = 0;
+        } else {
+            goto full;
+        }
+    } else {
+        if (r - w > n) {
+            pos = w;
+        } else {
+            goto full;
+        }
+    }
+    w = pos + n;
+    if (w == b->buf_size)
+        w = 0;
+    b->write_pos = w;
+    return b->buf + pos;
+ full:
+    b->dropped++;
+    return NULL;
+}
+
+static void canvas_emit(CanvasState *cs, int op, const float *args, int arg_count)
+{
+    uint32_t *p;
+    p = canvas_alloc(cs, 1 + arg_count);
+    if (p) {
+        p[0] = op | (arg_count << 8);
+        memcpy(p + 1, args, arg_count * sizeof(float));
+    }
+}
+
+static void canvas_emit_string(CanvasState *cs, int op, int str_idx,
+                               const float *args, int arg_count)
+{
+    uint32_t *p;
+    p = canvas_alloc(cs, 2 + arg_count);
+    if (p) {
+        p[0] = op | ((1 + arg_count) << 8);
+        p[1] = str_idx;
+        memcpy(p + 2, args, arg_count * sizeof(float));
+    }
+}
+
+static CanvasState *canvas_get(JSContext *ctx)
+{
+    WasmContext *wc = JS_GetContextOpaque(ctx);
+    CanvasState *cs = wc->canvas;
+    const char *str;
+    int i, idx;
+
+    if (!cs) {
+        cs = calloc(1, sizeof(*cs));
+        if (!cs)
+            return NULL;
+        cs->b.buf_size = CANVAS_BUF_WORDS;
+        /* the host canvas may have another initial state, so the
+           defaults are sent with the first commands */
+        for(i = 0; i < CANVAS_STYLE_COUNT; i++) {
+            str = canvas_style_defaults[i];
+            idx = canvas_intern_string(cs, str, strlen(str));
+            cs->style[i] = idx;
+            canvas_emit_string(cs, CANVAS_OP_SET_FILL_STYLE + i, idx, NULL, 0);
+        }
+        cs->line_width = 1;
+        canvas_emit(cs, CANVAS_OP_SET_LINE_WIDTH, &cs->line_width, 1);
+        wc->canvas = cs;
+    }
+    return cs;
+}
+
+/* called by the host once the commands have been executed. The
+   string table is cleared when it is more than half full. */
+static void canvas_flush(CanvasState *cs)
+{
+    CanvasBuffer *b = &cs->b;
+    int i, idx, len;
+    char str[CANVAS_STYLE_COUNT][256];
+    int str_len[CANVAS_STYLE_COUNT];
+
+    b->read_pos = b->write_pos;
+    if (b->string_count <= CANVAS_MAX_STRINGS / 2 &&
+        b->string_offsets[b->string_count] <= CANVAS_STRING_POOL_SIZE / 2)
+        return;
+    /* keep the current styles (truncated if too long, which should not
+       happen with valid styles) */
+    for(i = 0; i < CANVAS_STYLE_COUNT; i++) {
+        idx = cs->style[i];
+        if (idx >= 0) {
+            len = b->string_offsets[idx + 1] - b->string_offsets[idx];
+            if (len > sizeof(str[i]))
+                len = sizeof(str[i]);
+            memcpy(str[i], b->string_pool + b->string_offsets[idx], len);
+            str_len[i] = len;
+        }
+    }
+    b->string_count = 0;
+    b->string_gen++;
+    memset(cs->hash, 0, sizeof(cs->hash));
+    for(i = 0; i < CANVAS_STYLE_COUNT; i++) {
+        if (cs->style[i] >= 0) {
+            idx = canvas_intern_string(cs, str[i], str_len[i]);
+            cs->style[i] = idx;
+            /* the host keeps its state: only the index must be updated */
+            canvas_emit_string(cs, CANVAS_OP_SET_FILL_STYLE + i, idx, NULL, 0);
+        }
+    }
+}
+
+static int canvas_get_args(JSContext *ctx, float *args, int arg_count,
+                           JSValue *argv)
+{
+    double d;
+    int i;
+    for(i = 0; i < arg_count; i++) {
+        if (JS_ToNumber(ctx, &d, argv[i]))
+            return -1;
+        args[i] = d;
+    }
+    return 0;
+}
+
+static JSValue js_canvas_draw(JSContext *ctx, JSValue *this_val, int argc,
+                              JSValue *argv, int magic)
+{
+    float args[6];
+    int arg_count = canvas_op_arg_count[magic];
+    CanvasState *cs;
+
+    /* the arguments are converted first because it may call JS code */
+    if (canvas_get_args(ctx, args, arg_count, argv))
+        return JS_EXCEPTION;
+    /* optional 'anticlockwise' argument (no JS_ToBool() in the API:
+       only numbers and booleans are expected) */
+    if (magic == CANVAS_OP_ARC)
+        args[5] = (args[5] != 0 && !isnan(args[5]));
+    cs = canvas_get(ctx);
+    if (!cs)
+        return JS_ThrowOutOfMemory(ctx);
+    canvas_emit(cs, magic, args, arg_count);
+    return JS_UNDEFINED;
+}
+
+static JSValue js_canvas_text(JSContext *ctx, JSValue *this_val, int argc,
+                              JSValue *argv, int magic)
+{
+    float args[2];
+    CanvasState *cs;
+    JSCStringBuf buf;
+    const char *str;
+    size_t len;
+    int idx;
+
+    if (canvas_get_args(ctx, args, 2, argv + 1))
+        return JS_EXCEPTION;
+    str = JS_ToCStringLen(ctx, &len, argv[0], &buf);
+    if (!str)
+        return JS_EXCEPTION;
+    cs = canvas_get(ctx);
+    if (!cs)
+        return JS_ThrowOutOfMemory(ctx);
+    idx = canvas_intern_string(cs, str, len);
+    if (idx < 0)
+        cs->b.dropped++;
+    else
+        canvas_emit_string(cs, magic, idx, args, 2);
+    return JS_UNDEFINED;
+}
+
+static JSValue js_canvas_get_style(JSContext *ctx, JSValue *this_val, int argc,
+                                   JSValue *argv, int magic)
+{
+    CanvasState *cs = canvas_get(ctx);
+    CanvasBuffer *b;
+    int idx;
+
+    if (!cs)
+        return JS_ThrowOutOfMemory(ctx);
+    idx = cs->style[magic];
+    if (idx < 0)
+        return JS_NewString(ctx, canvas_style_defaults[magic]);
+    b = &cs->b;
+    return JS_NewStringLen(ctx, (const char *)b->string_pool + b->string_offsets[idx],
+                           b->string_offsets[idx + 1] - b->string_offsets[idx]);
+}
+
+static JSValue js_canvas_set_style(JSContext *ctx, JSValue *this_val, int argc,
+                                   JSValue *argv, int magic)
+{
+    CanvasState *cs;
+    JSCStringBuf buf;
+    const char *str;
+    size_t len;
+    int idx;
+
+    str = JS_ToCStringLen(ctx, &len, argv[0], &buf);
+    if (!str)
+        return JS_EXCEPTION;
+    cs = canvas_get(ctx);
+    if (!cs)
+        return JS_ThrowOutOfMemory(ctx);
+    idx = canvas_intern_string(cs, str, len);
+    if (idx < 0) {
+        cs->b.dropped++;
+    } else if (idx != cs->style[magic]) {
+        cs->style[magic] = idx;
+        canvas_emit_string(cs, CANVAS_OP_SET_FILL_STYLE + magic, idx, NULL, 0);
+    }
+    return JS_UNDEFINED;
+}
+
+static JSValue js_canvas_get_lineWidth(JSContext *ctx, JSValue *this_val, int argc,
+                                       JSValue *argv)
+{
+    CanvasState *cs = canvas_get(ctx);
+    if (!cs)
+        return JS_ThrowOutOfMemory(ctx);
+    return JS_NewFloat64(ctx, cs->line_width);
+}
+
+static JSValue js_canvas_set_lineWidth(JSContext *ctx, JSValue *this_val, int argc,
+                                       JSValue *argv)
+{
+    CanvasState *cs;
+    float w;
+
+    if (canvas_get_args(ctx, &w, 1, argv))
+        return JS_EXCEPTION;
+    cs = canvas_get(ctx);
+    if (!cs)
+        return JS_ThrowOutOfMemory(ctx);
+    /* invalid values are ignored as in the browser */
+    if (w > 0 && w != cs->line_width && isfinite(w)) {
+        cs->line_width = w;
+        canvas_emit(cs, CANVAS_OP_SET_LINE_WIDTH, &w, 1);
+    }
     return JS_UNDEFINED;
 }
 
 /* Include the generated stdlib header - this defines js_stdlib */
-#include "mqjs_stdlib.h"
+#include "wasm_stdlib.h"
 
 /* Custom write function to capture output */
 static void wasm_write_func(void *opaque, const void *buf, size_t buf_len) {
-    (void)opaque;
-    if (output_pos + buf_len < OUTPUT_BUF_SIZE - 1) {
-        memcpy(output_buffer + output_pos, buf, buf_len);
-        output_pos += buf_len;
-        output_buffer[output_pos] = '\0';
-    }
+    output_write(opaque, buf, buf_len);
 }
 
-/* Initialize the JavaScript engine */
-EMSCRIPTEN_KEEPALIVE
-int mquickjs_init(void) {
-    if (global_ctx != NULL) {
-        return 0;  /* Already initialized */
-    }
+/* GC pause clock in microseconds */
+static int64_t wasm_gc_clock(void *opaque) {
+    return (int64_t)(emscripten_get_now() * 1000.0);
+}
 
+/* Suspend the execution at the end of the current time slice. The
+   deadline is only set while the scheduler runs a task so that the
+   other API calls (e.g. the result conversion) are never suspended. */
+static int wasm_interrupt_handler(JSContext *ctx, void *opaque) {
+    WasmContext *wc = opaque;
+    if (wc->slice_deadline > 0 && emscripten_get_now() >= wc->slice_deadline)
+        return JS_INTERRUPT_SUSPEND;
+    return 0;
+}
+
+/* the JSGCRef of the timers belong to the previous JS context */
+static void wasm_sched_reset(WasmContext *wc) {
+    memset(wc->timers, 0, sizeof(wc->timers));
+    wc->task = MQUICKJS_TASK_NONE;
+    wc->slice_deadline = 0;
+}
+
+static int wasm_ctx_init(WasmContext *wc) {
     /* Create context with the standard library */
-    global_ctx = JS_NewContext(js_memory, sizeof(js_memory), &js_stdlib);
-    if (!global_ctx) {
+    wc->ctx = JS_NewContext(wc->mem, wc->mem_size, &js_stdlib);
+    if (!wc->ctx) {
         return -1;
     }
+    JS_SetContextOpaque(wc->ctx, wc);
 
     /* Set up logging */
-    JS_SetLogFunc(global_ctx, wasm_write_func);
-
-    /* Clear output buffer */
-    output_pos = 0;
-    output_buffer[0] = '\0';
+    JS_SetLogFunc(wc->ctx, wasm_write_func);
+    JS_SetGCClock(wc->ctx, wasm_gc_clock);
+    JS_SetShapeMode(wc->ctx, (wc->options & MQUICKJS_OPT_SHAPES) != 0);
+    JS_SetInterruptHandler(wc->ctx, wasm_interrupt_handler);
+    wasm_sched_reset(wc);
 
+    output_clear(wc);
     return 0;
 }
 
+/* Initialize the JavaScript engine */
+EMSCRIPTEN_KEEPALIVE
+int mquickjs_init(void) {
+    if (default_wc.ctx != NULL) {
+        return 0;  /* Already initialized */
+    }
+    return wasm_ctx_init(&default_wc);
+}
+
 /* Cleanup the JavaScript engine */
 EMSCRIPTEN_KEEPALIVE
 void mquickjs_cleanup(void) {
-    if (global_ctx) {
-        JS_FreeContext(global_ctx);
-        global_ctx = NULL;
+    if (default_wc.ctx) {
+        if (bytecode_count != 0)
+            JS_DeleteGCRef(default_wc.ctx, &bytecode_func_ref);
+        JS_FreeContext(default_wc.ctx);
+        default_wc.ctx = NULL;
     }
+    free(default_wc.canvas);
+    default_wc.canvas = NULL;
+    bytecode_free(0);
+    /* the snapshot may reference the bytecode */
+    free(snapshot_buf);
+    snapshot_buf = NULL;
+    snapshot_len = 0;
 }
 
 /* Clear output buffer */
 EMSCRIPTEN_KEEPALIVE
 void mquickjs_clear_output(void) {
-    output_pos = 0;
-    output_buffer[0] = '\0';
+    output_clear(&default_wc);
 }
 
 /* Get output buffer */
@@ -198,70 +752,465 @@ const char* mquickjs_get_output(void) {
     return output_buffer;
 }
 
-/* Run JavaScript code and return result as string */
-EMSCRIPTEN_KEEPALIVE
-const char* mquickjs_run(const char *code) {
-    static char result_buffer[OUTPUT_BUF_SIZE];
-
-    if (!global_ctx) {
-        if (mquickjs_init() != 0) {
-            return "Error: Failed to initialize engine";
-        }
-    }
-
-    /* Clear output buffer */
-    output_pos = 0;
-    output_buffer[0] = '\0';
-
-    /* Parse and run the code */
-    /* JS_EVAL_RETVAL: return last expression value
-       JS_EVAL_REPL: allow implicit global variable definitions */
-    JSValue val = JS_Eval(global_ctx, code, strlen(code), "<input>", JS_EVAL_RETVAL | JS_EVAL_REPL);
+/* Format the result of an evaluation (with the console output
+   prepended) */
+static const char *format_result(WasmContext *wc, JSValue val) {
+    char *result = wc->result;
+    size_t result_size = wc->result_size;
 
     if (JS_IsException(val)) {
         /* Get exception message */
-        JSValue exc = JS_GetException(global_ctx);
+        JSValue exc = JS_GetException(wc->ctx);
         /* Clear and use output buffer for error */
-        output_pos = 0;
-        output_buffer[0] = '\0';
+        output_clear(wc);
         /* Use JS_PrintValueF to format the exception (writes to log func) */
-        JS_PrintValueF(global_ctx, exc, 1 /* JS_DUMP_LONG */);
-        if (output_pos > 0) {
-            snprintf(result_buffer, sizeof(result_buffer), "Error: %s", output_buffer);
+        JS_PrintValueF(wc->ctx, exc, 1 /* JS_DUMP_LONG */);
+        if (wc->output_pos > 0) {
+            snprintf(result, result_size, "Error: %s", wc->output);
         } else {
-            snprintf(result_buffer, sizeof(result_buffer), "Error: Exception occurred");
+            snprintf(result, result_size, "Error: Exception occurred");
         }
-        return result_buffer;
+        return result;
     }
 
     /* Convert result to string */
     if (JS_IsUndefined(val)) {
-        if (output_pos > 0) {
-            return output_buffer;
+        if (wc->output_pos > 0) {
+            return wc->output;
         }
         return "undefined";
     } else if (JS_IsNull(val)) {
-        if (output_pos > 0) {
-            snprintf(result_buffer, sizeof(result_buffer), "%snull", output_buffer);
-            return result_buffer;
+        if (wc->output_pos > 0) {
+            snprintf(result, result_size, "%snull", wc->output);
+            return result;
         }
         return "null";
     } else {
         JSCStringBuf buf;
-        const char *str = JS_ToCString(global_ctx, val, &buf);
+        const char *str = JS_ToCString(wc->ctx, val, &buf);
         if (str) {
             /* Combine output and result */
-            if (output_pos > 0) {
-                snprintf(result_buffer, sizeof(result_buffer), "%s%s", output_buffer, str);
+            if (wc->output_pos > 0) {
+                snprintf(result, result_size, "%s%s", wc->output, str);
             } else {
-                snprintf(result_buffer, sizeof(result_buffer), "%s", str);
+                snprintf(result, result_size, "%s", str);
             }
-            return result_buffer;
+            return result;
         }
-        return output_buffer[0] ? output_buffer : "[Object]";
+        return wc->output[0] ? wc->output : "[Object]";
     }
 }
 
+static void slice_start(WasmContext *wc) {
+    if (wc->slice_ms > 0)
+        wc->slice_deadline = emscripten_get_now() + wc->slice_ms;
+}
+
+/* Return TRUE if the task was suspended */
+static int slice_end(WasmContext *wc, JSValue val, int task) {
+    wc->slice_deadline = 0;
+    if (JS_IsException(val) && JS_IsSuspended(wc->ctx)) {
+        wc->task = task;
+        return 1;
+    }
+    wc->task = MQUICKJS_TASK_NONE;
+    return 0;
+}
+
+/* the exceptions of the timer callbacks go to the console output */
+static void timer_result(WasmContext *wc, JSValue val) {
+    if (JS_IsException(val)) {
+        output_puts(wc, "Error: ");
+        JS_PrintValueF(wc->ctx, JS_GetException(wc->ctx), 1 /* JS_DUMP_LONG */);
+        output_puts(wc, "\n");
+    }
+}
+
+/* The arena is allocated at its maximum size by
+   mquickjs_ctx_set_max_heap(): growing only lets the heap use more of
+   it */
+static size_t wasm_heap_grow(void *opaque, void *mem_start, size_t mem_size,
+                             size_t min_size) {
+    return min_size;
+}
+
+static int wasm_eval_flags(WasmContext *wc) {
+    int flags = JS_EVAL_RETVAL | JS_EVAL_REPL;
+    if (wc->options & MQUICKJS_OPT_LAZY)
+        flags |= JS_EVAL_LAZY;
+    return flags;
+}
+
+static const char *wasm_ctx_run(WasmContext *wc, const char *code) {
+    JSValue val;
+
+    if (wc->task != MQUICKJS_TASK_NONE) {
+        return "Error: a task is suspended (use mquickjs_resume())";
+    }
+    JS_ResetMeter(wc->ctx, &wc->budget);
+    /* Clear output buffer */
+    output_clear(wc);
+
+    /* Parse and run the code */
+    /* JS_EVAL_RETVAL: return last expression value
+       JS_EVAL_REPL: allow implicit global variable definitions */
+    slice_start(wc);
+    val = JS_Eval(wc->ctx, code, strlen(code), "<input>", wasm_eval_flags(wc));
+    if (slice_end(wc, val, MQUICKJS_TASK_SCRIPT))
+        return "";
+    return format_result(wc, val);
+}
+
+/* Continue the suspended task for another time slice. Return "" if it
+   is still suspended, otherwise the result of the script (same format
+   as mquickjs_run()) or the console output for a timer callback. */
+static const char *wasm_ctx_resume(WasmContext *wc) {
+    JSValue val;
+    int task = wc->task;
+
+    if (task == MQUICKJS_TASK_NONE) {
+        return "Error: no suspended task";
+    }
+    slice_start(wc);
+    val = JS_Resume(wc->ctx);
+    if (slice_end(wc, val, task))
+        return "";
+    if (task == MQUICKJS_TASK_TIMER) {
+        timer_result(wc, val);
+        return wc->output;
+    }
+    return format_result(wc, val);
+}
+
+/* Call the callbacks of the timers which are due, in due order. The
+   timers added by the callbacks are run by the next call. The console
+   output is cleared first. Return the delay in ms until the next timer
+   (0 if the run was suspended or stopped at the end of the time slice)
+   or -1 if there is no timer. */
+static double wasm_ctx_run_timers(WasmContext *wc) {
+    JSContext *ctx;
+    WasmTimer *th, *th1;
+    double now, delay, deadline;
+    JSValue val;
+    int i;
+
+    if (wc->task != MQUICKJS_TASK_NONE) {
+        return 0;
+    }
+    ctx = wc->ctx;
+    JS_ResetMeter(ctx, &wc->budget);
+    output_clear(wc);
+    now = emscripten_get_now();
+    for(i = 0; i < MQUICKJS_MAX_TIMERS; i++) {
+        th = &wc->timers[i];
+        if (th->allocated && th->due <= now)
+            th->ready = 1;
+    }
+    slice_start(wc);
+    deadline = wc->slice_deadline;
+    for(;;) {
+        th = NULL;
+        for(i = 0; i < MQUICKJS_MAX_TIMERS; i++) {
+            th1 = &wc->timers[i];
+            if (th1->allocated && th1->ready && (!th || th1->due < th->due))
+                th = th1;
+        }
+        if (!th)
+            break;
+        if (JS_StackCheck(ctx, 2)) {
+            timer_result(wc, JS_EXCEPTION);
+            break;
+        }
+        JS_PushArg(ctx, th->func.val);
+        JS_PushArg(ctx, JS_NULL); /* this */
+        th->ready = 0;
+        if (th->interval >= 0) {
+            /* may be cleared by the callback */
+            th->due = now + th->interval;
+        } else {
+            JS_DeleteGCRef(ctx, &th->func);
+            th->allocated = 0;
+        }
+        val = JS_Call(ctx, 0);
+        if (slice_end(wc, val, MQUICKJS_TASK_TIMER))
+            return 0;
+        timer_result(wc, val);
+        if (deadline > 0) {
+            if (emscripten_get_now() >= deadline)
+                return 0;
+            /* cleared by slice_end() */
+            wc->slice_deadline = deadline;
+        }
+    }
+    wc->slice_deadline = 0;
+    delay = -1;
+    now = emscripten_get_now();
+    for(i = 0; i < MQUICKJS_MAX_TIMERS; i++) {
+        th = &wc->timers[i];
+        if (th->allocated) {
+            if (th->ready || th->due <= now)
+                return 0;
+            if (delay < 0 || th->due - now < delay)
+                delay = th->due - now;
+        }
+    }
+    return delay;
+}
+
+/* Run JavaScript code and return result as string */
+EMSCRIPTEN_KEEPALIVE
+const char* mquickjs_run(const char *code) {
+    if (!default_wc.ctx) {
+        if (mquickjs_init() != 0) {
+            return "Error: Failed to initialize engine";
+        }
+    }
+    return wasm_ctx_run(&default_wc, code);
+}
+
+/* Run the scripts and the timer callbacks in slices of 'ms'
+   milliseconds (0 to disable, the default). A script which does not
+   complete in its slice is suspended: mquickjs_run() then returns ""
+   and mquickjs_is_suspended() returns 1. The host must call
+   mquickjs_resume() (e.g. from requestAnimationFrame()) until it
+   completes. */
+EMSCRIPTEN_KEEPALIVE
+void mquickjs_set_time_slice(double ms) {
+    default_wc.slice_ms = ms > 0 ? ms : 0;
+}
+
+EMSCRIPTEN_KEEPALIVE
+int mquickjs_is_suspended(void) {
+    return default_wc.task != MQUICKJS_TASK_NONE;
+}
+
+EMSCRIPTEN_KEEPALIVE
+const char* mquickjs_resume(void) {
+    if (!default_wc.ctx) {
+        return "Error: no suspended task";
+    }
+    return wasm_ctx_resume(&default_wc);
+}
+
+EMSCRIPTEN_KEEPALIVE
+double mquickjs_run_timers(void) {
+    if (!default_wc.ctx) {
+        return -1;
+    }
+    return wasm_ctx_run_timers(&default_wc);
+}
+
+/* Result types of mquickjs_run_binary() */
+#define MQUICKJS_RESULT_ERROR  (-1) /* UTF-8 error message */
+#define MQUICKJS_RESULT_STRING 0    /* UTF-8 string (other values are converted) */
+#define MQUICKJS_RESULT_BYTES  1    /* contents of an ArrayBuffer or typed array */
+
+static int wasm_ctx_run_binary(WasmContext *wc, const char *code) {
+    JSValue val;
+    const char *str;
+    size_t len;
+
+    if (wc->task != MQUICKJS_TASK_NONE) {
+        str = "Error: a task is suspended (use mquickjs_resume())";
+        wc->result_ptr = (const uint8_t *)str;
+        wc->result_len = strlen(str);
+        return MQUICKJS_RESULT_ERROR;
+    }
+    JS_ResetMeter(wc->ctx, &wc->budget);
+    output_clear(wc);
+    val = JS_Eval(wc->ctx, code, strlen(code), "<input>", wasm_eval_flags(wc));
+    if (!JS_IsException(val)) {
+        wc->result_ptr = JS_GetArrayBuffer(wc->ctx, &len, val);
+        if (wc->result_ptr) {
+            wc->result_len = len;
+            return MQUICKJS_RESULT_BYTES;
+        }
+        /* a string is returned as is */
+        str = JS_ToCStringLen(wc->ctx, &len, val, &wc->result_cbuf);
+        if (str) {
+            wc->result_ptr = (const uint8_t *)str;
+            wc->result_len = len;
+            return MQUICKJS_RESULT_STRING;
+        }
+        val = JS_EXCEPTION;
+    }
+    str = format_result(wc, val);
+    wc->result_ptr = (const uint8_t *)str;
+    wc->result_len = strlen(str);
+    return MQUICKJS_RESULT_ERROR;
+}
+
+/* Run JavaScript code without converting the result to a C string:
+   the result is available with mquickjs_result_ptr() and
+   mquickjs_result_len() so that the host can read it with a Uint8Array
+   view of the WASM memory. The pointer points inside the JS heap hence
+   it is only valid until the next call to the engine. The console
+   output is available with mquickjs_get_output(). Return the result
+   type (MQUICKJS_RESULT_x). */
+EMSCRIPTEN_KEEPALIVE
+int mquickjs_run_binary(const char *code) {
+    if (!default_wc.ctx) {
+        if (mquickjs_init() != 0) {
+            return MQUICKJS_RESULT_ERROR;
+        }
+    }
+    return wasm_ctx_run_binary(&default_wc, code);
+}
+
+EMSCRIPTEN_KEEPALIVE
+const uint8_t *mquickjs_result_ptr(void) {
+    return default_wc.result_ptr;
+}
+
+EMSCRIPTEN_KEEPALIVE
+int mquickjs_result_len(void) {
+    return (int)default_wc.result_len;
+}
+
+/* Load a 32-bit bytecode file produced by "mqjs -m32 -o file.bin
+   file.js". The buffer is copied outside the context memory. Its atoms
+   are stored in ROM so loading fails if a script run before still
+   references one of them (call mquickjs_reset() first if needed). Up
+   to MQUICKJS_MAX_BYTECODE_FILES files can be loaded, each one sharing
+   the atoms of the previous ones. Return 0 if OK, -1 if error (the
+   error message is in the output buffer). */
+EMSCRIPTEN_KEEPALIVE
+int mquickjs_load_bytecode(const uint8_t *buf, int buf_len) {
+    uint8_t *bytecode_buf;
+    JSValue val;
+
+    if (!default_wc.ctx) {
+        if (mquickjs_init() != 0) {
+            return -1;
+        }
+    }
+
+    /* Clear output buffer */
+    output_clear(&default_wc);
+
+    if (bytecode_count >= MQUICKJS_MAX_BYTECODE_FILES) {
+        snprintf(output_buffer, OUTPUT_BUF_SIZE, "Error: too many bytecode files");
+        return -1;
+    }
+    if (buf_len <= 0 || !JS_IsBytecode(buf, buf_len)) {
+        snprintf(output_buffer, OUTPUT_BUF_SIZE, "Error: invalid bytecode");
+        return -1;
+    }
+    bytecode_buf = malloc(buf_len);
+    if (!bytecode_buf) {
+        snprintf(output_buffer, OUTPUT_BUF_SIZE, "Error: not enough memory");
+        return -1;
+    }
+    memcpy(bytecode_buf, buf, buf_len);
+    if (JS_RelocateBytecode(default_wc.ctx, bytecode_buf, buf_len)) {
+        snprintf(output_buffer, OUTPUT_BUF_SIZE,
+                 "Error: could not relocate bytecode (not generated with mqjs -m32 ?)");
+        goto fail;
+    }
+    val = JS_LoadBytecode(default_wc.ctx, bytecode_buf);
+    if (JS_IsException(val)) {
+        snprintf(output_buffer, OUTPUT_BUF_SIZE, "%s", format_result(&default_wc, val));
+        goto fail;
+    }
+    if (bytecode_count == 0)
+        JS_AddGCRef(default_wc.ctx, &bytecode_func_ref);
+    bytecode_func_ref.val = val;
+    bytecode_bufs[bytecode_count++] = bytecode_buf;
+    return 0;
+ fail:
+    default_wc.output_pos = strlen(output_buffer);
+    free(bytecode_buf);
+    return -1;
+}
+
+/* Run the last bytecode file loaded with mquickjs_load_bytecode().
+   Return the result as a string (same format as mquickjs_run()) */
+EMSCRIPTEN_KEEPALIVE
+const char* mquickjs_run_bytecode(void) {
+    JSValue val;
+
+    if (!default_wc.ctx || bytecode_count == 0) {
+        return "Error: no bytecode loaded";
+    }
+    if (default_wc.task != MQUICKJS_TASK_NONE) {
+        return "Error: a task is suspended (use mquickjs_resume())";
+    }
+
+    /* Clear output buffer */
+    output_clear(&default_wc);
+
+    val = JS_Run(default_wc.ctx, bytecode_func_ref.val);
+    return format_result(&default_wc, val);
+}
+
+/* Save the current state of the engine (e.g. after running the bridge
+   prelude) so that mquickjs_restore() can go back to it. Return the
+   snapshot size or -1 if error. */
+EMSCRIPTEN_KEEPALIVE
+int mquickjs_snapshot(void) {
+    size_t len;
+    uint8_t *buf;
+
+    if (!default_wc.ctx) {
+        if (mquickjs_init() != 0) {
+            return -1;
+        }
+    }
+    /* the suspended frames and the timers are not saved */
+    if (default_wc.task != MQUICKJS_TASK_NONE) {
+        return -1;
+    }
+    len = JS_SnapshotContext(default_wc.ctx, NULL, 0);
+    if (len == 0) {
+        return -1;
+    }
+    buf = realloc(snapshot_buf, len);
+    if (!buf) {
+        return -1;
+    }
+    snapshot_buf = buf;
+    snapshot_len = JS_SnapshotContext(default_wc.ctx, snapshot_buf, len);
+    snapshot_bytecode_count = bytecode_count;
+    if (bytecode_count != 0)
+        snapshot_bytecode_func = bytecode_func_ref.val;
+    return (int)snapshot_len;
+}
+
+/* Go back to the state saved by mquickjs_snapshot(). It is much faster
+   than mquickjs_reset() followed by the prelude. Return 0 if OK, -1 if
+   error */
+EMSCRIPTEN_KEEPALIVE
+int mquickjs_restore(void) {
+    if (!snapshot_buf) {
+        return -1;
+    }
+    /* the previous context does not need to be freed: the user
+       finalizers are not used in the WASM build */
+    default_wc.ctx = JS_RestoreContext(js_memory, sizeof(js_memory),
+                                       snapshot_buf, snapshot_len);
+    if (!default_wc.ctx) {
+        return -1;
+    }
+    JS_SetContextOpaque(default_wc.ctx, &default_wc);
+    JS_SetLogFunc(default_wc.ctx, wasm_write_func);
+    JS_SetInterruptHandler(default_wc.ctx, wasm_interrupt_handler);
+    wasm_sched_reset(&default_wc);
+    /* the files loaded after the snapshot are unknown to the restored
+       context */
+    bytecode_free(snapshot_bytecode_count);
+    if (bytecode_count != 0) {
+        /* the JSGCRef are not part of the snapshot. The function is in
+           a bytecode buffer, hence its address is unchanged. If files
+           were loaded after the snapshot, it is the one of the last
+           file loaded before it. */
+        JSValue func = snapshot_bytecode_func;
+        *JS_AddGCRef(default_wc.ctx, &bytecode_func_ref) = func;
+    }
+
+    output_clear(&default_wc);
+    return 0;
+}
+
 /* Reset the engine (create fresh context) */
 EMSCRIPTEN_KEEPALIVE
 int mquickjs_reset(void) {
@@ -280,3 +1229,396 @@ EMSCRIPTEN_KEEPALIVE
 int mquickjs_memory_size(void) {
     return MQUICKJS_MEM_SIZE;
 }
+
+static const WasmMemoryUsage *wasm_memory_usage(WasmContext *wc) {
+    JSMemoryUsage mu;
+    int i;
+
+    if (!wc->ctx) {
+        return NULL;
+    }
+    JS_GetMemoryUsage(wc->ctx, &mu);
+    memory_usage.mem_size = mu.mem_size;
+    memory_usage.heap_size = mu.heap_size;
+    memory_usage.stack_size = mu.stack_size;
+    memory_usage.free_size = mu.free_size;
+    memory_usage.gc_count = mu.gc.gc_count;
+    memory_usage.minor_gc_count = mu.gc.minor_gc_count;
+    memory_usage.gc_reclaimed_bytes = mu.gc.reclaimed_bytes;
+    memory_usage.gc_last_pause_ms = mu.gc.last_pause / 1000.0;
+    memory_usage.gc_max_pause_ms = mu.gc.max_pause / 1000.0;
+    memory_usage.gc_total_pause_ms = mu.gc.total_pause / 1000.0;
+    for (i = 0; i < JS_MEMORY_TAG_COUNT; i++) {
+        memory_usage.block_count[i] = mu.block_count[i];
+        memory_usage.block_size[i] = mu.block_size[i];
+    }
+    memory_usage.gc_max_heap_size = mu.gc.max_heap_size;
+    return &memory_usage;
+}
+
+/* Get the memory usage of the default context or NULL if it is not
+   initialized. The record is overwritten by the next call. */
+EMSCRIPTEN_KEEPALIVE
+const WasmMemoryUsage *mquickjs_memory_usage(void) {
+    return wasm_memory_usage(&default_wc);
+}
+
+static void wasm_set_budget(WasmContext *wc, double max_ticks,
+                            double max_alloc_bytes, double max_native_ms) {
+    wc->budget.ticks = max_ticks > 0 ? (uint64_t)max_ticks : 0;
+    wc->budget.alloc_bytes = max_alloc_bytes > 0 ? (uint64_t)max_alloc_bytes : 0;
+    /* the clock is in microseconds */
+    wc->budget.native_time = max_native_ms > 0 ? (int64_t)(max_native_ms * 1000.0) : 0;
+}
+
+static const WasmMeter *wasm_meter(WasmContext *wc) {
+    JSMeterStats ms;
+
+    if (!wc->ctx) {
+        return NULL;
+    }
+    JS_GetMeterStats(wc->ctx, &ms);
+    meter.ticks = ms.ticks;
+    meter.alloc_bytes = ms.alloc_bytes;
+    meter.native_time_ms = ms.native_time / 1000.0;
+    return &meter;
+}
+
+/* Set the budget of each mquickjs_run(), mquickjs_run_binary() and
+   mquickjs_run_timers() call, including the time slices given by
+   mquickjs_resume(). 0 means no limit. When a budget is reached, the
+   run stops with an "InternalError: xxx budget exceeded" error which
+   cannot be caught by the script. */
+EMSCRIPTEN_KEEPALIVE
+void mquickjs_set_budget(double max_ticks, double max_alloc_bytes,
+                         double max_native_ms) {
+    wasm_set_budget(&default_wc, max_ticks, max_alloc_bytes, max_native_ms);
+}
+
+/* Get the work done by the last run of the default context (it is
+   updated while a task is suspended) or NULL if it is not
+   initialized. The record is overwritten by the next call. */
+EMSCRIPTEN_KEEPALIVE
+const WasmMeter *mquickjs_meter(void) {
+    return wasm_meter(&default_wc);
+}
+
+static void wasm_set_options(WasmContext *wc, int options) {
+    wc->options = options;
+    /* the objects created afterwards share their shapes */
+    if (wc->ctx) {
+        JS_SetShapeMode(wc->ctx, (options & MQUICKJS_OPT_SHAPES) != 0);
+    }
+}
+
+/* Set the options of the default context (MQUICKJS_OPT_x, 0 by
+   default). MQUICKJS_OPT_SHAPES shares the property layout of the
+   plain objects created afterwards. MQUICKJS_OPT_LAZY compiles the
+   functions of the next scripts at their first call. The options are
+   kept by mquickjs_reset(). */
+EMSCRIPTEN_KEEPALIVE
+void mquickjs_set_options(int options) {
+    wasm_set_options(&default_wc, options);
+}
+
+/* Name of the block type 'tag' of the memory usage record or NULL */
+EMSCRIPTEN_KEEPALIVE
+const char *mquickjs_memory_tag_name(int tag) {
+    return JS_GetMemoryTagName(tag);
+}
+
+static const CanvasBuffer *wasm_canvas_buffer(WasmContext *wc) {
+    return wc->canvas ? &wc->canvas->b : NULL;
+}
+
+static void wasm_canvas_flush(WasmContext *wc) {
+    if (wc->canvas) {
+        canvas_flush(wc->canvas);
+    }
+}
+
+/* Get the command buffer of the canvas object or NULL if the canvas
+   was not used yet. */
+EMSCRIPTEN_KEEPALIVE
+const CanvasBuffer *mquickjs_canvas_buffer(void) {
+    return wasm_canvas_buffer(&default_wc);
+}
+
+/* Tell that the canvas commands have been executed by the host */
+EMSCRIPTEN_KEEPALIVE
+void mquickjs_canvas_flush(void) {
+    wasm_canvas_flush(&default_wc);
+}
+
+/* Independent contexts. Each context has its own arena allocated from
+   the WASM heap and its own output buffer, so that a single module
+   instance can run several isolated scripts. */
+
+static WasmContext *ctx_from_handle(int handle) {
+    if (handle <= 0 || handle > MQUICKJS_MAX_CONTEXTS) {
+        return NULL;
+    }
+    return ctx_table[handle - 1];
+}
+
+static void wasm_ctx_delete(WasmContext *wc) {
+    if (wc->ctx) {
+        JS_FreeContext(wc->ctx);
+    }
+    free(wc->mem);
+    free(wc->output);
+    free(wc->result);
+    free(wc->canvas);
+    free(wc);
+}
+
+/* Create a new context with a 'heap_bytes' arena (the default size if
+   heap_bytes <= 0). Return a handle > 0 or 0 if error. */
+EMSCRIPTEN_KEEPALIVE
+int mquickjs_ctx_new(int heap_bytes) {
+    WasmContext *wc;
+    int i;
+
+    if (heap_bytes <= 0) {
+        heap_bytes = MQUICKJS_MEM_SIZE;
+    }
+    if (heap_bytes < MQUICKJS_MIN_HEAP_SIZE) {
+        return 0;
+    }
+    for(i = 0; i < MQUICKJS_MAX_CONTEXTS; i++) {
+        if (!ctx_table[i])
+            break;
+    }
+    if (i == MQUICKJS_MAX_CONTEXTS) {
+        return 0;
+    }
+    wc = calloc(1, sizeof(*wc));
+    if (!wc) {
+        return 0;
+    }
+    /* malloc() returns memory suitably aligned for JS_NewContext() */
+    wc->mem_size = heap_bytes & ~7;
+    wc->mem = malloc(wc->mem_size);
+    wc->output_size = MQUICKJS_CTX_OUTPUT_SIZE;
+    wc->output = malloc(wc->output_size);
+    wc->result_size = MQUICKJS_CTX_OUTPUT_SIZE;
+    wc->result = malloc(wc->result_size);
+    if (!wc->mem || !wc->output || !wc->result ||
+        wasm_ctx_init(wc) != 0) {
+        wasm_ctx_delete(wc);
+        return 0;
+    }
+    ctx_table[i] = wc;
+    return i + 1;
+}
+
+/* Run JavaScript code in the context 'handle' and return the result as
+   a string (same format as mquickjs_run()). The string is valid until
+   the next call using the same context. */
+EMSCRIPTEN_KEEPALIVE
+const char* mquickjs_ctx_run(int handle, const char *code) {
+    WasmContext *wc = ctx_from_handle(handle);
+    if (!wc) {
+        return "Error: invalid context handle";
+    }
+    return wasm_ctx_run(wc, code);
+}
+
+/* Same as mquickjs_run_binary() for the context 'handle' */
+EMSCRIPTEN_KEEPALIVE
+int mquickjs_ctx_run_binary(int handle, const char *code) {
+    WasmContext *wc = ctx_from_handle(handle);
+    if (!wc) {
+        return MQUICKJS_RESULT_ERROR;
+    }
+    return wasm_ctx_run_binary(wc, code);
+}
+
+EMSCRIPTEN_KEEPALIVE
+const uint8_t *mquickjs_ctx_result_ptr(int handle) {
+    WasmContext *wc = ctx_from_handle(handle);
+    if (!wc) {
+        return NULL;
+    }
+    return wc->result_ptr;
+}
+
+EMSCRIPTEN_KEEPALIVE
+int mquickjs_ctx_result_len(int handle) {
+    WasmContext *wc = ctx_from_handle(handle);
+    if (!wc) {
+        return 0;
+    }
+    return (int)wc->result_len;
+}
+
+/* Same as mquickjs_set_time_slice() for the context 'handle' */
+EMSCRIPTEN_KEEPALIVE
+void mquickjs_ctx_set_time_slice(int handle, double ms) {
+    WasmContext *wc = ctx_from_handle(handle);
+    if (wc) {
+        wc->slice_ms = ms > 0 ? ms : 0;
+    }
+}
+
+EMSCRIPTEN_KEEPALIVE
+int mquickjs_ctx_is_suspended(int handle) {
+    WasmContext *wc = ctx_from_handle(handle);
+    return wc && wc->task != MQUICKJS_TASK_NONE;
+}
+
+EMSCRIPTEN_KEEPALIVE
+const char* mquickjs_ctx_resume(int handle) {
+    WasmContext *wc = ctx_from_handle(handle);
+    if (!wc) {
+        return "Error: invalid context handle";
+    }
+    return wasm_ctx_resume(wc);
+}
+
+EMSCRIPTEN_KEEPALIVE
+double mquickjs_ctx_run_timers(int handle) {
+    WasmContext *wc = ctx_from_handle(handle);
+    if (!wc) {
+        return -1;
+    }
+    return wasm_ctx_run_timers(wc);
+}
+
+/* Get the console output of the last mquickjs_ctx_run() */
+EMSCRIPTEN_KEEPALIVE
+const char* mquickjs_ctx_get_output(int handle) {
+    WasmContext *wc = ctx_from_handle(handle);
+    if (!wc) {
+        return "";
+    }
+    return wc->output;
+}
+
+EMSCRIPTEN_KEEPALIVE
+void mquickjs_ctx_clear_output(int handle) {
+    WasmContext *wc = ctx_from_handle(handle);
+    if (wc) {
+        output_clear(wc);
+    }
+}
+
+/* Get the arena size of the context 'handle' or -1 if invalid handle */
+EMSCRIPTEN_KEEPALIVE
+int mquickjs_ctx_memory_size(int handle) {
+    WasmContext *wc = ctx_from_handle(handle);
+    if (!wc) {
+        return -1;
+    }
+    return (int)wc->mem_size;
+}
+
+/* Let the heap of the context 'handle' grow up to 'max_bytes'. This is
+   a quota, not an allocation on demand: the context is moved to an
+   arena of 'max_bytes', whose WASM memory is allocated now, but its
+   heap keeps the same usable size. The engine uses more of the arena
+   when less than half of the usable memory is free after a GC, at any
+   allocation. 'max_bytes' = 0 makes the whole arena usable. Return 0
+   if OK, -1 if invalid handle, suspended task or not enough memory. */
+EMSCRIPTEN_KEEPALIVE
+int mquickjs_ctx_set_max_heap(int handle, int max_bytes) {
+    WasmContext *wc = ctx_from_handle(handle);
+    JSMemoryUsage mu;
+    JSContext *ctx;
+    uint8_t *mem;
+    size_t mem_size;
+
+    if (!wc || wc->task != MQUICKJS_TASK_NONE) {
+        return -1;
+    }
+    if (max_bytes <= 0) {
+        JS_SetHeapGrowCallback(wc->ctx, NULL, NULL, 0);
+        return 0;
+    }
+    JS_GetMemoryUsage(wc->ctx, &mu);
+    mem_size = max_bytes & ~7;
+    if (mem_size > wc->mem_size) {
+        mem = malloc(mem_size);
+        if (!mem) {
+            return -1;
+        }
+        ctx = JS_ExtendHeap(wc->ctx, mem, mem_size);
+        if (!ctx) {
+            free(mem);
+            return -1;
+        }
+        free(wc->mem);
+        wc->ctx = ctx;
+        wc->mem = mem;
+        wc->mem_size = mem_size;
+    }
+    JS_SetHeapGrowCallback(wc->ctx, wasm_heap_grow, wc, mu.mem_size);
+    return 0;
+}
+
+/* Same as mquickjs_memory_usage() for the context 'handle' */
+EMSCRIPTEN_KEEPALIVE
+const WasmMemoryUsage *mquickjs_ctx_memory_usage(int handle) {
+    WasmContext *wc = ctx_from_handle(handle);
+    if (!wc) {
+        return NULL;
+    }
+    return wasm_memory_usage(wc);
+}
+
+/* Same as mquickjs_set_budget() for the context 'handle' */
+EMSCRIPTEN_KEEPALIVE
+void mquickjs_ctx_set_budget(int handle, double max_ticks,
+                             double max_alloc_bytes, double max_native_ms) {
+    WasmContext *wc = ctx_from_handle(handle);
+    if (wc) {
+        wasm_set_budget(wc, max_ticks, max_alloc_bytes, max_native_ms);
+    }
+}
+
+/* Same as mquickjs_set_options() for the context 'handle' */
+EMSCRIPTEN_KEEPALIVE
+void mquickjs_ctx_set_options(int handle, int options) {
+    WasmContext *wc = ctx_from_handle(handle);
+    if (wc) {
+        wasm_set_options(wc, options);
+    }
+}
+
+/* Same as mquickjs_meter() for the context 'handle' */
+EMSCRIPTEN_KEEPALIVE
+const WasmMeter *mquickjs_ctx_meter(int handle) {
+    WasmContext *wc = ctx_from_handle(handle);
+    if (!wc) {
+        return NULL;
+    }
+    return wasm_meter(wc);
+}
+
+EMSCRIPTEN_KEEPALIVE
+const CanvasBuffer *mquickjs_ctx_canvas_buffer(int handle) {
+    WasmContext *wc = ctx_from_handle(handle);
+    if (!wc) {
+        return NULL;
+    }
+    return wasm_canvas_buffer(wc);
+}
+
+EMSCRIPTEN_KEEPALIVE
+void mquickjs_ctx_canvas_flush(int handle) {
+    WasmContext *wc = ctx_from_handle(handle);
+    if (wc) {
+        wasm_canvas_flush(wc);
+    }
+}
+
+/* Free the context 'handle' and its memory. The handle can be reused
+   by a later mquickjs_ctx_new(). */
+EMSCRIPTEN_KEEPALIVE
+void mquickjs_ctx_free(int handle) {
+    WasmContext *wc = ctx_from_handle(handle);
+    if (wc) {
+        wasm_ctx_delete(wc);
+        ctx_table[handle - 1] = NULL;
+    }
+}